@@ -19,8 +19,11 @@
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
-#include <errno.h>
-#include "def.h"
+#include <getopt.h>
+#include "cpuusage.h"
+#include "output.h"
+#include "topology.h"
+#include "shm.h"
 
 /**
  * ラインバッファのサイズ
@@ -29,342 +32,576 @@
 /**
  * 2つのポインタ値の入れ替え
  */
-#define SWAP(a, b) {void *tmp = a; a = b; b = tmp;}
-
 /**
- * statのCPUカウンタ記録用構造体
+ * 1回分のサンプリング結果
  */
-typedef struct cputime_t {
-  uint64_t user;       /**< ユーザーモードで消費した時間 */
-  uint64_t nice;       /**< 低い優先度のユーザーモードで消費した時間 */
-  uint64_t system;     /**< システムモードで消費した時間 */
-  uint64_t idle;       /**< タスク待ちで消費した時間 */
-  uint64_t iowait;     /**< I/O の完了待ちの時間 */
-  uint64_t irq;        /**< 割り込みの処理に使った時間 */
-  uint64_t softirq;    /**< ソフト割り込みの処理に使った時間 */
-  uint64_t steal;      /**< 仮想環境下で他のOSに消費された時間 */
-  uint64_t guest;      /**< ゲストOSの実行に消費された時間 */
-  uint64_t guest_nice; /**< 低い優先度のゲストOSの実行に消費された時間 */
-} cputime_t;
-
-/**
- * 全CPU時間格納構造体
- */
-typedef struct cpu_t {
-  int num;            /**< CPUの個数 */
-  cputime_t *times;   /**< CPU時間 */
-} cpu_t;
-
-static void *xmalloc(size_t size);
-static cpu_t *new_cpu_t(int num);
-static void delete_cpu_t(cpu_t *cpu);
-static uint64_t get_total(cputime_t *time);
-static uint64_t get_load(cputime_t *time);
-static uint64_t get_idle(cputime_t *time);
-static uint64_t get_iowait(cputime_t *time);
-static uint64_t get_system(cputime_t *time);
-static uint64_t get_user(cputime_t *time);
-static uint64_t get_irq(cputime_t *time);
-static uint64_t get_guest(cputime_t *time);
-static void get_diff(cputime_t *before, cputime_t *after, cputime_t *diff);
-static result_t read_stat(cpu_t *cpu);
-static void show_title(int num);
-static void show_result(cpu_t *before, cpu_t *after);
+typedef struct sample_t {
+  cputime_t total;     /**< CPU全体のCPU時間 */
+  cpu_matrix_t *cores; /**< 各コアのCPU時間 */
+} sample_t;
 
-/**
- * @brief malloc結果がNULLだった場合にexitする
- *
- * @param[in] size 確保サイズ
- * @return  確保された領域へのポインタ
- */
-static void *xmalloc(size_t size) {
-  void *p = malloc(size);
-  if (p == NULL) {
-    ERR("%s\n", strerror(errno));
-    exit(EXIT_FAILURE);
-  }
-  return p;
-}
+static sample_t *new_sample_t(int num);
+static void delete_sample_t(sample_t *sample);
+static void show_title(int num, topology_t *topology);
+static void show_topology(topology_t *topology, cpu_usage_t *cores);
+static void show_result(sample_t *before, sample_t *after, cpu_usage_t *cores,
+                        topology_t *topology, ticker_t *ticker);
+static void show_usage(cputime_t *diff, cpu_usage_t *cores, topology_t *topology,
+                       ticker_t *ticker);
+static int run_client(const char *name, int screen);
 
 /**
- * @brief 全CPU時間格納構造体の初期化を行う
- *
- * メモリ確保できない場合はexitする
+ * @brief サンプリング結果を格納する構造体を確保する
  *
  * @param[in] num CPUの個数
- * @return 全CPU時間格納構造体
+ * @return サンプリング結果
  */
-static cpu_t *new_cpu_t(int num) {
-  cpu_t *cpu;
-  cpu = xmalloc(sizeof(cpu_t));
-  cpu->num = num;
-  cpu->times = xmalloc((num + 1) * sizeof(cputime_t));
-  return cpu;
+static sample_t *new_sample_t(int num) {
+  sample_t *sample = xmalloc(sizeof(sample_t));
+  sample->cores = new_cpu_matrix_t(num);
+  return sample;
 }
 
 /**
- * @brief 全CPU時間格納構造体の開放を行う
+ * @brief サンプリング結果を格納する構造体を開放する
  *
- * @param[in] cpu 開放する構造体
+ * @param[in] sample 開放する構造体
  */
-static void delete_cpu_t(cpu_t *cpu) {
-  if (cpu == NULL) {
+static void delete_sample_t(sample_t *sample) {
+  if (sample == NULL) {
     return;
   }
-  free(cpu->times);
-  free(cpu);
+  delete_cpu_matrix_t(sample->cores);
+  free(sample);
 }
 
 /**
- * @brief カウンタの合計を返す
- *
- * @param[in] time cputime_t構造体
- * @return カウンタの合計値
- */
-static uint64_t get_total(cputime_t *time) {
-  return time->user + time->nice + time->system
-      + time->idle + time->iowait + time->irq + time->softirq
-      + time->steal + time->guest + time->guest_nice;
-}
-/**
- * @brief 負荷のカウンタの合計を返す
- *
- * @param[in] time cputime_t構造体
- * @return 負荷のカウンタの合計値
- */
-static uint64_t get_load(cputime_t *time) {
-  return time->user + time->nice + time->system
-      + time->irq + time->softirq
-      + time->steal + time->guest + time->guest_nice;
-}
-
-/**
- * @brief アイドルのカウンタの合計を返す
+ * @brief 結果表示
  *
- * @param[in] time cputime_t構造体
- * @return アイドルのカウンタの合計値
+ * @param[in] before 時間的に前の値
+ * @param[in] after  時間的に後の値
+ * @param[in] cores    各コアの使用率の計算に使う構造体
+ * @param[in] topology トポロジーごとの集計先、集計しない場合NULL
+ * @param[in] ticker   実測した間隔を持つタイマー
  */
-static uint64_t get_idle(cputime_t *time) {
-  return time->idle + time->iowait;
+static void show_result(sample_t *before, sample_t *after, cpu_usage_t *cores,
+                        topology_t *topology, ticker_t *ticker) {
+  cputime_t diff;
+  get_diff(&before->total, &after->total, &diff);
+  if (cores->num > 1) {
+    cpu_matrix_usage(before->cores, after->cores, cores);
+  }
+  show_usage(&diff, cores, topology, ticker);
 }
 
 /**
- * @brief I/O待ちのカウンタの合計を返す
+ * @brief 計算済みの使用率の表示
  *
- * @param[in] time cputime_t構造体
- * @return I/O待ちのカウンタの合計値
+ * @param[in] diff     CPU全体のCPU時間の差分
+ * @param[in] cores    各コアの使用率の計算結果、コアが1つの場合は参照しない
+ * @param[in] topology トポロジーごとの集計先、集計しない場合NULL
+ * @param[in] ticker   実測した間隔を持つタイマー
  */
-static uint64_t get_iowait(cputime_t *time) {
-  return time->iowait;
+static void show_usage(cputime_t *diff, cpu_usage_t *cores, topology_t *topology,
+                       ticker_t *ticker) {
+  int num = cores->num;
+  uint64_t total  = get_total(diff);
+  uint64_t load   = get_load(diff);
+  uint64_t idle   = get_idle(diff);
+  uint64_t iowait = get_iowait(diff);
+  uint64_t system = get_system(diff);
+  uint64_t user   = get_user(diff);
+  uint64_t irq    = get_irq(diff);
+  uint64_t guest  = get_guest(diff);
+  if (total == 0) {
+    total = 1;
+  }
+  float usage = (float) load / total * 100;
+  printf("%5.1f%% (T:%4lu I:%4lu IO:%4lu S:%4lu U:%4lu IRQ:%4lu G:%4lu)",
+         usage, total, idle, iowait, system, user, irq, guest);
+  show_ticker(ticker);
+  if (num > 1) {
+    int i;
+    if (topology != NULL) {
+      show_topology(topology, cores);
+    }
+    for (i = 0; i < num; i++) {
+      if (!cores->online[i]) {
+        printf("   off");
+        continue;
+      }
+      printf("%5.1f%%", cores->usage[i]);
+    }
+  }
+  if (ticker->skipped > 0) {
+    printf(" skipped:%d", ticker->skipped);
+  }
+  printf("\n");
 }
 
 /**
- * @brief systemのカウンタの合計を返す
+ * @brief トポロジーごとの使用率の表示
  *
- * @param[in] time cputime_t構造体
- * @return systemのカウンタの合計値
- */
-static uint64_t get_system(cputime_t *time) {
-  return time->system;
-}
-
-/**
- * @brief userのカウンタの合計を返す
+ * NUMAノード、パッケージ、L3キャッシュの共有範囲の順に表示する。
  *
- * @param[in] time cputime_t構造体
- * @return userのカウンタの合計値
+ * @param[in] topology 集計先
+ * @param[in] cores    各コアの使用率の計算結果
  */
-static uint64_t get_user(cputime_t *time) {
-  return time->user + time->nice;
+static void show_topology(topology_t *topology, cpu_usage_t *cores) {
+  int i, j;
+  topology_usage(topology, cores);
+  for (i = 0; i < TOPOLOGY_LEVELS; i++) {
+    topology_level_t *level = &topology->levels[i];
+    for (j = 0; j < level->num; j++) {
+      printf("%5.1f%%", level->usage[j]);
+    }
+  }
 }
 
 /**
- * @brief 割り込みのカウンタの合計を返す
+ * @brief 結果のカラムタイトル表示
  *
- * @param[in] time cputime_t構造体
- * @return 割り込みのカウンタの合計値
+ * @param[in] num      CPUの個数
+ * @param[in] topology トポロジーごとの集計先、集計しない場合NULL
  */
-static uint64_t get_irq(cputime_t *time) {
-  return time->irq + time->softirq;
+static void show_title(int num, topology_t *topology) {
+  printf("  load ( total   idle  iowait system   user      irq  guest) interval" );
+  if (num > 1) {
+    char name[16];
+    int i, j;
+    for (i = 0; topology != NULL && i < TOPOLOGY_LEVELS; i++) {
+      topology_level_t *level = &topology->levels[i];
+      for (j = 0; j < level->num; j++) {
+        snprintf(name, sizeof(name), "%s%d", level->name, level->id[j]);
+        printf("%6s", name);
+      }
+    }
+    for (i = 0; i < num; i++) {
+      printf("  cpu%d", i);
+    }
+  }
+  printf("\n");
 }
 
+#ifdef BENCH
 /**
- * @brief ゲストのカウンタの合計を返す
- *
- * @param[in] time cputime_t構造体
- * @return ゲストのカウンタの合計値
+ * ベンチマークの繰り返し回数
  */
-static uint64_t get_guest(cputime_t *time) {
-  return time->guest + time->guest_nice;
-}
+#define BENCH_LOOPS 2000
 
 /**
- * @brief cputime_t間の差分を取る
+ * @brief 指定コア数の/proc/stat相当の内容を生成する
  *
- * @param[in] before 時間的に前の値
- * @param[in] after 時間的に後の値
- * @param[out] diff 差分の格納先
+ * @param[in] num CPUの個数
+ * @return 生成した内容、呼び出し側でfreeすること
  */
-static void get_diff(cputime_t *before, cputime_t *after, cputime_t *diff) {
-  uint64_t tmp;
-  // 負の値の場合は0とする
-#define DIFF(x) {tmp = after->x - before->x; diff->x = tmp < 0 ? 0 : tmp;}
-  DIFF(user);
-  DIFF(nice);
-  DIFF(system);
-  DIFF(idle);
-  DIFF(iowait);
-  DIFF(irq);
-  DIFF(softirq);
-  DIFF(steal);
-  DIFF(guest);
-  DIFF(guest_nice);
-#undef DIFF
+static char *bench_make_stat(int num) {
+  size_t size = (num + 2) * 128 + 256;
+  char *text = xmalloc(size);
+  int len;
+  int i;
+  len = snprintf(text, size, "cpu  %lu 12345 %lu %lu 4567 0 890 12 0 0\n",
+                 183746291UL * num, 38475621UL * num, 9283746512UL * num);
+  for (i = 0; i < num; i++) {
+    len += snprintf(text + len, size - len,
+                    "cpu%d %lu 123 %lu %lu 45 0 8 1 0 0\n",
+                    i, 183746291UL + i, 38475621UL + i, 9283746512UL + i);
+  }
+  snprintf(text + len, size - len,
+           "intr 1234567 0 0 0\nctxt 98765432\nbtime 1458518400\n");
+  return text;
 }
 
 /**
- * @brief statの値を読みだす
+ * @brief 従来のfgets/sscanfによる読み出し
  *
- * @param[out] cpu 結果の書き込み先
+ * @param[in]  file 読み出し元
+ * @param[out] cpu  結果の書き込み先
  * @return 成功：SUCCESS / 失敗：FAILURE
  */
-static result_t read_stat(cpu_t *cpu) {
-  result_t result = FAILURE;
+static result_t bench_parse_sscanf(FILE *file, snapshot_t *cpu) {
   cputime_t *work;
-  FILE *file;
   char line[LINE_BUFFER_SIZE];
-  file = fopen("/proc/stat", "rb");
-  if (file == NULL) {
-    ERR("%s\n", strerror(errno));
-    return FAILURE;
-  }
+  int i;
   if (fgets(line, sizeof(line), file) == NULL) {
-    ERR("%s\n", strerror(errno));
-    goto error;
+    return FAILURE;
   }
   memset(cpu->times, 0, sizeof(cputime_t) * (cpu->num + 1));
   work = &cpu->times[cpu->num];
   if (sscanf(line, "cpu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
-             &work->user,
-             &work->nice,
-             &work->system,
-             &work->idle,
-             &work->iowait,
-             &work->irq,
-             &work->softirq,
-             &work->steal,
-             &work->guest,
-             &work->guest_nice) < 4) {
-    ERR("%s\n", strerror(errno));
-    goto error;
+             &work->user, &work->nice, &work->system, &work->idle,
+             &work->iowait, &work->irq, &work->softirq, &work->steal,
+             &work->guest, &work->guest_nice) < 4) {
+    return FAILURE;
   }
-  if (cpu->num > 1) {
-    int i;
-    for (i = 0; i < cpu->num; i++) {
-      if (fgets(line, sizeof(line), file) == NULL) {
-        ERR("%s\n", strerror(errno));
-        goto error;
-      }
-      work = &cpu->times[i];
-      if (sscanf(line, "cpu%*u %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
-                 &work->user,
-                 &work->nice,
-                 &work->system,
-                 &work->idle,
-                 &work->iowait,
-                 &work->irq,
-                 &work->softirq,
-                 &work->steal,
-                 &work->guest,
-                 &work->guest_nice) < 4) {
-        ERR("%s\n", strerror(errno));
-        goto error;
-      }
+  for (i = 0; cpu->num > 1 && i < cpu->num; i++) {
+    if (fgets(line, sizeof(line), file) == NULL) {
+      return FAILURE;
+    }
+    work = &cpu->times[i];
+    if (sscanf(line, "cpu%*u %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
+               &work->user, &work->nice, &work->system, &work->idle,
+               &work->iowait, &work->irq, &work->softirq, &work->steal,
+               &work->guest, &work->guest_nice) < 4) {
+      return FAILURE;
     }
   }
-  result = SUCCESS;
-  error:
-  fclose(file);
-  return result;
+  return SUCCESS;
 }
 
 /**
- * @brief 結果表示
+ * @brief 指定コア数でパース処理の速度を比較する
  *
- * @param[in] before 時間的に前の値
- * @param[in] after  時間的に後の値
+ * @param[in] num CPUの個数
  */
-static void show_result(cpu_t *before, cpu_t *after) {
-  cputime_t diff;
-  int num = before->num;
-  get_diff(&before->times[num], &after->times[num], &diff);
-  uint64_t total  = get_total(&diff);
-  uint64_t load   = get_load(&diff);
-  uint64_t idle   = get_idle(&diff);
-  uint64_t iowait = get_iowait(&diff);
-  uint64_t system = get_system(&diff);
-  uint64_t user   = get_user(&diff);
-  uint64_t irq    = get_irq(&diff);
-  uint64_t guest  = get_guest(&diff);
-  if (total == 0) {
-    total = 1;
+static void bench_parse(int num) {
+  char *text = bench_make_stat(num);
+  size_t len = strlen(text);
+  snapshot_t *expect = new_snapshot_t(num);
+  snapshot_t *actual = new_snapshot_t(num);
+  cpu_matrix_t *expect_cores = new_cpu_matrix_t(num);
+  cpu_matrix_t *actual_cores = new_cpu_matrix_t(num);
+  cputime_t total;
+  uint64_t start;
+  uint64_t sscanf_ns;
+  uint64_t scan_ns;
+  int i;
+  start = get_monotonic();
+  for (i = 0; i < BENCH_LOOPS; i++) {
+    FILE *file = fmemopen(text, len, "r");
+    bench_parse_sscanf(file, expect);
+    fclose(file);
   }
-  float usage = (float) load / total * 100;
-  printf("%5.1f%% (T:%4lu I:%4lu IO:%4lu S:%4lu U:%4lu IRQ:%4lu G:%4lu)",
-         usage, total, idle, iowait, system, user, irq, guest);
-  if (num > 1) {
-    int i;
-    for (i = 0; i < num; i++) {
-      get_diff(&before->times[i], &after->times[i], &diff);
-      total  = get_total(&diff);
-      load   = get_load(&diff);
+  sscanf_ns = get_monotonic() - start;
+  start = get_monotonic();
+  for (i = 0; i < BENCH_LOOPS; i++) {
+    parse_cpus(text, actual->times, num);
+  }
+  scan_ns = get_monotonic() - start;
+  cpu_matrix_store(expect_cores, expect->times);
+  parse_cpus_matrix(text, &total, actual_cores);
+  printf("%5d cpus: sscanf %7.1f ns/cpu  scan %7.1f ns/cpu  x%.1f %s\n",
+         num,
+         (double) sscanf_ns / BENCH_LOOPS / (num + 1),
+         (double) scan_ns / BENCH_LOOPS / (num + 1),
+         (double) sscanf_ns / (scan_ns ? scan_ns : 1),
+         memcmp(expect->times, actual->times, sizeof(cputime_t) * (num + 1)) == 0
+             && memcmp(&expect->times[num], &total, sizeof(cputime_t)) == 0
+             && (num <= 1 || memcmp(expect_cores->counters, actual_cores->counters,
+                                    sizeof(uint64_t) * CPUTIME_FIELDS * expect_cores->stride) == 0)
+             ? "" : "MISMATCH");
+  delete_cpu_matrix_t(expect_cores);
+  delete_cpu_matrix_t(actual_cores);
+  delete_snapshot_t(expect);
+  delete_snapshot_t(actual);
+  free(text);
+}
+
+/**
+ * @brief 指定コア数で各コアの使用率計算の速度を比較する
+ *
+ * 一部のコアはカウンタが減少した(リセットされた)状態とし、結果も比較する。
+ *
+ * @param[in] num CPUの個数
+ */
+static void bench_usage(int num) {
+  snapshot_t *before = new_snapshot_t(num);
+  snapshot_t *after = new_snapshot_t(num);
+  cpu_usage_t *usage = new_cpu_usage_t(num);
+  cpu_matrix_t *before_matrix = new_cpu_matrix_t(num);
+  cpu_matrix_t *after_matrix = new_cpu_matrix_t(num);
+  float *expect = xmalloc(sizeof(float) * num);
+  float sink = 0;
+  uint64_t start;
+  uint64_t scalar_ns;
+  uint64_t matrix_ns;
+  int mismatch = 0;
+  int i, j;
+  for (i = 0; i < num; i++) {
+    uint64_t *b = (uint64_t *) &before->times[i];
+    uint64_t *a = (uint64_t *) &after->times[i];
+    for (j = 0; j < CPUTIME_FIELDS; j++) {
+      b[j] = 1000000 + i * 7 + j * 13;
+      a[j] = b[j] + (i * 31 + j * 17) % 500;
+    }
+    if (i % 16 == 15) {
+      // カウンタのリセット
+      after->times[i].user = 0;
+      after->times[i].idle = 0;
+    }
+  }
+  start = get_monotonic();
+  for (i = 0; i < BENCH_LOOPS; i++) {
+    for (j = 0; j < num; j++) {
+      cputime_t diff;
+      uint64_t total;
+      get_diff(&before->times[j], &after->times[j], &diff);
+      total = get_total(&diff);
       if (total == 0) {
         total = 1;
       }
-      printf("%5.1f%%", (float) load / total * 100);
+      expect[j] = (float) get_load(&diff) / total * 100;
     }
+    sink += expect[i % num];
   }
-  printf("\n");
+  scalar_ns = get_monotonic() - start;
+  cpu_matrix_store(before_matrix, before->times);
+  cpu_matrix_store(after_matrix, after->times);
+  start = get_monotonic();
+  for (i = 0; i < BENCH_LOOPS; i++) {
+    cpu_matrix_usage(before_matrix, after_matrix, usage);
+    sink += usage->usage[i % num];
+  }
+  matrix_ns = get_monotonic() - start;
+  for (i = 0; i < num; i++) {
+    if (memcmp(&expect[i], &usage->usage[i], sizeof(float)) != 0) {
+      mismatch++;
+    }
+  }
+  printf("%5d cpus: scalar %6.2f ns/cpu  matrix %6.2f ns/cpu  x%.1f %s\n",
+         num,
+         (double) scalar_ns / BENCH_LOOPS / num,
+         (double) matrix_ns / BENCH_LOOPS / num,
+         (double) scalar_ns / (matrix_ns ? matrix_ns : 1),
+         mismatch == 0 && sink >= 0 ? "" : "MISMATCH");
+  free(expect);
+  delete_cpu_matrix_t(before_matrix);
+  delete_cpu_matrix_t(after_matrix);
+  delete_cpu_usage_t(usage);
+  delete_snapshot_t(before);
+  delete_snapshot_t(after);
 }
 
 /**
- * @brief 結果のカラムタイトル表示
+ * @brief 実際の/proc/statに対して読み出し全体の速度を比較する
  *
  * @param[in] num CPUの個数
  */
-static void show_title(int num) {
-  printf("  load ( total   idle  iowait system   user      irq  guest)" );
-  if (num > 1) {
+static void bench_read(int num) {
+  snapshot_t *cpu = new_snapshot_t(num);
+  stat_sampler_t *sampler = new_stat_sampler_t();
+  uint64_t start;
+  uint64_t fopen_ns;
+  uint64_t pread_ns;
+  int i;
+  if (sampler == NULL) {
+    delete_snapshot_t(cpu);
+    return;
+  }
+  start = get_monotonic();
+  for (i = 0; i < BENCH_LOOPS; i++) {
+    FILE *file = fopen("/proc/stat", "rb");
+    if (file == NULL) {
+      break;
+    }
+    bench_parse_sscanf(file, cpu);
+    fclose(file);
+  }
+  fopen_ns = get_monotonic() - start;
+  start = get_monotonic();
+  for (i = 0; i < BENCH_LOOPS; i++) {
+    snapshot_read(sampler, cpu);
+  }
+  pread_ns = get_monotonic() - start;
+  printf("/proc/stat (%d cpus): fopen+sscanf %8.1f ns/read  pread+scan %8.1f ns/read\n",
+         num,
+         (double) fopen_ns / BENCH_LOOPS,
+         (double) pread_ns / BENCH_LOOPS);
+  delete_stat_sampler_t(sampler);
+  delete_snapshot_t(cpu);
+}
+
+int main(int argc, char **argv) {
+  static const int nums[] = {1, 8, 64, 256, 1024};
+  int i;
+  for (i = 0; i < sizeof(nums) / sizeof(nums[0]); i++) {
+    bench_parse(nums[i]);
+  }
+  for (i = 2; i < sizeof(nums) / sizeof(nums[0]); i++) {
+    bench_usage(nums[i]);
+  }
+  bench_read(sysconf(_SC_NPROCESSORS_ONLN));
+  return EXIT_SUCCESS;
+}
+#else
+/**
+ * @brief 共有メモリに公開されたスナップショットを表示し続ける
+ *
+ * 自身では/proc/statを読まず、公開する側の計測ごとに表示する。
+ * 各コアの使用率はスナップショットの0.1%単位の値を使う。
+ * SIGINT/SIGTERMを受けると後始末をして終了する。
+ *
+ * @param[in] name   共有メモリの名前
+ * @param[in] screen 全画面表示する場合TRUE、カラムタイトルを毎回表示する
+ * @return 終了コード
+ */
+static int run_client(const char *name, int screen) {
+  int result = EXIT_FAILURE;
+  output_t *output = NULL;
+  format_t *format = NULL;
+  cpu_usage_t *usage = NULL;
+  uint64_t seq = 0;
+  shm_t *shm = load_shm_t(name);
+  if (shm == NULL) {
+    fprintf(stderr, "%s: cannot open shared memory\n", name);
+    return EXIT_FAILURE;
+  }
+  output = new_output_t(STDOUT_FILENO, DEFAULT_OUTPUT_FRAMES);
+  if (output == NULL) {
+    goto error;
+  }
+  output_redirect_stdout(output);
+  if (screen) {
+    output_set_screen(output);
+  }
+  format = new_format_t();
+  shm_catch_signals();
+  while (TRUE) {
+    const binary_record_t *record = shm_wait(shm, format, &seq);
+    const uint16_t *cores;
+    cputime_t diff;
+    ticker_t ticker;
     int i;
-    for (i = 0; i < num; i++) {
-      printf("  cpu%d", i);
+    if (record == NULL) {
+      break;
+    }
+    cores = binary_cores(record);
+    diff = record->total;
+    if (usage == NULL || usage->num != record->cpu_num) {
+      delete_cpu_usage_t(usage);
+      usage = new_cpu_usage_t(record->cpu_num);
+      if (!screen) {
+        show_title(usage->num, NULL);
+      }
+    }
+    if (screen) {
+      show_title(usage->num, NULL);
     }
+    for (i = 0; i < usage->num; i++) {
+      usage->online[i] = cores[i] != BINARY_CORE_OFFLINE;
+      usage->usage[i] = usage->online[i] ? cores[i] / 10.0f : 0;
+    }
+    ticker.elapsed = record->elapsed;
+    ticker.skipped = record->skipped;
+    show_usage(&diff, usage, NULL, &ticker);
+    output_commit(output);
   }
-  printf("\n");
+  result = EXIT_SUCCESS;
+  error:
+  delete_output_t(output);
+  delete_format_t(format);
+  delete_cpu_usage_t(usage);
+  delete_shm_t(shm);
+  return result;
 }
 
 int main(int argc, char **argv) {
   int result = EXIT_FAILURE;
-  cpu_t *after;
-  cpu_t *before;
-  int num = sysconf(_SC_NPROCESSORS_ONLN);
-  after = new_cpu_t(num);
-  before = new_cpu_t(num);
-  show_title(num);
-  if (read_stat(before) != SUCCESS) {
+  sample_t *after = NULL;
+  sample_t *before = NULL;
+  cpu_usage_t *usage = NULL;
+  topology_t *topology = NULL;
+  stat_sampler_t *sampler;
+  output_t *output = NULL;
+  const char *sys_root = DEFAULT_SYS_ROOT;
+  const char *client_name = NULL;
+  int screen = FALSE;
+  int rollup = FALSE;
+  ticker_t ticker;
+  int interval = DEFAULT_INTERVAL_MS;
+  int num;
+  const struct option options[] = {
+      {"proc-root", required_argument, NULL, 'R'},
+      {"sys-root", required_argument, NULL, 'Y'},
+      {"shm", required_argument, NULL, 'M'},
+      {"screen", no_argument, NULL, 'S'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "i:TR:", options, NULL)) != -1) {
+    switch (opt) {
+      case 'R':
+        set_proc_root(optarg);
+        break;
+      case 'T':
+        rollup = TRUE;
+        break;
+      case 'Y':
+        sys_root = optarg;
+        break;
+      case 'M':
+        client_name = optarg;
+        break;
+      case 'S':
+        screen = TRUE;
+        break;
+      case 'i':
+        interval = atoi(optarg);
+        if (interval < MIN_INTERVAL_MS) {
+          fprintf(stderr, "-i: %d or more\n", MIN_INTERVAL_MS);
+          return EXIT_FAILURE;
+        }
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-i msec] [-T] [--sys-root dir] [--screen] [--shm name] [--proc-root dir]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (client_name != NULL) {
+    if (rollup) {
+      fprintf(stderr, "--shm: not available with -T\n");
+      return EXIT_FAILURE;
+    }
+    return run_client(client_name, screen);
+  }
+  sampler = new_stat_sampler_t();
+  if (sampler == NULL) {
     goto error;
   }
+  num = stat_sampler_count_cpus(sampler);
+  if (num < 0) {
+    goto error;
+  }
+  after = new_sample_t(num);
+  before = new_sample_t(num);
+  usage = new_cpu_usage_t(num);
+  if (rollup) {
+    topology = new_topology_t(sys_root, num);
+  }
+  output = new_output_t(STDOUT_FILENO, DEFAULT_OUTPUT_FRAMES);
+  if (output == NULL) {
+    goto error;
+  }
+  output_redirect_stdout(output);
+  if (screen) {
+    output_set_screen(output);
+  } else {
+    show_title(num, topology);
+  }
+  if (stat_sampler_read_matrix(sampler, &before->total, before->cores) != SUCCESS) {
+    goto error;
+  }
+  ticker_start(&ticker, interval);
   while (TRUE) {
-    sleep(5);
-    if (read_stat(after) != SUCCESS) {
+    ticker_wait(&ticker);
+    if (stat_sampler_read_matrix(sampler, &after->total, after->cores) != SUCCESS) {
       goto error;
     }
-    show_result(before, after);
+    if (screen) {
+      show_title(num, topology);
+    }
+    show_result(before, after, usage, topology, &ticker);
+    output_commit(output);
     SWAP(before, after);
   }
   result = EXIT_SUCCESS;
   error:
-  delete_cpu_t(before);
-  delete_cpu_t(after);
+  delete_output_t(output);
+  delete_sample_t(before);
+  delete_sample_t(after);
+  delete_cpu_usage_t(usage);
+  delete_topology_t(topology);
+  delete_stat_sampler_t(sampler);
   return result;
 }
+#endif
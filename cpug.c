@@ -0,0 +1,660 @@
+/**
+ * @file cpug.c
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief CPU使用率調査コマンド
+ *
+ * CPU全体の使用率に加え、cgroup v2の各cgroupの使用率を表示する。
+ * タスクを走査する代わりに各cgroupのcpu.statを読み出すため、
+ * 処理量はタスク数ではなくcgroup数に比例する。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "cpuusage.h"
+#include "output.h"
+
+/**
+ * cgroup v2のマウント先の初期値
+ */
+#define DEFAULT_CGROUP_ROOT "/sys/fs/cgroup"
+/**
+ * cgroupのパスの長さ、超える場合は末尾を切り捨てる
+ */
+#define CGROUP_PATH_LEN 256
+/**
+ * 配列の初期サイズ
+ */
+#define INIT_CGROUPS 256
+/**
+ * cpu.statの読み出しバッファのサイズ
+ */
+#define CPU_STAT_SIZE 1024
+/**
+ * ポインタの入れ替え
+ */
+/**
+ * cgroupのパスの文字列テーブルの要素
+ */
+typedef char path_t[CGROUP_PATH_LEN];
+
+/**
+ * 走査中のcgroupの情報
+ */
+typedef struct cgroup_t {
+  int id;                /**< ID、inode番号の下位32bit */
+  int leaf;              /**< 子のcgroupを持たない場合TRUE */
+  uint64_t ino;          /**< inode番号、再作成の判別に使う */
+  uint64_t user;         /**< user_usec */
+  uint64_t system;       /**< system_usec */
+  uint64_t nr_throttled; /**< nr_throttled */
+  uint64_t throttled;    /**< throttled_usec */
+  path_t path;           /**< ルートからのパス */
+} cgroup_t;
+
+/**
+ * 1回分のcgroupのサンプリング結果
+ *
+ * 各配列はIDの昇順に並べる。
+ */
+typedef struct sample_t {
+  cputime_t total;        /**< CPU全体のCPU時間 */
+  int num;                /**< cgroup数 */
+  int array_num;          /**< 各配列の長さ */
+  int *id;                /**< ID */
+  uint64_t *ino;          /**< inode番号 */
+  uint64_t *utime;        /**< ユーザ時間[us] */
+  uint64_t *stime;        /**< システム時間[us] */
+  uint64_t *load;         /**< 負荷[us] */
+  uint64_t *nr_throttled; /**< スロットリングされた回数 */
+  uint64_t *throttled;    /**< スロットリングされた時間[us] */
+  uint64_t *user_delta;   /**< 前回からのユーザ時間[us] */
+  uint64_t *system_delta; /**< 前回からのシステム時間[us] */
+  uint64_t *nr_delta;     /**< 前回からのスロットリングされた回数 */
+  uint64_t *throttled_delta; /**< 前回からのスロットリングされた時間[us] */
+  int *order;             /**< 負荷上位のインデックス */
+  path_t *path;           /**< パスの文字列テーブル */
+} sample_t;
+
+/**
+ * cgroupの走査に使う構造体
+ *
+ * 走査結果の一時領域は拡張のみ行い、以降の走査で使い回す。
+ */
+typedef struct walker_t {
+  const char *root;  /**< cgroup v2のマウント先 */
+  int leaf_only;     /**< 子を持たないcgroupのみを対象とする場合TRUE */
+  int num;           /**< 走査したcgroup数 */
+  int array_num;     /**< cgroupsの長さ */
+  cgroup_t *cgroups; /**< 走査結果 */
+  char buf[CPU_STAT_SIZE]; /**< cpu.statの読み出しバッファ */
+} walker_t;
+
+static sample_t *new_sample_t(void);
+static void delete_sample_t(sample_t *sample);
+static void sample_grow(sample_t *sample, int num);
+static walker_t *new_walker_t(const char *root, int leaf_only);
+static void delete_walker_t(walker_t *walker);
+static cgroup_t *walker_next(walker_t *walker);
+static result_t parse_cpu_stat(char *buf, cgroup_t *cgroup);
+static result_t read_cpu_stat(walker_t *walker, int dir_fd, cgroup_t *cgroup);
+static int walk_cgroup(walker_t *walker, int dir_fd, const char *path, int depth);
+static int comp_cgroup(const void *a, const void *b);
+static result_t read_cgroups(walker_t *walker, sample_t *sample);
+static void get_columns(sample_t *sample, task_columns_t *columns);
+static uint64_t get_delta(uint64_t after, uint64_t before);
+static void calc_detail(sample_t *before, sample_t *after);
+static void show_result(sample_t *before, sample_t *after, const rank_t *rank, ticker_t *ticker);
+static void show_result_cgroup(uint64_t total, sample_t *before, sample_t *after, const rank_t *rank);
+
+/**
+ * @brief サンプリング結果の初期化を行う
+ *
+ * @return サンプリング結果
+ */
+static sample_t *new_sample_t(void) {
+  sample_t *sample = xmalloc(sizeof(sample_t));
+  memset(sample, 0, sizeof(sample_t));
+  sample_grow(sample, INIT_CGROUPS);
+  return sample;
+}
+
+/**
+ * @brief サンプリング結果の開放を行う
+ *
+ * @param[in] sample 開放するサンプリング結果
+ */
+static void delete_sample_t(sample_t *sample) {
+  if (sample == NULL) {
+    return;
+  }
+  free(sample->id);
+  free(sample->ino);
+  free(sample->utime);
+  free(sample->stime);
+  free(sample->load);
+  free(sample->nr_throttled);
+  free(sample->throttled);
+  free(sample->user_delta);
+  free(sample->system_delta);
+  free(sample->nr_delta);
+  free(sample->throttled_delta);
+  free(sample->order);
+  free(sample->path);
+  free(sample);
+}
+
+/**
+ * @brief 各配列をnum個以上の長さに拡張する
+ *
+ * 毎回すべて書きなおすため、内容は引き継がない。
+ *
+ * @param[in,out] sample 対象のサンプリング結果
+ * @param[in]     num    必要な長さ
+ */
+static void sample_grow(sample_t *sample, int num) {
+  if (num <= sample->array_num) {
+    return;
+  }
+  if (sample->array_num == 0) {
+    sample->array_num = num;
+  }
+  while (sample->array_num < num) {
+    sample->array_num *= 2;
+  }
+  num = sample->array_num;
+  sample->id = xrealloc(sample->id, sizeof(int) * num);
+  sample->ino = xrealloc(sample->ino, sizeof(uint64_t) * num);
+  sample->utime = xrealloc(sample->utime, sizeof(uint64_t) * num);
+  sample->stime = xrealloc(sample->stime, sizeof(uint64_t) * num);
+  sample->load = xrealloc(sample->load, sizeof(uint64_t) * num);
+  sample->nr_throttled = xrealloc(sample->nr_throttled, sizeof(uint64_t) * num);
+  sample->throttled = xrealloc(sample->throttled, sizeof(uint64_t) * num);
+  sample->user_delta = xrealloc(sample->user_delta, sizeof(uint64_t) * num);
+  sample->system_delta = xrealloc(sample->system_delta, sizeof(uint64_t) * num);
+  sample->nr_delta = xrealloc(sample->nr_delta, sizeof(uint64_t) * num);
+  sample->throttled_delta = xrealloc(sample->throttled_delta, sizeof(uint64_t) * num);
+  sample->order = xrealloc(sample->order, sizeof(int) * num);
+  sample->path = xrealloc(sample->path, sizeof(path_t) * num);
+}
+
+/**
+ * @brief cgroupの走査に使う構造体の初期化を行う
+ *
+ * @param[in] root      cgroup v2のマウント先
+ * @param[in] leaf_only 子を持たないcgroupのみを対象とする場合TRUE
+ * @return 走査に使う構造体
+ */
+static walker_t *new_walker_t(const char *root, int leaf_only) {
+  walker_t *walker = xmalloc(sizeof(walker_t));
+  walker->root = root;
+  walker->leaf_only = leaf_only;
+  walker->num = 0;
+  walker->array_num = INIT_CGROUPS;
+  walker->cgroups = xmalloc(sizeof(cgroup_t) * walker->array_num);
+  return walker;
+}
+
+/**
+ * @brief cgroupの走査に使う構造体の開放を行う
+ *
+ * @param[in] walker 開放する構造体
+ */
+static void delete_walker_t(walker_t *walker) {
+  if (walker == NULL) {
+    return;
+  }
+  free(walker->cgroups);
+  free(walker);
+}
+
+/**
+ * @brief 次の走査結果の書き込み先を取得する
+ *
+ * @param[in,out] walker 走査に使う構造体
+ * @return 書き込み先
+ */
+static cgroup_t *walker_next(walker_t *walker) {
+  if (walker->num == walker->array_num) {
+    walker->array_num *= 2;
+    walker->cgroups = xrealloc(walker->cgroups, sizeof(cgroup_t) * walker->array_num);
+  }
+  return &walker->cgroups[walker->num];
+}
+
+/**
+ * @brief cpu.statの内容をパースする
+ *
+ * usage_usecはuser_usecとsystem_usecの和であるため読み出さない。
+ * cpuコントローラが無効なcgroupではスロットリングの項目は存在せず、0とする。
+ *
+ * @param[in]  buf    cpu.statの内容
+ * @param[out] cgroup 書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t parse_cpu_stat(char *buf, cgroup_t *cgroup) {
+  static const struct {
+    const char *key;
+    size_t offset;
+  } keys[] = {
+      {"user_usec", offsetof(cgroup_t, user)},
+      {"system_usec", offsetof(cgroup_t, system)},
+      {"nr_throttled", offsetof(cgroup_t, nr_throttled)},
+      {"throttled_usec", offsetof(cgroup_t, throttled)},
+  };
+  int found = 0;
+  char *line = buf;
+  cgroup->user = 0;
+  cgroup->system = 0;
+  cgroup->nr_throttled = 0;
+  cgroup->throttled = 0;
+  while (line != NULL && *line != 0) {
+    char *end = strchr(line, ' ');
+    int i;
+    if (end == NULL) {
+      break;
+    }
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+      if (end - line == strlen(keys[i].key) && strncmp(line, keys[i].key, end - line) == 0) {
+        uint64_t *value = (uint64_t *) ((char *) cgroup + keys[i].offset);
+        if (scan_uint64(end, value) == NULL) {
+          return FAILURE;
+        }
+        found++;
+        break;
+      }
+    }
+    line = strchr(end, '\n');
+    if (line != NULL) {
+      line++;
+    }
+  }
+  return found >= 2 ? SUCCESS : FAILURE;
+}
+
+/**
+ * @brief cgroupのcpu.statを読み出す
+ *
+ * @param[in,out] walker 走査に使う構造体
+ * @param[in]     dir_fd cgroupのディレクトリ
+ * @param[out]    cgroup 書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t read_cpu_stat(walker_t *walker, int dir_fd, cgroup_t *cgroup) {
+  ssize_t size;
+  int fd = openat(dir_fd, "cpu.stat", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return FAILURE;
+  }
+  size = read(fd, walker->buf, sizeof(walker->buf) - 1);
+  close(fd);
+  if (size <= 0) {
+    return FAILURE;
+  }
+  walker->buf[size] = 0;
+  return parse_cpu_stat(walker->buf, cgroup);
+}
+
+/**
+ * @brief cgroupのディレクトリを再帰的に走査する
+ *
+ * ルート(depth 0)はCPU全体と同じ値となるため記録しない。
+ * 走査中に削除されたcgroupは無視する。
+ *
+ * @param[in,out] walker 走査に使う構造体
+ * @param[in]     dir_fd 走査するディレクトリ、この関数内で閉じる
+ * @param[in]     path   ルートからのパス
+ * @param[in]     depth  ルートからの深さ
+ * @return 子のcgroupの数
+ */
+static int walk_cgroup(walker_t *walker, int dir_fd, const char *path, int depth) {
+  struct stat st;
+  struct dirent *dent;
+  int children = 0;
+  int self = -1;
+  DIR *dir;
+  if (depth > 0 && fstat(dir_fd, &st) == 0) {
+    cgroup_t *cgroup = walker_next(walker);
+    if (read_cpu_stat(walker, dir_fd, cgroup) == SUCCESS) {
+      cgroup->ino = st.st_ino;
+      cgroup->id = (int) (uint32_t) st.st_ino;
+      snprintf(cgroup->path, sizeof(cgroup->path), "%s", path);
+      self = walker->num++;
+    }
+  }
+  dir = fdopendir(dir_fd);
+  if (dir == NULL) {
+    close(dir_fd);
+    return 0;
+  }
+  while ((dent = readdir(dir)) != NULL) {
+    char child[PATH_MAX];
+    int fd;
+    if (dent->d_name[0] == '.'
+        || (dent->d_type != DT_DIR && dent->d_type != DT_UNKNOWN)) {
+      continue;
+    }
+    fd = openat(dirfd(dir), dent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    snprintf(child, sizeof(child), "%s/%s", path, dent->d_name);
+    walk_cgroup(walker, fd, child, depth + 1);
+    children++;
+  }
+  closedir(dir);
+  if (self >= 0) {
+    walker->cgroups[self].leaf = children == 0;
+  }
+  return children;
+}
+
+/**
+ * @brief cgroupのID昇順ソート用比較関数
+ *
+ * IDが等しい場合はinode番号の昇順とする。
+ *
+ * @param[in] a 比較対象
+ * @param[in] b 比較対象
+ * @return a < b の時負、a == b の時0、a > b の時正
+ */
+static int comp_cgroup(const void *a, const void *b) {
+  const cgroup_t *ca = a;
+  const cgroup_t *cb = b;
+  if (ca->id != cb->id) {
+    return ca->id < cb->id ? -1 : 1;
+  }
+  if (ca->ino != cb->ino) {
+    return ca->ino < cb->ino ? -1 : 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief 全cgroupを走査し、ID昇順にサンプリング結果へ格納する
+ *
+ * @param[in,out] walker 走査に使う構造体
+ * @param[out]    sample 書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t read_cgroups(walker_t *walker, sample_t *sample) {
+  int i, num = 0;
+  int fd = open(walker->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    ERR("%s: %s\n", walker->root, strerror(errno));
+    return FAILURE;
+  }
+  walker->num = 0;
+  walk_cgroup(walker, fd, "", 0);
+  qsort(walker->cgroups, walker->num, sizeof(cgroup_t), comp_cgroup);
+  sample_grow(sample, walker->num);
+  for (i = 0; i < walker->num; i++) {
+    cgroup_t *cgroup = &walker->cgroups[i];
+    if (walker->leaf_only && !cgroup->leaf) {
+      continue;
+    }
+    sample->id[num] = cgroup->id;
+    sample->ino[num] = cgroup->ino;
+    sample->utime[num] = cgroup->user;
+    sample->stime[num] = cgroup->system;
+    sample->nr_throttled[num] = cgroup->nr_throttled;
+    sample->throttled[num] = cgroup->throttled;
+    memcpy(sample->path[num], cgroup->path, sizeof(path_t));
+    num++;
+  }
+  sample->num = num;
+  return SUCCESS;
+}
+
+/**
+ * @brief 負荷計算に使う列の参照を取得する
+ *
+ * キーにはinode番号の下位32bitを使い、inode番号全体を起動時刻の代わりとして
+ * 同じIDで作りなおされたcgroupを判別する。
+ *
+ * @param[in]  sample  対象のサンプリング結果
+ * @param[out] columns 列の参照の書き込み先
+ */
+static void get_columns(sample_t *sample, task_columns_t *columns) {
+  columns->num = sample->num;
+  columns->id = sample->id;
+  columns->utime = sample->utime;
+  columns->stime = sample->stime;
+  columns->starttime = sample->ino;
+  columns->load = sample->load;
+  columns->pid = sample->id;
+  columns->nice = NULL;
+  columns->comm = (const char *) sample->path;
+  columns->comm_size = sizeof(path_t);
+  columns->delay = NULL;
+}
+
+/**
+ * @brief カウンタの差分を求める
+ *
+ * @param[in] after  時間的に後の値
+ * @param[in] before 時間的に前の値
+ * @return 差分、カウンタが減少していた場合0
+ */
+static uint64_t get_delta(uint64_t after, uint64_t before) {
+  return after > before ? after - before : 0;
+}
+
+/**
+ * @brief 前回からのユーザ時間、システム時間、スロットリングの回数と時間を求める
+ *
+ * 負荷と同じく、ID昇順のマージ結合で対応付ける。
+ *
+ * @param[in]     before 時間的に前の値
+ * @param[in,out] after  時間的に後の値、各deltaを書き込む
+ */
+static void calc_detail(sample_t *before, sample_t *after) {
+  int i, j;
+  for (i = 0, j = 0; i < after->num; i++) {
+    after->user_delta[i] = after->utime[i];
+    after->system_delta[i] = after->stime[i];
+    after->nr_delta[i] = after->nr_throttled[i];
+    after->throttled_delta[i] = after->throttled[i];
+    for (; j < before->num && before->id[j] < after->id[i]; j++);
+    if (j < before->num && before->id[j] == after->id[i]
+        && before->ino[j] == after->ino[i]) {
+      after->user_delta[i] = get_delta(after->utime[i], before->utime[j]);
+      after->system_delta[i] = get_delta(after->stime[i], before->stime[j]);
+      after->nr_delta[i] = get_delta(after->nr_throttled[i], before->nr_throttled[j]);
+      after->throttled_delta[i] = get_delta(after->throttled[i], before->throttled[j]);
+    }
+  }
+}
+
+/**
+ * @brief 結果表示
+ *
+ * @param[in] before 時間的に前の値
+ * @param[in] after  時間的に後の値
+ * @param[in] rank   上位選択の条件
+ * @param[in] ticker 実測した間隔を持つタイマー
+ */
+static void show_result(sample_t *before, sample_t *after, const rank_t *rank, ticker_t *ticker) {
+  cputime_t diff;
+  get_diff(&before->total, &after->total, &diff);
+  uint64_t total  = get_total(&diff);
+  uint64_t load   = get_load(&diff);
+  uint64_t idle   = get_idle(&diff);
+  uint64_t iowait = get_iowait(&diff);
+  uint64_t system = get_system(&diff);
+  uint64_t user   = get_user(&diff);
+  uint64_t irq    = get_irq(&diff);
+  uint64_t guest  = get_guest(&diff);
+  if (total == 0) {
+    total = 1;
+  }
+  float usage = (float) load / total * 100;
+  printf("%5.1f%% (T:%4lu I:%4lu IO:%4lu S:%4lu U:%4lu IRQ:%4lu G:%4lu)",
+         usage, total, idle, iowait, system, user, irq, guest);
+  show_ticker(ticker);
+  if (ticker->skipped > 0) {
+    printf(" skipped:%d", ticker->skipped);
+  }
+  printf("\n");
+  show_result_cgroup(total, before, after, rank);
+}
+
+/**
+ * @brief cgroupごとの情報を表示する
+ *
+ * cpu.statの値はマイクロ秒単位であるため、
+ * CPU全体のCPU時間をマイクロ秒に換算して使用率を求める。
+ *
+ * @param[in]     total  CPU全体のカウンタの合計値
+ * @param[in]     before 時間的に前の値
+ * @param[in,out] after  時間的に後の値
+ * @param[in]     rank   上位選択の条件
+ */
+static void show_result_cgroup(uint64_t total, sample_t *before, sample_t *after, const rank_t *rank) {
+  task_columns_t prev;
+  task_columns_t next;
+  double total_usec = (double) total * 1000000 / sysconf(_SC_CLK_TCK);
+  int display;
+  int i;
+  get_columns(before, &prev);
+  get_columns(after, &next);
+  task_delta(&prev, &next);
+  calc_detail(before, after);
+  display = task_rank(&next, rank, after->order);
+  printf("%d cgroups\n", after->num);
+  printf("   CPU   USER(ms)    SYS(ms)  THR THR(ms) CGROUP\n");
+  for (i = 0; i < display; i++) {
+    int k = after->order[i];
+    printf("%5.1f%% %10.1f %10.1f %4lu %7.1f %s\n",
+           after->load[k] / total_usec * 100,
+           (double) after->user_delta[k] / 1000,
+           (double) after->system_delta[k] / 1000,
+           after->nr_delta[k],
+           (double) after->throttled_delta[k] / 1000,
+           after->path[k]);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  int result = EXIT_FAILURE;
+  sample_t *after = NULL;
+  sample_t *before = NULL;
+  stat_sampler_t *sampler = NULL;
+  walker_t *walker = NULL;
+  output_t *output = NULL;
+  const char *root = DEFAULT_CGROUP_ROOT;
+  int leaf_only = FALSE;
+  int screen = FALSE;
+  ticker_t ticker;
+  int interval = DEFAULT_INTERVAL_MS;
+  rank_t rank;
+  const struct option options[] = {
+      {"proc-root", required_argument, NULL, 'R'},
+      {"cgroup-root", required_argument, NULL, 'C'},
+      {"sort", required_argument, NULL, 'k'},
+      {"path", required_argument, NULL, 'c'},
+      {"screen", no_argument, NULL, 'S'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  rank_init(&rank);
+  while ((opt = getopt_long(argc, argv, "i:n:LR:", options, NULL)) != -1) {
+    switch (opt) {
+      case 'R':
+        set_proc_root(optarg);
+        break;
+      case 'C':
+        root = optarg;
+        break;
+      case 'L':
+        leaf_only = TRUE;
+        break;
+      case 'S':
+        screen = TRUE;
+        break;
+      case 'i':
+        interval = atoi(optarg);
+        if (interval < MIN_INTERVAL_MS) {
+          fprintf(stderr, "-i: %d or more\n", MIN_INTERVAL_MS);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'n':
+        rank.num = atoi(optarg);
+        if (rank.num < 0) {
+          fprintf(stderr, "-n: 0 or more\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'k':
+        rank.key = parse_rank_key(optarg);
+        if (rank.key < 0 || rank.key == RANK_KEY_NICE || rank.key == RANK_KEY_DELAY) {
+          fprintf(stderr, "--sort: cpu, total, utime or stime\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'c':
+        rank.comm = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-i msec] [-n num] [-L] [--sort key] [--path name] [--screen] [--cgroup-root dir] [--proc-root dir]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  sampler = new_stat_sampler_t();
+  if (sampler == NULL) {
+    goto error;
+  }
+  output = new_output_t(STDOUT_FILENO, DEFAULT_OUTPUT_FRAMES);
+  if (output == NULL) {
+    goto error;
+  }
+  output_redirect_stdout(output);
+  if (screen) {
+    output_set_screen(output);
+  }
+  walker = new_walker_t(root, leaf_only);
+  after = new_sample_t();
+  before = new_sample_t();
+  if (stat_sampler_read(sampler, &before->total, 0) != SUCCESS
+      || read_cgroups(walker, before) != SUCCESS) {
+    goto error;
+  }
+  ticker_start(&ticker, interval);
+  while (TRUE) {
+    ticker_wait(&ticker);
+    if (stat_sampler_read(sampler, &after->total, 0) != SUCCESS
+        || read_cgroups(walker, after) != SUCCESS) {
+      goto error;
+    }
+    show_result(before, after, &rank, &ticker);
+    output_commit(output);
+    SWAP(before, after);
+  }
+  result = EXIT_SUCCESS;
+  error:
+  delete_output_t(output);
+  delete_sample_t(before);
+  delete_sample_t(after);
+  delete_walker_t(walker);
+  delete_stat_sampler_t(sampler);
+  return result;
+}
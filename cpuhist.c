@@ -0,0 +1,402 @@
+/**
+ * @file cpuhist.c
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief CPU使用率調査コマンド
+ *
+ * cpup/cputが-Hで記録した履歴ファイルの表示
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "cpuusage.h"
+#include "history.h"
+
+/**
+ * 時刻を表示する文字列のバッファサイズ
+ */
+#define TIME_BUFFER_SIZE 32
+
+/**
+ * 表示の対象とする範囲
+ */
+typedef struct window_t {
+  uint64_t from;      /**< 開始時刻[ns]、0の場合制限なし */
+  uint64_t to;        /**< 終了時刻[ns]、0の場合制限なし */
+  uint64_t last;      /**< 最新から数えたレコード数、0の場合制限なし */
+} window_t;
+
+static result_t parse_time(const char *text, uint64_t *time);
+static void format_time(uint64_t time, char *buf, size_t size);
+static int in_window(const window_t *window, const history_record_t *record);
+static void show_usage(cputime_t *diff);
+static void show_cores(history_t *history, cputime_t *cores);
+static void show_tasks(history_t *history, history_task_t *tasks, int num, uint64_t total);
+static int record_task_num(history_t *history, const history_record_t *record);
+static void show_record(history_t *history, const history_record_t *record);
+static int comp_task_id(const void *a, const void *b);
+static int comp_task_load(const void *a, const void *b);
+static void show_summary(history_t *history, const window_t *window);
+
+/**
+ * @brief 時刻の指定をパースする
+ *
+ * "YYYY-MM-DD HH:MM:SS"形式のローカル時刻またはUNIX時間[s]を受け付ける。
+ *
+ * @param[in]  text  時刻の指定
+ * @param[out] time  時刻[ns]の書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t parse_time(const char *text, uint64_t *time) {
+  struct tm tm;
+  char *end;
+  memset(&tm, 0, sizeof(tm));
+  end = strptime(text, "%Y-%m-%d %H:%M:%S", &tm);
+  if (end != NULL && *end == 0) {
+    tm.tm_isdst = -1;
+    *time = (uint64_t) mktime(&tm) * 1000000000;
+    return SUCCESS;
+  }
+  *time = strtoull(text, &end, 10) * 1000000000;
+  if (*text == 0 || *end != 0) {
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief 時刻をローカル時刻の文字列にする
+ *
+ * @param[in]  time 時刻[ns]
+ * @param[out] buf  書き込み先
+ * @param[in]  size bufのサイズ
+ */
+static void format_time(uint64_t time, char *buf, size_t size) {
+  time_t sec = time / 1000000000;
+  struct tm tm;
+  size_t len;
+  localtime_r(&sec, &tm);
+  len = strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+  snprintf(buf + len, size - len, ".%03lu", time / 1000000 % 1000);
+}
+
+/**
+ * @brief レコードが表示の対象かを判定する
+ *
+ * @param[in] window 表示の対象とする範囲
+ * @param[in] record 判定するレコード
+ * @return 対象の場合TRUE
+ */
+static int in_window(const window_t *window, const history_record_t *record) {
+  return (window->from == 0 || record->time >= window->from)
+      && (window->to == 0 || record->time <= window->to);
+}
+
+/**
+ * @brief CPU全体の使用率を表示する
+ *
+ * @param[in] diff CPU時間の差分
+ */
+static void show_usage(cputime_t *diff) {
+  uint64_t total  = get_total(diff);
+  uint64_t load   = get_load(diff);
+  uint64_t idle   = get_idle(diff);
+  uint64_t iowait = get_iowait(diff);
+  uint64_t system = get_system(diff);
+  uint64_t user   = get_user(diff);
+  uint64_t irq    = get_irq(diff);
+  uint64_t guest  = get_guest(diff);
+  if (total == 0) {
+    total = 1;
+  }
+  printf("%5.1f%% (T:%4lu I:%4lu IO:%4lu S:%4lu U:%4lu IRQ:%4lu G:%4lu)",
+         (float) load / total * 100, total, idle, iowait, system, user, irq, guest);
+}
+
+/**
+ * @brief CPUコアごとの使用率を表示する
+ *
+ * @param[in] history 履歴ファイル
+ * @param[in] cores   各コアのCPU時間の差分
+ */
+static void show_cores(history_t *history, cputime_t *cores) {
+  int num = history_header(history)->cpu_num;
+  int i;
+  if (num <= 1) {
+    return;
+  }
+  for (i = 0; i < num; i++) {
+    uint64_t total = get_total(&cores[i]);
+    if (total == 0) {
+      total = 1;
+    }
+    printf("%5.1f%%", (float) get_load(&cores[i]) / total * 100);
+  }
+}
+
+/**
+ * @brief タスクを表示する
+ *
+ * @param[in] history 履歴ファイル
+ * @param[in] tasks   タスク
+ * @param[in] num     タスク数
+ * @param[in] total   CPU全体の全時間の差分
+ */
+static void show_tasks(history_t *history, history_task_t *tasks, int num, uint64_t total) {
+  int threads = history_header(history)->flags & HISTORY_FLAG_THREADS;
+  int i;
+  if (total == 0) {
+    total = 1;
+  }
+  printf(threads ? "  PID   TID    CPU  CNT NAME\n" : "  PID    CPU  CNT COMMAND\n");
+  for (i = 0; i < num; i++) {
+    char comm[HISTORY_NAME_LEN + 1];
+    memcpy(comm, tasks[i].comm, HISTORY_NAME_LEN);
+    comm[HISTORY_NAME_LEN] = 0;
+    if (threads) {
+      printf("%5d %5d ", tasks[i].pid, tasks[i].tid);
+    } else {
+      printf("%5d ", tasks[i].pid);
+    }
+    printf("%5.1f%% %4lu %s\n", (float) tasks[i].load / total * 100, tasks[i].load, comm);
+  }
+  printf("\n");
+}
+
+/**
+ * @brief レコードのタスク数をヘッダのタスク数以下に制限して返す
+ *
+ * 壊れたファイルのレコードでもタスク領域を超えて読まないようにする。
+ *
+ * @param[in] history 履歴ファイル
+ * @param[in] record  対象のレコード
+ * @return タスク数
+ */
+static int record_task_num(history_t *history, const history_record_t *record) {
+  uint32_t max = history_header(history)->task_num;
+  return record->task_num < max ? record->task_num : max;
+}
+
+/**
+ * @brief 1レコードを表示する
+ *
+ * @param[in] history 履歴ファイル
+ * @param[in] record  表示するレコード
+ */
+static void show_record(history_t *history, const history_record_t *record) {
+  cputime_t total = record->total;
+  char time[TIME_BUFFER_SIZE];
+  format_time(record->time, time, sizeof(time));
+  printf("%s ", time);
+  show_usage(&total);
+  printf(" %7.3fs", (double) record->elapsed / 1000000000);
+  show_cores(history, history_cores(history, record));
+  printf("\n");
+  printf("%u %s\n", record->proc_num,
+         history_header(history)->flags & HISTORY_FLAG_THREADS ? "threads" : "processes");
+  show_tasks(history, history_tasks(history, record), record_task_num(history, record), get_total(&total));
+}
+
+/**
+ * @brief タスクをPID、TID昇順に並べ替えるための比較関数
+ *
+ * @param[in] a 比較対象1
+ * @param[in] b 比較対象2
+ * @return 比較結果
+ */
+static int comp_task_id(const void *a, const void *b) {
+  const history_task_t *ta = a;
+  const history_task_t *tb = b;
+  if (ta->pid != tb->pid) {
+    return ta->pid < tb->pid ? -1 : 1;
+  }
+  if (ta->tid != tb->tid) {
+    return ta->tid < tb->tid ? -1 : 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief タスクを負荷の降順に並べ替えるための比較関数
+ *
+ * @param[in] a 比較対象1
+ * @param[in] b 比較対象2
+ * @return 比較結果
+ */
+static int comp_task_load(const void *a, const void *b) {
+  const history_task_t *ta = a;
+  const history_task_t *tb = b;
+  if (ta->load != tb->load) {
+    return ta->load > tb->load ? -1 : 1;
+  }
+  return comp_task_id(a, b);
+}
+
+/**
+ * @brief 範囲内のレコードを集計して表示する
+ *
+ * CPU時間は範囲内の差分の合計、タスクは各レコードの負荷上位に現れた負荷の合計とする。
+ *
+ * @param[in] history 履歴ファイル
+ * @param[in] window  表示の対象とする範囲
+ */
+static void show_summary(history_t *history, const window_t *window) {
+  const history_header_t *header = history_header(history);
+  uint64_t count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+  uint64_t first = count > header->record_num ? count - header->record_num + 1 : 1;
+  cputime_t *cores = xmalloc(sizeof(cputime_t) * (header->cpu_num + 1));
+  cputime_t *total = &cores[header->cpu_num];
+  history_task_t *tasks = NULL;
+  history_record_t *record = xmalloc(header->record_size);
+  uint64_t begin = 0;
+  uint64_t end = 0;
+  uint64_t elapsed = 0;
+  int task_num = 0;
+  int records = 0;
+  int num;
+  char time[TIME_BUFFER_SIZE];
+  uint64_t seq;
+  int i, j;
+  if (window->last != 0 && count - first + 1 > window->last) {
+    first = count - window->last + 1;
+  }
+  memset(cores, 0, sizeof(cputime_t) * (header->cpu_num + 1));
+  tasks = xmalloc(sizeof(history_task_t) * header->task_num * (count - first + 1));
+  for (seq = first; seq <= count; seq++) {
+    const uint64_t *src;
+    uint64_t *dst;
+    if (history_get(history, seq, record) != SUCCESS || !in_window(window, record)) {
+      continue;
+    }
+    if (records++ == 0) {
+      begin = record->time;
+    }
+    end = record->time;
+    elapsed += record->elapsed;
+    for (i = 0; i <= header->cpu_num; i++) {
+      src = (const uint64_t *) (i < header->cpu_num ? &history_cores(history, record)[i] : &record->total);
+      dst = (uint64_t *) &cores[i];
+      for (j = 0; j < CPUTIME_FIELDS; j++) {
+        dst[j] += src[j];
+      }
+    }
+    num = record_task_num(history, record);
+    memcpy(&tasks[task_num], history_tasks(history, record), sizeof(history_task_t) * num);
+    task_num += num;
+  }
+  if (records == 0) {
+    printf("no records\n");
+    goto end;
+  }
+  // 同じタスクの負荷を合計する
+  qsort(tasks, task_num, sizeof(history_task_t), comp_task_id);
+  for (i = 0, j = 0; i < task_num; i++) {
+    if (j > 0 && comp_task_id(&tasks[j - 1], &tasks[i]) == 0) {
+      tasks[j - 1].load += tasks[i].load;
+    } else {
+      tasks[j++] = tasks[i];
+    }
+  }
+  task_num = j;
+  qsort(tasks, task_num, sizeof(history_task_t), comp_task_load);
+  format_time(begin, time, sizeof(time));
+  printf("%s - ", time);
+  format_time(end, time, sizeof(time));
+  printf("%s (%d records)\n", time, records);
+  show_usage(total);
+  printf(" %7.3fs", (double) elapsed / 1000000000);
+  show_cores(history, cores);
+  printf("\n");
+  show_tasks(history, tasks, task_num < header->task_num ? task_num : header->task_num, get_total(total));
+  end:
+  free(record);
+  free(tasks);
+  free(cores);
+}
+
+int main(int argc, char **argv) {
+  int result = EXIT_FAILURE;
+  history_t *history = NULL;
+  const history_header_t *header;
+  history_record_t *record = NULL;
+  window_t window = {0, 0, 0};
+  int summary = FALSE;
+  uint64_t count;
+  uint64_t first;
+  uint64_t seq;
+  int last;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:f:t:S")) != -1) {
+    switch (opt) {
+      case 'n':
+        last = atoi(optarg);
+        if (last < 1) {
+          fprintf(stderr, "-n: 1 or more\n");
+          return EXIT_FAILURE;
+        }
+        window.last = last;
+        break;
+      case 'f':
+        if (parse_time(optarg, &window.from) != SUCCESS) {
+          fprintf(stderr, "-f: \"YYYY-MM-DD HH:MM:SS\" or seconds since the epoch\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 't':
+        if (parse_time(optarg, &window.to) != SUCCESS) {
+          fprintf(stderr, "-t: \"YYYY-MM-DD HH:MM:SS\" or seconds since the epoch\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'S':
+        summary = TRUE;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n records] [-f time] [-t time] [-S] file\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-n records] [-f time] [-t time] [-S] file\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  history = load_history_t(argv[optind]);
+  if (history == NULL) {
+    fprintf(stderr, "%s: cannot load history\n", argv[optind]);
+    goto error;
+  }
+  if (summary) {
+    show_summary(history, &window);
+    result = EXIT_SUCCESS;
+    goto error;
+  }
+  header = history_header(history);
+  record = xmalloc(header->record_size);
+  count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+  first = count > header->record_num ? count - header->record_num + 1 : 1;
+  if (window.last != 0 && count - first + 1 > window.last) {
+    first = count - window.last + 1;
+  }
+  for (seq = first; seq <= count; seq++) {
+    if (history_get(history, seq, record) == SUCCESS && in_window(&window, record)) {
+      show_record(history, record);
+    }
+  }
+  result = EXIT_SUCCESS;
+  error:
+  free(record);
+  delete_history_t(history);
+  return result;
+}
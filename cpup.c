@@ -14,19 +14,28 @@
  * @date 2016/3/21
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
-#include "def.h"
+#include <getopt.h>
+#include "cpuusage.h"
+#include "history.h"
+#include "output.h"
+#include "format.h"
+#include "topology.h"
+#include "shm.h"
+#include "watch.h"
 
 /**
- * パス名の最大
+ * /proc配下の相対パス名バッファのサイズ
  */
-#define PATH_MAX 4096
+#define NAME_BUFFER_SIZE 64
 /**
  * ラインバッファのサイズ
  */
@@ -36,33 +45,21 @@
  */
 #define INIT_PROCS 1024
 /**
- * プロセス名の上限
+ * PIDバッファの初期値
  */
-#define PR_NAME_LEN 16
+#define INIT_PIDS 1024
 /**
- * 表示するプロセス数
+ * ワーカー数の上限
  */
-#define DISPLAY_PROCESS_NUM 10
+#define MAX_WORKERS 256
 /**
- * 2つのポインタ値の入れ替え
+ * ワーカー間で受け渡す作業の単位となるPID数
  */
-#define SWAP(a, b) {void *tmp = a; a = b; b = tmp;}
-
+#define SCAN_CHUNK 32
 /**
- * statのCPUカウンタ記録用構造体
+ * プロセス名の上限
  */
-typedef struct cputime_t {
-  uint64_t user;       /**< ユーザーモードで消費した時間 */
-  uint64_t nice;       /**< 低い優先度のユーザーモードで消費した時間 */
-  uint64_t system;     /**< システムモードで消費した時間 */
-  uint64_t idle;       /**< タスク待ちで消費した時間 */
-  uint64_t iowait;     /**< I/O の完了待ちの時間 */
-  uint64_t irq;        /**< 割り込みの処理に使った時間 */
-  uint64_t softirq;    /**< ソフト割り込みの処理に使った時間 */
-  uint64_t steal;      /**< 仮想環境下で他のOSに消費された時間 */
-  uint64_t guest;      /**< ゲストOSの実行に消費された時間 */
-  uint64_t guest_nice; /**< 低い優先度のゲストOSの実行に消費された時間 */
-} cputime_t;
+#define PR_NAME_LEN 16
 
 /**
  * /proc/[pid]/statの情報保持構造体
@@ -71,387 +68,895 @@ typedef struct process_t {
   int pid;           /**< PID */
   char comm[PR_NAME_LEN];  /**< プロセス名 */
   char state;        /**< state */
-  uint64_t load;     /**< 負荷の合計 */
   uint64_t utime;    /**< ユーザ時間 */
   uint64_t stime;    /**< システム時間 */
   uint64_t cutime;   /**< 子プロセスのユーザ時間 */
   uint64_t cstime;   /**< 子プロセスのシステム時間 */
   int64_t priority;  /**< プライオリティ */
   int64_t nice;      /**< nice値 */
+  uint64_t starttime; /**< 起動時刻 */
 } process_t;
 
+/**
+ * プロセス名の文字列テーブルのエントリ
+ */
+typedef char name_t[PR_NAME_LEN];
+
 /**
  * 全CPU時間格納構造体
+ *
+ * プロセス情報は項目ごとの配列として保持する。
+ * 各配列はarena_tが確保した1つの領域から切り出され、PID昇順に格納される。
  */
 typedef struct cpu_t {
+  struct arena_t *arena; /**< 配列を確保したアリーナ */
   int cpu_num;        /**< CPUの個数 */
-  cputime_t *times;   /**< CPU時間 */
+  cputime_t total;    /**< CPU全体のCPU時間 */
+  cpu_matrix_t *cores; /**< 各コアのCPU時間 */
   int proc_num;       /**< 格納済みプロセス数 */
-  int alloc_num;      /**< メモリ確保数 */
-  int array_num;      /**< 配列の長さ */
-  process_t **procs;  /**< プロセス情報格納配列 */
+  int skipped;        /**< 読み出しを間引いたプロセス数 */
+  int opened;         /**< 今回のサンプリングで開いたファイル数 */
+  uint64_t *load;     /**< 負荷の合計 */
+  uint64_t *utime;    /**< ユーザ時間 */
+  uint64_t *stime;    /**< システム時間 */
+  uint64_t *starttime; /**< 起動時刻 */
+  int64_t *priority;  /**< プライオリティ */
+  int64_t *nice;      /**< nice値 */
+  int *pid;           /**< PID */
+  int *order;         /**< 並べ替え・負荷上位のインデックス */
+  int top_num;        /**< 負荷上位として選択した数 */
+  char *state;        /**< state */
+  name_t *comm;       /**< プロセス名の文字列テーブル */
 } cpu_t;
 
-static void *xmalloc(size_t size);
-static void *xrealloc(void *ptr, size_t size);
-static cpu_t *new_cpu_t(int num);
-static void delete_cpu_t(cpu_t *cpu);
-static int comp_pid(const void *a, const void *b);
-static int comp_load(const void *a, const void *b);
-static uint64_t get_total(cputime_t *time);
-static uint64_t get_load(cputime_t *time);
-static uint64_t get_idle(cputime_t *time);
-static uint64_t get_iowait(cputime_t *time);
-static uint64_t get_system(cputime_t *time);
-static uint64_t get_user(cputime_t *time);
-static uint64_t get_irq(cputime_t *time);
-static uint64_t get_guest(cputime_t *time);
-static void get_diff(cputime_t *before, cputime_t *after, cputime_t *diff);
-static result_t read_stat(cpu_t *cpu);
-static result_t read_process(cpu_t *cpu);
-static result_t read_pid_stat(process_t *proc, int pid);
+/**
+ * 前回と今回のサンプリング結果を格納するアリーナ
+ *
+ * 2つのcpu_tの全配列を1つの領域に配置し、書き込み先を交互に切り替える。
+ * 配列が不足した場合のみ領域を拡張するため、定常状態ではメモリ確保を行わない。
+ */
+typedef struct arena_t {
+  cpu_t cpus[2];      /**< サンプリング結果 */
+  int current;        /**< 今回の書き込み先のインデックス */
+  int array_num;      /**< 各配列の長さ */
+  char *mem;          /**< 全配列を格納する領域 */
+  cpu_usage_t *usage; /**< 各コアの使用率の計算に使う構造体 */
+  topology_t *topology; /**< トポロジーごとの集計先、集計しない場合NULL */
+  uint64_t *sort_buf; /**< 基数ソートの作業領域 */
+} arena_t;
+
+/**
+ * 共有メモリから読みだしたスレッドをプロセスごとに集計した結果
+ *
+ * 各配列はスナップショットのスレッド数の長さで確保する。
+ */
+typedef struct client_t {
+  int size;           /**< 各配列の長さ */
+  int num;            /**< プロセス数 */
+  int *rows;          /**< PID、TID順に並べたスレッドのインデックス */
+  int *pid;           /**< PID */
+  int *priority;      /**< プライオリティ */
+  int64_t *nice;      /**< nice値 */
+  char *state;        /**< state */
+  uint64_t *load;     /**< スレッドの負荷の合計 */
+  name_t *comm;       /**< プロセス名の文字列テーブル */
+  int *order;         /**< 上位選択の結果 */
+} client_t;
+
+/**
+ * 走査後にfdキャッシュへ登録するfd
+ */
+typedef struct fd_pending_t {
+  uint64_t key;   /**< キー(PID/TID) */
+  int fd;         /**< ファイルディスクリプタ */
+  process_t last; /**< 読みだした内容 */
+} fd_pending_t;
+
+/**
+ * ワーカーが担当するチャンクの両端キュー
+ *
+ * 走査開始前に連続したチャンク番号の範囲[top, bottom)を割り当て、
+ * 走査中は所有者がbottom側から、他のワーカーがtop側から取り出す。
+ * 走査中に追加することはないため、範囲のみを保持すれば足りる。
+ * 他のワーカーが書き換えるため、キャッシュラインを分ける。
+ */
+typedef struct deque_t {
+  int top;    /**< 盗む側の取り出し位置、CASで進める */
+  int bottom; /**< 所有者の取り出し位置、所有者のみが更新する */
+} __attribute__((aligned(64))) deque_t;
+
+/**
+ * チャンクの読み出し結果の位置
+ *
+ * チャンクを取り出したワーカーのみが書き込むため、ロックを必要としない。
+ */
+typedef struct chunk_t {
+  int worker; /**< 読み出したワーカー番号 */
+  int start;  /**< ワーカーのアリーナ上の先頭位置 */
+  int num;    /**< 読みだしたプロセス数 */
+} chunk_t;
+
+/**
+ * /proc走査ワーカー
+ *
+ * 自身の両端キューのチャンクを読み終えると他のワーカーのキューから盗む。
+ * プロセス情報のアリーナと新たに開いたfdの一覧を専有し、
+ * 共有のfdキャッシュは参照のみ行うため、走査中にロックを必要としない。
+ */
+typedef struct worker_t {
+  deque_t deque;      /**< 担当するチャンクの両端キュー */
+  struct sampler_t *sampler; /**< 所属するサンプラー */
+  int index;          /**< ワーカー番号 */
+  fd_pending_t *pending; /**< 走査後にfdキャッシュへ登録するfd */
+  int pending_num;    /**< 登録待ちのfd数 */
+  int pending_array_num; /**< 登録待ち配列の長さ */
+  int skipped;        /**< 今回のサンプリングで間引いたタスク数 */
+  int opened;         /**< 今回のサンプリングで開いたファイル数 */
+  process_t *procs;   /**< プロセス情報のアリーナ、走査ごとに先頭から詰めて書き込む */
+  int proc_num;       /**< 格納済みプロセス数 */
+  int array_num;      /**< アリーナの長さ */
+} worker_t;
+
+/**
+ * /proc/stat読み出し用構造体
+ *
+ * /proc/statはopenしたまま保持し、サンプリングごとにpreadで先頭から読みなおす。
+ * バッファも使い回すため、定常状態ではメモリ確保を行わない。
+ */
+typedef struct sampler_t {
+  stat_sampler_t *stat; /**< /proc/statの読み出し */
+  DIR *proc_dir;     /**< /procのディレクトリストリーム */
+  watch_t *watch;    /**< イベント方式のプロセス追跡、/procを走査する場合NULL */
+  int *pids;         /**< /procから列挙したPID */
+  int pid_num;       /**< 列挙したPID数 */
+  int pid_array_num; /**< PID配列の長さ */
+  chunk_t *chunks;   /**< チャンクごとの読み出し結果の位置 */
+  int chunk_num;     /**< 今回のチャンク数 */
+  int chunk_array_num; /**< チャンク配列の長さ */
+  fd_cache_t *fds;   /**< statファイルのfdキャッシュ、全ワーカーで共有する */
+  int fd_reserve;    /**< 今回の走査で新たに登録できる残り、ワーカー間でアトミックに減らす */
+  int worker_num;    /**< ワーカー数 */
+  worker_t *workers; /**< ワーカー */
+  pool_t *pool;      /**< ワーカースレッド */
+} sampler_t;
+
+static arena_t *new_arena_t(int num);
+static void delete_arena_t(arena_t *arena);
+static void arena_layout(arena_t *arena, char *mem, int array_num);
+static void arena_grow(arena_t *arena);
+static void arena_flip(arena_t *arena, cpu_t **before, cpu_t **after);
+static void ensure_next_proc(cpu_t *cpu);
+static void set_proc(cpu_t *cpu, int i, process_t *proc);
+static void get_proc(cpu_t *cpu, int i, process_t *proc);
+static void sort_pid(cpu_t *cpu);
+static sampler_t *new_sampler_t(int event, int worker_num, int adaptive);
+static void delete_sampler_t(sampler_t *sampler);
+static result_t read_stat(sampler_t *sampler, cpu_t *cpu);
+static result_t read_process_watch(watch_t *watch, DIR *proc_dir, cpu_t *cpu);
+static void worker_run(void *arg, int index);
+static void worker_scan(worker_t *worker);
+static int worker_pop(worker_t *worker);
+static int worker_steal(worker_t *victim);
+static void worker_read_chunk(worker_t *worker, int chunk);
+static process_t *worker_next_proc(worker_t *worker);
+static void worker_defer_fd(worker_t *worker, uint64_t key, int fd, const process_t *proc);
+static void assign_chunks(sampler_t *sampler);
+static void merge_chunks(sampler_t *sampler, cpu_t *cpu);
+static void commit_fds(sampler_t *sampler);
+static result_t read_process(sampler_t *sampler, cpu_t *cpu);
+static result_t read_pid_stat(worker_t *worker, process_t *proc, int proc_fd,
+                              int pid, const char *name);
 static result_t parse_stat(char *line, process_t *proc);
-static void show_result(cpu_t *before, cpu_t *after);
+static void record_history(history_t *history, cpu_t *before, cpu_t *after, ticker_t *ticker);
+static void show_result(cpu_t *before, cpu_t *after, const rank_t *rank, ticker_t *ticker);
 static void show_result_cpus(cpu_t *before, cpu_t *after);
-static void show_result_process(uint64_t total, cpu_t *before, cpu_t *after);
+static void get_columns(cpu_t *cpu, task_columns_t *columns);
+static void calc_load(cpu_t *before, cpu_t *after);
+static int select_top(cpu_t *cpu, const rank_t *rank);
+static void show_result_process(uint64_t total, cpu_t *before, cpu_t *after, const rank_t *rank);
+static void put_result(format_t *format, int kind, cpu_t *before, cpu_t *after,
+                       const rank_t *rank, ticker_t *ticker, int dropped);
+static void put_result_json(format_t *format, cputime_t *diff, cpu_t *after,
+                            ticker_t *ticker, int dropped);
+static void put_result_binary(format_t *format, cputime_t *diff, cpu_t *after,
+                              ticker_t *ticker, int dropped);
+static client_t *new_client_t(void);
+static void delete_client_t(client_t *client);
+static int comp_snapshot_task(const void *a, const void *b, void *arg);
+static void client_rollup(client_t *client, const binary_record_t *record);
+static void show_snapshot(client_t *client, const binary_record_t *record, const rank_t *rank);
+static int run_client(const char *name, const rank_t *rank, int screen);
 
 /**
- * @brief malloc結果がNULLだった場合にexitする
+ * @brief サンプリング結果のアリーナの初期化を行う
  *
- * @param[in] size 確保サイズ
- * @return 確保された領域へのポインタ
+ * @param[in] num CPUの個数
+ * @return アリーナ
  */
-static void *xmalloc(size_t size) {
-  void *p = malloc(size);
-  if (p == NULL) {
-    ERR("%s\n", strerror(errno));
-    exit(EXIT_FAILURE);
+static arena_t *new_arena_t(int num) {
+  int i;
+  arena_t *arena = xmalloc(sizeof(arena_t));
+  arena->current = 0;
+  arena->array_num = INIT_PROCS;
+  arena->usage = new_cpu_usage_t(num);
+  for (i = 0; i < 2; i++) {
+    cpu_t *cpu = &arena->cpus[i];
+    cpu->arena = arena;
+    cpu->cpu_num = num;
+    cpu->cores = new_cpu_matrix_t(num);
+    cpu->proc_num = 0;
+    cpu->skipped = 0;
   }
-  return p;
+  arena->mem = NULL;
+  arena->sort_buf = NULL;
+  arena->topology = NULL;
+  arena_grow(arena);
+  return arena;
 }
 
 /**
- * @brief realloc結果がNULLだった場合にexitする
+ * @brief サンプリング結果のアリーナの開放を行う
  *
- * @param[in] ptr ポインタ
- * @param[in] size 確保サイズ
- * @return 確保された領域へのポインタ
+ * @param[in] arena 開放するアリーナ
  */
-static void *xrealloc(void *ptr, size_t size) {
-  void *p = realloc(ptr, size);
-  if (p == NULL) {
-    ERR("%s\n", strerror(errno));
-    exit(EXIT_FAILURE);
+static void delete_arena_t(arena_t *arena) {
+  if (arena == NULL) {
+    return;
   }
-  return p;
+  free(arena->mem);
+  delete_cpu_matrix_t(arena->cpus[0].cores);
+  delete_cpu_matrix_t(arena->cpus[1].cores);
+  delete_cpu_usage_t(arena->usage);
+  delete_topology_t(arena->topology);
+  free(arena->sort_buf);
+  free(arena);
 }
 
 /**
- * @brief 全CPU時間格納構造体の初期化を行う
+ * @brief 領域を2つのcpu_tの各配列に割り当てる
  *
- * @param[in] num CPUの個数
- * @return 全CPU時間格納構造体
+ * 要素サイズの大きい配列から順に配置し、アラインメントを保つ。
+ *
+ * @param[in,out] arena     対象のアリーナ
+ * @param[in]     mem       割り当てる領域
+ * @param[in]     array_num 各配列の長さ
  */
-static cpu_t *new_cpu_t(int num) {
-  cpu_t *cpu;
-  cpu = xmalloc(sizeof(cpu_t));
-  cpu->cpu_num = num;
-  cpu->times = xmalloc((num + 1) * sizeof(cputime_t));
-  cpu->proc_num = 0;
-  cpu->array_num = INIT_PROCS;
-  cpu->procs = xmalloc(INIT_PROCS * sizeof(process_t*));
-  return cpu;
+static void arena_layout(arena_t *arena, char *mem, int array_num) {
+  int i;
+  for (i = 0; i < 2; i++) {
+    cpu_t *cpu = &arena->cpus[i];
+    cpu->load = (uint64_t *) mem;
+    mem += sizeof(uint64_t) * array_num;
+    cpu->utime = (uint64_t *) mem;
+    mem += sizeof(uint64_t) * array_num;
+    cpu->stime = (uint64_t *) mem;
+    mem += sizeof(uint64_t) * array_num;
+    cpu->starttime = (uint64_t *) mem;
+    mem += sizeof(uint64_t) * array_num;
+    cpu->priority = (int64_t *) mem;
+    mem += sizeof(int64_t) * array_num;
+    cpu->nice = (int64_t *) mem;
+    mem += sizeof(int64_t) * array_num;
+    cpu->pid = (int *) mem;
+    mem += sizeof(int) * array_num;
+    cpu->order = (int *) mem;
+    mem += sizeof(int) * array_num;
+    cpu->comm = (name_t *) mem;
+    mem += sizeof(name_t) * array_num;
+    cpu->state = mem;
+    mem += sizeof(char) * array_num;
+  }
 }
 
 /**
- * @brief 全CPU時間格納構造体の開放を行う
+ * 配列の格納済みの要素を新しい配列へコピーする
+ */
+#define COPY_COLUMN(dst, src, column) \
+    memcpy((dst)->column, (src)->column, sizeof(*(src)->column) * (src)->proc_num)
+
+/**
+ * @brief アリーナの各配列の長さを倍にする
+ *
+ * 初回は初期サイズで確保する。格納済みの内容は引き継ぐ。
  *
- * @param[in] cpu 開放する構造体
+ * @param[in,out] arena 対象のアリーナ
  */
-static void delete_cpu_t(cpu_t *cpu) {
+static void arena_grow(arena_t *arena) {
+  size_t row = sizeof(uint64_t) * 4 + sizeof(int64_t) * 2 + sizeof(int) * 2
+      + sizeof(name_t) + sizeof(char);
+  cpu_t old[2];
+  char *old_mem = arena->mem;
   int i;
-  if (cpu == NULL) {
+  if (old_mem != NULL) {
+    arena->array_num *= 2;
+  }
+  memcpy(old, arena->cpus, sizeof(old));
+  arena->mem = xmalloc(row * arena->array_num * 2);
+  arena->sort_buf = xrealloc(arena->sort_buf, sizeof(uint64_t) * arena->array_num * 2);
+  arena_layout(arena, arena->mem, arena->array_num);
+  if (old_mem == NULL) {
     return;
   }
-  for (i = 0; i < cpu->alloc_num; i++) {
-    free(cpu->procs[i]);
+  for (i = 0; i < 2; i++) {
+    cpu_t *cpu = &arena->cpus[i];
+    COPY_COLUMN(cpu, &old[i], load);
+    COPY_COLUMN(cpu, &old[i], utime);
+    COPY_COLUMN(cpu, &old[i], stime);
+    COPY_COLUMN(cpu, &old[i], starttime);
+    COPY_COLUMN(cpu, &old[i], priority);
+    COPY_COLUMN(cpu, &old[i], nice);
+    COPY_COLUMN(cpu, &old[i], pid);
+    COPY_COLUMN(cpu, &old[i], order);
+    COPY_COLUMN(cpu, &old[i], comm);
+    COPY_COLUMN(cpu, &old[i], state);
   }
-  free(cpu->procs);
-  free(cpu->times);
-  free(cpu);
+  free(old_mem);
+}
+
+/**
+ * @brief 今回の結果を前回の結果とし、書き込み先を切り替える
+ *
+ * @param[in,out] arena  対象のアリーナ
+ * @param[out]    before 前回の結果の格納先
+ * @param[out]    after  次回の書き込み先の格納先
+ */
+static void arena_flip(arena_t *arena, cpu_t **before, cpu_t **after) {
+  arena->current ^= 1;
+  *before = &arena->cpus[arena->current ^ 1];
+  *after = &arena->cpus[arena->current];
 }
 
 /**
- * @brief 次のプロセス構造体が利用できるようにする
+ * @brief 次のプロセス情報が格納できるようにする
  *
- * proc_numの位置がメモリ確保された状態であることを担保する。
+ * proc_numの位置が配列の範囲内であることを担保する。
  *
- * @param[out] cpu 確保する構造体
+ * @param[in,out] cpu 格納先の構造体
  */
 static void ensure_next_proc(cpu_t *cpu) {
-  if (cpu->array_num == cpu->proc_num) {
-    cpu->array_num *= 2;
-    cpu->procs = xrealloc(cpu->procs, sizeof(process_t*) * cpu->array_num);
+  if (cpu->proc_num == cpu->arena->array_num) {
+    arena_grow(cpu->arena);
+  }
+}
+
+/**
+ * @brief プロセス情報を各配列の指定位置へ書き込む
+ *
+ * @param[out] cpu  書き込み先
+ * @param[in]  i    書き込む位置
+ * @param[in]  proc プロセス情報
+ */
+static void set_proc(cpu_t *cpu, int i, process_t *proc) {
+  cpu->utime[i] = proc->utime;
+  cpu->stime[i] = proc->stime;
+  cpu->starttime[i] = proc->starttime;
+  cpu->priority[i] = proc->priority;
+  cpu->nice[i] = proc->nice;
+  cpu->pid[i] = proc->pid;
+  memcpy(cpu->comm[i], proc->comm, sizeof(name_t));
+  cpu->state[i] = proc->state;
+}
+
+/**
+ * @brief 各配列の指定位置からプロセス情報を読み出す
+ *
+ * @param[in]  cpu  読み出し元
+ * @param[in]  i    読み出す位置
+ * @param[out] proc プロセス情報
+ */
+static void get_proc(cpu_t *cpu, int i, process_t *proc) {
+  proc->utime = cpu->utime[i];
+  proc->stime = cpu->stime[i];
+  proc->starttime = cpu->starttime[i];
+  proc->priority = cpu->priority[i];
+  proc->nice = cpu->nice[i];
+  proc->pid = cpu->pid[i];
+  memcpy(proc->comm, cpu->comm[i], sizeof(name_t));
+  proc->state = cpu->state[i];
+}
+
+/**
+ * @brief プロセス情報をPID昇順に並べる
+ *
+ * /procの走査結果は通常PID昇順のため、並んでいればそのまま返す。
+ * 並んでいない場合はPIDと位置の組を基数ソートし、その置換を巡回ごとに適用する。
+ *
+ * @param[in,out] cpu 対象の構造体
+ */
+static void sort_pid(cpu_t *cpu) {
+  uint64_t *data = cpu->arena->sort_buf;
+  uint64_t *sorted;
+  int i;
+  int num = cpu->proc_num;
+  for (i = 1; i < num && cpu->pid[i - 1] < cpu->pid[i]; i++);
+  if (i >= num) {
+    return;
+  }
+  for (i = 0; i < num; i++) {
+    data[i] = (uint64_t) (uint32_t) cpu->pid[i] << 32 | (uint32_t) i;
   }
-  if (cpu->alloc_num == cpu->proc_num) {
-    cpu->procs[cpu->alloc_num] = xmalloc(sizeof(process_t));
-    cpu->alloc_num++;
+  sorted = radix_sort(data, data + cpu->arena->array_num, num);
+  for (i = 0; i < num; i++) {
+    cpu->order[i] = (uint32_t) sorted[i];
+  }
+  for (i = 0; i < num; i++) {
+    process_t tmp;
+    process_t proc;
+    int j;
+    int k;
+    if (cpu->order[i] == i) {
+      continue;
+    }
+    get_proc(cpu, i, &tmp);
+    for (j = i; (k = cpu->order[j]) != i; j = k) {
+      get_proc(cpu, k, &proc);
+      set_proc(cpu, j, &proc);
+      cpu->order[j] = j;
+    }
+    set_proc(cpu, j, &tmp);
+    cpu->order[j] = j;
   }
 }
 
 /**
- * @brief pid昇順ソート用比較関数
+ * @brief /proc/stat読み出し用構造体の初期化を行う
+ *
+ * イベント方式が利用できない場合は/procの走査で代用する。
+ * /procの走査はworker_num個のワーカーで分担し、
+ * 呼び出し元スレッドを0番として残りのスレッドを起動する。
+ * fdキャッシュはワーカー間で共有し、どのワーカーが読んでもPIDごとに同じエントリを使う。
  *
- * @param[in] a 比較対象
- * @param[in] b 比較対象
- * @return a < b の時負、a == b の時0、a > b の時正
+ * @param[in] event      イベント方式でプロセスを追跡するか
+ * @param[in] worker_num /procを走査するワーカー数
+ * @param[in] adaptive   読み出しを間引くまでのアイドル回数、0の場合は間引かない
+ * @return /proc/stat読み出し用構造体、失敗した場合NULL
  */
-static int comp_pid(const void *a, const void *b) {
-  return (*(process_t**)a)->pid - (*(process_t**)b)->pid;
+static sampler_t *new_sampler_t(int event, int worker_num, int adaptive) {
+  int i;
+  sampler_t *sampler;
+  sampler = xmalloc(sizeof(sampler_t));
+  sampler->stat = new_stat_sampler_t();
+  if (sampler->stat == NULL) {
+    free(sampler);
+    return NULL;
+  }
+  sampler->proc_dir = opendir(get_proc_root());
+  if (sampler->proc_dir == NULL) {
+    ERR("%s\n", strerror(errno));
+    delete_stat_sampler_t(sampler->stat);
+    free(sampler);
+    return NULL;
+  }
+  sampler->watch = NULL;
+  if (event && !is_default_proc_root()) {
+    fprintf(stderr, "-e is not available with --proc-root, scanning %s instead\n", get_proc_root());
+  } else if (event) {
+    sampler->watch = new_watch_t(dirfd(sampler->proc_dir), WATCH_PROCESS);
+    if (sampler->watch == NULL) {
+      fprintf(stderr, "proc connector/taskstats is not available, scanning /proc instead\n");
+    }
+  }
+  sampler->pid_num = 0;
+  sampler->pid_array_num = INIT_PIDS;
+  sampler->pids = xmalloc(sizeof(int) * sampler->pid_array_num);
+  sampler->chunk_num = 0;
+  sampler->chunk_array_num = INIT_PIDS / SCAN_CHUNK;
+  sampler->chunks = xmalloc(sizeof(chunk_t) * sampler->chunk_array_num);
+  sampler->worker_num = worker_num;
+  sampler->workers = xmalloc(sizeof(worker_t) * worker_num);
+  sampler->fds = new_fd_cache_t(get_fd_limit(), sizeof(process_t));
+  sampler->fds->adaptive = adaptive;
+  sampler->fd_reserve = 0;
+  for (i = 0; i < worker_num; i++) {
+    worker_t *worker = &sampler->workers[i];
+    worker->deque.top = 0;
+    worker->deque.bottom = 0;
+    worker->sampler = sampler;
+    worker->index = i;
+    worker->pending_num = 0;
+    worker->pending_array_num = INIT_PROCS;
+    worker->pending = xmalloc(sizeof(fd_pending_t) * worker->pending_array_num);
+    worker->skipped = 0;
+    worker->opened = 0;
+    worker->proc_num = 0;
+    worker->array_num = INIT_PROCS;
+    worker->procs = xmalloc(sizeof(process_t) * worker->array_num);
+  }
+  sampler->pool = new_pool_t(worker_num, worker_run, sampler);
+  return sampler;
 }
 
 /**
- * @brief 負荷降順ソート用比較関数
+ * @brief /proc/stat読み出し用構造体の開放を行う
  *
- * @param[in] a 比較対象
- * @param[in] b 比較対象
- * @return a > b の時負、a == b の時0、a < b の時正
+ * @param[in] sampler 開放する構造体
  */
-static int comp_load(const void *a, const void *b) {
-  return (*(process_t**)b)->load - (*(process_t**)a)->load;
+static void delete_sampler_t(sampler_t *sampler) {
+  int i;
+  if (sampler == NULL) {
+    return;
+  }
+  delete_pool_t(sampler->pool);
+  for (i = 0; i < sampler->worker_num; i++) {
+    free(sampler->workers[i].pending);
+    free(sampler->workers[i].procs);
+  }
+  delete_fd_cache_t(sampler->fds);
+  delete_stat_sampler_t(sampler->stat);
+  closedir(sampler->proc_dir);
+  delete_watch_t(sampler->watch);
+  free(sampler->workers);
+  free(sampler->chunks);
+  free(sampler->pids);
+  free(sampler);
 }
 
 /**
- * @brief カウンタの合計を返す
+ * @brief statの値を読みだす
  *
- * @param[in] time cputime_t構造体
- * @return カウンタの合計値
+ * @param[in,out] sampler 読み出しに使う構造体
+ * @param[out] cpu 結果の書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
  */
-static uint64_t get_total(cputime_t *time) {
-  return time->user + time->nice + time->system
-      + time->idle + time->iowait + time->irq + time->softirq
-      + time->steal + time->guest + time->guest_nice;
+static result_t read_stat(sampler_t *sampler, cpu_t *cpu) {
+  return stat_sampler_read_matrix(sampler->stat, &cpu->total, cpu->cores);
 }
+
 /**
- * @brief 負荷のカウンタの合計を返す
+ * @brief イベント方式でプロセス情報の読み出し
+ *
+ * 追跡対象を最新の状態にしたうえで、結果として有効なタスクを書き込む。
  *
- * @param[in] time cputime_t構造体
- * @return 負荷のカウンタの合計値
+ * @param[in,out] watch    タスク追跡構造体
+ * @param[in]     proc_dir /procのディレクトリストリーム
+ * @param[out]    cpu      結果の書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
  */
-static uint64_t get_load(cputime_t *time) {
-  return time->user + time->nice + time->system
-      + time->irq + time->softirq
-      + time->steal + time->guest + time->guest_nice;
+static result_t read_process_watch(watch_t *watch, DIR *proc_dir, cpu_t *cpu) {
+  int i;
+  watch_update(watch, proc_dir);
+  cpu->proc_num = 0;
+  for (i = 0; i < watch->size; i++) {
+    watch_task_t *task = &watch->tasks[i];
+    process_t proc;
+    if (task->tid == 0 || task->refresh) {
+      continue;
+    }
+    memset(&proc, 0, sizeof(process_t));
+    proc.pid = task->pid;
+    memcpy(proc.comm, task->comm, sizeof(proc.comm));
+    proc.state = task->state;
+    proc.utime = task->utime;
+    proc.stime = task->stime;
+    proc.priority = task->priority;
+    proc.nice = task->nice;
+    ensure_next_proc(cpu);
+    set_proc(cpu, cpu->proc_num++, &proc);
+  }
+  sort_pid(cpu);
+  return SUCCESS;
 }
 
 /**
- * @brief アイドルのカウンタの合計を返す
+ * @brief ワーカー番号に対応するワーカーで走査する
  *
- * @param[in] time cputime_t構造体
- * @return アイドルのカウンタの合計値
+ * @param[in] arg   読み出しに使う構造体
+ * @param[in] index ワーカー番号
  */
-static uint64_t get_idle(cputime_t *time) {
-  return time->idle + time->iowait;
+static void worker_run(void *arg, int index) {
+  sampler_t *sampler = arg;
+  worker_scan(&sampler->workers[index]);
 }
 
 /**
- * @brief I/O待ちのカウンタの合計を返す
+ * @brief ワーカーによるプロセスの走査
+ *
+ * 自身のキューのチャンクを読み終えたら、隣のワーカーから順にキューが空になるまで盗む。
+ * 走査中にチャンクが追加されることはないため、一巡して全て空であれば終了できる。
  *
- * @param[in] time cputime_t構造体
- * @return I/O待ちのカウンタの合計値
+ * @param[in,out] worker 走査するワーカー
  */
-static uint64_t get_iowait(cputime_t *time) {
-  return time->iowait;
+static void worker_scan(worker_t *worker) {
+  sampler_t *sampler = worker->sampler;
+  int chunk;
+  int i;
+  worker->proc_num = 0;
+  worker->skipped = 0;
+  worker->opened = 0;
+  while ((chunk = worker_pop(worker)) >= 0) {
+    worker_read_chunk(worker, chunk);
+  }
+  for (i = 1; i < sampler->worker_num; i++) {
+    worker_t *victim = &sampler->workers[(worker->index + i) % sampler->worker_num];
+    while ((chunk = worker_steal(victim)) >= 0) {
+      worker_read_chunk(worker, chunk);
+    }
+  }
 }
 
 /**
- * @brief systemのカウンタの合計を返す
+ * @brief 自身のキューのbottom側からチャンクを取り出す
+ *
+ * bottomを先に減らしてからtopを確認する。
+ * 残りが1つの場合は盗む側と競合するため、topのCASに成功した側が取得する。
  *
- * @param[in] time cputime_t構造体
- * @return systemのカウンタの合計値
+ * @param[in,out] worker 対象のワーカー
+ * @return チャンク番号、空の場合-1
  */
-static uint64_t get_system(cputime_t *time) {
-  return time->system;
+static int worker_pop(worker_t *worker) {
+  deque_t *deque = &worker->deque;
+  int bottom = deque->bottom - 1;
+  int top;
+  int chunk = bottom;
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_SEQ_CST);
+  top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+  if (top < bottom) {
+    return chunk;
+  }
+  if (top > bottom
+      || !__atomic_compare_exchange_n(&deque->top, &top, top + 1, FALSE,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    chunk = -1;
+  }
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_SEQ_CST);
+  return chunk;
 }
 
 /**
- * @brief userのカウンタの合計を返す
+ * @brief 他のワーカーのキューのtop側からチャンクを盗む
+ *
+ * CASに失敗した場合は他のワーカーが先に取り出しているため、残りがあればやりなおす。
  *
- * @param[in] time cputime_t構造体
- * @return userのカウンタの合計値
+ * @param[in,out] victim 盗む対象のワーカー
+ * @return チャンク番号、空の場合-1
  */
-static uint64_t get_user(cputime_t *time) {
-  return time->user + time->nice;
+static int worker_steal(worker_t *victim) {
+  deque_t *deque = &victim->deque;
+  int top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+  int bottom = __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+  while (top < bottom) {
+    if (__atomic_compare_exchange_n(&deque->top, &top, top + 1, FALSE,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      return top;
+    }
+    bottom = __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+  }
+  return -1;
 }
 
 /**
- * @brief 割り込みのカウンタの合計を返す
+ * @brief チャンクに含まれるPIDのstatを読み出す
+ *
+ * 結果は自身のアリーナの末尾へ追記し、その位置をチャンクの結果として記録する。
  *
- * @param[in] time cputime_t構造体
- * @return 割り込みのカウンタの合計値
+ * @param[in,out] worker 読み出すワーカー
+ * @param[in]     chunk  チャンク番号
  */
-static uint64_t get_irq(cputime_t *time) {
-  return time->irq + time->softirq;
+static void worker_read_chunk(worker_t *worker, int chunk) {
+  sampler_t *sampler = worker->sampler;
+  chunk_t *result = &sampler->chunks[chunk];
+  int proc_fd = dirfd(sampler->proc_dir);
+  int end = (chunk + 1) * SCAN_CHUNK;
+  int i;
+  if (end > sampler->pid_num) {
+    end = sampler->pid_num;
+  }
+  result->worker = worker->index;
+  result->start = worker->proc_num;
+  for (i = chunk * SCAN_CHUNK; i < end; i++) {
+    char name[NAME_BUFFER_SIZE];
+    int pid = sampler->pids[i];
+    snprintf(name, sizeof(name), "%d", pid);
+    if (read_pid_stat(worker, worker_next_proc(worker), proc_fd, pid, name) == SUCCESS) {
+      worker->proc_num++;
+    }
+  }
+  result->num = worker->proc_num - result->start;
 }
 
 /**
- * @brief ゲストのカウンタの合計を返す
+ * @brief アリーナの次のプロセス情報を返す
+ *
+ * proc_numの位置が利用できるようにアリーナを拡張する。
  *
- * @param[in] time cputime_t構造体
- * @return ゲストのカウンタの合計値
+ * @param[in,out] worker 対象のワーカー
+ * @return proc_numの位置のプロセス情報
  */
-static uint64_t get_guest(cputime_t *time) {
-  return time->guest + time->guest_nice;
+static process_t *worker_next_proc(worker_t *worker) {
+  if (worker->array_num == worker->proc_num) {
+    worker->array_num *= 2;
+    worker->procs = xrealloc(worker->procs, sizeof(process_t) * worker->array_num);
+  }
+  return &worker->procs[worker->proc_num];
 }
 
 /**
- * @brief cputime_t間の差分を取る
+ * @brief 新たに開いたfdを走査後の登録待ちに加える
  *
- * @param[in] before 時間的に前の値
- * @param[in] after 時間的に後の値
- * @param[out] diff 差分の格納先
- */
-static void get_diff(cputime_t *before, cputime_t *after, cputime_t *diff) {
-  uint64_t tmp;
-  // 負の値の場合は0とする
-#define DIFF(x) {tmp = after->x - before->x; diff->x = tmp < 0 ? 0 : tmp;}
-  DIFF(user);
-  DIFF(nice);
-  DIFF(system);
-  DIFF(idle);
-  DIFF(iowait);
-  DIFF(irq);
-  DIFF(softirq);
-  DIFF(steal);
-  DIFF(guest);
-  DIFF(guest_nice);
-#undef DIFF
+ * 共有のfdキャッシュの上限を超えないよう、走査前に求めた残りからアトミックに確保し、
+ * 確保できなかった場合はその場で閉じる。
+ *
+ * @param[in,out] worker 開いたワーカー
+ * @param[in]     key    キー
+ * @param[in]     fd     開いたファイルディスクリプタ
+ * @param[in]     proc   fdから読みだした内容
+ */
+static void worker_defer_fd(worker_t *worker, uint64_t key, int fd, const process_t *proc) {
+  fd_pending_t *pending;
+  if (__atomic_sub_fetch(&worker->sampler->fd_reserve, 1, __ATOMIC_RELAXED) < 0) {
+    close(fd);
+    return;
+  }
+  if (worker->pending_array_num == worker->pending_num) {
+    worker->pending_array_num *= 2;
+    worker->pending = xrealloc(worker->pending, sizeof(fd_pending_t) * worker->pending_array_num);
+  }
+  pending = &worker->pending[worker->pending_num++];
+  pending->key = key;
+  pending->fd = fd;
+  pending->last = *proc;
 }
 
 /**
- * @brief statの値を読みだす
+ * @brief 列挙したPIDをチャンクに区切り、各ワーカーのキューへ割り当てる
  *
- * @param[out] cpu 結果の書き込み先
- * @return 成功：SUCCESS / 失敗：FAILURE
+ * 各ワーカーには連続したチャンクを等分する。
+ * PIDの分布が偏っていても、読み終えたワーカーが盗むことで負荷が均される。
+ *
+ * @param[in,out] sampler 読み出しに使う構造体
  */
-static result_t read_stat(cpu_t *cpu) {
-  result_t result = FAILURE;
-  cputime_t *work;
-  FILE *file;
-  char line[LINE_BUFFER_SIZE];
-  file = fopen("/proc/stat", "rb");
-  if (file == NULL) {
-    ERR("%s\n", strerror(errno));
-    return FAILURE;
+static void assign_chunks(sampler_t *sampler) {
+  int i;
+  int num = sampler->worker_num;
+  sampler->chunk_num = (sampler->pid_num + SCAN_CHUNK - 1) / SCAN_CHUNK;
+  if (sampler->chunk_num > sampler->chunk_array_num) {
+    while (sampler->chunk_num > sampler->chunk_array_num) {
+      sampler->chunk_array_num *= 2;
+    }
+    sampler->chunks = xrealloc(sampler->chunks, sizeof(chunk_t) * sampler->chunk_array_num);
   }
-  if (fgets(line, sizeof(line), file) == NULL) {
-    ERR("%s\n", strerror(errno));
-    goto error;
+  for (i = 0; i < num; i++) {
+    worker_t *worker = &sampler->workers[i];
+    worker->deque.top = (int) ((int64_t) sampler->chunk_num * i / num);
+    worker->deque.bottom = (int) ((int64_t) sampler->chunk_num * (i + 1) / num);
   }
-  memset(cpu->times, 0, sizeof(cputime_t) * cpu->cpu_num);
-  work = &cpu->times[cpu->cpu_num];
-  if (sscanf(line, "cpu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
-             &work->user,
-             &work->nice,
-             &work->system,
-             &work->idle,
-             &work->iowait,
-             &work->irq,
-             &work->softirq,
-             &work->steal,
-             &work->guest,
-             &work->guest_nice) < 4) {
-    ERR("%s\n", strerror(errno));
-    goto error;
+}
+
+/**
+ * @brief チャンクごとの結果をチャンク順に連結する
+ *
+ * チャンクはPIDの列挙順に並んでいるため、
+ * どのワーカーが読み出したかによらず1スレッドで走査した場合と同じ順になる。
+ *
+ * @param[in]  sampler 読み出しに使う構造体
+ * @param[out] cpu     結果の書き込み先
+ */
+static void merge_chunks(sampler_t *sampler, cpu_t *cpu) {
+  int i, j;
+  cpu->proc_num = 0;
+  for (i = 0; i < sampler->chunk_num; i++) {
+    chunk_t *chunk = &sampler->chunks[i];
+    process_t *procs = sampler->workers[chunk->worker].procs + chunk->start;
+    for (j = 0; j < chunk->num; j++) {
+      ensure_next_proc(cpu);
+      set_proc(cpu, cpu->proc_num++, &procs[j]);
+    }
   }
-  if (cpu->cpu_num > 1) {
-    int i;
-    for (i = 0; i < cpu->cpu_num; i++) {
-      if (fgets(line, sizeof(line), file) == NULL) {
-        ERR("%s\n", strerror(errno));
-        goto error;
-      }
-      work = &cpu->times[i];
-      if (sscanf(line, "cpu%*u %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
-                 &work->user,
-                 &work->nice,
-                 &work->system,
-                 &work->idle,
-                 &work->iowait,
-                 &work->irq,
-                 &work->softirq,
-                 &work->steal,
-                 &work->guest,
-                 &work->guest_nice) < 4) {
-        ERR("%s\n", strerror(errno));
-        goto error;
+  cpu->skipped = 0;
+  cpu->opened = 0;
+  for (i = 0; i < sampler->worker_num; i++) {
+    cpu->skipped += sampler->workers[i].skipped;
+    cpu->opened += sampler->workers[i].opened;
+  }
+}
+
+/**
+ * @brief 走査後にfdキャッシュを更新する
+ *
+ * 参照されなかったエントリを削除してから各ワーカーが新たに開いたfdを登録し、
+ * サンプリング世代を進める。呼び出し元スレッドで全ワーカーの走査完了後に行う。
+ *
+ * @param[in,out] sampler 読み出しに使う構造体
+ */
+static void commit_fds(sampler_t *sampler) {
+  fd_cache_t *fds = sampler->fds;
+  int i, j;
+  fd_cache_sweep(fds);
+  for (i = 0; i < sampler->worker_num; i++) {
+    worker_t *worker = &sampler->workers[i];
+    for (j = 0; j < worker->pending_num; j++) {
+      fd_pending_t *pending = &worker->pending[j];
+      fd_entry_t *entry = fd_cache_insert(fds, pending->key, pending->fd);
+      if (entry == NULL) {
+        close(pending->fd);
+        continue;
       }
+      fd_cache_check(entry, pending->last.starttime);
+      fd_cache_record(fds, entry, pending->last.utime, pending->last.stime, &pending->last);
     }
+    worker->pending_num = 0;
   }
-  result = SUCCESS;
-  error:
-  fclose(file);
-  return result;
+  fds->generation++;
 }
 
 /**
  * @brief プロセス情報の読み出し
  *
+ * /procはopenしたまま保持し、statファイルは
+ * ディレクトリfdからの相対パスで開く。
+ * PIDを列挙してから各ワーカーへ割り当て、呼び出し元スレッドも0番として走査に加わる。
+ * fdキャッシュへの登録と削除は全ワーカーの走査完了後に呼び出し元スレッドで行う。
+ *
+ * @param[in,out] sampler 読み出しに使う構造体
  * @param[out] cpu 結果の書き込み先
  * @return 成功：SUCCESS / 失敗：FAILURE
  */
-static result_t read_process(cpu_t *cpu) {
-  DIR *dir;
-  struct dirent *dent;
-  cpu->proc_num = 0;
-  dir = opendir("/proc");
-  if (dir == NULL) {
-    ERR("%s\n", strerror(errno));
-    return FAILURE;
-  }
-  while ((dent = readdir(dir)) != NULL) {
-    if(dent->d_name[0] >= '0' && dent->d_name[0] <= '9') {
-      int pid = atoi(dent->d_name);
-      ensure_next_proc(cpu);
-      process_t *process = cpu->procs[cpu->proc_num];
-      if (read_pid_stat(process, pid) == SUCCESS) {
-        cpu->proc_num++;
-      }
-    }
+static result_t read_process(sampler_t *sampler, cpu_t *cpu) {
+  cpu->skipped = 0;
+  if (sampler->watch != NULL) {
+    result_t result = read_process_watch(sampler->watch, sampler->proc_dir, cpu);
+    cpu->opened = sampler->watch->opened;
+    return result;
   }
-  qsort(cpu->procs, cpu->proc_num, sizeof(process_t*), comp_pid);
-  closedir(dir);
+  sampler->pid_num = list_pids(sampler->proc_dir, &sampler->pids, &sampler->pid_array_num);
+  assign_chunks(sampler);
+  sampler->fd_reserve = sampler->fds->limit - sampler->fds->num;
+  pool_run(sampler->pool);
+  commit_fds(sampler);
+  merge_chunks(sampler, cpu);
+  sort_pid(cpu);
   return SUCCESS;
 }
 
 /**
  * @brief 指定PIDのプロセス情報を読みだす
  *
- * @param[out] proc 結果の書き込み先
- * @param[in]  pid  PID
+ * fdキャッシュにエントリがあればそのfdで読みなおす。
+ * タスクが終了していた場合や起動時刻が変わってPIDが再利用されていた場合は、
+ * エントリを参照せずに残して走査後に削除させ、新しいタスクとして開きなおす。
+ *
+ * @param[in,out] worker  読み出すワーカー
+ * @param[out]    proc    結果の書き込み先
+ * @param[in]     proc_fd /procのファイルディスクリプタ
+ * @param[in]     pid     PID
+ * @param[in]     name    PIDのディレクトリ名
  * @return 成功：SUCCESS / 失敗：FAILURE
  */
-static result_t read_pid_stat(process_t *proc, int pid) {
-  result_t result = FAILURE;
-  char path[PATH_MAX];
-  FILE *file;
+static result_t read_pid_stat(worker_t *worker, process_t *proc, int proc_fd,
+                              int pid, const char *name) {
+  fd_cache_t *fds = worker->sampler->fds;
+  fd_entry_t *entry = fd_cache_find(fds, pid);
   char line[LINE_BUFFER_SIZE];
-  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
-  file = fopen(path, "rb");
-  if (file == NULL) {
-    ERR("%s: %s\n", path, strerror(errno));
-    goto error;
+  int fd;
+  if (entry != NULL) {
+    if (fd_cache_reuse(fds, entry, pid)) {
+      *proc = *(process_t *) fd_entry_data(entry);
+      entry->seen = fds->generation;
+      worker->skipped++;
+      return SUCCESS;
+    }
+    memset(proc, 0, sizeof(process_t));
+    proc->pid = pid;
+    if (reread_fd(entry->fd, line, sizeof(line)) == SUCCESS
+        && parse_stat(line, proc) == SUCCESS
+        && proc->starttime == entry->starttime) {
+      entry->seen = fds->generation;
+      fd_cache_record(fds, entry, proc->utime, proc->stime, proc);
+      return SUCCESS;
+    }
   }
-  if (fgets(line, sizeof(line), file) == NULL) {
-    ERR("%s\n", strerror(errno));
-    goto error;
+  if (read_stat_open(proc_fd, name, "/stat", line, sizeof(line), &fd) != SUCCESS) {
+    return FAILURE;
   }
+  worker->opened++;
   memset(proc, 0, sizeof(process_t));
   proc->pid = pid;
-  result = parse_stat(line, proc);
-  error:
-  fclose(file);
-  return result;
+  if (parse_stat(line, proc) != SUCCESS) {
+    close(fd);
+    return FAILURE;
+  }
+  worker_defer_fd(worker, pid, fd, proc);
+  return SUCCESS;
 }
 
 /**
@@ -462,58 +967,63 @@ static result_t read_pid_stat(process_t *proc, int pid) {
  * @return 成功：SUCCESS / 失敗：FAILURE
  */
 static result_t parse_stat(char *line, process_t *proc) {
-  char *tmp;
-  int len;
-  int n;
-  line = strchr(line, '(') + 1;
-  tmp = strrchr(line, ')');
-  len = tmp - line;
-  if (len >= sizeof(proc->comm)) {
-    len = sizeof(proc->comm) - 1;
-  }
-  memcpy(proc->comm, line, len);
-  proc->comm[len] = 0;
-  line = tmp + 2;
-  n = sscanf(line,
-             "%c" // state
-             "%*d %*d %*d %*d %*d " // ppid pgid sid tty_nr tty_pgrp
-             "%*u %*u %*u %*u %*u " // flags min_flt cmin_flt maj_flt cmaj_flt
-             "%lu %lu %lu %lu " // utime stime cutime cstime
-             "%ld %ld " // priority nice
-             //"%ld " // num_threads
-             //"%lu %lu %lu %lu %lu " // itrealvalue starttime vsize rss rsslim
-             //"%lu %lu %lu " // start_code end_code start_stack
-             //"%lu %lu " // kstkesp kstkeip
-             //"%lu %lu %lu %lu %lu " // signal blocked sigignore sigcatch wchan
-             //"%lu %lu " // nswap cnswap
-             //"%ld %ld " // exit_signal processor
-             //"%lu %lu %lu " // rt_priority policy delayacct_blkio_ticks
-             //"%lu %ld " // guest_time cguest_time
-             ,
-             &proc->state,
-             &proc->utime,
-             &proc->stime,
-             &proc->cutime,
-             &proc->cstime,
-             &proc->priority,
-             &proc->nice
-  );
-  if (n != 7) {
+  task_stat_t stat;
+  if (parse_task_stat(line, proc->comm, sizeof(proc->comm), &stat) != SUCCESS) {
     return FAILURE;
   }
+  proc->state = stat.state;
+  proc->utime = stat.utime;
+  proc->stime = stat.stime;
+  proc->cutime = stat.cutime;
+  proc->cstime = stat.cstime;
+  proc->priority = stat.priority;
+  proc->nice = stat.nice;
+  proc->starttime = stat.starttime;
   return SUCCESS;
 }
 
+/**
+ * @brief 計測結果を履歴ファイルへ追記する
+ *
+ * 表示で選択した負荷上位のプロセスを記録する。
+ *
+ * @param[in,out] history 履歴ファイル
+ * @param[in]     before  時間的に前の値
+ * @param[in]     after   時間的に後の値、負荷と上位選択は計算済みであること
+ * @param[in]     ticker  実測した間隔を持つタイマー
+ */
+static void record_history(history_t *history, cpu_t *before, cpu_t *after, ticker_t *ticker) {
+  history_record_t *record = history_begin(history);
+  history_task_t *tasks = history_tasks(history, record);
+  int num = after->top_num < HISTORY_TASKS ? after->top_num : HISTORY_TASKS;
+  int i;
+  record->elapsed = ticker->elapsed;
+  record->proc_num = after->proc_num;
+  record->task_num = num;
+  get_diff(&before->total, &after->total, &record->total);
+  cpu_matrix_diff(before->cores, after->cores, history_cores(history, record));
+  for (i = 0; i < num; i++) {
+    int k = after->order[i];
+    tasks[i].pid = after->pid[k];
+    tasks[i].tid = after->pid[k];
+    tasks[i].load = after->load[k];
+    memcpy(tasks[i].comm, after->comm[k], HISTORY_NAME_LEN);
+  }
+  history_commit(history, record);
+}
+
 /**
  * @brief 結果表示
  *
  * @param[in] before 時間的に前の値
  * @param[in] after  時間的に後の値
+ * @param[in] rank   上位選択の条件
+ * @param[in] ticker 実測した間隔を持つタイマー
  */
-static void show_result(cpu_t *before, cpu_t *after) {
+static void show_result(cpu_t *before, cpu_t *after, const rank_t *rank, ticker_t *ticker) {
   cputime_t diff;
   int num = before->cpu_num;
-  get_diff(&before->times[num], &after->times[num], &diff);
+  get_diff(&before->total, &after->total, &diff);
   uint64_t total  = get_total(&diff);
   uint64_t load   = get_load(&diff);
   uint64_t idle   = get_idle(&diff);
@@ -528,108 +1038,758 @@ static void show_result(cpu_t *before, cpu_t *after) {
   float usage = (float) load / total * 100;
   printf("%5.1f%% (T:%4lu I:%4lu IO:%4lu S:%4lu U:%4lu IRQ:%4lu G:%4lu)",
          usage, total, idle, iowait, system, user, irq, guest);
+  show_ticker(ticker);
   if (num > 1) {
     show_result_cpus(before, after);
   }
+  if (ticker->skipped > 0) {
+    printf(" skipped:%d", ticker->skipped);
+  }
   printf("\n");
-  show_result_process(total, before, after);
+  show_result_process(total, before, after, rank);
 }
 
 /**
  * @brief CPUコアごとの使用率の表示
  *
+ * トポロジーごとに集計する場合は、各コアの前に分類名とともに表示する。
+ *
  * @param[in] before 時間的に前の値
  * @param[in] after  時間的に後の値
  */
 static void show_result_cpus(cpu_t *before, cpu_t *after) {
-  cputime_t diff;
-  int i;
-  int num = before->cpu_num;
-  uint64_t total;
-  uint64_t load;
-  for (i = 0; i < num; i++) {
-    get_diff(&before->times[i], &after->times[i], &diff);
-    total  = get_total(&diff);
-    load   = get_load(&diff);
-    if (total == 0) {
-      total = 1;
+  cpu_usage_t *usage = after->arena->usage;
+  topology_t *topology = after->arena->topology;
+  int i, j;
+  cpu_matrix_usage(before->cores, after->cores, usage);
+  if (topology != NULL) {
+    topology_usage(topology, usage);
+    for (i = 0; i < TOPOLOGY_LEVELS; i++) {
+      topology_level_t *level = &topology->levels[i];
+      for (j = 0; j < level->num; j++) {
+        printf(" %s%d:%5.1f%%", level->name, level->id[j], level->usage[j]);
+      }
+    }
+    printf(" |");
+  }
+  for (i = 0; i < usage->num; i++) {
+    if (!usage->online[i]) {
+      printf("   off");
+      continue;
     }
-    printf("%5.1f%%", (float) load / total * 100);
+    printf("%5.1f%%", usage->usage[i]);
   }
 }
 
+/**
+ * @brief 負荷計算に使う列の参照を取得する
+ *
+ * キーにはPIDを使う。
+ *
+ * @param[in]  cpu     対象の構造体
+ * @param[out] columns 列の参照の書き込み先
+ */
+static void get_columns(cpu_t *cpu, task_columns_t *columns) {
+  columns->num = cpu->proc_num;
+  columns->id = cpu->pid;
+  columns->utime = cpu->utime;
+  columns->stime = cpu->stime;
+  columns->starttime = cpu->starttime;
+  columns->load = cpu->load;
+  columns->pid = cpu->pid;
+  columns->nice = cpu->nice;
+  columns->comm = (const char *) cpu->comm;
+  columns->comm_size = sizeof(name_t);
+  columns->delay = NULL;
+}
+
+/**
+ * @brief 前回からの負荷を求める
+ *
+ * 前回・今回ともPID昇順に並んでいるため、マージ結合で対応付ける。
+ * PIDが一致しても起動時刻が異なる場合は再利用された別のプロセスとみなす。
+ * カウンタが減少していた場合は負荷を0とする。
+ *
+ * @param[in]     before 時間的に前の値
+ * @param[in,out] after  時間的に後の値、loadを書き込む
+ */
+static void calc_load(cpu_t *before, cpu_t *after) {
+  task_columns_t prev;
+  task_columns_t next;
+  get_columns(before, &prev);
+  get_columns(after, &next);
+  task_delta(&prev, &next);
+}
+
+/**
+ * @brief 条件に一致する上位のインデックスをorderに降順で格納する
+ *
+ * 件数を指定した場合は要素数nのヒープで選択するため、全体をソートする必要はない。
+ *
+ * @param[in,out] cpu  対象の構造体
+ * @param[in]     rank 上位選択の条件
+ * @return 選択した件数
+ */
+static int select_top(cpu_t *cpu, const rank_t *rank) {
+  task_columns_t columns;
+  get_columns(cpu, &columns);
+  return task_rank(&columns, rank, cpu->order);
+}
+
 /**
  * @brief プロセス情報を表示する
  *
  * @param[in] total  カウンタの合計値
  * @param[in] before 時間的に前の値
  * @param[in] after  時間的に後の値
+ * @param[in] rank   上位選択の条件
  */
-static void show_result_process(uint64_t total, cpu_t *before, cpu_t *after) {
-  int i, j;
+static void show_result_process(uint64_t total, cpu_t *before, cpu_t *after, const rank_t *rank) {
+  int i;
   int num = after->proc_num;
   int display;
-  process_t **list = xmalloc(sizeof(process_t*) * num);
-  for (i = 0, j = 0; i < num; i++) {
-    process_t *a = after->procs[i];
-    process_t *b = NULL;
-    list[i] = a;
-    a->load = a->utime + a->stime;
-    for (;j < before->proc_num && before->procs[j]->pid < a->pid; j++);
-    if (j < before->proc_num) {
-      b = before->procs[j];
-      if(a->pid == b->pid) {
-        a->load -= (b->utime + b->stime);
-      }
-    }
+  calc_load(before, after);
+  display = select_top(after, rank);
+  after->top_num = display;
+  printf("%d processes", num);
+  if (after->skipped > 0) {
+    printf(" (approximate, %d idle not read)", after->skipped);
   }
-  qsort(list, num, sizeof(process_t*), comp_load);
-  display = num < DISPLAY_PROCESS_NUM ? num : DISPLAY_PROCESS_NUM;
-  printf("%d processes\n", num);
+  printf("\n");
   printf("  PID  PR  NI S    CPU  CNT COMMAND\n");
   for (i = 0; i < display; i++) {
+    int k = after->order[i];
     char prio[4];
-    if (list[i]->priority > 999 || list[i]->priority < -99) {
+    if (after->priority[k] > 999 || after->priority[k] < -99) {
       snprintf(prio, sizeof(prio), " rt");
     } else {
-      snprintf(prio, sizeof(prio), "%3ld", list[i]->priority);
+      snprintf(prio, sizeof(prio), "%3ld", after->priority[k]);
     }
     printf("%5d %s %3ld %c %5.1f%% %4lu %s\n",
-           list[i]->pid,
+           after->pid[k],
            prio,
-           list[i]->nice,
-           list[i]->state,
-           (float) list[i]->load / total * 100,
-           list[i]->load,
-           list[i]->comm);
+           after->nice[k],
+           after->state[k],
+           (float) after->load[k] / total * 100,
+           after->load[k],
+           after->comm[k]);
   }
-  free(list);
   printf("\n");
 }
 
+/**
+ * @brief 計測結果を機械可読な形式でバッファへ書き込む
+ *
+ * 表示と同じく負荷の計算と上位選択を行い、formatの内容を1レコードとする。
+ * コアが1つのみの場合、各コアのCPU時間はパースしないため全体の使用率を使う。
+ *
+ * @param[out]    format  書き込み先
+ * @param[in]     kind    FORMAT_JSONまたはFORMAT_BINARY
+ * @param[in]     before  時間的に前の値
+ * @param[in,out] after   時間的に後の値
+ * @param[in]     rank    上位選択の条件
+ * @param[in]     ticker  実測した間隔を持つタイマー
+ * @param[in]     dropped 直前に破棄した表示の回数
+ */
+static void put_result(format_t *format, int kind, cpu_t *before, cpu_t *after,
+                       const rank_t *rank, ticker_t *ticker, int dropped) {
+  cputime_t diff;
+  cpu_usage_t *usage = after->arena->usage;
+  get_diff(&before->total, &after->total, &diff);
+  if (usage->num > 1) {
+    cpu_matrix_usage(before->cores, after->cores, usage);
+  } else {
+    usage->usage[0] = get_permille(get_load(&diff), get_total(&diff)) / 10.0f;
+    usage->online[0] = TRUE;
+  }
+  calc_load(before, after);
+  after->top_num = select_top(after, rank);
+  format_reset(format);
+  if (kind == FORMAT_JSON) {
+    put_result_json(format, &diff, after, ticker, dropped);
+  } else {
+    put_result_binary(format, &diff, after, ticker, dropped);
+  }
+}
+
+/**
+ * @brief 計測結果をJSON Lines形式の1行として書き込む
+ *
+ * @param[out] format  書き込み先
+ * @param[in]  diff    CPU全体のCPU時間の差分
+ * @param[in]  after   負荷と上位選択を計算済みの値
+ * @param[in]  ticker  実測した間隔を持つタイマー
+ * @param[in]  dropped 直前に破棄した表示の回数
+ */
+static void put_result_json(format_t *format, cputime_t *diff, cpu_t *after,
+                            ticker_t *ticker, int dropped) {
+  cpu_usage_t *usage = after->arena->usage;
+  uint64_t total = get_total(diff);
+  int i;
+  format_str(format, "{\"time\":");
+  format_uint(format, get_realtime());
+  format_str(format, ",\"elapsed\":");
+  format_uint(format, ticker->elapsed);
+  format_str(format, ",\"skipped\":");
+  format_uint(format, ticker->skipped);
+  format_str(format, ",\"dropped\":");
+  format_uint(format, dropped);
+  format_str(format, ",\"usage\":");
+  format_permille(format, get_permille(get_load(diff), total));
+  format_str(format, ",\"total\":");
+  format_uint(format, total);
+  format_str(format, ",\"idle\":");
+  format_uint(format, get_idle(diff));
+  format_str(format, ",\"iowait\":");
+  format_uint(format, get_iowait(diff));
+  format_str(format, ",\"system\":");
+  format_uint(format, get_system(diff));
+  format_str(format, ",\"user\":");
+  format_uint(format, get_user(diff));
+  format_str(format, ",\"irq\":");
+  format_uint(format, get_irq(diff));
+  format_str(format, ",\"guest\":");
+  format_uint(format, get_guest(diff));
+  format_str(format, ",\"cpus\":[");
+  for (i = 0; i < usage->num; i++) {
+    if (i != 0) {
+      format_str(format, ",");
+    }
+    if (!usage->online[i]) {
+      format_str(format, "null");
+      continue;
+    }
+    format_permille(format, (uint16_t) (usage->usage[i] * 10 + 0.5f));
+  }
+  format_str(format, "],\"num\":");
+  format_uint(format, after->proc_num);
+  format_str(format, ",\"approx\":");
+  format_uint(format, after->skipped);
+  format_str(format, ",\"tasks\":[");
+  for (i = 0; i < after->top_num; i++) {
+    int k = after->order[i];
+    if (i != 0) {
+      format_str(format, ",");
+    }
+    format_str(format, "{\"pid\":");
+    format_int(format, after->pid[k]);
+    format_str(format, ",\"pr\":");
+    format_int(format, after->priority[k]);
+    format_str(format, ",\"ni\":");
+    format_int(format, after->nice[k]);
+    format_str(format, ",\"state\":");
+    format_json_str(format, &after->state[k], 1);
+    format_str(format, ",\"usage\":");
+    format_permille(format, get_permille(after->load[k], total));
+    format_str(format, ",\"load\":");
+    format_uint(format, after->load[k]);
+    format_str(format, ",\"comm\":");
+    format_json_str(format, after->comm[k], PR_NAME_LEN);
+    format_str(format, "}");
+  }
+  format_str(format, "]}\n");
+}
+
+/**
+ * @brief 計測結果を長さ付きバイナリ形式の1レコードとして書き込む
+ *
+ * 形式はformat.hのbinary_record_tを参照。
+ *
+ * @param[out] format  書き込み先
+ * @param[in]  diff    CPU全体のCPU時間の差分
+ * @param[in]  after   負荷と上位選択を計算済みの値
+ * @param[in]  ticker  実測した間隔を持つタイマー
+ * @param[in]  dropped 直前に破棄した表示の回数
+ */
+static void put_result_binary(format_t *format, cputime_t *diff, cpu_t *after,
+                              ticker_t *ticker, int dropped) {
+  cpu_usage_t *usage = after->arena->usage;
+  uint64_t total = get_total(diff);
+  size_t cores_size = (sizeof(uint16_t) * usage->num + 7) & ~(size_t) 7;
+  size_t size = sizeof(binary_record_t) + cores_size
+      + sizeof(binary_task_t) * after->top_num;
+  binary_record_t *record = format_reserve(format, size);
+  uint16_t *cores = (uint16_t *) (record + 1);
+  binary_task_t *tasks = (binary_task_t *) ((char *) cores + cores_size);
+  int i;
+  memset(record, 0, size);
+  record->size = size;
+  record->version = BINARY_VERSION;
+  record->flags = 0;
+  record->cpu_num = usage->num;
+  record->task_num = after->top_num;
+  record->proc_num = after->proc_num;
+  record->approx = after->skipped;
+  record->skipped = ticker->skipped;
+  record->dropped = dropped;
+  record->time = get_realtime();
+  record->elapsed = ticker->elapsed;
+  record->total = *diff;
+  for (i = 0; i < usage->num; i++) {
+    cores[i] = usage->online[i] ? (uint16_t) (usage->usage[i] * 10 + 0.5f) : BINARY_CORE_OFFLINE;
+  }
+  for (i = 0; i < after->top_num; i++) {
+    int k = after->order[i];
+    tasks[i].pid = after->pid[k];
+    tasks[i].tid = after->pid[k];
+    tasks[i].priority = after->priority[k];
+    tasks[i].nice = after->nice[k];
+    tasks[i].load = after->load[k];
+    tasks[i].usage = get_permille(after->load[k], total);
+    tasks[i].state = after->state[k];
+    memcpy(tasks[i].comm, after->comm[k], BINARY_NAME_LEN);
+    memcpy(tasks[i].pcomm, after->comm[k], BINARY_NAME_LEN);
+  }
+}
+
+/**
+ * @brief スナップショットの集計結果を格納する構造体を確保する
+ *
+ * @return 集計結果
+ */
+static client_t *new_client_t(void) {
+  client_t *client = xmalloc(sizeof(client_t));
+  memset(client, 0, sizeof(client_t));
+  return client;
+}
+
+/**
+ * @brief スナップショットの集計結果を格納する構造体を開放する
+ *
+ * @param[in] client 開放する構造体
+ */
+static void delete_client_t(client_t *client) {
+  if (client == NULL) {
+    return;
+  }
+  free(client->rows);
+  free(client->pid);
+  free(client->priority);
+  free(client->nice);
+  free(client->state);
+  free(client->load);
+  free(client->comm);
+  free(client->order);
+  free(client);
+}
+
+/**
+ * @brief スナップショットのスレッドをPID、TIDの昇順に並べる比較関数
+ *
+ * @param[in] a   比較対象のインデックス
+ * @param[in] b   比較対象のインデックス
+ * @param[in] arg スナップショットのタスク
+ * @return 比較結果
+ */
+static int comp_snapshot_task(const void *a, const void *b, void *arg) {
+  const binary_task_t *tasks = arg;
+  const binary_task_t *ta = &tasks[*(const int *) a];
+  const binary_task_t *tb = &tasks[*(const int *) b];
+  if (ta->pid != tb->pid) {
+    return ta->pid < tb->pid ? -1 : 1;
+  }
+  return ta->tid < tb->tid ? -1 : ta->tid > tb->tid;
+}
+
+/**
+ * @brief スナップショットのスレッドの負荷をプロセスごとに集計する
+ *
+ * スレッドをPID、TID順に並べ、同じPIDの連続する範囲を1プロセスとする。
+ * プライオリティ、nice値、stateはメインスレッドの値とし、
+ * メインスレッドが含まれない場合は最小のTIDの値とする。
+ *
+ * @param[out] client 集計先
+ * @param[in]  record 読みだしたスナップショット
+ */
+static void client_rollup(client_t *client, const binary_record_t *record) {
+  const binary_task_t *tasks = binary_tasks(record);
+  int num = 0;
+  int i;
+  if (client->size < record->task_num) {
+    client->size = record->task_num;
+    client->rows = xrealloc(client->rows, sizeof(int) * client->size);
+    client->pid = xrealloc(client->pid, sizeof(int) * client->size);
+    client->priority = xrealloc(client->priority, sizeof(int) * client->size);
+    client->nice = xrealloc(client->nice, sizeof(int64_t) * client->size);
+    client->state = xrealloc(client->state, sizeof(char) * client->size);
+    client->load = xrealloc(client->load, sizeof(uint64_t) * client->size);
+    client->comm = xrealloc(client->comm, sizeof(name_t) * client->size);
+    client->order = xrealloc(client->order, sizeof(int) * client->size);
+  }
+  for (i = 0; i < record->task_num; i++) {
+    client->rows[i] = i;
+  }
+  qsort_r(client->rows, record->task_num, sizeof(int), comp_snapshot_task, (void *) tasks);
+  for (i = 0; i < record->task_num; i++) {
+    const binary_task_t *task = &tasks[client->rows[i]];
+    if (num == 0 || client->pid[num - 1] != task->pid) {
+      num++;
+      client->pid[num - 1] = task->pid;
+      client->load[num - 1] = 0;
+    } else if (task->tid != task->pid) {
+      client->load[num - 1] += task->load;
+      continue;
+    }
+    client->priority[num - 1] = task->priority;
+    client->nice[num - 1] = task->nice;
+    client->state[num - 1] = task->state;
+    client->load[num - 1] += task->load;
+    memcpy(client->comm[num - 1], task->pcomm, PR_NAME_LEN);
+    client->comm[num - 1][PR_NAME_LEN - 1] = 0;
+  }
+  client->num = num;
+}
+
+/**
+ * @brief 共有メモリから読みだしたスナップショットをプロセス単位で表示する
+ *
+ * 上位選択は負荷またはnice値をキーとして自身で行う。
+ * 公開する側が上位のスレッドのみを書き込んでいる場合、
+ * プロセス数と各プロセスの負荷は書き込まれたスレッドのみから求めた下限となるため、
+ * プロセス数の代わりに概算であることと元にしたスレッド数を表示する。
+ * 負荷が[ns]で記録されている場合は、CNTの代わりに実行時間[ms]を表示し、
+ * 使用率は計測の間隔とオンラインのコアの個数の積に対する割合とする。
+ *
+ * @param[in,out] client 集計先
+ * @param[in]     record 読みだしたスナップショット
+ * @param[in]     rank   上位選択の条件
+ */
+static void show_snapshot(client_t *client, const binary_record_t *record, const rank_t *rank) {
+  const uint16_t *cores = binary_cores(record);
+  cputime_t diff = record->total;
+  uint64_t total  = get_total(&diff);
+  uint64_t load   = get_load(&diff);
+  int ns = (record->flags & BINARY_FLAG_NS) != 0;
+  uint64_t task_total;
+  task_columns_t columns;
+  int display;
+  int i;
+  if (total == 0) {
+    total = 1;
+  }
+  task_total = total;
+  if (ns) {
+    int online = 0;
+    for (i = 0; i < record->cpu_num; i++) {
+      online += cores[i] != BINARY_CORE_OFFLINE;
+    }
+    task_total = record->elapsed * (online > 0 ? online : 1);
+  }
+  printf("%5.1f%% (T:%4lu I:%4lu IO:%4lu S:%4lu U:%4lu IRQ:%4lu G:%4lu)",
+         (float) load / total * 100, total, get_idle(&diff), get_iowait(&diff),
+         get_system(&diff), get_user(&diff), get_irq(&diff), get_guest(&diff));
+  printf(" %7.3fs", (double) record->elapsed / 1000000000);
+  for (i = 0; record->cpu_num > 1 && i < record->cpu_num; i++) {
+    if (cores[i] == BINARY_CORE_OFFLINE) {
+      printf("   off");
+      continue;
+    }
+    printf("%5.1f%%", cores[i] / 10.0f);
+  }
+  if (record->skipped > 0) {
+    printf(" skipped:%u", record->skipped);
+  }
+  printf("\n");
+  client_rollup(client, record);
+  memset(&columns, 0, sizeof(columns));
+  columns.num = client->num;
+  columns.id = client->pid;
+  columns.load = client->load;
+  columns.pid = client->pid;
+  columns.nice = client->nice;
+  columns.comm = (const char *) client->comm;
+  columns.comm_size = sizeof(name_t);
+  display = task_rank(&columns, rank, client->order);
+  if (record->task_num < record->proc_num) {
+    printf("approximate: %d processes from top %u of %u threads",
+           client->num, record->task_num, record->proc_num);
+  } else {
+    printf("%d processes", client->num);
+  }
+  if (record->approx > 0) {
+    printf(" (approximate, %u idle not read)", record->approx);
+  }
+  printf("\n");
+  printf("  PID  PR  NI S    CPU %s COMMAND\n", ns ? "TIME(ms)" : " CNT");
+  for (i = 0; i < display; i++) {
+    int k = client->order[i];
+    char prio[4];
+    if (client->priority[k] > 999 || client->priority[k] < -99) {
+      snprintf(prio, sizeof(prio), " rt");
+    } else {
+      snprintf(prio, sizeof(prio), "%3d", client->priority[k]);
+    }
+    printf("%5d %s %3ld %c %5.1f%% ",
+           client->pid[k],
+           prio,
+           client->nice[k],
+           client->state[k],
+           (float) client->load[k] / task_total * 100);
+    if (ns) {
+      printf("%8.2f ", (double) client->load[k] / 1000000);
+    } else {
+      printf("%4lu ", client->load[k]);
+    }
+    printf("%s\n", client->comm[k]);
+  }
+  printf("\n");
+}
+
+/**
+ * @brief 共有メモリに公開されたスナップショットを表示し続ける
+ *
+ * 自身では/procを読まず、公開する側の計測ごとにスレッドをプロセス単位に集計して表示する。
+ * SIGINT/SIGTERMを受けると後始末をして終了する。
+ *
+ * @param[in] name   共有メモリの名前
+ * @param[in] rank   上位選択の条件
+ * @param[in] screen 全画面表示する場合TRUE
+ * @return 終了コード
+ */
+static int run_client(const char *name, const rank_t *rank, int screen) {
+  int result = EXIT_FAILURE;
+  output_t *output = NULL;
+  format_t *format = NULL;
+  client_t *client = NULL;
+  const binary_record_t *record;
+  uint64_t seq = 0;
+  shm_t *shm = load_shm_t(name);
+  if (shm == NULL) {
+    fprintf(stderr, "%s: cannot open shared memory\n", name);
+    return EXIT_FAILURE;
+  }
+  output = new_output_t(STDOUT_FILENO, DEFAULT_OUTPUT_FRAMES);
+  if (output == NULL) {
+    goto error;
+  }
+  output_redirect_stdout(output);
+  if (screen) {
+    output_set_screen(output);
+  }
+  format = new_format_t();
+  client = new_client_t();
+  shm_catch_signals();
+  while ((record = shm_wait(shm, format, &seq)) != NULL) {
+    show_snapshot(client, record, rank);
+    output_commit(output);
+  }
+  result = EXIT_SUCCESS;
+  error:
+  delete_output_t(output);
+  delete_format_t(format);
+  delete_client_t(client);
+  delete_shm_t(shm);
+  return result;
+}
+
 int main(int argc, char **argv) {
   int result = EXIT_FAILURE;
+  arena_t *arena = NULL;
   cpu_t *after = NULL;
   cpu_t *before = NULL;
-  int num = sysconf(_SC_NPROCESSORS_ONLN);
-  after = new_cpu_t(num);
-  before = new_cpu_t(num);
-  if (read_stat(before) != SUCCESS
-      || read_process(before) != SUCCESS) {
+  sampler_t *sampler = NULL;
+  ticker_t ticker;
+  int interval = DEFAULT_INTERVAL_MS;
+  int event = FALSE;
+  int adaptive = 0;
+  int worker_num = 1;
+  int self = FALSE;
+  overhead_t overhead;
+  history_t *history = NULL;
+  output_t *output = NULL;
+  format_t *format = NULL;
+  int kind = FORMAT_TEXT;
+  rank_t rank;
+  const char *history_path = NULL;
+  int history_records = DEFAULT_HISTORY_RECORDS;
+  const char *sys_root = DEFAULT_SYS_ROOT;
+  const char *client_name = NULL;
+  int screen = FALSE;
+  int rollup = FALSE;
+  int num;
+  const struct option options[] = {
+      {"proc-root", required_argument, NULL, 'R'},
+      {"sys-root", required_argument, NULL, 'Y'},
+      {"history-records", required_argument, NULL, 'N'},
+      {"format", required_argument, NULL, 'F'},
+      {"sort", required_argument, NULL, 'k'},
+      {"pid", required_argument, NULL, 'p'},
+      {"comm", required_argument, NULL, 'c'},
+      {"shm", required_argument, NULL, 'M'},
+      {"screen", no_argument, NULL, 'S'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  rank_init(&rank);
+  while ((opt = getopt_long(argc, argv, "ea:j:i:n:sTR:H:", options, NULL)) != -1) {
+    switch (opt) {
+      case 'T':
+        rollup = TRUE;
+        break;
+      case 'Y':
+        sys_root = optarg;
+        break;
+      case 'e':
+        event = TRUE;
+        break;
+      case 'j':
+        worker_num = atoi(optarg);
+        if (worker_num < 1 || worker_num > MAX_WORKERS) {
+          fprintf(stderr, "-j: 1 to %d\n", MAX_WORKERS);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'i':
+        interval = atoi(optarg);
+        if (interval < MIN_INTERVAL_MS) {
+          fprintf(stderr, "-i: %d or more\n", MIN_INTERVAL_MS);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 's':
+        self = TRUE;
+        break;
+      case 'R':
+        set_proc_root(optarg);
+        break;
+      case 'H':
+        history_path = optarg;
+        break;
+      case 'n':
+        rank.num = atoi(optarg);
+        if (rank.num < 0) {
+          fprintf(stderr, "-n: 0 or more\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'k':
+        rank.key = parse_rank_key(optarg);
+        if (rank.key < 0 || rank.key == RANK_KEY_DELAY) {
+          fprintf(stderr, "--sort: cpu, total, utime, stime or nice\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'p':
+        if (rank_add_pids(&rank, optarg) != SUCCESS) {
+          fprintf(stderr, "--pid: comma separated pids, up to %d\n", RANK_PIDS);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'c':
+        rank.comm = optarg;
+        break;
+      case 'M':
+        client_name = optarg;
+        break;
+      case 'S':
+        screen = TRUE;
+        break;
+      case 'F':
+        kind = parse_format(optarg);
+        if (kind < 0) {
+          fprintf(stderr, "--format: text, json or binary\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'N':
+        history_records = atoi(optarg);
+        if (history_records < 1) {
+          fprintf(stderr, "--history-records: 1 or more\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'a':
+        adaptive = atoi(optarg);
+        if (adaptive < 1) {
+          fprintf(stderr, "-a: 1 or more\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-e] [-a ticks] [-j workers] [-i msec] [-s] [-H file [--history-records N]] [-n num] [--sort key] [--pid list] [--comm name] [--format text|json|binary] [-T] [--sys-root dir] [--screen] [--shm name] [--proc-root dir]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (client_name != NULL) {
+    if (rank.key != RANK_KEY_CPU && rank.key != RANK_KEY_NICE) {
+      fprintf(stderr, "--shm: --sort cpu or nice only\n");
+      return EXIT_FAILURE;
+    }
+    return run_client(client_name, &rank, screen);
+  }
+  if (screen && kind != FORMAT_TEXT) {
+    fprintf(stderr, "--screen: not available with --format\n");
+    return EXIT_FAILURE;
+  }
+  sampler = new_sampler_t(event, worker_num, adaptive);
+  if (sampler == NULL) {
+    goto error;
+  }
+  num = stat_sampler_count_cpus(sampler->stat);
+  if (num < 0) {
+    goto error;
+  }
+  if (history_path != NULL) {
+    history = new_history_t(history_path, num, history_records, 0);
+    if (history == NULL) {
+      fprintf(stderr, "%s: cannot open history\n", history_path);
+      goto error;
+    }
+  }
+  output = new_output_t(STDOUT_FILENO, DEFAULT_OUTPUT_FRAMES);
+  if (output == NULL) {
     goto error;
   }
+  output_redirect_stdout(output);
+  if (screen) {
+    output_set_screen(output);
+  }
+  if (kind != FORMAT_TEXT) {
+    output_set_annotate(output, FALSE);
+    format = new_format_t();
+  }
+  arena = new_arena_t(num);
+  if (rollup) {
+    arena->topology = new_topology_t(sys_root, num);
+  }
+  before = &arena->cpus[arena->current ^ 1];
+  after = &arena->cpus[arena->current];
+  if (read_stat(sampler, after) != SUCCESS
+      || read_process(sampler, after) != SUCCESS) {
+    goto error;
+  }
+  arena_flip(arena, &before, &after);
+  overhead_start(&overhead);
+  ticker_start(&ticker, interval);
   while (TRUE) {
-    sleep(5);
-    if (read_stat(after) != SUCCESS
-        || read_process(after) != SUCCESS) {
+    ticker_wait(&ticker);
+    overhead_begin(&overhead);
+    if (read_stat(sampler, after) != SUCCESS
+        || read_process(sampler, after) != SUCCESS) {
       goto error;
     }
-    show_result(before, after);
-    SWAP(before, after);
+    overhead_end(&overhead);
+    if (kind == FORMAT_TEXT) {
+      show_result(before, after, &rank, &ticker);
+      if (self) {
+        show_overhead(&overhead, after->opened, after->proc_num);
+      }
+    } else {
+      put_result(format, kind, before, after, &rank, &ticker, output_dropped(output));
+      output_put(output, format->buf, format->len);
+    }
+    output_commit(output);
+    if (history != NULL) {
+      record_history(history, before, after, &ticker);
+    }
+    arena_flip(arena, &before, &after);
   }
   result = EXIT_SUCCESS;
   error:
-  delete_cpu_t(before);
-  delete_cpu_t(after);
+  delete_output_t(output);
+  delete_format_t(format);
+  delete_arena_t(arena);
+  delete_sampler_t(sampler);
+  delete_history_t(history);
   return result;
 }
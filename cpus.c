@@ -10,227 +10,209 @@
  *
  * CPU全体の使用率の表示
  *
+ * feature.hの指定でパースするフィールドを絞った場合、含まれない内訳は表示しない。
+ *
  * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
  * @date 2016/3/21
  */
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 #include <stdint.h>
 #include <unistd.h>
-#include "def.h"
+#include <getopt.h>
+#include "cpuusage.h"
+#include "output.h"
+#if FEATURE_SHM
+#include "shm.h"
+#endif
 
 /**
- * ラインバッファのサイズ
- */
-#define LINE_BUFFER_SIZE 1024
-
-/**
- * statのCPUカウンタ記録用構造体
- */
-typedef struct cputime_t {
-  uint64_t user;       /**< ユーザーモードで消費した時間 */
-  uint64_t nice;       /**< 低い優先度のユーザーモードで消費した時間 */
-  uint64_t system;     /**< システムモードで消費した時間 */
-  uint64_t idle;       /**< タスク待ちで消費した時間 */
-  uint64_t iowait;     /**< I/O の完了待ちの時間 */
-  uint64_t irq;        /**< 割り込みの処理に使った時間 */
-  uint64_t softirq;    /**< ソフト割り込みの処理に使った時間 */
-  uint64_t steal;      /**< 仮想環境下で他のOSに消費された時間 */
-  uint64_t guest;      /**< ゲストOSの実行に消費された時間 */
-  uint64_t guest_nice; /**< 低い優先度のゲストOSの実行に消費された時間 */
-} cputime_t;
-
-static uint64_t get_total(cputime_t *time);
-static uint64_t get_load(cputime_t *time);
-static uint64_t get_idle(cputime_t *time);
-static uint64_t get_iowait(cputime_t *time);
-static uint64_t get_system(cputime_t *time);
-static uint64_t get_user(cputime_t *time);
-static uint64_t get_irq(cputime_t *time);
-static uint64_t get_guest(cputime_t *time);
-static void get_diff(cputime_t *before, cputime_t *after, cputime_t *diff);
-static result_t read_stat(cputime_t *cpu);
-static void show_result(cputime_t *before, cputime_t *after);
-
-/**
- * @brief カウンタの合計を返す
- *
- * @param[in] time cputime_t構造体
- * @return カウンタの合計値
- */
-static uint64_t get_total(cputime_t *time) {
-  return time->user + time->nice + time->system
-      + time->idle + time->iowait + time->irq + time->softirq
-      + time->steal + time->guest + time->guest_nice;
-}
-/**
- * @brief 負荷のカウンタの合計を返す
- *
- * @param[in] time cputime_t構造体
- * @return 負荷のカウンタの合計値
+ * 使用方法に表示する共有メモリのオプション
  */
-static uint64_t get_load(cputime_t *time) {
-  return time->user + time->nice + time->system
-      + time->irq + time->softirq
-      + time->steal + time->guest + time->guest_nice;
-}
+#if FEATURE_SHM
+#define SHM_USAGE " [--shm name]"
+#else
+#define SHM_USAGE ""
+#endif
 
-/**
- * @brief アイドルのカウンタの合計を返す
- *
- * @param[in] time cputime_t構造体
- * @return アイドルのカウンタの合計値
- */
-static uint64_t get_idle(cputime_t *time) {
-  return time->idle + time->iowait;
-}
+static void show_result(cputime_t *before, cputime_t *after, ticker_t *ticker);
+static void show_diff(cputime_t *diff, ticker_t *ticker);
+#if FEATURE_SHM
+static int run_client(const char *name, int screen);
+#endif
 
 /**
- * @brief I/O待ちのカウンタの合計を返す
- *
- * @param[in] time cputime_t構造体
- * @return I/O待ちのカウンタの合計値
- */
-static uint64_t get_iowait(cputime_t *time) {
-  return time->iowait;
-}
-
-/**
- * @brief systemのカウンタの合計を返す
- *
- * @param[in] time cputime_t構造体
- * @return systemのカウンタの合計値
- */
-static uint64_t get_system(cputime_t *time) {
-  return time->system;
-}
-
-/**
- * @brief userのカウンタの合計を返す
- *
- * @param[in] time cputime_t構造体
- * @return userのカウンタの合計値
- */
-static uint64_t get_user(cputime_t *time) {
-  return time->user + time->nice;
-}
-
-/**
- * @brief 割り込みのカウンタの合計を返す
- *
- * @param[in] time cputime_t構造体
- * @return 割り込みのカウンタの合計値
- */
-static uint64_t get_irq(cputime_t *time) {
-  return time->irq + time->softirq;
-}
-
-/**
- * @brief ゲストのカウンタの合計を返す
- *
- * @param[in] time cputime_t構造体
- * @return ゲストのカウンタの合計値
- */
-static uint64_t get_guest(cputime_t *time) {
-  return time->guest + time->guest_nice;
-}
-
-/**
- * @brief cputime_t間の差分を取る
+ * @brief 結果表示
  *
  * @param[in] before 時間的に前の値
- * @param[in] after 時間的に後の値
- * @param[out] diff 差分の格納先
+ * @param[in] after  時間的に後の値
+ * @param[in] ticker 実測した間隔を持つタイマー
  */
-static void get_diff(cputime_t *before, cputime_t *after, cputime_t *diff) {
-  uint64_t tmp;
-  // 負の値の場合は0とする
-#define DIFF(x) {tmp = after->x - before->x; diff->x = tmp < 0 ? 0 : tmp;}
-  DIFF(user);
-  DIFF(nice);
-  DIFF(system);
-  DIFF(idle);
-  DIFF(iowait);
-  DIFF(irq);
-  DIFF(softirq);
-  DIFF(steal);
-  DIFF(guest);
-  DIFF(guest_nice);
-#undef DIFF
+static void show_result(cputime_t *before, cputime_t *after, ticker_t *ticker) {
+  cputime_t diff;
+  get_diff(before, after, &diff);
+  show_diff(&diff, ticker);
 }
 
 /**
- * @brief statの値を読みだす
+ * @brief CPU時間の差分の表示
  *
- * @param[out] cpu 結果の書き込み先
- * @return 成功：SUCCESS / 失敗：FAILURE
+ * @param[in] diff   CPU全体のCPU時間の差分
+ * @param[in] ticker 実測した間隔を持つタイマー
  */
-static result_t read_stat(cputime_t *cpu) {
-  result_t result = FAILURE;
-  FILE *file;
-  char line[LINE_BUFFER_SIZE];
-  file = fopen("/proc/stat", "rb");
-  if (file == NULL) {
-    return FAILURE;
+static void show_diff(cputime_t *diff, ticker_t *ticker) {
+  uint64_t total  = get_total(diff);
+  uint64_t load   = get_load(diff);
+  uint64_t idle   = get_idle(diff);
+  uint64_t iowait = get_iowait(diff);
+  uint64_t system = get_system(diff);
+  uint64_t user   = get_user(diff);
+  uint64_t irq    = get_irq(diff);
+  uint64_t guest  = get_guest(diff);
+  if (total == 0) {
+    total = 1;
+  }
+  float usage = (float) load / total * 100;
+  printf("%5.1f%% (T:%4lu I:%4lu", usage, total, idle);
+  if (FEATURE_FIELDS > 4) {
+    printf(" IO:%4lu", iowait);
+  }
+  printf(" S:%4lu U:%4lu", system, user);
+  if (FEATURE_FIELDS > 5) {
+    printf(" IRQ:%4lu", irq);
   }
-  if (fgets(line, sizeof(line), file) == NULL) {
-    goto error;
+  if (FEATURE_FIELDS > 8) {
+    printf(" G:%4lu", guest);
   }
-  memset(cpu, 0, sizeof(cputime_t));
-  if (sscanf(line, "cpu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
-             &cpu->user,
-             &cpu->nice,
-             &cpu->system,
-             &cpu->idle,
-             &cpu->iowait,
-             &cpu->irq,
-             &cpu->softirq,
-             &cpu->steal,
-             &cpu->guest,
-             &cpu->guest_nice) < 4) {
-    goto error;
+  printf(")");
+  show_ticker(ticker);
+  if (ticker->skipped > 0) {
+    printf(" skipped:%d", ticker->skipped);
   }
-  result = SUCCESS;
-  error: fclose(file);
-  return result;
+  printf("\n");
 }
 
+#if FEATURE_SHM
 /**
- * @brief 結果表示
+ * @brief 共有メモリに公開されたスナップショットを表示し続ける
  *
- * @param[in] before 時間的に前の値
- * @param[in] after  時間的に後の値
+ * 自身では/proc/statを読まず、公開する側の計測ごとに表示する。
+ * SIGINT/SIGTERMを受けると後始末をして終了する。
+ *
+ * @param[in] name   共有メモリの名前
+ * @param[in] screen 全画面表示する場合TRUE
+ * @return 終了コード
  */
-static void show_result(cputime_t *before, cputime_t *after) {
-  cputime_t diff;
-  get_diff(before, after, &diff);
-  uint64_t total  = get_total(&diff);
-  uint64_t load   = get_load(&diff);
-  uint64_t idle   = get_idle(&diff);
-  uint64_t iowait = get_iowait(&diff);
-  uint64_t system = get_system(&diff);
-  uint64_t user   = get_user(&diff);
-  uint64_t irq    = get_irq(&diff);
-  uint64_t guest  = get_guest(&diff);
-  if (total == 0) {
-    total = 1;
+static int run_client(const char *name, int screen) {
+  output_t *output;
+  format_t *format;
+  const binary_record_t *record;
+  uint64_t seq = 0;
+  shm_t *shm = load_shm_t(name);
+  if (shm == NULL) {
+    fprintf(stderr, "%s: cannot open shared memory\n", name);
+    return EXIT_FAILURE;
   }
-  float usage = (float) load / total * 100;
-  printf("%5.1f%% (T:%4lu I:%4lu IO:%4lu S:%4lu U:%4lu IRQ:%4lu G:%4lu)\n",
-         usage, total, idle, iowait, system, user, irq, guest);
+  output = new_output_t(STDOUT_FILENO, DEFAULT_OUTPUT_FRAMES);
+  if (output == NULL) {
+    delete_shm_t(shm);
+    return EXIT_FAILURE;
+  }
+  output_redirect_stdout(output);
+  if (screen) {
+    output_set_screen(output);
+  }
+  format = new_format_t();
+  shm_catch_signals();
+  while ((record = shm_wait(shm, format, &seq)) != NULL) {
+    cputime_t diff = record->total;
+    ticker_t ticker;
+    ticker.elapsed = record->elapsed;
+    ticker.skipped = record->skipped;
+    show_diff(&diff, &ticker);
+    output_commit(output);
+  }
+  delete_format_t(format);
+  delete_output_t(output);
+  delete_shm_t(shm);
+  return EXIT_SUCCESS;
 }
+#endif
 
 int main(int argc, char **argv) {
   cputime_t after;
   cputime_t before;
-  read_stat(&before);
+  ticker_t ticker;
+  int interval = DEFAULT_INTERVAL_MS;
+#if FEATURE_SHM
+  const char *client_name = NULL;
+#endif
+  int screen = FALSE;
+  stat_sampler_t *sampler;
+  output_t *output;
+  const struct option options[] = {
+      {"proc-root", required_argument, NULL, 'R'},
+#if FEATURE_SHM
+      {"shm", required_argument, NULL, 'M'},
+#endif
+      {"screen", no_argument, NULL, 'S'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "i:R:", options, NULL)) != -1) {
+    switch (opt) {
+      case 'R':
+        set_proc_root(optarg);
+        break;
+#if FEATURE_SHM
+      case 'M':
+        client_name = optarg;
+        break;
+#endif
+      case 'S':
+        screen = TRUE;
+        break;
+      case 'i':
+        interval = atoi(optarg);
+        if (interval < MIN_INTERVAL_MS) {
+          fprintf(stderr, "-i: %d or more\n", MIN_INTERVAL_MS);
+          return EXIT_FAILURE;
+        }
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-i msec] [--screen]" SHM_USAGE " [--proc-root dir]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+#if FEATURE_SHM
+  if (client_name != NULL) {
+    return run_client(client_name, screen);
+  }
+#endif
+  sampler = new_stat_sampler_t();
+  if (sampler == NULL) {
+    return EXIT_FAILURE;
+  }
+  output = new_output_t(STDOUT_FILENO, DEFAULT_OUTPUT_FRAMES);
+  if (output == NULL) {
+    delete_stat_sampler_t(sampler);
+    return EXIT_FAILURE;
+  }
+  output_redirect_stdout(output);
+  if (screen) {
+    output_set_screen(output);
+  }
+  stat_sampler_read(sampler, &before, 0);
+  ticker_start(&ticker, interval);
   while (TRUE) {
-    sleep(5);
-    read_stat(&after);
-    show_result(&before, &after);
+    ticker_wait(&ticker);
+    stat_sampler_read(sampler, &after, 0);
+    show_result(&before, &after, &ticker);
+    output_commit(output);
     before = after;
   }
+  delete_output_t(output);
+  delete_stat_sampler_t(sampler);
   return 0;
 }
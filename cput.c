@@ -14,55 +14,88 @@
  * @date 2016/3/21
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
-#include "def.h"
+#include <getopt.h>
+#ifdef BENCH
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "cpuusage.h"
+#include "history.h"
+#include "output.h"
+#include "format.h"
+#include "uring.h"
+#include "shm.h"
+#include "watch.h"
 
 /**
- * パス名の最大
+ * /proc配下の相対パス名バッファのサイズ
  */
-#define PATH_MAX 4096
+#define NAME_BUFFER_SIZE 64
+/**
+ * getdents64用バッファのサイズ
+ */
+#define DENTS_BUFFER_SIZE 4096
 /**
  * ラインバッファのサイズ
  */
 #define LINE_BUFFER_SIZE 1024
 /**
- * プロセスバッファの初期値
+ * スレッドのschedstatをfdキャッシュに格納する際のキー
+ *
+ * スレッドのstatはTIDをそのままキーとするため、重複しないようにする。
  */
-#define INIT_PROCS 1024
+#define SCHEDSTAT_KEY(tid) ((2ULL << 32) | (uint32_t) (tid))
 /**
- * プロセス名の上限
+ * schedstatを読み出すバッファのサイズ
  */
-#define PR_NAME_LEN 16
+#define SCHEDSTAT_BUFFER_SIZE 64
+/**
+ * io_uringで一度に投入するタスク数
+ *
+ * 1タスクあたりstatとschedstatの2つの読み出しを積む。
+ */
+#define URING_BATCH 256
 /**
- * 表示するプロセス数
+ * 名前キャッシュのテーブルサイズの初期値
  */
-#define DISPLAY_PROCESS_NUM 10
+#define INIT_NAME_CACHE 256
 /**
- * 2つのポインタ値の入れ替え
+ * 表示し続けている名前をこの回数ごとに読みなおし、名前の変更を反映する
  */
-#define SWAP(a, b) {void *tmp = a; a = b; b = tmp;}
-
+#define NAME_REFRESH_TICKS 8
+/**
+ * この回数参照されなかった名前はキャッシュから削除する
+ */
+#define NAME_EXPIRE_TICKS 16
+/**
+ * PIDリストの初期サイズ
+ */
+#define INIT_PIDS 1024
+/**
+ * ワーカー数の上限
+ */
+#define MAX_WORKERS 256
+/**
+ * プロセスバッファの初期値
+ */
+#define INIT_PROCS 1024
+/**
+ * プロセス名の上限
+ */
+#define PR_NAME_LEN 16
 /**
- * statのCPUカウンタ記録用構造体
+ * プロセスごとの表示で1プロセスあたりに表示するスレッド数
  */
-typedef struct cputime_t {
-  uint64_t user;       /**< ユーザーモードで消費した時間 */
-  uint64_t nice;       /**< 低い優先度のユーザーモードで消費した時間 */
-  uint64_t system;     /**< システムモードで消費した時間 */
-  uint64_t idle;       /**< タスク待ちで消費した時間 */
-  uint64_t iowait;     /**< I/O の完了待ちの時間 */
-  uint64_t irq;        /**< 割り込みの処理に使った時間 */
-  uint64_t softirq;    /**< ソフト割り込みの処理に使った時間 */
-  uint64_t steal;      /**< 仮想環境下で他のOSに消費された時間 */
-  uint64_t guest;      /**< ゲストOSの実行に消費された時間 */
-  uint64_t guest_nice; /**< 低い優先度のゲストOSの実行に消費された時間 */
-} cputime_t;
+#define ROLLUP_THREAD_NUM 3
 
 /**
  * /proc/[pid]/task/[tid]/statの情報保持構造体
@@ -70,647 +103,2668 @@ typedef struct cputime_t {
 typedef struct process_t {
   int pid;           /**< PID */
   int tid;           /**< TID */
-  char pcomm[PR_NAME_LEN]; /**< プロセス名 */
-  char comm[PR_NAME_LEN];  /**< スレッド名 */
   char state;        /**< state */
-  uint64_t load;     /**< 負荷の合計 */
-  uint64_t utime;    /**< ユーザ時間 */
-  uint64_t stime;    /**< システム時間 */
+  uint64_t utime;    /**< ユーザ時間、[ns]で扱う場合はschedstatの実行時間 */
+  uint64_t stime;    /**< システム時間、[ns]で扱う場合は0 */
   uint64_t cutime;   /**< 子プロセスのユーザ時間 */
   uint64_t cstime;   /**< 子プロセスのシステム時間 */
   int64_t priority;  /**< プライオリティ */
   int64_t nice;      /**< nice値 */
+  uint64_t starttime; /**< 起動時刻 */
+  int processor;     /**< 最後に実行したCPU、読み出さない場合-1 */
+  uint64_t run_delay; /**< 実行待ち時間の累計[ns] */
 } process_t;
 
+/**
+ * プロセス名・スレッド名の文字列テーブルのエントリ
+ */
+typedef char name_t[PR_NAME_LEN];
+
+/**
+ * 名前キャッシュのエントリ
+ */
+typedef struct name_entry_t {
+  int id;              /**< PID/TID、0は未使用 */
+  uint64_t starttime;  /**< 起動時刻 */
+  uint32_t used;       /**< 最後に参照された世代 */
+  uint32_t read;       /**< 最後に読み出した世代 */
+  name_t name;         /**< 名前 */
+} name_entry_t;
+
+/**
+ * プロセス名・スレッド名の名前キャッシュ
+ *
+ * 走査では名前を扱わず、各行のPID・TID・起動時刻を名前のハンドルとする。
+ * 表示や記録の対象となった行についてのみ、IDと起動時刻の組をキーとする
+ * オープンアドレス法のハッシュテーブルから名前を引く。
+ */
+typedef struct name_cache_t {
+  name_entry_t *entries; /**< ハッシュテーブル */
+  int size;              /**< テーブルサイズ(2のべき乗) */
+  int num;               /**< 格納数 */
+  uint32_t generation;   /**< 表示の世代 */
+  int proc_fd;           /**< 名前の読み出しに使う/procのファイルディスクリプタ */
+} name_cache_t;
+
 /**
  * 全CPU時間格納構造体
+ *
+ * タスク情報は項目ごとの配列として保持する。
+ * 各配列はarena_tが確保した1つの領域から切り出され、TID昇順に格納される。
+ * 名前は保持せず、必要な行のみname_cache_tから引く。
  */
 typedef struct cpu_t {
+  struct arena_t *arena; /**< 配列を確保したアリーナ */
   int cpu_num;        /**< CPUの個数 */
-  cputime_t *times;   /**< CPU時間 */
-  int proc_num;       /**< 格納済みプロセス数 */
-  int alloc_num;      /**< メモリ確保数 */
-  int array_num;      /**< 配列の長さ */
-  process_t **procs;  /**< プロセス情報格納配列 */
+  cputime_t total;    /**< CPU全体のCPU時間 */
+  cpu_matrix_t *cores; /**< 各コアのCPU時間 */
+  int proc_num;       /**< 格納済みタスク数 */
+  int skipped;        /**< 読み出しを間引いたタスク数 */
+  int opened;         /**< 今回のサンプリングで開いたファイル数 */
+  uint64_t *load;     /**< 負荷の合計 */
+  uint64_t *utime;    /**< ユーザ時間 */
+  uint64_t *stime;    /**< システム時間 */
+  uint64_t *starttime; /**< 起動時刻 */
+  uint64_t *run_delay; /**< 実行待ち時間の累計[ns] */
+  uint64_t *delay;    /**< 前回からの実行待ち時間[ns] */
+  int64_t *priority;  /**< プライオリティ */
+  int64_t *nice;      /**< nice値 */
+  int *pid;           /**< PID */
+  int *tid;           /**< TID */
+  int *processor;     /**< 最後に実行したCPU、読み出さない場合-1 */
+  int *migrations;    /**< 計測開始から観測した実行CPUの変化の回数 */
+  int *order;         /**< 負荷上位のインデックス */
+  int top_num;        /**< 負荷上位として選択した数 */
+  char *state;        /**< state */
 } cpu_t;
 
-static void *xmalloc(size_t size);
-static void *xrealloc(void *ptr, size_t size);
-static cpu_t *new_cpu_t(int num);
-static void delete_cpu_t(cpu_t *cpu);
-static int comp_tid(const void *a, const void *b);
-static int comp_load(const void *a, const void *b);
-static uint64_t get_total(cputime_t *time);
-static uint64_t get_load(cputime_t *time);
-static uint64_t get_idle(cputime_t *time);
-static uint64_t get_iowait(cputime_t *time);
-static uint64_t get_system(cputime_t *time);
-static uint64_t get_user(cputime_t *time);
-static uint64_t get_irq(cputime_t *time);
-static uint64_t get_guest(cputime_t *time);
-static void get_diff(cputime_t *before, cputime_t *after, cputime_t *diff);
-static result_t read_stat(cpu_t *cpu);
-static result_t read_process(cpu_t *cpu);
-static result_t read_pid_comm(int pid, char *comm);
-static result_t read_thread(cpu_t *cpu, int pid, char *pcomm);
-static result_t read_tid_stat(process_t *proc, int pid, char *pcomm, int tid);
-static result_t parse_stat(char *line, process_t *proc);
-static void show_result(cpu_t *before, cpu_t *after);
+/**
+ * 前回と今回のサンプリング結果を格納するアリーナ
+ *
+ * 2つのcpu_tの全配列を1つの領域に配置し、書き込み先を交互に切り替える。
+ * 配列が不足した場合のみ領域を拡張するため、定常状態ではメモリ確保を行わない。
+ */
+typedef struct arena_t {
+  cpu_t cpus[2];      /**< サンプリング結果 */
+  int current;        /**< 今回の書き込み先のインデックス */
+  int array_num;      /**< 各配列の長さ */
+  char *mem;          /**< 全配列を格納する領域 */
+  cpu_usage_t *usage; /**< 各コアの使用率の計算に使う構造体 */
+  struct rollup_t *rollup; /**< プロセスごとの集計、集計しない場合NULL */
+  int sched;          /**< 実行CPUと実行待ち時間を扱うか */
+  int runtime;        /**< タスクの負荷をクロックティックではなく[ns]で扱うか */
+  name_cache_t *names; /**< 名前キャッシュ */
+  name_t *filter;     /**< 名前での絞り込みに使うプロセス名、各配列と同じ長さ */
+} arena_t;
+
+/**
+ * スレッドの負荷のプロセスごとの集計
+ *
+ * 行はcpu_tのスレッドの行、グループは集計したプロセスを示す。
+ * 各配列はスレッド数に合わせて拡張し、以降の計測で使い回す。
+ */
+typedef struct rollup_t {
+  int array_num;      /**< 各配列の長さ */
+  int num;            /**< グループ数 */
+  int *slot;          /**< 行ごとの属するグループ */
+  int *next;          /**< 行ごとの同じグループの次の行、末尾は-1 */
+  int *head;          /**< グループの最初の行 */
+  int *row;           /**< グループの代表の行(メインスレッド) */
+  int *pid;           /**< グループのPID */
+  int *threads;       /**< グループのスレッド数 */
+  uint64_t *load;     /**< グループの負荷の合計 */
+  uint64_t *utime;    /**< グループのユーザ時間の合計 */
+  uint64_t *stime;    /**< グループのシステム時間の合計 */
+  int64_t *nice;      /**< グループの代表の行のnice値 */
+  name_t *comm;       /**< グループのプロセス名 */
+  int *order;         /**< 負荷上位のグループ */
+} rollup_t;
+
+/**
+ * io_uringで読み出し中のタスク
+ */
+typedef struct uring_read_t {
+  int proc;                /**< 結果を書き込むアリーナ上の位置 */
+  int pid;                 /**< PID */
+  int tid;                 /**< TID */
+  int res;                 /**< statの読み出し結果 */
+  int sched_res;           /**< schedstatの読み出し結果、積まなかった場合-1 */
+  char line[LINE_BUFFER_SIZE];  /**< statの読み出し先 */
+  char sched_line[SCHEDSTAT_BUFFER_SIZE]; /**< schedstatの読み出し先 */
+} uring_read_t;
+
+/**
+ * /proc走査ワーカー
+ *
+ * PIDのハッシュで割り当てられたプロセスのみを担当し、
+ * fdキャッシュとタスク情報のアリーナを専有するためロックを必要としない。
+ */
+typedef struct worker_t {
+  struct sampler_t *sampler; /**< 所属するサンプラー */
+  int index;          /**< ワーカー番号 */
+  fd_cache_t *fds;    /**< statファイルのfdキャッシュ */
+  int sched;          /**< processorとschedstatも読み出すか */
+  int runtime;        /**< schedstatの実行時間[ns]をユーザ時間とするか */
+  int skipped;        /**< 今回のサンプリングで間引いたタスク数 */
+  int opened;         /**< 今回のサンプリングで開いたファイル数 */
+  process_t *procs;   /**< タスク情報のアリーナ */
+  uint64_t *order;    /**< 上位32bitにTID、下位32bitにアリーナ上の位置を格納したソート用配列 */
+  uint64_t *tmp;      /**< ソート用の作業領域 */
+  uint64_t *sorted;   /**< TID昇順に並んだ配列(orderまたはtmp) */
+  int proc_num;       /**< 格納済みタスク数 */
+  int array_num;      /**< アリーナの長さ */
+  int pos;            /**< マージ中の読み出し位置 */
+  uring_t *uring;     /**< statのまとめ読みに使うio_uring、使わない場合NULL */
+  uring_read_t *reads; /**< io_uringで読み出し中のタスク、URING_BATCH個 */
+  int read_num;       /**< io_uringへ積んだタスク数 */
+  int dropped;        /**< io_uringで読み出せず、アリーナから除くタスク数 */
+} worker_t;
+
+/**
+ * /proc/stat読み出し用構造体
+ *
+ * /proc/statはopenしたまま保持し、サンプリングごとにpreadで先頭から読みなおす。
+ * バッファも使い回すため、定常状態ではメモリ確保を行わない。
+ */
+typedef struct sampler_t {
+  stat_sampler_t *stat; /**< /proc/statの読み出し */
+  DIR *proc_dir;     /**< /procのディレクトリストリーム */
+  watch_t *watch;    /**< イベント方式のタスク追跡、/procを走査する場合NULL */
+  int *pids;         /**< /procから列挙したPID */
+  int pid_num;       /**< 列挙したPID数 */
+  int pid_array_num; /**< PID配列の長さ */
+  int worker_num;    /**< ワーカー数 */
+  worker_t *workers; /**< ワーカー */
+  int *heap;         /**< マージ用のワーカー番号のヒープ */
+  pool_t *pool;      /**< ワーカースレッド */
+} sampler_t;
+
+static arena_t *new_arena_t(int num);
+static void delete_arena_t(arena_t *arena);
+static void arena_layout(arena_t *arena, char *mem, int array_num);
+static void arena_grow(arena_t *arena);
+static void arena_flip(arena_t *arena, cpu_t **before, cpu_t **after);
+static void ensure_next_proc(cpu_t *cpu);
+static void set_proc(cpu_t *cpu, int i, process_t *proc);
+static name_cache_t *new_name_cache_t(void);
+static void delete_name_cache_t(name_cache_t *cache);
+static uint32_t name_cache_hash(name_cache_t *cache, int id, uint64_t starttime);
+static name_entry_t *name_cache_entry(name_cache_t *cache, int id, uint64_t starttime);
+static void name_cache_remove(name_cache_t *cache, name_entry_t *entry);
+static void name_cache_get(name_cache_t *cache, int pid, int tid, uint64_t starttime,
+                           char *name);
+static void name_cache_sweep(name_cache_t *cache);
+static void thread_name(cpu_t *cpu, int k, char *name);
+static void process_name(cpu_t *cpu, int k, char *name);
+static sampler_t *new_sampler_t(int event, int worker_num, int adaptive, int sched,
+                                int runtime, int uring);
+static void delete_sampler_t(sampler_t *sampler);
+static result_t read_stat(sampler_t *sampler, cpu_t *cpu);
+static result_t read_stat_cached(worker_t *worker, uint64_t key, int dir_fd,
+                                 const char *name, const char *file, char *buf, size_t size);
+static result_t read_process_watch(watch_t *watch, DIR *proc_dir, worker_t *stage);
+static void worker_run(void *arg, int index);
+static void worker_scan(worker_t *worker);
+static void worker_sort(worker_t *worker);
+static result_t worker_queue_stat(worker_t *worker, int pid, int tid);
+static void worker_flush_reads(worker_t *worker);
+static void worker_complete_read(worker_t *worker, uring_read_t *task, int proc_fd);
+static void worker_compact(worker_t *worker);
+static process_t *worker_next_proc(worker_t *worker);
+static int worker_head_tid(worker_t *worker);
+static void heap_down(sampler_t *sampler, int num, int i);
+static void merge_workers(sampler_t *sampler, int num, cpu_t *cpu);
+static result_t read_process(sampler_t *sampler, cpu_t *cpu);
+static result_t read_thread(worker_t *worker, int proc_fd, int pid, const char *name);
+static result_t read_tid_stat(worker_t *worker, process_t *proc, int task_fd,
+                              int pid, int tid, const char *name);
+static void read_tid_schedstat(worker_t *worker, process_t *proc, int dir_fd, const char *name);
+static result_t parse_schedstat_line(char *line, process_t *proc, int runtime);
+static result_t parse_stat(char *line, process_t *proc, int sched);
+static void record_history(history_t *history, cpu_t *before, cpu_t *after, ticker_t *ticker);
+static void show_result(cpu_t *before, cpu_t *after, const rank_t *rank, ticker_t *ticker);
 static void show_result_cpus(cpu_t *before, cpu_t *after);
-static void show_result_thread(uint64_t total, cpu_t *before, cpu_t *after);
+static void get_columns(cpu_t *cpu, task_columns_t *columns);
+static void calc_load(cpu_t *before, cpu_t *after);
+static void calc_sched(cpu_t *before, cpu_t *after);
+static int select_top(cpu_t *cpu, const rank_t *rank);
+static void show_result_thread(uint64_t total, cpu_t *before, cpu_t *after, const rank_t *rank);
+static uint64_t get_task_total(cpu_t *after, ticker_t *ticker, uint64_t total);
+static void show_load(arena_t *arena, uint64_t load);
+static rollup_t *new_rollup_t(void);
+static void delete_rollup_t(rollup_t *rollup);
+static void rollup_grow(rollup_t *rollup, int num);
+static int find_thread_row(cpu_t *cpu, int tid);
+static void rollup_threads(rollup_t *rollup, cpu_t *cpu);
+static int rollup_top_threads(rollup_t *rollup, cpu_t *cpu, int group, int *rows, int n);
+static void show_result_rollup(uint64_t total, cpu_t *before, cpu_t *after, const rank_t *rank);
+static void put_result(format_t *format, int kind, cpu_t *before, cpu_t *after,
+                       const rank_t *rank, ticker_t *ticker, int dropped);
+static void put_result_json(format_t *format, cputime_t *diff, cpu_t *after,
+                            ticker_t *ticker, int dropped);
+static void put_result_binary(format_t *format, cputime_t *diff, cpu_t *after,
+                              ticker_t *ticker, int dropped);
+static void show_snapshot(const binary_record_t *record, int n);
+static int run_client(const char *name, int n, int screen);
 
 /**
- * @brief malloc結果がNULLだった場合にexitする
+ * @brief サンプリング結果のアリーナの初期化を行う
  *
- * @param[in] size 確保サイズ
- * @return 確保された領域へのポインタ
+ * @param[in] num CPUの個数
+ * @return アリーナ
  */
-static void *xmalloc(size_t size) {
-  void *p = malloc(size);
-  if (p == NULL) {
-    ERR("%s\n", strerror(errno));
-    exit(EXIT_FAILURE);
+static arena_t *new_arena_t(int num) {
+  int i;
+  arena_t *arena = xmalloc(sizeof(arena_t));
+  arena->current = 0;
+  arena->array_num = INIT_PROCS;
+  arena->usage = new_cpu_usage_t(num);
+  arena->rollup = NULL;
+  arena->names = NULL;
+  arena->filter = NULL;
+  arena->sched = FALSE;
+  arena->runtime = FALSE;
+  for (i = 0; i < 2; i++) {
+    cpu_t *cpu = &arena->cpus[i];
+    cpu->arena = arena;
+    cpu->cpu_num = num;
+    cpu->cores = new_cpu_matrix_t(num);
+    cpu->proc_num = 0;
+    cpu->skipped = 0;
   }
-  return p;
+  arena->mem = NULL;
+  arena_grow(arena);
+  return arena;
 }
 
 /**
- * @brief realloc結果がNULLだった場合にexitする
+ * @brief サンプリング結果のアリーナの開放を行う
  *
- * @param[in] ptr ポインタ
- * @param[in] size 確保サイズ
- * @return 確保された領域へのポインタ
+ * @param[in] arena 開放するアリーナ
  */
-static void *xrealloc(void *ptr, size_t size) {
-  void *p = realloc(ptr, size);
-  if (p == NULL) {
-    ERR("%s\n", strerror(errno));
-    exit(EXIT_FAILURE);
+static void delete_arena_t(arena_t *arena) {
+  if (arena == NULL) {
+    return;
   }
-  return p;
+  free(arena->mem);
+  delete_cpu_matrix_t(arena->cpus[0].cores);
+  delete_cpu_matrix_t(arena->cpus[1].cores);
+  delete_cpu_usage_t(arena->usage);
+  delete_rollup_t(arena->rollup);
+  delete_name_cache_t(arena->names);
+  free(arena->filter);
+  free(arena);
 }
 
 /**
- * @brief 全CPU時間格納構造体の初期化を行う
+ * @brief 領域を2つのcpu_tの各配列に割り当てる
  *
- * @param[in] num CPUの個数
- * @return 全CPU時間格納構造体
+ * 要素サイズの大きい配列から順に配置し、アラインメントを保つ。
+ *
+ * @param[in,out] arena     対象のアリーナ
+ * @param[in]     mem       割り当てる領域
+ * @param[in]     array_num 各配列の長さ
  */
-static cpu_t *new_cpu_t(int num) {
-  cpu_t *cpu;
-  cpu = xmalloc(sizeof(cpu_t));
-  cpu->cpu_num = num;
-  cpu->times = xmalloc((num + 1) * sizeof(cputime_t));
-  cpu->proc_num = 0;
-  cpu->array_num = INIT_PROCS;
-  cpu->procs = xmalloc(INIT_PROCS * sizeof(process_t*));
-  return cpu;
+static void arena_layout(arena_t *arena, char *mem, int array_num) {
+  int i;
+  for (i = 0; i < 2; i++) {
+    cpu_t *cpu = &arena->cpus[i];
+    cpu->load = (uint64_t *) mem;
+    mem += sizeof(uint64_t) * array_num;
+    cpu->utime = (uint64_t *) mem;
+    mem += sizeof(uint64_t) * array_num;
+    cpu->stime = (uint64_t *) mem;
+    mem += sizeof(uint64_t) * array_num;
+    cpu->starttime = (uint64_t *) mem;
+    mem += sizeof(uint64_t) * array_num;
+    cpu->run_delay = (uint64_t *) mem;
+    mem += sizeof(uint64_t) * array_num;
+    cpu->delay = (uint64_t *) mem;
+    mem += sizeof(uint64_t) * array_num;
+    cpu->priority = (int64_t *) mem;
+    mem += sizeof(int64_t) * array_num;
+    cpu->nice = (int64_t *) mem;
+    mem += sizeof(int64_t) * array_num;
+    cpu->pid = (int *) mem;
+    mem += sizeof(int) * array_num;
+    cpu->tid = (int *) mem;
+    mem += sizeof(int) * array_num;
+    cpu->processor = (int *) mem;
+    mem += sizeof(int) * array_num;
+    cpu->migrations = (int *) mem;
+    mem += sizeof(int) * array_num;
+    cpu->order = (int *) mem;
+    mem += sizeof(int) * array_num;
+    cpu->state = mem;
+    mem += sizeof(char) * array_num;
+  }
 }
 
 /**
- * @brief 全CPU時間格納構造体の開放を行う
+ * 配列の格納済みの要素を新しい配列へコピーする
+ */
+#define COPY_COLUMN(dst, src, column) \
+    memcpy((dst)->column, (src)->column, sizeof(*(src)->column) * (src)->proc_num)
+
+/**
+ * @brief アリーナの各配列の長さを倍にする
+ *
+ * 初回は初期サイズで確保する。格納済みの内容は引き継ぐ。
  *
- * @param[in] cpu 開放する構造体
+ * @param[in,out] arena 対象のアリーナ
  */
-static void delete_cpu_t(cpu_t *cpu) {
+static void arena_grow(arena_t *arena) {
+  size_t row = sizeof(uint64_t) * 6 + sizeof(int64_t) * 2 + sizeof(int) * 5
+      + sizeof(char);
+  cpu_t old[2];
+  char *old_mem = arena->mem;
   int i;
-  if (cpu == NULL) {
+  if (old_mem != NULL) {
+    arena->array_num *= 2;
+  }
+  memcpy(old, arena->cpus, sizeof(old));
+  arena->mem = xmalloc(row * arena->array_num * 2);
+  arena->filter = xrealloc(arena->filter, sizeof(name_t) * arena->array_num);
+  arena_layout(arena, arena->mem, arena->array_num);
+  if (old_mem == NULL) {
     return;
   }
-  for (i = 0; i < cpu->alloc_num; i++) {
-    free(cpu->procs[i]);
+  for (i = 0; i < 2; i++) {
+    cpu_t *cpu = &arena->cpus[i];
+    COPY_COLUMN(cpu, &old[i], load);
+    COPY_COLUMN(cpu, &old[i], utime);
+    COPY_COLUMN(cpu, &old[i], stime);
+    COPY_COLUMN(cpu, &old[i], starttime);
+    COPY_COLUMN(cpu, &old[i], run_delay);
+    COPY_COLUMN(cpu, &old[i], delay);
+    COPY_COLUMN(cpu, &old[i], priority);
+    COPY_COLUMN(cpu, &old[i], nice);
+    COPY_COLUMN(cpu, &old[i], pid);
+    COPY_COLUMN(cpu, &old[i], tid);
+    COPY_COLUMN(cpu, &old[i], processor);
+    COPY_COLUMN(cpu, &old[i], migrations);
+    COPY_COLUMN(cpu, &old[i], order);
+    COPY_COLUMN(cpu, &old[i], state);
   }
-  free(cpu->procs);
-  free(cpu->times);
-  free(cpu);
+  free(old_mem);
 }
 
 /**
- * @brief 次のプロセス構造体が利用できるようにする
- *
- * proc_numの位置がメモリ確保された状態であることを担保する。
+ * @brief 今回の結果を前回の結果とし、書き込み先を切り替える
  *
- * @param[out] cpu 確保する構造体
+ * @param[in,out] arena  対象のアリーナ
+ * @param[out]    before 前回の結果の格納先
+ * @param[out]    after  次回の書き込み先の格納先
  */
-static void ensure_next_proc(cpu_t *cpu) {
-  if (cpu->array_num == cpu->proc_num) {
-    cpu->array_num *= 2;
-    cpu->procs = xrealloc(cpu->procs, sizeof(process_t*) * cpu->array_num);
-  }
-  if (cpu->alloc_num == cpu->proc_num) {
-    cpu->procs[cpu->alloc_num] = xmalloc(sizeof(process_t));
-    cpu->alloc_num++;
-  }
+static void arena_flip(arena_t *arena, cpu_t **before, cpu_t **after) {
+  arena->current ^= 1;
+  *before = &arena->cpus[arena->current ^ 1];
+  *after = &arena->cpus[arena->current];
 }
 
 /**
- * @brief tid昇順ソート用比較関数
+ * @brief 次のタスク情報が格納できるようにする
  *
- * @param[in] a 比較対象
- * @param[in] b 比較対象
- * @return a < b の時負、a == b の時0、a > b の時正
+ * proc_numの位置が配列の範囲内であることを担保する。
+ *
+ * @param[in,out] cpu 格納先の構造体
  */
-static int comp_tid(const void *a, const void *b) {
-  return (*(process_t**)a)->tid - (*(process_t**)b)->tid;
+static void ensure_next_proc(cpu_t *cpu) {
+  if (cpu->proc_num == cpu->arena->array_num) {
+    arena_grow(cpu->arena);
+  }
 }
 
 /**
- * @brief 負荷降順ソート用比較関数
+ * @brief タスク情報を各配列の指定位置へ書き込む
  *
- * @param[in] a 比較対象
- * @param[in] b 比較対象
- * @return a > b の時負、a == b の時0、a < b の時正
+ * @param[out] cpu  書き込み先
+ * @param[in]  i    書き込む位置
+ * @param[in]  proc タスク情報
  */
-static int comp_load(const void *a, const void *b) {
-  return (*(process_t**)b)->load - (*(process_t**)a)->load;
+static void set_proc(cpu_t *cpu, int i, process_t *proc) {
+  cpu->utime[i] = proc->utime;
+  cpu->stime[i] = proc->stime;
+  cpu->starttime[i] = proc->starttime;
+  cpu->run_delay[i] = proc->run_delay;
+  cpu->priority[i] = proc->priority;
+  cpu->nice[i] = proc->nice;
+  cpu->pid[i] = proc->pid;
+  cpu->tid[i] = proc->tid;
+  cpu->processor[i] = proc->processor;
+  cpu->delay[i] = 0;
+  cpu->migrations[i] = 0;
+  cpu->state[i] = proc->state;
 }
 
 /**
- * @brief カウンタの合計を返す
+ * @brief 名前キャッシュの初期化を行う
+ *
+ * 名前の読み出しには専用に開いた/procのディレクトリfdを使う。
  *
- * @param[in] time cputime_t構造体
- * @return カウンタの合計値
+ * @return 名前キャッシュ、/procを開けなかった場合NULL
  */
-static uint64_t get_total(cputime_t *time) {
-  return time->user + time->nice + time->system
-      + time->idle + time->iowait + time->irq + time->softirq
-      + time->steal + time->guest + time->guest_nice;
+static name_cache_t *new_name_cache_t(void) {
+  int i;
+  name_cache_t *cache = xmalloc(sizeof(name_cache_t));
+  cache->proc_fd = open(get_proc_root(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (cache->proc_fd < 0) {
+    ERR("%s\n", strerror(errno));
+    free(cache);
+    return NULL;
+  }
+  cache->size = INIT_NAME_CACHE;
+  cache->num = 0;
+  cache->generation = 0;
+  cache->entries = xmalloc(sizeof(name_entry_t) * cache->size);
+  for (i = 0; i < cache->size; i++) {
+    cache->entries[i].id = 0;
+  }
+  return cache;
 }
+
 /**
- * @brief 負荷のカウンタの合計を返す
+ * @brief 名前キャッシュの開放を行う
  *
- * @param[in] time cputime_t構造体
- * @return 負荷のカウンタの合計値
+ * @param[in] cache 開放する名前キャッシュ
  */
-static uint64_t get_load(cputime_t *time) {
-  return time->user + time->nice + time->system
-      + time->irq + time->softirq
-      + time->steal + time->guest + time->guest_nice;
+static void delete_name_cache_t(name_cache_t *cache) {
+  if (cache == NULL) {
+    return;
+  }
+  close(cache->proc_fd);
+  free(cache->entries);
+  free(cache);
 }
 
 /**
- * @brief アイドルのカウンタの合計を返す
+ * @brief IDと起動時刻からテーブル上の初期位置を求める
  *
- * @param[in] time cputime_t構造体
- * @return アイドルのカウンタの合計値
+ * @param[in] cache     名前キャッシュ
+ * @param[in] id        PID/TID
+ * @param[in] starttime 起動時刻
+ * @return テーブル上の位置
  */
-static uint64_t get_idle(cputime_t *time) {
-  return time->idle + time->iowait;
+static uint32_t name_cache_hash(name_cache_t *cache, int id, uint64_t starttime) {
+  uint64_t key = (uint64_t) (uint32_t) id << 32 ^ starttime;
+  return (uint32_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (cache->size - 1);
 }
 
 /**
- * @brief I/O待ちのカウンタの合計を返す
+ * @brief IDと起動時刻に対応するエントリを返す
+ *
+ * 見つからない場合は名前が空のエントリを追加する。
+ * 追加によってテーブルを拡張した場合、以前に返したエントリへのポインタは無効となる。
  *
- * @param[in] time cputime_t構造体
- * @return I/O待ちのカウンタの合計値
+ * @param[in,out] cache     名前キャッシュ
+ * @param[in]     id        PID/TID
+ * @param[in]     starttime 起動時刻
+ * @return エントリ
  */
-static uint64_t get_iowait(cputime_t *time) {
-  return time->iowait;
+static name_entry_t *name_cache_entry(name_cache_t *cache, int id, uint64_t starttime) {
+  uint32_t mask = cache->size - 1;
+  uint32_t i;
+  for (i = name_cache_hash(cache, id, starttime);
+       cache->entries[i].id != 0; i = (i + 1) & mask) {
+    if (cache->entries[i].id == id && cache->entries[i].starttime == starttime) {
+      return &cache->entries[i];
+    }
+  }
+  if ((cache->num + 1) * 2 > cache->size) {
+    name_entry_t *old = cache->entries;
+    int old_size = cache->size;
+    int j;
+    cache->size *= 2;
+    cache->entries = xmalloc(sizeof(name_entry_t) * cache->size);
+    for (j = 0; j < cache->size; j++) {
+      cache->entries[j].id = 0;
+    }
+    mask = cache->size - 1;
+    for (j = 0; j < old_size; j++) {
+      if (old[j].id == 0) {
+        continue;
+      }
+      for (i = name_cache_hash(cache, old[j].id, old[j].starttime);
+           cache->entries[i].id != 0; i = (i + 1) & mask);
+      cache->entries[i] = old[j];
+    }
+    free(old);
+    for (i = name_cache_hash(cache, id, starttime);
+         cache->entries[i].id != 0; i = (i + 1) & mask);
+  }
+  cache->entries[i].id = id;
+  cache->entries[i].starttime = starttime;
+  cache->entries[i].used = cache->generation;
+  cache->entries[i].read = cache->generation - NAME_REFRESH_TICKS;
+  cache->entries[i].name[0] = 0;
+  cache->num++;
+  return &cache->entries[i];
 }
 
 /**
- * @brief systemのカウンタの合計を返す
+ * @brief エントリを名前キャッシュから削除する
+ *
+ * 後続のエントリを詰めなおすため、削除後はエントリへのポインタは無効となる。
  *
- * @param[in] time cputime_t構造体
- * @return systemのカウンタの合計値
+ * @param[in,out] cache 名前キャッシュ
+ * @param[in]     entry 削除するエントリ
  */
-static uint64_t get_system(cputime_t *time) {
-  return time->system;
+static void name_cache_remove(name_cache_t *cache, name_entry_t *entry) {
+  name_entry_t *entries = cache->entries;
+  uint32_t mask = cache->size - 1;
+  uint32_t i = entry - entries;
+  uint32_t j = i;
+  while (TRUE) {
+    uint32_t home;
+    j = (j + 1) & mask;
+    if (entries[j].id == 0) {
+      break;
+    }
+    home = name_cache_hash(cache, entries[j].id, entries[j].starttime);
+    // homeが(i, j]の範囲外であれば空いた位置へ詰める
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      entries[i] = entries[j];
+      i = j;
+    }
+  }
+  entries[i].id = 0;
+  cache->num--;
 }
 
 /**
- * @brief userのカウンタの合計を返す
+ * @brief タスクの名前を取得する
  *
- * @param[in] time cputime_t構造体
- * @return userのカウンタの合計値
+ * 名前はIDと起動時刻の組で引き、未取得の場合とNAME_REFRESH_TICKS回ごとに
+ * statを読み出してcommを取りだす。起動時刻が一致しない場合は
+ * IDが再利用された別のタスクのため採用しない。
+ * 読み出せなかった場合は以前に取得した名前を使い、無ければ空文字列とする。
+ * 起動時刻が0の場合は確認を行わない。
+ *
+ * @param[in,out] cache     名前キャッシュ
+ * @param[in]     pid       PID
+ * @param[in]     tid       TID、プロセス名の場合0
+ * @param[in]     starttime 起動時刻
+ * @param[out]    name      名前の書き込み先
  */
-static uint64_t get_user(cputime_t *time) {
-  return time->user + time->nice;
+static void name_cache_get(name_cache_t *cache, int pid, int tid, uint64_t starttime,
+                           char *name) {
+  name_entry_t *entry = name_cache_entry(cache, tid != 0 ? tid : pid, starttime);
+  entry->used = cache->generation;
+  if (cache->generation - entry->read >= NAME_REFRESH_TICKS) {
+    char path[NAME_BUFFER_SIZE];
+    char line[LINE_BUFFER_SIZE];
+    task_stat_t stat;
+    int fd;
+    if (tid != 0) {
+      snprintf(path, sizeof(path), "%d/task/%d", pid, tid);
+    } else {
+      snprintf(path, sizeof(path), "%d", pid);
+    }
+    fd = open_stat_at(cache->proc_fd, path, "/stat");
+    if (fd >= 0) {
+      if (read_fd(fd, line, sizeof(line)) > 0
+          && parse_task_stat(line, name, PR_NAME_LEN, &stat) == SUCCESS
+          && (starttime == 0 || stat.starttime == starttime)) {
+        memcpy(entry->name, name, PR_NAME_LEN);
+        entry->read = cache->generation;
+      }
+      close(fd);
+    }
+  }
+  memcpy(name, entry->name, PR_NAME_LEN);
 }
 
 /**
- * @brief 割り込みのカウンタの合計を返す
+ * @brief NAME_EXPIRE_TICKS回参照されなかったエントリを削除する
  *
- * @param[in] time cputime_t構造体
- * @return 割り込みのカウンタの合計値
+ * 削除によって後続のエントリが詰められるため、
+ * 削除した位置は再度確認する。
+ *
+ * @param[in,out] cache 名前キャッシュ
  */
-static uint64_t get_irq(cputime_t *time) {
-  return time->irq + time->softirq;
+static void name_cache_sweep(name_cache_t *cache) {
+  int i = 0;
+  while (i < cache->size) {
+    name_entry_t *entry = &cache->entries[i];
+    if (entry->id != 0 && cache->generation - entry->used >= NAME_EXPIRE_TICKS) {
+      name_cache_remove(cache, entry);
+    } else {
+      i++;
+    }
+  }
+  cache->generation++;
 }
 
 /**
- * @brief ゲストのカウンタの合計を返す
+ * @brief 行のスレッド名を取得する
  *
- * @param[in] time cputime_t構造体
- * @return ゲストのカウンタの合計値
+ * @param[in]  cpu  対象の構造体
+ * @param[in]  k    行
+ * @param[out] name 名前の書き込み先
  */
-static uint64_t get_guest(cputime_t *time) {
-  return time->guest + time->guest_nice;
+static void thread_name(cpu_t *cpu, int k, char *name) {
+  name_cache_get(cpu->arena->names, cpu->pid[k], cpu->tid[k], cpu->starttime[k], name);
 }
 
 /**
- * @brief cputime_t間の差分を取る
+ * @brief 行の属するプロセスの名前を取得する
  *
- * @param[in] before 時間的に前の値
- * @param[in] after 時間的に後の値
- * @param[out] diff 差分の格納先
- */
-static void get_diff(cputime_t *before, cputime_t *after, cputime_t *diff) {
-  uint64_t tmp;
-  // 負の値の場合は0とする
-#define DIFF(x) {tmp = after->x - before->x; diff->x = tmp < 0 ? 0 : tmp;}
-  DIFF(user);
-  DIFF(nice);
-  DIFF(system);
-  DIFF(idle);
-  DIFF(iowait);
-  DIFF(irq);
-  DIFF(softirq);
-  DIFF(steal);
-  DIFF(guest);
-  DIFF(guest_nice);
-#undef DIFF
+ * メインスレッドの行があればその起動時刻で引き、
+ * 無い場合は起動時刻を確認せずに/proc/[pid]/statから読み出す。
+ *
+ * @param[in]  cpu  対象の構造体、TID昇順に並んでいること
+ * @param[in]  k    行
+ * @param[out] name 名前の書き込み先
+ */
+static void process_name(cpu_t *cpu, int k, char *name) {
+  int pid = cpu->pid[k];
+  int leader = cpu->tid[k] == pid ? k : find_thread_row(cpu, pid);
+  name_cache_get(cpu->arena->names, pid, 0, leader >= 0 ? cpu->starttime[leader] : 0, name);
 }
 
 /**
- * @brief statの値を読みだす
+ * @brief /proc/stat読み出し用構造体の初期化を行う
  *
- * @param[out] cpu 結果の書き込み先
- * @return 成功：SUCCESS / 失敗：FAILURE
+ * イベント方式が利用できない場合は/procの走査で代用する。
+ * /procの走査はworker_num個のワーカーで分担し、
+ * 呼び出し元スレッドを0番として残りのスレッドを起動する。
+ * fdの上限はワーカー間で等分する。
+ *
+ * @param[in] event      イベント方式でタスクを追跡するか
+ * @param[in] worker_num /procを走査するワーカー数
+ * @param[in] adaptive   読み出しを間引くまでのアイドル回数、0の場合は間引かない
+ * @param[in] sched      実行CPUとschedstatも読み出すか
+ * @param[in] runtime    schedstatの実行時間[ns]をCPU時間とするか
+ * @param[in] uring      io_uringでstatをまとめ読みするか、利用できない場合は同期的に読み出す
+ * @return /proc/stat読み出し用構造体、失敗した場合NULL
  */
-static result_t read_stat(cpu_t *cpu) {
-  result_t result = FAILURE;
-  cputime_t *work;
-  FILE *file;
-  char line[LINE_BUFFER_SIZE];
-  file = fopen("/proc/stat", "rb");
-  if (file == NULL) {
-    ERR("%s\n", strerror(errno));
-    return FAILURE;
+static sampler_t *new_sampler_t(int event, int worker_num, int adaptive, int sched,
+                                int runtime, int uring) {
+  int i;
+  int limit;
+  sampler_t *sampler;
+  sampler = xmalloc(sizeof(sampler_t));
+  sampler->stat = new_stat_sampler_t();
+  if (sampler->stat == NULL) {
+    free(sampler);
+    return NULL;
   }
-  if (fgets(line, sizeof(line), file) == NULL) {
+  sampler->proc_dir = opendir(get_proc_root());
+  if (sampler->proc_dir == NULL) {
     ERR("%s\n", strerror(errno));
-    goto error;
+    delete_stat_sampler_t(sampler->stat);
+    free(sampler);
+    return NULL;
   }
-  memset(cpu->times, 0, sizeof(cputime_t) * cpu->cpu_num);
-  work = &cpu->times[cpu->cpu_num];
-  if (sscanf(line, "cpu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
-             &work->user,
-             &work->nice,
-             &work->system,
-             &work->idle,
-             &work->iowait,
-             &work->irq,
-             &work->softirq,
-             &work->steal,
-             &work->guest,
-             &work->guest_nice) < 4) {
-    ERR("%s\n", strerror(errno));
-    goto error;
+  sampler->watch = NULL;
+  if (event && !is_default_proc_root()) {
+    fprintf(stderr, "-e is not available with --proc-root, scanning %s instead\n", get_proc_root());
+  } else if (event && sched) {
+    fprintf(stderr, "-e is not available with --sched, scanning /proc instead\n");
+  } else if (event && runtime) {
+    fprintf(stderr, "-e is not available with --ns, scanning /proc instead\n");
+  } else if (event) {
+    sampler->watch = new_watch_t(dirfd(sampler->proc_dir), WATCH_THREAD);
+    if (sampler->watch == NULL) {
+      fprintf(stderr, "proc connector/taskstats is not available, scanning /proc instead\n");
+    }
   }
-  if (cpu->cpu_num > 1) {
-    int i;
-    for (i = 0; i < cpu->cpu_num; i++) {
-      if (fgets(line, sizeof(line), file) == NULL) {
-        ERR("%s\n", strerror(errno));
-        goto error;
-      }
-      work = &cpu->times[i];
-      if (sscanf(line, "cpu%*u %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
-                 &work->user,
-                 &work->nice,
-                 &work->system,
-                 &work->idle,
-                 &work->iowait,
-                 &work->irq,
-                 &work->softirq,
-                 &work->steal,
-                 &work->guest,
-                 &work->guest_nice) < 4) {
-        ERR("%s\n", strerror(errno));
-        goto error;
-      }
+  sampler->pid_num = 0;
+  sampler->pid_array_num = INIT_PIDS;
+  sampler->pids = xmalloc(sizeof(int) * sampler->pid_array_num);
+  sampler->worker_num = worker_num;
+  sampler->workers = xmalloc(sizeof(worker_t) * worker_num);
+  sampler->heap = xmalloc(sizeof(int) * worker_num);
+  limit = get_fd_limit() / worker_num;
+  for (i = 0; i < worker_num; i++) {
+    worker_t *worker = &sampler->workers[i];
+    worker->sampler = sampler;
+    worker->index = i;
+    worker->fds = new_fd_cache_t(limit, sizeof(process_t));
+    worker->fds->adaptive = adaptive;
+    worker->sched = sched;
+    worker->runtime = runtime;
+    worker->skipped = 0;
+    worker->opened = 0;
+    worker->proc_num = 0;
+    worker->array_num = INIT_PROCS;
+    worker->procs = xmalloc(sizeof(process_t) * worker->array_num);
+    worker->order = xmalloc(sizeof(uint64_t) * worker->array_num);
+    worker->tmp = xmalloc(sizeof(uint64_t) * worker->array_num);
+    worker->sorted = worker->order;
+    worker->pos = 0;
+    worker->uring = NULL;
+    worker->reads = NULL;
+    worker->read_num = 0;
+    worker->dropped = 0;
+    if (uring && (i == 0 || sampler->workers[0].uring != NULL)) {
+      worker->uring = new_uring_t(URING_BATCH * 2);
+    }
+    if (worker->uring != NULL) {
+      worker->reads = xmalloc(sizeof(uring_read_t) * URING_BATCH);
+    } else if (uring && i == 0) {
+      fprintf(stderr, "io_uring is not available, reading stat synchronously instead\n");
     }
   }
-  result = SUCCESS;
-  error:
-  fclose(file);
-  return result;
+  sampler->pool = new_pool_t(worker_num, worker_run, sampler);
+  return sampler;
 }
 
 /**
- * @brief プロセス情報の読み出し
+ * @brief /proc/stat読み出し用構造体の開放を行う
  *
- * @param[out] cpu 結果の書き込み先
- * @return 成功：SUCCESS / 失敗：FAILURE
+ * @param[in] sampler 開放する構造体
  */
-static result_t read_process(cpu_t *cpu) {
-  DIR *dir;
-  struct dirent *dent;
-  cpu->proc_num = 0;
-  dir = opendir("/proc");
-  if (dir == NULL) {
-    ERR("%s\n", strerror(errno));
-    return FAILURE;
+static void delete_sampler_t(sampler_t *sampler) {
+  int i;
+  if (sampler == NULL) {
+    return;
   }
-  while ((dent = readdir(dir)) != NULL) {
-    if(dent->d_name[0] >= '0' && dent->d_name[0] <= '9') {
-      char pcomm[PR_NAME_LEN];
-      int pid = atoi(dent->d_name);
-      if (read_pid_comm(pid, pcomm) != SUCCESS) {
-        continue;
-      }
-      read_thread(cpu, pid, pcomm);
-    }
+  delete_pool_t(sampler->pool);
+  for (i = 0; i < sampler->worker_num; i++) {
+    delete_fd_cache_t(sampler->workers[i].fds);
+    free(sampler->workers[i].procs);
+    free(sampler->workers[i].order);
+    free(sampler->workers[i].tmp);
+    delete_uring_t(sampler->workers[i].uring);
+    free(sampler->workers[i].reads);
   }
-  closedir(dir);
-  qsort(cpu->procs, cpu->proc_num, sizeof(process_t*), comp_tid);
-  return SUCCESS;
+  delete_stat_sampler_t(sampler->stat);
+  closedir(sampler->proc_dir);
+  delete_watch_t(sampler->watch);
+  free(sampler->workers);
+  free(sampler->heap);
+  free(sampler->pids);
+  free(sampler);
 }
 
 /**
- * @brief 指定PIDのプロセス名のみを読みだす
+ * @brief statの値を読みだす
  *
- * @param[in] pid PID
- * @param[out] comm プロセス名書き込み先
+ * @param[in,out] sampler 読み出しに使う構造体
+ * @param[out] cpu 結果の書き込み先
  * @return 成功：SUCCESS / 失敗：FAILURE
  */
-static result_t read_pid_comm(int pid, char *comm) {
-  result_t result = FAILURE;
-  char path[PATH_MAX];
-  FILE *file;
-  char line[LINE_BUFFER_SIZE];
-  char *tmp1;
-  char *tmp2;
-  int len;
-  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
-  file = fopen(path, "rb");
-  if (file == NULL) {
-    ERR("%s: %s\n", path, strerror(errno));
-    goto error;
+static result_t read_stat(sampler_t *sampler, cpu_t *cpu) {
+  return stat_sampler_read_matrix(sampler->stat, &cpu->total, cpu->cores);
+}
+
+/**
+ * @brief fdキャッシュを使ってstatファイルを読み出す
+ *
+ * キャッシュ済みであればpreadで先頭から読みなおす。
+ * タスクが終了していた(ESRCH/ENOENT)などで読み出せなかった場合は
+ * エントリを削除し、同じIDの新しいタスクとして開きなおす。
+ * キャッシュが上限に達している場合は読み出すたびに開いて閉じる。
+ *
+ * @param[in,out] worker 読み出すワーカー
+ * @param[in]     key    キー
+ * @param[in]     dir_fd 基準となるディレクトリのファイルディスクリプタ
+ * @param[in]     name   ディレクトリ名(PID/TID)
+ * @param[in]     file   ファイル名("/stat"、"/schedstat")
+ * @param[out]    buf    書き込み先
+ * @param[in]     size   書き込み先のサイズ
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t read_stat_cached(worker_t *worker, uint64_t key, int dir_fd,
+                                 const char *name, const char *file, char *buf, size_t size) {
+  fd_cache_t *cache = worker->fds;
+  fd_entry_t *entry = fd_cache_find(cache, key);
+  int fd;
+  if (entry != NULL) {
+    if (reread_fd(entry->fd, buf, size) == SUCCESS) {
+      entry->seen = cache->generation;
+      return SUCCESS;
+    }
+    fd_cache_remove(cache, entry);
   }
-  if (fgets(line, sizeof(line), file) == NULL) {
-    ERR("%s\n", strerror(errno));
-    goto error;
+  if (read_stat_open(dir_fd, name, file, buf, size, &fd) != SUCCESS) {
+    return FAILURE;
   }
-  tmp1 = strchr(line, '(') + 1;
-  tmp2 = strrchr(line, ')');
-  len = tmp2 - tmp1;
-  if (len >= PR_NAME_LEN) {
-    len = PR_NAME_LEN - 1;
+  worker->opened++;
+  if (fd_cache_insert(cache, key, fd) == NULL) {
+    close(fd);
   }
-  memcpy(comm, tmp1, len);
-  comm[len] = 0;
-  result = SUCCESS;
-  error:
-  fclose(file);
-  return result;
+  return SUCCESS;
 }
 
 /**
- * @brief 指定PIDプロセス配下のスレッド情報の読み出し
+ * @brief イベント方式でプロセス情報の読み出し
  *
- * @param[out] cpu 結果の書き込み先
- * @param[in]  pid PID
- * @param[in]  pcomm プロセス名
+ * 追跡対象を最新の状態にしたうえで、結果として有効なタスクを書き込む。
+ *
+ * @param[in,out] watch    タスク追跡構造体
+ * @param[in]     proc_dir /procのディレクトリストリーム
+ * @param[out]    stage    結果の書き込み先のワーカー
  * @return 成功：SUCCESS / 失敗：FAILURE
  */
-static result_t read_thread(cpu_t *cpu, int pid, char *pcomm) {
-  char path[PATH_MAX];
-  DIR *dir;
-  struct dirent *dent;
-  snprintf(path, sizeof(path), "/proc/%d/task", pid);
-  dir = opendir(path);
-  if (dir == NULL) {
-    ERR("%s: %s\n", path, strerror(errno));
-    return FAILURE;
-  }
-  while ((dent = readdir(dir)) != NULL) {
-    if(dent->d_name[0] >= '0' && dent->d_name[0] <= '9') {
-      int tid = atoi(dent->d_name);
-      ensure_next_proc(cpu);
-      process_t *process = cpu->procs[cpu->proc_num];
-      if (read_tid_stat(process, pid, pcomm, tid) == SUCCESS) {
-        cpu->proc_num++;
-      }
+static result_t read_process_watch(watch_t *watch, DIR *proc_dir, worker_t *stage) {
+  int i;
+  watch_update(watch, proc_dir);
+  stage->proc_num = 0;
+  for (i = 0; i < watch->size; i++) {
+    watch_task_t *task = &watch->tasks[i];
+    process_t *proc;
+    if (task->tid == 0 || task->refresh) {
+      continue;
     }
+    proc = worker_next_proc(stage);
+    stage->proc_num++;
+    memset(proc, 0, sizeof(process_t));
+    proc->pid = task->pid;
+    proc->tid = task->tid;
+    proc->state = task->state;
+    proc->utime = task->utime;
+    proc->stime = task->stime;
+    proc->priority = task->priority;
+    proc->nice = task->nice;
   }
-  closedir(dir);
+  worker_sort(stage);
   return SUCCESS;
 }
 
 /**
- * @brief 指定TIDのスレッド情報を読みだす
+ * @brief ワーカー番号に対応するワーカーで走査する
  *
- * @param[out] proc  結果の書き込み先
- * @param[in]  pid   PID
- * @param[in]  pcomm プロセス名
- * @param[in]  tid   TID
- * @return 成功：SUCCESS / 失敗：FAILURE
+ * @param[in] arg   読み出しに使う構造体
+ * @param[in] index ワーカー番号
  */
-static result_t read_tid_stat(process_t *proc, int pid, char *pcomm, int tid) {
-  result_t result = FAILURE;
-  char path[PATH_MAX];
-  FILE *file;
-  char line[LINE_BUFFER_SIZE];
-  snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", pid, tid);
-  file = fopen(path, "rb");
-  if (file == NULL) {
-    ERR("%s: %s\n", path, strerror(errno));
-    goto error;
+static void worker_run(void *arg, int index) {
+  sampler_t *sampler = arg;
+  worker_scan(&sampler->workers[index]);
+}
+
+/**
+ * @brief ワーカーが担当するプロセスの走査
+ *
+ * PIDをワーカー数で割った余りがワーカー番号と一致するプロセスを担当する。
+ * 同じプロセスは常に同じワーカーが担当するため、fdキャッシュを専有できる。
+ *
+ * io_uringを使う場合は最後に残りを投入し、読み出せなかったタスクを詰める。
+ *
+ * @param[in,out] worker 走査するワーカー
+ */
+static void worker_scan(worker_t *worker) {
+  sampler_t *sampler = worker->sampler;
+  int proc_fd = dirfd(sampler->proc_dir);
+  int i;
+  worker->proc_num = 0;
+  worker->skipped = 0;
+  worker->opened = 0;
+  for (i = 0; i < sampler->pid_num; i++) {
+    char name[NAME_BUFFER_SIZE];
+    int pid = sampler->pids[i];
+    if (pid % sampler->worker_num != worker->index) {
+      continue;
+    }
+    snprintf(name, sizeof(name), "%d", pid);
+    read_thread(worker, proc_fd, pid, name);
   }
-  if (fgets(line, sizeof(line), file) == NULL) {
-    ERR("%s\n", strerror(errno));
-    goto error;
+  if (worker->uring != NULL) {
+    worker_flush_reads(worker);
+    worker_compact(worker);
   }
-  memset(proc, 0, sizeof(process_t));
-  proc->pid = pid;
-  strncpy(proc->pcomm, pcomm, sizeof(proc->pcomm));
-  proc->tid = tid;
-  result = parse_stat(line, proc);
-  error:
-  fclose(file);
-  return result;
+  fd_cache_sweep(worker->fds);
+  worker->fds->generation++;
+  worker_sort(worker);
 }
 
 /**
- * @brief statの情報をパースする
+ * @brief ワーカーが読みだしたタスクをTID昇順に並べる
  *
- * @param[in]  line statを読みだした内容
- * @param[out] proc 結果の書き込み先
- * @return 成功：SUCCESS / 失敗：FAILURE
+ * TIDとアリーナ上の位置の組を基数ソートする。
+ *
+ * @param[in,out] worker 対象のワーカー
  */
-static result_t parse_stat(char *line, process_t *proc) {
-  char *tmp;
-  int len;
-  int n;
-  line = strchr(line, '(') + 1;
-  tmp = strrchr(line, ')');
-  len = tmp - line;
-  if (len >= sizeof(proc->comm)) {
-    len = sizeof(proc->comm) - 1;
-  }
-  memcpy(proc->comm, line, len);
-  proc->comm[len] = 0;
-  line = tmp + 2;
-  n = sscanf(line,
-             "%c" // state
-             "%*d %*d %*d %*d %*d " // ppid pgid sid tty_nr tty_pgrp
-             "%*u %*u %*u %*u %*u " // flags min_flt cmin_flt maj_flt cmaj_flt
-             "%lu %lu %lu %lu " // utime stime cutime cstime
-             "%ld %ld " // priority nice
-             //"%ld " // num_threads
-             //"%lu %lu %lu %lu %lu " // itrealvalue starttime vsize rss rsslim
-             //"%lu %lu %lu " // start_code end_code start_stack
-             //"%lu %lu " // kstkesp kstkeip
-             //"%lu %lu %lu %lu %lu " // signal blocked sigignore sigcatch wchan
-             //"%lu %lu " // nswap cnswap
-             //"%ld %ld " // exit_signal processor
-             //"%lu %lu %lu " // rt_priority policy delayacct_blkio_ticks
-             //"%lu %ld " // guest_time cguest_time
-             ,
-             &proc->state,
-             &proc->utime,
-             &proc->stime,
-             &proc->cutime,
-             &proc->cstime,
-             &proc->priority,
-             &proc->nice
-  );
-  if (n != 7) {
-    return FAILURE;
+static void worker_sort(worker_t *worker) {
+  int i;
+  for (i = 0; i < worker->proc_num; i++) {
+    worker->order[i] = (uint64_t) (uint32_t) worker->procs[i].tid << 32 | (uint32_t) i;
   }
-  return SUCCESS;
+  worker->sorted = radix_sort(worker->order, worker->tmp, worker->proc_num);
+  worker->pos = 0;
 }
 
 /**
- * @brief 結果表示
+ * @brief キャッシュ済みのfdからのstatの読み出しをio_uringへ積む
  *
- * @param[in] before 時間的に前の値
- * @param[in] after  時間的に後の値
+ * 結果の書き込み先はアリーナ上に確保しておき、完了の回収時に埋める。
+ * fdが未キャッシュのタスク、間引きの対象となりうるアイドルなタスクは積まずに
+ * 同期的に読み出す。積んだ数がURING_BATCHに達していれば先に投入して回収する。
+ *
+ * @param[in,out] worker 読み出すワーカー
+ * @param[in]     pid    PID
+ * @param[in]     tid    TID
+ * @return 積んだ場合SUCCESS / 同期的に読み出す必要がある場合FAILURE
  */
-static void show_result(cpu_t *before, cpu_t *after) {
-  cputime_t diff;
-  int num = before->cpu_num;
-  get_diff(&before->times[num], &after->times[num], &diff);
-  uint64_t total  = get_total(&diff);
-  uint64_t load   = get_load(&diff);
-  uint64_t idle   = get_idle(&diff);
-  uint64_t iowait = get_iowait(&diff);
-  uint64_t system = get_system(&diff);
-  uint64_t user   = get_user(&diff);
-  uint64_t irq    = get_irq(&diff);
-  uint64_t guest  = get_guest(&diff);
-  if (total == 0) {
-    total = 1;
+static result_t worker_queue_stat(worker_t *worker, int pid, int tid) {
+  fd_cache_t *fds = worker->fds;
+  fd_entry_t *entry = fd_cache_find(fds, tid);
+  uring_read_t *task;
+  if (entry == NULL || (fds->adaptive > 0 && entry->idle >= fds->adaptive)) {
+    return FAILURE;
   }
-  float usage = (float) load / total * 100;
-  printf("%5.1f%% (T:%4lu I:%4lu IO:%4lu S:%4lu U:%4lu IRQ:%4lu G:%4lu)",
-         usage, total, idle, iowait, system, user, irq, guest);
-  if (num > 1) {
-    show_result_cpus(before, after);
+  if (worker->read_num == URING_BATCH) {
+    worker_flush_reads(worker);
+    if (worker->uring == NULL) {
+      return FAILURE;
+    }
   }
-  printf("\n");
-  show_result_thread(total, before, after);
+  task = &worker->reads[worker->read_num];
+  if (uring_prep_read(worker->uring, entry->fd, task->line, sizeof(task->line) - 1,
+                      (uint64_t) worker->read_num << 1) != SUCCESS) {
+    return FAILURE;
+  }
+  entry->seen = fds->generation;
+  task->sched_res = -1;
+  if (worker->sched || worker->runtime) {
+    entry = fd_cache_find(fds, SCHEDSTAT_KEY(tid));
+    if (entry != NULL
+        && uring_prep_read(worker->uring, entry->fd, task->sched_line,
+                           sizeof(task->sched_line) - 1,
+                           (uint64_t) worker->read_num << 1 | 1) == SUCCESS) {
+      entry->seen = fds->generation;
+      task->sched_res = 0;
+    }
+  }
+  worker_next_proc(worker);
+  task->proc = worker->proc_num++;
+  task->pid = pid;
+  task->tid = tid;
+  task->res = 0;
+  worker->read_num++;
+  return SUCCESS;
 }
 
 /**
- * @brief CPUコアごとの使用率の表示
+ * @brief io_uringへ積んだ読み出しを投入し、完了したものから結果を埋める
  *
- * @param[in] before 時間的に前の値
- * @param[in] after  時間的に後の値
+ * 完了の順序は不定のため、全て回収してから積んだ順に解釈する。
+ * 投入に失敗した場合は以降io_uringを使わず、積んでいた分は同期的に読みなおす。
+ *
+ * @param[in,out] worker 読み出すワーカー
  */
-static void show_result_cpus(cpu_t *before, cpu_t *after) {
-  cputime_t diff;
+static void worker_flush_reads(worker_t *worker) {
+  int proc_fd = dirfd(worker->sampler->proc_dir);
+  uint64_t user_data;
+  int res;
   int i;
-  int num = before->cpu_num;
-  uint64_t total;
-  uint64_t load;
-  for (i = 0; i < num; i++) {
-    get_diff(&before->times[i], &after->times[i], &diff);
-    total  = get_total(&diff);
-    load   = get_load(&diff);
-    if (total == 0) {
-      total = 1;
+  if (worker->read_num == 0) {
+    return;
+  }
+  if (uring_submit_wait(worker->uring) == SUCCESS) {
+    while (uring_reap(worker->uring, &user_data, &res)) {
+      uring_read_t *task = &worker->reads[user_data >> 1];
+      if (user_data & 1) {
+        task->sched_res = res;
+      } else {
+        task->res = res;
+      }
     }
-    printf("%5.1f%%", (float) load / total * 100);
+  } else {
+    delete_uring_t(worker->uring);
+    worker->uring = NULL;
+    for (i = 0; i < worker->read_num; i++) {
+      worker->reads[i].res = -1;
+      worker->reads[i].sched_res = -1;
+    }
+  }
+  for (i = 0; i < worker->read_num; i++) {
+    worker_complete_read(worker, &worker->reads[i], proc_fd);
   }
+  worker->read_num = 0;
 }
 
 /**
- * @brief スレッド情報を表示する
+ * @brief io_uringで読みだしたstatを解釈し、アリーナへ書き込む
  *
- * @param[in] total  カウンタの合計値
- * @param[in] before 時間的に前の値
- * @param[in] after  時間的に後の値
+ * 読み出しに失敗した場合やTIDが再利用されていた場合は、
+ * /proc/[pid]/task/[tid]として同期的に開きなおす。
+ * それでも読み出せなかったタスクはTIDを0とし、後でアリーナから除く。
+ *
+ * @param[in,out] worker  読み出したワーカー
+ * @param[in,out] task    読み出し結果
+ * @param[in]     proc_fd /procのファイルディスクリプタ
  */
-static void show_result_thread(uint64_t total, cpu_t *before, cpu_t *after) {
-  int i, j;
-  int num = after->proc_num;
-  int display;
-  process_t **list = xmalloc(sizeof(process_t*) * num);
-  for (i = 0, j = 0; i < num; i++) {
-    process_t *a = after->procs[i];
-    process_t *b = NULL;
-    list[i] = a;
-    a->load = a->utime + a->stime;
-    for (;j < before->proc_num && before->procs[j]->tid < a->tid; j++);
-    if (j < before->proc_num) {
-      b = before->procs[j];
-      if(a->tid == b->tid) {
-        a->load -= (b->utime + b->stime);
+static void worker_complete_read(worker_t *worker, uring_read_t *task, int proc_fd) {
+  process_t *proc = &worker->procs[task->proc];
+  fd_cache_t *fds = worker->fds;
+  fd_entry_t *entry;
+  char name[NAME_BUFFER_SIZE];
+  snprintf(name, sizeof(name), "%d/task/%d", task->pid, task->tid);
+  if (task->res > 0) {
+    task->line[task->res] = 0;
+    memset(proc, 0, sizeof(process_t));
+    proc->pid = task->pid;
+    proc->tid = task->tid;
+    entry = fd_cache_find(fds, task->tid);
+    if (parse_stat(task->line, proc, worker->sched) == SUCCESS
+        && entry != NULL && fd_cache_check(entry, proc->starttime) == SUCCESS) {
+      if (worker->sched || worker->runtime) {
+        if (task->sched_res > 0) {
+          task->sched_line[task->sched_res] = 0;
+        }
+        if (task->sched_res <= 0
+            || parse_schedstat_line(task->sched_line, proc, worker->runtime) != SUCCESS) {
+          read_tid_schedstat(worker, proc, proc_fd, name);
+        }
+        entry = fd_cache_find(fds, task->tid);
       }
+      fd_cache_record(fds, entry, proc->utime, proc->stime, proc);
+      return;
+    }
+    if (entry != NULL) {
+      fd_cache_remove(fds, entry);
     }
   }
-  qsort(list, num, sizeof(process_t*), comp_load);
-  display = num < DISPLAY_PROCESS_NUM ? num : DISPLAY_PROCESS_NUM;
-  printf("%d threads\n", num);
-  printf("  PID   TID  PR  NI S    CPU  CNT NAME             (COMMAND)\n");
+  if (read_tid_stat(worker, proc, proc_fd, task->pid, task->tid, name) != SUCCESS) {
+    proc->tid = 0;
+    worker->dropped++;
+  }
+}
+
+/**
+ * @brief io_uringで読み出せなかったタスクをアリーナから除く
+ *
+ * @param[in,out] worker 対象のワーカー
+ */
+static void worker_compact(worker_t *worker) {
+  int i;
+  int n = 0;
+  if (worker->dropped == 0) {
+    return;
+  }
+  for (i = 0; i < worker->proc_num; i++) {
+    if (worker->procs[i].tid != 0) {
+      worker->procs[n++] = worker->procs[i];
+    }
+  }
+  worker->proc_num = n;
+  worker->dropped = 0;
+}
+
+/**
+ * @brief アリーナの次のタスク情報を返す
+ *
+ * proc_numの位置が利用できるようにアリーナを拡張する。
+ *
+ * @param[in,out] worker 対象のワーカー
+ * @return proc_numの位置のタスク情報
+ */
+static process_t *worker_next_proc(worker_t *worker) {
+  if (worker->array_num == worker->proc_num) {
+    worker->array_num *= 2;
+    worker->procs = xrealloc(worker->procs, sizeof(process_t) * worker->array_num);
+    worker->order = xrealloc(worker->order, sizeof(uint64_t) * worker->array_num);
+    worker->tmp = xrealloc(worker->tmp, sizeof(uint64_t) * worker->array_num);
+  }
+  return &worker->procs[worker->proc_num];
+}
+
+/**
+ * @brief マージ中のワーカーの先頭タスクのTIDを返す
+ *
+ * @param[in] worker 対象のワーカー
+ * @return 先頭タスクのTID
+ */
+static int worker_head_tid(worker_t *worker) {
+  return (int) (worker->sorted[worker->pos] >> 32);
+}
+
+/**
+ * @brief マージ用ヒープの指定位置から下方向へ整列する
+ *
+ * @param[in,out] sampler 読み出しに使う構造体
+ * @param[in]     num     ヒープの要素数
+ * @param[in]     i       整列を開始する位置
+ */
+static void heap_down(sampler_t *sampler, int num, int i) {
+  int *heap = sampler->heap;
+  worker_t *workers = sampler->workers;
+  while (TRUE) {
+    int min = i;
+    int left = i * 2 + 1;
+    int right = left + 1;
+    int tmp;
+    if (left < num
+        && worker_head_tid(&workers[heap[left]]) < worker_head_tid(&workers[heap[min]])) {
+      min = left;
+    }
+    if (right < num
+        && worker_head_tid(&workers[heap[right]]) < worker_head_tid(&workers[heap[min]])) {
+      min = right;
+    }
+    if (min == i) {
+      return;
+    }
+    tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
+
+/**
+ * @brief ワーカーごとの結果をTID昇順にマージする
+ *
+ * 各ワーカーの結果はTID昇順に並んでいるため、
+ * ワーカー番号のヒープで先頭を比較するk-wayマージを行い、
+ * 結果の各配列へ順に書き込む。
+ *
+ * @param[in,out] sampler 読み出しに使う構造体
+ * @param[in]     num     マージするワーカー数
+ * @param[out]    cpu     結果の書き込み先
+ */
+static void merge_workers(sampler_t *sampler, int num, cpu_t *cpu) {
+  int i;
+  int n = 0;
+  for (i = 0; i < num; i++) {
+    if (sampler->workers[i].proc_num > 0) {
+      sampler->heap[n++] = i;
+    }
+  }
+  num = n;
+  for (i = num / 2 - 1; i >= 0; i--) {
+    heap_down(sampler, num, i);
+  }
+  cpu->proc_num = 0;
+  while (num > 0) {
+    worker_t *worker = &sampler->workers[sampler->heap[0]];
+    ensure_next_proc(cpu);
+    set_proc(cpu, cpu->proc_num, &worker->procs[(uint32_t) worker->sorted[worker->pos]]);
+    cpu->proc_num++;
+    worker->pos++;
+    if (worker->pos == worker->proc_num) {
+      sampler->heap[0] = sampler->heap[--num];
+    }
+    heap_down(sampler, num, 0);
+  }
+}
+
+/**
+ * @brief プロセス情報の読み出し
+ *
+ * /procはopenしたまま保持し、以降のファイルはすべて
+ * ディレクトリfdからの相対パスで開く。
+ * PIDの列挙のみ呼び出し元で行い、各プロセスの読み出しはワーカーで分担する。
+ *
+ * @param[in,out] sampler 読み出しに使う構造体
+ * @param[out] cpu 結果の書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t read_process(sampler_t *sampler, cpu_t *cpu) {
+  int i;
+  if (sampler->watch != NULL) {
+    if (read_process_watch(sampler->watch, sampler->proc_dir,
+                           &sampler->workers[0]) != SUCCESS) {
+      return FAILURE;
+    }
+    merge_workers(sampler, 1, cpu);
+    cpu->skipped = 0;
+    cpu->opened = sampler->watch->opened;
+    return SUCCESS;
+  }
+  sampler->pid_num = list_pids(sampler->proc_dir, &sampler->pids, &sampler->pid_array_num);
+  pool_run(sampler->pool);
+  merge_workers(sampler, sampler->worker_num, cpu);
+  cpu->skipped = 0;
+  cpu->opened = 0;
+  for (i = 0; i < sampler->worker_num; i++) {
+    cpu->skipped += sampler->workers[i].skipped;
+    cpu->opened += sampler->workers[i].opened;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief 指定PIDプロセス配下のスレッド情報の読み出し
+ *
+ * /proc/[pid]/taskをディレクトリfdとして開き、
+ * getdents64で直接スタック上のバッファへ読み出す。
+ * io_uringを使う場合、fdがキャッシュ済みのスレッドはまとめ読みへ回す。
+ *
+ * @param[in,out] worker  結果の書き込み先のワーカー
+ * @param[in]     proc_fd /procのファイルディスクリプタ
+ * @param[in]     pid     PID
+ * @param[in]     name    PIDのディレクトリ名
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t read_thread(worker_t *worker, int proc_fd, int pid, const char *name) {
+  char path[NAME_BUFFER_SIZE];
+  char dents[DENTS_BUFFER_SIZE];
+  ssize_t size;
+  int task_fd;
+  snprintf(path, sizeof(path), "%s/task", name);
+  task_fd = openat(proc_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (task_fd < 0) {
+    ERR("%s: %s\n", path, strerror(errno));
+    return FAILURE;
+  }
+  worker->opened++;
+  while ((size = getdents64(task_fd, dents, sizeof(dents))) > 0) {
+    ssize_t pos;
+    struct dirent64 *dent;
+    for (pos = 0; pos < size; pos += dent->d_reclen) {
+      dent = (struct dirent64 *) (dents + pos);
+      if(dent->d_name[0] >= '0' && dent->d_name[0] <= '9') {
+        int tid = atoi(dent->d_name);
+        process_t *process;
+        if (worker->uring != NULL && worker_queue_stat(worker, pid, tid) == SUCCESS) {
+          continue;
+        }
+        process = worker_next_proc(worker);
+        if (read_tid_stat(worker, process, task_fd, pid, tid, dent->d_name) == SUCCESS) {
+          worker->proc_num++;
+        }
+      }
+    }
+  }
+  close(task_fd);
+  return SUCCESS;
+}
+
+/**
+ * @brief 指定TIDのスレッド情報を読みだす
+ *
+ * ワーカーでschedstatの読み出しが有効な場合は、実行待ち時間も読み出す。
+ * schedstatが無い環境では実行待ち時間を0とする。
+ *
+ * @param[in,out] worker  読み出すワーカー
+ * @param[out]    proc    結果の書き込み先
+ * @param[in]     task_fd /proc/[pid]/taskのファイルディスクリプタ
+ * @param[in]     pid     PID
+ * @param[in]     tid     TID
+ * @param[in]     name    TIDのディレクトリ名
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t read_tid_stat(worker_t *worker, process_t *proc, int task_fd,
+                              int pid, int tid, const char *name) {
+  fd_cache_t *fds = worker->fds;
+  fd_entry_t *entry = fd_cache_find(fds, tid);
+  char line[LINE_BUFFER_SIZE];
+  if (entry != NULL && fd_cache_reuse(fds, entry, tid)) {
+    *proc = *(process_t *) fd_entry_data(entry);
+    entry->seen = fds->generation;
+    worker->skipped++;
+    return SUCCESS;
+  }
+  if (read_stat_cached(worker, tid, task_fd, name, "/stat", line, sizeof(line)) != SUCCESS) {
+    return FAILURE;
+  }
+  memset(proc, 0, sizeof(process_t));
+  proc->pid = pid;
+  proc->tid = tid;
+  if (parse_stat(line, proc, worker->sched) != SUCCESS) {
+    return FAILURE;
+  }
+  entry = fd_cache_find(fds, tid);
+  if (entry != NULL && fd_cache_check(entry, proc->starttime) != SUCCESS) {
+    // TIDが再利用されていたため開きなおす
+    fd_cache_remove(fds, entry);
+    return read_tid_stat(worker, proc, task_fd, pid, tid, name);
+  }
+  if (worker->sched || worker->runtime) {
+    read_tid_schedstat(worker, proc, task_fd, name);
+    entry = fd_cache_find(fds, tid);
+  }
+  if (entry != NULL) {
+    fd_cache_record(fds, entry, proc->utime, proc->stime, proc);
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief 指定TIDの実行待ち時間を読みだす
+ *
+ * schedstatが無い環境では実行待ち時間を0とし、実行時間をCPU時間とする場合はCPU時間も0とする。
+ *
+ * @param[in,out] worker 読み出すワーカー
+ * @param[in,out] proc   結果の書き込み先、tidは設定済みであること
+ * @param[in]     dir_fd 基準となるディレクトリのファイルディスクリプタ
+ * @param[in]     name   TIDのディレクトリ名
+ */
+static void read_tid_schedstat(worker_t *worker, process_t *proc, int dir_fd, const char *name) {
+  char line[SCHEDSTAT_BUFFER_SIZE];
+  if (read_stat_cached(worker, SCHEDSTAT_KEY(proc->tid), dir_fd, name, "/schedstat",
+                       line, sizeof(line)) != SUCCESS
+      || parse_schedstat_line(line, proc, worker->runtime) != SUCCESS) {
+    proc->run_delay = 0;
+    if (worker->runtime) {
+      proc->utime = 0;
+      proc->stime = 0;
+    }
+  }
+}
+
+/**
+ * @brief schedstatの内容をパースする
+ *
+ * 実行時間をCPU時間とする場合は、statのユーザ時間・システム時間を置き換える。
+ * schedstatはユーザ時間とシステム時間を区別しないため、システム時間は0とする。
+ *
+ * @param[in]  line    schedstatを読みだした内容
+ * @param[out] proc    結果の書き込み先、statは読み出し済みであること
+ * @param[in]  runtime 実行時間をCPU時間とするか
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t parse_schedstat_line(char *line, process_t *proc, int runtime) {
+  uint64_t run_time;
+  if (parse_schedstat(line, &run_time, &proc->run_delay) != SUCCESS) {
+    return FAILURE;
+  }
+  if (runtime) {
+    proc->utime = run_time;
+    proc->stime = 0;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief statの情報をパースする
+ *
+ * @param[in]  line  statを読みだした内容
+ * @param[out] proc  結果の書き込み先
+ * @param[in]  sched 最後に実行したCPUも読み出すか
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t parse_stat(char *line, process_t *proc, int sched) {
+  task_stat_t stat;
+  if ((sched ? parse_task_stat_sched : parse_task_stat)(line, NULL, 0, &stat) != SUCCESS) {
+    return FAILURE;
+  }
+  proc->state = stat.state;
+  proc->utime = stat.utime;
+  proc->stime = stat.stime;
+  proc->cutime = stat.cutime;
+  proc->cstime = stat.cstime;
+  proc->priority = stat.priority;
+  proc->nice = stat.nice;
+  proc->starttime = stat.starttime;
+  proc->processor = stat.processor;
+  return SUCCESS;
+}
+
+/**
+ * @brief 計測結果を履歴ファイルへ追記する
+ *
+ * 表示で選択した負荷上位のスレッドを記録する。
+ * 負荷を[ns]で扱う場合も、履歴にはクロックティックへ換算して記録する。
+ *
+ * @param[in,out] history 履歴ファイル
+ * @param[in]     before  時間的に前の値
+ * @param[in]     after   時間的に後の値、負荷と上位選択は計算済みであること
+ * @param[in]     ticker  実測した間隔を持つタイマー
+ */
+static void record_history(history_t *history, cpu_t *before, cpu_t *after, ticker_t *ticker) {
+  history_record_t *record = history_begin(history);
+  history_task_t *tasks = history_tasks(history, record);
+  int num = after->top_num < HISTORY_TASKS ? after->top_num : HISTORY_TASKS;
+  name_t name;
+  int i;
+  record->elapsed = ticker->elapsed;
+  record->proc_num = after->proc_num;
+  record->task_num = num;
+  get_diff(&before->total, &after->total, &record->total);
+  cpu_matrix_diff(before->cores, after->cores, history_cores(history, record));
+  for (i = 0; i < num; i++) {
+    int k = after->order[i];
+    tasks[i].pid = after->pid[k];
+    tasks[i].tid = after->tid[k];
+    tasks[i].load = after->arena->runtime ? after->load[k] / get_tick_ns() : after->load[k];
+    thread_name(after, k, name);
+    memcpy(tasks[i].comm, name, HISTORY_NAME_LEN);
+  }
+  history_commit(history, record);
+}
+
+/**
+ * @brief 結果表示
+ *
+ * @param[in] before 時間的に前の値
+ * @param[in] after  時間的に後の値
+ * @param[in] rank   上位選択の条件
+ * @param[in] ticker 実測した間隔を持つタイマー
+ */
+static void show_result(cpu_t *before, cpu_t *after, const rank_t *rank, ticker_t *ticker) {
+  cputime_t diff;
+  int num = before->cpu_num;
+  get_diff(&before->total, &after->total, &diff);
+  uint64_t total  = get_total(&diff);
+  uint64_t load   = get_load(&diff);
+  uint64_t idle   = get_idle(&diff);
+  uint64_t iowait = get_iowait(&diff);
+  uint64_t system = get_system(&diff);
+  uint64_t user   = get_user(&diff);
+  uint64_t irq    = get_irq(&diff);
+  uint64_t guest  = get_guest(&diff);
+  if (total == 0) {
+    total = 1;
+  }
+  float usage = (float) load / total * 100;
+  printf("%5.1f%% (T:%4lu I:%4lu IO:%4lu S:%4lu U:%4lu IRQ:%4lu G:%4lu)",
+         usage, total, idle, iowait, system, user, irq, guest);
+  show_ticker(ticker);
+  if (num > 1) {
+    show_result_cpus(before, after);
+  }
+  if (ticker->skipped > 0) {
+    printf(" skipped:%d", ticker->skipped);
+  }
+  printf("\n");
+  total = get_task_total(after, ticker, total);
+  if (after->arena->rollup != NULL) {
+    show_result_rollup(total, before, after, rank);
+  } else {
+    show_result_thread(total, before, after, rank);
+  }
+}
+
+/**
+ * @brief CPUコアごとの使用率の表示
+ *
+ * @param[in] before 時間的に前の値
+ * @param[in] after  時間的に後の値
+ */
+static void show_result_cpus(cpu_t *before, cpu_t *after) {
+  cpu_usage_t *usage = after->arena->usage;
+  int i;
+  cpu_matrix_usage(before->cores, after->cores, usage);
+  for (i = 0; i < usage->num; i++) {
+    if (!usage->online[i]) {
+      printf("   off");
+      continue;
+    }
+    printf("%5.1f%%", usage->usage[i]);
+  }
+}
+
+/**
+ * @brief 負荷計算に使う列の参照を取得する
+ *
+ * キーにはTIDを使う。
+ *
+ * @param[in]  cpu     対象の構造体
+ * @param[out] columns 列の参照の書き込み先
+ */
+static void get_columns(cpu_t *cpu, task_columns_t *columns) {
+  columns->num = cpu->proc_num;
+  columns->id = cpu->tid;
+  columns->utime = cpu->utime;
+  columns->stime = cpu->stime;
+  columns->starttime = cpu->starttime;
+  columns->load = cpu->load;
+  columns->pid = cpu->pid;
+  columns->nice = cpu->nice;
+  columns->comm = NULL;
+  columns->comm_size = 0;
+  columns->delay = cpu->delay;
+}
+
+/**
+ * @brief 前回からの負荷を求める
+ *
+ * 前回・今回ともTID昇順に並んでいるため、マージ結合で対応付ける。
+ * TIDが一致しても起動時刻が異なる場合は再利用された別のスレッドとみなす。
+ * カウンタが減少していた場合は負荷を0とする。
+ *
+ * @param[in]     before 時間的に前の値
+ * @param[in,out] after  時間的に後の値、loadを書き込む
+ */
+static void calc_load(cpu_t *before, cpu_t *after) {
+  task_columns_t prev;
+  task_columns_t next;
+  get_columns(before, &prev);
+  get_columns(after, &next);
+  task_delta(&prev, &next);
+  if (after->arena->sched) {
+    calc_sched(before, after);
+  }
+}
+
+/**
+ * @brief 前回からの実行待ち時間と実行CPUの変化を求める
+ *
+ * calc_load同様にマージ結合で前回のスレッドと対応付ける。
+ * 実行CPUは計測時点の値のみを観測するため、変化の回数は実際のマイグレーション回数の下限となる。
+ * 新たに現れたスレッドは実行待ち時間の累計をそのまま差分とし、変化の回数を0とする。
+ *
+ * @param[in]     before 時間的に前の値
+ * @param[in,out] after  時間的に後の値、delayとmigrationsを書き込む
+ */
+static void calc_sched(cpu_t *before, cpu_t *after) {
+  int i, j;
+  for (i = 0, j = 0; i < after->proc_num; i++) {
+    after->delay[i] = after->run_delay[i];
+    after->migrations[i] = 0;
+    for (;j < before->proc_num && before->tid[j] < after->tid[i]; j++);
+    if (j < before->proc_num && before->tid[j] == after->tid[i]
+        && before->starttime[j] == after->starttime[i]) {
+      after->delay[i] = after->run_delay[i] > before->run_delay[j]
+          ? after->run_delay[i] - before->run_delay[j] : 0;
+      after->migrations[i] = before->migrations[j]
+          + (before->processor[j] >= 0 && before->processor[j] != after->processor[i]);
+    }
+  }
+}
+
+/**
+ * @brief 条件に一致する上位のインデックスをorderに降順で格納する
+ *
+ * 件数を指定した場合は要素数nのヒープで選択するため、全体をソートする必要はない。
+ * 名前で絞り込む場合のみ、全ての行のプロセス名を引く。
+ *
+ * @param[in,out] cpu  対象の構造体
+ * @param[in]     rank 上位選択の条件
+ * @return 選択した件数
+ */
+static int select_top(cpu_t *cpu, const rank_t *rank) {
+  task_columns_t columns;
+  int i;
+  get_columns(cpu, &columns);
+  if (rank->comm != NULL) {
+    for (i = 0; i < cpu->proc_num; i++) {
+      process_name(cpu, i, cpu->arena->filter[i]);
+    }
+    columns.comm = (const char *) cpu->arena->filter;
+    columns.comm_size = sizeof(name_t);
+  }
+  return task_rank(&columns, rank, cpu->order);
+}
+
+/**
+ * @brief スレッド情報を表示する
+ *
+ * 負荷を[ns]で扱う場合、CNTの代わりに前回からの実行時間[ms]を表示する。
+ *
+ * @param[in] total  カウンタの合計値、負荷を[ns]で扱う場合は[ns]の時間
+ * @param[in] before 時間的に前の値
+ * @param[in] after  時間的に後の値
+ * @param[in] rank   上位選択の条件
+ */
+static void show_result_thread(uint64_t total, cpu_t *before, cpu_t *after, const rank_t *rank) {
+  name_t comm;
+  name_t pcomm;
+  int i;
+  int num = after->proc_num;
+  int display;
+  calc_load(before, after);
+  display = select_top(after, rank);
+  after->top_num = display;
+  printf("%d threads", num);
+  if (after->skipped > 0) {
+    printf(" (approximate, %d idle not read)", after->skipped);
+  }
+  printf("\n");
+  printf("  PID   TID  PR  NI S    CPU %s ", after->arena->runtime ? "TIME(ms)" : " CNT");
+  if (after->arena->sched) {
+    printf("LCPU  MIG RUNQ(ms) ");
+  }
+  printf("NAME             (COMMAND)\n");
   for (i = 0; i < display; i++) {
+    int k = after->order[i];
     char prio[4];
-    if (list[i]->priority > 999 || list[i]->priority < -99) {
+    if (after->priority[k] > 999 || after->priority[k] < -99) {
       snprintf(prio, sizeof(prio), " rt");
     } else {
-      snprintf(prio, sizeof(prio), "%3ld", list[i]->priority);
+      snprintf(prio, sizeof(prio), "%3ld", after->priority[k]);
     }
-    printf("%5d %5d %s %3ld %c %5.1f%% %4lu %-16s (%s)\n",
-           list[i]->pid,
-           list[i]->tid,
+    printf("%5d %5d %s %3ld %c %5.1f%% ",
+           after->pid[k],
+           after->tid[k],
            prio,
-           list[i]->nice,
-           list[i]->state,
-           (float) list[i]->load / total * 100,
-           list[i]->load,
-           list[i]->comm,
-           list[i]->pcomm);
+           after->nice[k],
+           after->state[k],
+           (float) after->load[k] / total * 100);
+    show_load(after->arena, after->load[k]);
+    if (after->arena->sched) {
+      printf("%4d %4d %8.1f ",
+             after->processor[k],
+             after->migrations[k],
+             (double) after->delay[k] / 1000000);
+    }
+    thread_name(after, k, comm);
+    process_name(after, k, pcomm);
+    printf("%-16s (%s)\n", comm, pcomm);
   }
-  free(list);
   printf("\n");
 }
 
+/**
+ * @brief タスクの負荷と同じ単位のCPU全体の時間を求める
+ *
+ * 負荷を[ns]で扱う場合、クロックティック単位の合計値では短い間隔で誤差が大きいため、
+ * 実測した間隔とオンラインのコアの個数の積とする。
+ *
+ * @param[in] after  時間的に後の値
+ * @param[in] ticker 実測した間隔を持つタイマー
+ * @param[in] total  CPU全体のカウンタの合計値
+ * @return 負荷を[ns]で扱う場合は[ns]の時間、それ以外はtotal
+ */
+static uint64_t get_task_total(cpu_t *after, ticker_t *ticker, uint64_t total) {
+  if (!after->arena->runtime) {
+    return total;
+  }
+  return ticker->elapsed * (after->cores->online_num > 0 ? after->cores->online_num : 1);
+}
+
+/**
+ * @brief 負荷の列を表示する
+ *
+ * クロックティックの場合は回数、[ns]の場合は[ms]として表示する。
+ *
+ * @param[in] arena 対象のアリーナ
+ * @param[in] load  負荷
+ */
+static void show_load(arena_t *arena, uint64_t load) {
+  if (arena->runtime) {
+    printf("%8.2f ", (double) load / 1000000);
+  } else {
+    printf("%4lu ", load);
+  }
+}
+
+/**
+ * @brief プロセスごとの集計を初期化する
+ *
+ * @return プロセスごとの集計
+ */
+static rollup_t *new_rollup_t(void) {
+  rollup_t *rollup = xmalloc(sizeof(rollup_t));
+  memset(rollup, 0, sizeof(rollup_t));
+  rollup_grow(rollup, INIT_PROCS);
+  return rollup;
+}
+
+/**
+ * @brief プロセスごとの集計を開放する
+ *
+ * @param[in] rollup 開放する集計
+ */
+static void delete_rollup_t(rollup_t *rollup) {
+  if (rollup == NULL) {
+    return;
+  }
+  free(rollup->slot);
+  free(rollup->next);
+  free(rollup->head);
+  free(rollup->row);
+  free(rollup->pid);
+  free(rollup->threads);
+  free(rollup->load);
+  free(rollup->utime);
+  free(rollup->stime);
+  free(rollup->nice);
+  free(rollup->comm);
+  free(rollup->order);
+  free(rollup);
+}
+
+/**
+ * @brief 各配列をnum個以上の長さに拡張する
+ *
+ * 集計は毎回やりなおすため、内容は引き継がない。
+ *
+ * @param[in,out] rollup 対象の集計
+ * @param[in]     num    必要な長さ
+ */
+static void rollup_grow(rollup_t *rollup, int num) {
+  if (num <= rollup->array_num) {
+    return;
+  }
+  if (rollup->array_num == 0) {
+    rollup->array_num = num;
+  }
+  while (rollup->array_num < num) {
+    rollup->array_num *= 2;
+  }
+  num = rollup->array_num;
+  rollup->slot = xrealloc(rollup->slot, sizeof(int) * num);
+  rollup->next = xrealloc(rollup->next, sizeof(int) * num);
+  rollup->head = xrealloc(rollup->head, sizeof(int) * num);
+  rollup->row = xrealloc(rollup->row, sizeof(int) * num);
+  rollup->pid = xrealloc(rollup->pid, sizeof(int) * num);
+  rollup->threads = xrealloc(rollup->threads, sizeof(int) * num);
+  rollup->load = xrealloc(rollup->load, sizeof(uint64_t) * num);
+  rollup->utime = xrealloc(rollup->utime, sizeof(uint64_t) * num);
+  rollup->stime = xrealloc(rollup->stime, sizeof(uint64_t) * num);
+  rollup->nice = xrealloc(rollup->nice, sizeof(int64_t) * num);
+  rollup->comm = xrealloc(rollup->comm, sizeof(name_t) * num);
+  rollup->order = xrealloc(rollup->order, sizeof(int) * num);
+}
+
+/**
+ * @brief TIDの行を二分探索する
+ *
+ * @param[in] cpu 対象の構造体、TID昇順に並んでいること
+ * @param[in] tid 探すTID
+ * @return 行、見つからない場合-1
+ */
+static int find_thread_row(cpu_t *cpu, int tid) {
+  int low = 0;
+  int high = cpu->proc_num - 1;
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    if (cpu->tid[mid] == tid) {
+      return mid;
+    }
+    if (cpu->tid[mid] < tid) {
+      low = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief 計算済みのスレッドの負荷をプロセスごとに集計する
+ *
+ * 同じ走査で読み出したスレッドの行のみを使うため、/procを再度走査する必要はない。
+ * 各スレッドはメインスレッド(TIDがPIDと等しい行)のグループへ集計する。
+ * 走査中に終了してメインスレッドの行が無い場合は、最初に現れたスレッドを代表とする。
+ *
+ * @param[in,out] rollup 集計の書き込み先
+ * @param[in]     cpu    負荷を計算済みの値
+ */
+static void rollup_threads(rollup_t *rollup, cpu_t *cpu) {
+  int i;
+  int num = 0;
+  rollup_grow(rollup, cpu->proc_num);
+  for (i = 0; i < cpu->proc_num; i++) {
+    rollup->slot[i] = -1;
+  }
+  for (i = 0; i < cpu->proc_num; i++) {
+    int leader = cpu->tid[i] == cpu->pid[i] ? i : find_thread_row(cpu, cpu->pid[i]);
+    int g;
+    if (leader < 0) {
+      leader = i;
+      for (g = 0; g < num && rollup->pid[g] != cpu->pid[i]; g++);
+      if (g < num) {
+        leader = rollup->row[g];
+      }
+    }
+    g = rollup->slot[leader];
+    if (g < 0) {
+      g = rollup->slot[leader] = num++;
+      rollup->head[g] = -1;
+      rollup->row[g] = leader;
+      rollup->pid[g] = cpu->pid[i];
+      rollup->threads[g] = 0;
+      rollup->load[g] = 0;
+      rollup->utime[g] = 0;
+      rollup->stime[g] = 0;
+      rollup->nice[g] = cpu->nice[leader];
+    }
+    rollup->slot[i] = g;
+    rollup->next[i] = rollup->head[g];
+    rollup->head[g] = i;
+    rollup->threads[g]++;
+    rollup->load[g] += cpu->load[i];
+    rollup->utime[g] += cpu->utime[i];
+    rollup->stime[g] += cpu->stime[i];
+  }
+  rollup->num = num;
+}
+
+/**
+ * @brief グループ内で負荷のあるスレッドを負荷降順に最大n件選ぶ
+ *
+ * @param[in]  rollup 集計
+ * @param[in]  cpu    負荷を計算済みの値
+ * @param[in]  group  グループ
+ * @param[out] rows   選んだ行の書き込み先、n個の領域
+ * @param[in]  n      選ぶ件数
+ * @return 選んだ件数
+ */
+static int rollup_top_threads(rollup_t *rollup, cpu_t *cpu, int group, int *rows, int n) {
+  int num = 0;
+  int i;
+  for (i = rollup->head[group]; i >= 0; i = rollup->next[i]) {
+    int j;
+    if (cpu->load[i] == 0 || (num == n && cpu->load[i] <= cpu->load[rows[n - 1]])) {
+      continue;
+    }
+    j = num < n ? num++ : n - 1;
+    for (; j > 0 && cpu->load[rows[j - 1]] < cpu->load[i]; j--) {
+      rows[j] = rows[j - 1];
+    }
+    rows[j] = i;
+  }
+  return num;
+}
+
+/**
+ * @brief スレッドの負荷をプロセスごとに集計して表示する
+ *
+ * プロセスの行の下に、負荷のあるスレッドを最大ROLLUP_THREAD_NUM件表示する。
+ * 履歴ファイルにはスレッドを記録するため、スレッドの上位選択も行う。
+ * 名前で絞り込む場合のみ、select_topで引いたプロセス名を集計に写す。
+ *
+ * @param[in] total  カウンタの合計値、負荷を[ns]で扱う場合は[ns]の時間
+ * @param[in] before 時間的に前の値
+ * @param[in] after  時間的に後の値
+ * @param[in] rank   上位選択の条件
+ */
+static void show_result_rollup(uint64_t total, cpu_t *before, cpu_t *after, const rank_t *rank) {
+  rollup_t *rollup = after->arena->rollup;
+  task_columns_t columns;
+  int rows[ROLLUP_THREAD_NUM];
+  name_t name;
+  int display;
+  int i, j;
+  calc_load(before, after);
+  after->top_num = select_top(after, rank);
+  rollup_threads(rollup, after);
+  columns.num = rollup->num;
+  columns.id = rollup->pid;
+  columns.utime = rollup->utime;
+  columns.stime = rollup->stime;
+  columns.starttime = NULL;
+  columns.load = rollup->load;
+  columns.pid = rollup->pid;
+  columns.nice = rollup->nice;
+  columns.comm = NULL;
+  columns.comm_size = 0;
+  if (rank->comm != NULL) {
+    for (i = 0; i < rollup->num; i++) {
+      memcpy(rollup->comm[i], after->arena->filter[rollup->row[i]], sizeof(name_t));
+    }
+    columns.comm = (const char *) rollup->comm;
+    columns.comm_size = sizeof(name_t);
+  }
+  columns.delay = NULL;
+  display = task_rank(&columns, rank, rollup->order);
+  printf("%d processes (%d threads)", rollup->num, after->proc_num);
+  if (after->skipped > 0) {
+    printf(" (approximate, %d idle not read)", after->skipped);
+  }
+  printf("\n");
+  printf("  PID   THR  PR  NI S    CPU %s COMMAND\n", after->arena->runtime ? "TIME(ms)" : " CNT");
+  for (i = 0; i < display; i++) {
+    int g = rollup->order[i];
+    int k = rollup->row[g];
+    int num;
+    char prio[4];
+    if (after->priority[k] > 999 || after->priority[k] < -99) {
+      snprintf(prio, sizeof(prio), " rt");
+    } else {
+      snprintf(prio, sizeof(prio), "%3ld", after->priority[k]);
+    }
+    process_name(after, k, name);
+    printf("%5d %5d %s %3ld %c %5.1f%% ",
+           rollup->pid[g],
+           rollup->threads[g],
+           prio,
+           rollup->nice[g],
+           after->state[k],
+           (float) rollup->load[g] / total * 100);
+    show_load(after->arena, rollup->load[g]);
+    printf("%s\n", name);
+    if (rollup->threads[g] <= 1) {
+      continue;
+    }
+    num = rollup_top_threads(rollup, after, g, rows, ROLLUP_THREAD_NUM);
+    for (j = 0; j < num; j++) {
+      k = rows[j];
+      thread_name(after, k, name);
+      printf("      +%5d         %c %5.1f%% ",
+             after->tid[k],
+             after->state[k],
+             (float) after->load[k] / total * 100);
+      show_load(after->arena, after->load[k]);
+      printf("%s\n", name);
+    }
+  }
+  printf("\n");
+}
+
+/**
+ * @brief 計測結果を機械可読な形式でバッファへ書き込む
+ *
+ * 表示と同じく負荷の計算と上位選択を行い、formatの内容を1レコードとする。
+ * コアが1つのみの場合、各コアのCPU時間はパースしないため全体の使用率を使う。
+ *
+ * @param[out]    format  書き込み先
+ * @param[in]     kind    FORMAT_JSONまたはFORMAT_BINARY
+ * @param[in]     before  時間的に前の値
+ * @param[in,out] after   時間的に後の値
+ * @param[in]     rank    上位選択の条件
+ * @param[in]     ticker  実測した間隔を持つタイマー
+ * @param[in]     dropped 直前に破棄した表示の回数
+ */
+static void put_result(format_t *format, int kind, cpu_t *before, cpu_t *after,
+                       const rank_t *rank, ticker_t *ticker, int dropped) {
+  cputime_t diff;
+  cpu_usage_t *usage = after->arena->usage;
+  get_diff(&before->total, &after->total, &diff);
+  if (usage->num > 1) {
+    cpu_matrix_usage(before->cores, after->cores, usage);
+  } else {
+    usage->usage[0] = get_permille(get_load(&diff), get_total(&diff)) / 10.0f;
+    usage->online[0] = TRUE;
+  }
+  calc_load(before, after);
+  after->top_num = select_top(after, rank);
+  format_reset(format);
+  if (kind == FORMAT_JSON) {
+    put_result_json(format, &diff, after, ticker, dropped);
+  } else {
+    put_result_binary(format, &diff, after, ticker, dropped);
+  }
+}
+
+/**
+ * @brief 計測結果をJSON Lines形式の1行として書き込む
+ *
+ * @param[out] format  書き込み先
+ * @param[in]  diff    CPU全体のCPU時間の差分
+ * @param[in]  after   負荷と上位選択を計算済みの値
+ * @param[in]  ticker  実測した間隔を持つタイマー
+ * @param[in]  dropped 直前に破棄した表示の回数
+ */
+static void put_result_json(format_t *format, cputime_t *diff, cpu_t *after,
+                            ticker_t *ticker, int dropped) {
+  cpu_usage_t *usage = after->arena->usage;
+  uint64_t total = get_total(diff);
+  uint64_t task_total = get_task_total(after, ticker, total);
+  name_t comm;
+  name_t pcomm;
+  int i;
+  format_str(format, "{\"time\":");
+  format_uint(format, get_realtime());
+  format_str(format, ",\"elapsed\":");
+  format_uint(format, ticker->elapsed);
+  format_str(format, ",\"skipped\":");
+  format_uint(format, ticker->skipped);
+  format_str(format, ",\"dropped\":");
+  format_uint(format, dropped);
+  format_str(format, ",\"usage\":");
+  format_permille(format, get_permille(get_load(diff), total));
+  format_str(format, ",\"total\":");
+  format_uint(format, total);
+  format_str(format, ",\"idle\":");
+  format_uint(format, get_idle(diff));
+  format_str(format, ",\"iowait\":");
+  format_uint(format, get_iowait(diff));
+  format_str(format, ",\"system\":");
+  format_uint(format, get_system(diff));
+  format_str(format, ",\"user\":");
+  format_uint(format, get_user(diff));
+  format_str(format, ",\"irq\":");
+  format_uint(format, get_irq(diff));
+  format_str(format, ",\"guest\":");
+  format_uint(format, get_guest(diff));
+  format_str(format, ",\"cpus\":[");
+  for (i = 0; i < usage->num; i++) {
+    if (i != 0) {
+      format_str(format, ",");
+    }
+    if (!usage->online[i]) {
+      format_str(format, "null");
+      continue;
+    }
+    format_permille(format, (uint16_t) (usage->usage[i] * 10 + 0.5f));
+  }
+  format_str(format, "],\"num\":");
+  format_uint(format, after->proc_num);
+  format_str(format, ",\"approx\":");
+  format_uint(format, after->skipped);
+  if (after->arena->runtime) {
+    format_str(format, ",\"unit\":\"ns\"");
+  }
+  format_str(format, ",\"tasks\":[");
+  for (i = 0; i < after->top_num; i++) {
+    int k = after->order[i];
+    if (i != 0) {
+      format_str(format, ",");
+    }
+    format_str(format, "{\"pid\":");
+    format_int(format, after->pid[k]);
+    format_str(format, ",\"tid\":");
+    format_int(format, after->tid[k]);
+    format_str(format, ",\"pr\":");
+    format_int(format, after->priority[k]);
+    format_str(format, ",\"ni\":");
+    format_int(format, after->nice[k]);
+    format_str(format, ",\"state\":");
+    format_json_str(format, &after->state[k], 1);
+    format_str(format, ",\"usage\":");
+    format_permille(format, get_permille(after->load[k], task_total));
+    format_str(format, ",\"load\":");
+    format_uint(format, after->load[k]);
+    thread_name(after, k, comm);
+    process_name(after, k, pcomm);
+    format_str(format, ",\"comm\":");
+    format_json_str(format, comm, PR_NAME_LEN);
+    format_str(format, ",\"pcomm\":");
+    format_json_str(format, pcomm, PR_NAME_LEN);
+    format_str(format, "}");
+  }
+  format_str(format, "]}\n");
+}
+
+/**
+ * @brief 計測結果を長さ付きバイナリ形式の1レコードとして書き込む
+ *
+ * 形式はformat.hのbinary_record_tを参照。
+ *
+ * @param[out] format  書き込み先
+ * @param[in]  diff    CPU全体のCPU時間の差分
+ * @param[in]  after   負荷と上位選択を計算済みの値
+ * @param[in]  ticker  実測した間隔を持つタイマー
+ * @param[in]  dropped 直前に破棄した表示の回数
+ */
+static void put_result_binary(format_t *format, cputime_t *diff, cpu_t *after,
+                              ticker_t *ticker, int dropped) {
+  cpu_usage_t *usage = after->arena->usage;
+  uint64_t total = get_task_total(after, ticker, get_total(diff));
+  size_t cores_size = (sizeof(uint16_t) * usage->num + 7) & ~(size_t) 7;
+  size_t size = sizeof(binary_record_t) + cores_size
+      + sizeof(binary_task_t) * after->top_num;
+  binary_record_t *record = format_reserve(format, size);
+  uint16_t *cores = (uint16_t *) (record + 1);
+  binary_task_t *tasks = (binary_task_t *) ((char *) cores + cores_size);
+  name_t comm;
+  name_t pcomm;
+  int i;
+  memset(record, 0, size);
+  record->size = size;
+  record->version = BINARY_VERSION;
+  record->flags = BINARY_FLAG_THREADS | (after->arena->runtime ? BINARY_FLAG_NS : 0);
+  record->cpu_num = usage->num;
+  record->task_num = after->top_num;
+  record->proc_num = after->proc_num;
+  record->approx = after->skipped;
+  record->skipped = ticker->skipped;
+  record->dropped = dropped;
+  record->time = get_realtime();
+  record->elapsed = ticker->elapsed;
+  record->total = *diff;
+  for (i = 0; i < usage->num; i++) {
+    cores[i] = usage->online[i] ? (uint16_t) (usage->usage[i] * 10 + 0.5f) : BINARY_CORE_OFFLINE;
+  }
+  for (i = 0; i < after->top_num; i++) {
+    int k = after->order[i];
+    tasks[i].pid = after->pid[k];
+    tasks[i].tid = after->tid[k];
+    tasks[i].priority = after->priority[k];
+    tasks[i].nice = after->nice[k];
+    tasks[i].load = after->load[k];
+    tasks[i].usage = get_permille(after->load[k], total);
+    tasks[i].state = after->state[k];
+    thread_name(after, k, comm);
+    process_name(after, k, pcomm);
+    memcpy(tasks[i].comm, comm, BINARY_NAME_LEN);
+    memcpy(tasks[i].pcomm, pcomm, BINARY_NAME_LEN);
+  }
+}
+
+/**
+ * @brief 共有メモリから読みだしたスナップショットを表示する
+ *
+ * スナップショットのスレッドは公開する側で選択済みのため、先頭から順に表示する。
+ * 負荷が[ns]で記録されている場合は、CNTの代わりに実行時間[ms]を表示する。
+ *
+ * @param[in] record 読みだしたスナップショット
+ * @param[in] n      表示するスレッド数、0の場合全て
+ */
+static void show_snapshot(const binary_record_t *record, int n) {
+  const uint16_t *cores = binary_cores(record);
+  const binary_task_t *tasks = binary_tasks(record);
+  cputime_t diff = record->total;
+  uint64_t total  = get_total(&diff);
+  uint64_t load   = get_load(&diff);
+  int display = n > 0 && n < record->task_num ? n : record->task_num;
+  int i;
+  if (total == 0) {
+    total = 1;
+  }
+  printf("%5.1f%% (T:%4lu I:%4lu IO:%4lu S:%4lu U:%4lu IRQ:%4lu G:%4lu)",
+         (float) load / total * 100, total, get_idle(&diff), get_iowait(&diff),
+         get_system(&diff), get_user(&diff), get_irq(&diff), get_guest(&diff));
+  printf(" %7.3fs", (double) record->elapsed / 1000000000);
+  for (i = 0; record->cpu_num > 1 && i < record->cpu_num; i++) {
+    if (cores[i] == BINARY_CORE_OFFLINE) {
+      printf("   off");
+      continue;
+    }
+    printf("%5.1f%%", cores[i] / 10.0f);
+  }
+  if (record->skipped > 0) {
+    printf(" skipped:%u", record->skipped);
+  }
+  printf("\n");
+  printf("%u threads", record->proc_num);
+  if (record->approx > 0) {
+    printf(" (approximate, %u idle not read)", record->approx);
+  }
+  printf("\n");
+  printf("  PID   TID  PR  NI S    CPU %s NAME             (COMMAND)\n",
+         record->flags & BINARY_FLAG_NS ? "TIME(ms)" : " CNT");
+  for (i = 0; i < display; i++) {
+    const binary_task_t *task = &tasks[i];
+    char prio[4];
+    if (task->priority > 999 || task->priority < -99) {
+      snprintf(prio, sizeof(prio), " rt");
+    } else {
+      snprintf(prio, sizeof(prio), "%3d", task->priority);
+    }
+    printf("%5d %5d %s %3d %c %5.1f%% ",
+           task->pid,
+           task->tid,
+           prio,
+           task->nice,
+           task->state,
+           task->usage / 10.0f);
+    if (record->flags & BINARY_FLAG_NS) {
+      printf("%8.2f ", (double) task->load / 1000000);
+    } else {
+      printf("%4lu ", task->load);
+    }
+    printf("%-16.16s (%.16s)\n", task->comm, task->pcomm);
+  }
+  printf("\n");
+}
+
+/**
+ * @brief 共有メモリに公開されたスナップショットを表示し続ける
+ *
+ * 自身では/procを読まず、公開する側の計測ごとに表示する。
+ * SIGINT/SIGTERMを受けると後始末をして終了する。
+ *
+ * @param[in] name   共有メモリの名前
+ * @param[in] n      表示するスレッド数、0の場合全て
+ * @param[in] screen 全画面表示する場合TRUE
+ * @return 終了コード
+ */
+static int run_client(const char *name, int n, int screen) {
+  int result = EXIT_FAILURE;
+  output_t *output = NULL;
+  format_t *format = NULL;
+  const binary_record_t *record;
+  uint64_t seq = 0;
+  shm_t *shm = load_shm_t(name);
+  if (shm == NULL) {
+    fprintf(stderr, "%s: cannot open shared memory\n", name);
+    return EXIT_FAILURE;
+  }
+  output = new_output_t(STDOUT_FILENO, DEFAULT_OUTPUT_FRAMES);
+  if (output == NULL) {
+    goto error;
+  }
+  output_redirect_stdout(output);
+  if (screen) {
+    output_set_screen(output);
+  }
+  format = new_format_t();
+  shm_catch_signals();
+  while ((record = shm_wait(shm, format, &seq)) != NULL) {
+    show_snapshot(record, n);
+    output_commit(output);
+  }
+  result = EXIT_SUCCESS;
+  error:
+  delete_output_t(output);
+  delete_format_t(format);
+  delete_shm_t(shm);
+  return result;
+}
+
+#ifdef BENCH
+/**
+ * ベンチマークで生成するスレッド数
+ */
+#define BENCH_THREADS 100000
+/**
+ * ベンチマークの繰り返し回数
+ */
+#define BENCH_LOOPS 20
+
+/**
+ * 従来の1件ずつ確保していたタスク情報
+ */
+typedef struct bench_process_t {
+  process_t proc;    /**< タスク情報 */
+  uint64_t load;     /**< 負荷の合計 */
+} bench_process_t;
+
+/**
+ * @brief キャッシュミス回数のカウンタを開く
+ *
+ * @return カウンタのファイルディスクリプタ、利用できない場合-1
+ */
+static int bench_open_counter(void) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * @brief カウンタの現在値を返す
+ *
+ * @param[in] fd カウンタのファイルディスクリプタ
+ * @return カウンタの値、利用できない場合0
+ */
+static uint64_t bench_read_counter(int fd) {
+  uint64_t value = 0;
+  if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+    return 0;
+  }
+  return value;
+}
+
+/**
+ * @brief 合成したタスク情報を返す
+ *
+ * 5%のスレッドは前回と今回で入れ替わるようにする。
+ *
+ * @param[in]  i     タスクの番号
+ * @param[in]  after 今回の値か
+ * @param[out] proc  書き込み先
+ */
+static void bench_make_proc(int i, int after, process_t *proc) {
+  memset(proc, 0, sizeof(process_t));
+  proc->tid = i * 2 + 1 + (after && i % 20 == 0);
+  proc->pid = proc->tid - proc->tid % 20 + 1;
+  proc->state = 'S';
+  proc->utime = (uint64_t) i * 7 + (after ? (i * 2654435761U) % 500 : 0);
+  proc->stime = (uint64_t) i * 3 + (after ? i % 13 : 0);
+  proc->priority = 20;
+  proc->starttime = i;
+}
+
+/**
+ * @brief 負荷降順ソート用比較関数(従来のポインタ配列用)
+ *
+ * @param[in] a 比較対象
+ * @param[in] b 比較対象
+ * @return a > b の時負、a == b の時0、a < b の時正
+ */
+static int bench_comp_load(const void *a, const void *b) {
+  return (*(bench_process_t**)b)->load - (*(bench_process_t**)a)->load;
+}
+
+/**
+ * @brief 従来のポインタ配列による負荷の計算
+ *
+ * @param[in]     before 前回の値
+ * @param[in,out] after  今回の値
+ * @param[out]    list   負荷降順のポインタ配列
+ * @param[in]     num    タスク数
+ */
+static void bench_calc_load_ptr(bench_process_t **before, bench_process_t **after,
+                                bench_process_t **list, int num) {
+  int i, j;
+  for (i = 0, j = 0; i < num; i++) {
+    bench_process_t *a = after[i];
+    list[i] = a;
+    a->load = a->proc.utime + a->proc.stime;
+    for (;j < num && before[j]->proc.tid < a->proc.tid; j++);
+    if (j < num && before[j]->proc.tid == a->proc.tid) {
+      a->load -= (before[j]->proc.utime + before[j]->proc.stime);
+    }
+  }
+  qsort(list, num, sizeof(bench_process_t*), bench_comp_load);
+}
+
+/**
+ * @brief 合成したスレッドで負荷の計算と上位の選択の速度を比較する
+ *
+ * 従来の構造では、ソートでポインタの並びと確保した順が一致しなくなった状態を
+ * 確保する順をシャッフルすることで再現する。
+ *
+ * @param[in] num タスク数
+ */
+static void bench_layout(int num) {
+  bench_process_t **ptrs[2];
+  bench_process_t **list = xmalloc(sizeof(bench_process_t*) * num);
+  int *shuffle = xmalloc(sizeof(int) * num);
+  arena_t *arena = new_arena_t(1);
+  int counter = bench_open_counter();
+  uint64_t start;
+  uint64_t misses;
+  uint64_t ptr_ns, ptr_misses;
+  uint64_t soa_ns, soa_misses;
+  int match = TRUE;
+  int display = 0;
+  rank_t rank;
+  int i, k;
+  rank_init(&rank);
+  for (i = 0; i < num; i++) {
+    shuffle[i] = i;
+  }
+  for (i = num - 1; i > 0; i--) {
+    int j = rand() % (i + 1);
+    int tmp = shuffle[i];
+    shuffle[i] = shuffle[j];
+    shuffle[j] = tmp;
+  }
+  for (k = 0; k < 2; k++) {
+    cpu_t *cpu = &arena->cpus[k];
+    ptrs[k] = xmalloc(sizeof(bench_process_t*) * num);
+    for (i = 0; i < num; i++) {
+      ptrs[k][shuffle[i]] = xmalloc(sizeof(bench_process_t));
+    }
+    cpu->proc_num = 0;
+    for (i = 0; i < num; i++) {
+      bench_make_proc(i, k, &ptrs[k][i]->proc);
+      ensure_next_proc(cpu);
+      set_proc(cpu, cpu->proc_num++, &ptrs[k][i]->proc);
+    }
+  }
+  start = get_monotonic();
+  misses = bench_read_counter(counter);
+  for (i = 0; i < BENCH_LOOPS; i++) {
+    bench_calc_load_ptr(ptrs[0], ptrs[1], list, num);
+  }
+  ptr_misses = bench_read_counter(counter) - misses;
+  ptr_ns = get_monotonic() - start;
+  start = get_monotonic();
+  misses = bench_read_counter(counter);
+  for (i = 0; i < BENCH_LOOPS; i++) {
+    calc_load(&arena->cpus[0], &arena->cpus[1]);
+    display = select_top(&arena->cpus[1], &rank);
+  }
+  soa_misses = bench_read_counter(counter) - misses;
+  soa_ns = get_monotonic() - start;
+  for (i = 0; i < display; i++) {
+    if (list[i]->load != arena->cpus[1].load[arena->cpus[1].order[i]]) {
+      match = FALSE;
+    }
+  }
+  printf("%d threads: pointer %8.1f us/tick  soa %8.1f us/tick  x%.1f %s\n",
+         num,
+         (double) ptr_ns / BENCH_LOOPS / 1000,
+         (double) soa_ns / BENCH_LOOPS / 1000,
+         (double) ptr_ns / (soa_ns ? soa_ns : 1),
+         match ? "" : "MISMATCH");
+  if (counter >= 0) {
+    printf("cache misses: pointer %10.0f /tick  soa %10.0f /tick\n",
+           (double) ptr_misses / BENCH_LOOPS,
+           (double) soa_misses / BENCH_LOOPS);
+    close(counter);
+  } else {
+    printf("cache misses: n/a (perf_event_open is not available)\n");
+  }
+  for (k = 0; k < 2; k++) {
+    for (i = 0; i < num; i++) {
+      free(ptrs[k][i]);
+    }
+    free(ptrs[k]);
+  }
+  free(list);
+  free(shuffle);
+  delete_arena_t(arena);
+}
+
+int main(int argc, char **argv) {
+  bench_layout(BENCH_THREADS);
+  return EXIT_SUCCESS;
+}
+#else
 int main(int argc, char **argv) {
   int result = EXIT_FAILURE;
+  arena_t *arena = NULL;
   cpu_t *after = NULL;
   cpu_t *before = NULL;
-  int num = sysconf(_SC_NPROCESSORS_ONLN);
-  after = new_cpu_t(num);
-  before = new_cpu_t(num);
-  if (read_stat(before) != SUCCESS
-      || read_process(before) != SUCCESS) {
+  sampler_t *sampler = NULL;
+  ticker_t ticker;
+  int interval = DEFAULT_INTERVAL_MS;
+  int event = FALSE;
+  int worker_num = 1;
+  int adaptive = 0;
+  int self = FALSE;
+  overhead_t overhead;
+  history_t *history = NULL;
+  output_t *output = NULL;
+  format_t *format = NULL;
+  int kind = FORMAT_TEXT;
+  int rollup = FALSE;
+  int sched = FALSE;
+  int runtime = FALSE;
+  int uring = FALSE;
+  rank_t rank;
+  const char *history_path = NULL;
+  int history_records = DEFAULT_HISTORY_RECORDS;
+  const char *publish_name = NULL;
+  const char *client_name = NULL;
+  shm_t *shm = NULL;
+  int screen = FALSE;
+  int top_given = FALSE;
+  int num;
+  const struct option options[] = {
+      {"proc-root", required_argument, NULL, 'R'},
+      {"history-records", required_argument, NULL, 'N'},
+      {"format", required_argument, NULL, 'F'},
+      {"sort", required_argument, NULL, 'k'},
+      {"pid", required_argument, NULL, 'p'},
+      {"comm", required_argument, NULL, 'c'},
+      {"sched", no_argument, NULL, 'D'},
+      {"ns", no_argument, NULL, 'T'},
+      {"io-uring", no_argument, NULL, 'U'},
+      {"publish", required_argument, NULL, 'W'},
+      {"shm", required_argument, NULL, 'M'},
+      {"screen", no_argument, NULL, 'S'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  rank_init(&rank);
+  while ((opt = getopt_long(argc, argv, "ej:a:i:n:sPR:H:", options, NULL)) != -1) {
+    switch (opt) {
+      case 'e':
+        event = TRUE;
+        break;
+      case 'j':
+        worker_num = atoi(optarg);
+        if (worker_num < 1 || worker_num > MAX_WORKERS) {
+          fprintf(stderr, "-j: 1 to %d\n", MAX_WORKERS);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'i':
+        interval = atoi(optarg);
+        if (interval < MIN_INTERVAL_MS) {
+          fprintf(stderr, "-i: %d or more\n", MIN_INTERVAL_MS);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 's':
+        self = TRUE;
+        break;
+      case 'R':
+        set_proc_root(optarg);
+        break;
+      case 'H':
+        history_path = optarg;
+        break;
+      case 'P':
+        rollup = TRUE;
+        break;
+      case 'D':
+        sched = TRUE;
+        break;
+      case 'T':
+        runtime = TRUE;
+        break;
+      case 'U':
+        uring = TRUE;
+        break;
+      case 'W':
+        publish_name = optarg;
+        break;
+      case 'M':
+        client_name = optarg;
+        break;
+      case 'S':
+        screen = TRUE;
+        break;
+      case 'n':
+        top_given = TRUE;
+        rank.num = atoi(optarg);
+        if (rank.num < 0) {
+          fprintf(stderr, "-n: 0 or more\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'k':
+        rank.key = parse_rank_key(optarg);
+        if (rank.key < 0) {
+          fprintf(stderr, "--sort: cpu, total, utime, stime, nice or delay\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'p':
+        if (rank_add_pids(&rank, optarg) != SUCCESS) {
+          fprintf(stderr, "--pid: comma separated pids, up to %d\n", RANK_PIDS);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'c':
+        rank.comm = optarg;
+        break;
+      case 'F':
+        kind = parse_format(optarg);
+        if (kind < 0) {
+          fprintf(stderr, "--format: text, json or binary\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'N':
+        history_records = atoi(optarg);
+        if (history_records < 1) {
+          fprintf(stderr, "--history-records: 1 or more\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'a':
+        adaptive = atoi(optarg);
+        if (adaptive < 1) {
+          fprintf(stderr, "-a: 1 or more\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-e] [-j workers] [-P] [-a ticks] [-i msec] [-s] [-H file [--history-records N]] [-n num] [--sort key] [--pid list] [--comm name] [--sched] [--ns] [--io-uring] [--format text|json|binary] [--screen] [--publish name] [--shm name] [--proc-root dir]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (rank.key == RANK_KEY_DELAY && (!sched || rollup)) {
+    fprintf(stderr, "--sort delay: requires --sched, not available with -P\n");
+    return EXIT_FAILURE;
+  }
+  if (client_name != NULL) {
+    return run_client(client_name, rank.num, screen);
+  }
+  if (screen && kind != FORMAT_TEXT) {
+    fprintf(stderr, "--screen: not available with --format\n");
+    return EXIT_FAILURE;
+  }
+  if (publish_name != NULL) {
+    if (rollup || self || screen || kind != FORMAT_TEXT || history_path != NULL) {
+      fprintf(stderr, "--publish: not available with -P, -s, -H, --screen or --format\n");
+      return EXIT_FAILURE;
+    }
+    if (!top_given) {
+      rank.num = 0;
+    }
+  }
+  sampler = new_sampler_t(event, worker_num, adaptive, sched, runtime, uring);
+  if (sampler == NULL) {
+    goto error;
+  }
+  num = stat_sampler_count_cpus(sampler->stat);
+  if (num < 0) {
+    goto error;
+  }
+  if (history_path != NULL) {
+    history = new_history_t(history_path, num, history_records, HISTORY_FLAG_THREADS);
+    if (history == NULL) {
+      fprintf(stderr, "%s: cannot open history\n", history_path);
+      goto error;
+    }
+  }
+  output = new_output_t(STDOUT_FILENO, DEFAULT_OUTPUT_FRAMES);
+  if (output == NULL) {
+    goto error;
+  }
+  output_redirect_stdout(output);
+  if (screen) {
+    output_set_screen(output);
+  }
+  if (kind != FORMAT_TEXT) {
+    output_set_annotate(output, FALSE);
+    format = new_format_t();
+  }
+  if (publish_name != NULL) {
+    shm = new_shm_t(publish_name);
+    if (shm == NULL) {
+      fprintf(stderr, "%s: cannot open shared memory\n", publish_name);
+      goto error;
+    }
+    format = new_format_t();
+  }
+  arena = new_arena_t(num);
+  arena->sched = sched;
+  arena->runtime = runtime;
+  if (rollup) {
+    arena->rollup = new_rollup_t();
+  }
+  arena->names = new_name_cache_t();
+  if (arena->names == NULL) {
     goto error;
   }
+  before = &arena->cpus[arena->current ^ 1];
+  after = &arena->cpus[arena->current];
+  if (read_stat(sampler, after) != SUCCESS
+      || read_process(sampler, after) != SUCCESS) {
+    goto error;
+  }
+  arena_flip(arena, &before, &after);
+  overhead_start(&overhead);
+  ticker_start(&ticker, interval);
   while (TRUE) {
-    sleep(5);
-    if (read_stat(after) != SUCCESS
-        || read_process(after) != SUCCESS) {
+    ticker_wait(&ticker);
+    overhead_begin(&overhead);
+    if (read_stat(sampler, after) != SUCCESS
+        || read_process(sampler, after) != SUCCESS) {
       goto error;
     }
-    show_result(before, after);
-    SWAP(before, after);
+    overhead_end(&overhead);
+    if (shm != NULL) {
+      put_result(format, FORMAT_BINARY, before, after, &rank, &ticker, 0);
+      if (shm_publish(shm, format->buf, format->len) != SUCCESS) {
+        goto error;
+      }
+    } else if (kind == FORMAT_TEXT) {
+      show_result(before, after, &rank, &ticker);
+      if (self) {
+        show_overhead(&overhead, after->opened, after->proc_num);
+      }
+      output_commit(output);
+    } else {
+      put_result(format, kind, before, after, &rank, &ticker, output_dropped(output));
+      output_put(output, format->buf, format->len);
+      output_commit(output);
+    }
+    if (history != NULL) {
+      record_history(history, before, after, &ticker);
+    }
+    name_cache_sweep(arena->names);
+    arena_flip(arena, &before, &after);
   }
   result = EXIT_SUCCESS;
   error:
-  delete_cpu_t(before);
-  delete_cpu_t(after);
+  delete_output_t(output);
+  delete_format_t(format);
+  delete_arena_t(arena);
+  delete_sampler_t(sampler);
+  delete_history_t(history);
+  delete_shm_t(shm);
   return result;
 }
+#endif
@@ -0,0 +1,2187 @@
+/**
+ * @file cpuusage.c
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief CPU使用率調査コマンドの共通処理
+ *
+ * cpus/cpu/cpup/cputから共通に使われる処理をまとめたライブラリ
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <pthread.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "cpuusage.h"
+
+/**
+ * /proc/stat読み出しバッファの初期サイズ
+ */
+#define STAT_BUFFER_SIZE 4096
+/**
+ * CPU全体の行のみを読み出す場合のバッファサイズ
+ */
+#define LINE_BUFFER_SIZE 1024
+/**
+ * 基数ソートの1パスあたりのビット数
+ */
+#define RADIX_BITS 8
+/**
+ * 基数ソートの1パスあたりの区分数
+ */
+#define RADIX_SIZE (1 << RADIX_BITS)
+/**
+ * タスクのstatで区切り位置を調べるフィールド数(state〜starttime)
+ */
+#define TASK_STAT_FIELDS 20
+/**
+ * タスクのstatでprocessorまで区切り位置を調べるフィールド数
+ */
+#define TASK_STAT_SCHED_FIELDS 37
+
+/**
+ * /proc配下の相対パス名バッファのサイズ
+ */
+#define NAME_BUFFER_SIZE 64
+/**
+ * fdキャッシュのテーブルサイズの初期値
+ */
+#define INIT_FD_CACHE 1024
+/**
+ * fdキャッシュで保持するfdの上限の最大値
+ */
+#define FD_CACHE_MAX 1048576
+/**
+ * fdキャッシュ以外のために残しておくfdの数
+ */
+#define FD_RESERVE 64
+/**
+ * 使用率計算のSIMDのレーン数
+ */
+#define USAGE_LANES 4
+
+#if defined(__AVX2__)
+/**
+ * 1回で区切りを調べるバイト数
+ */
+#define SCAN_WIDTH 32
+/**
+ * マスクの1バイトあたりのビット数
+ */
+#define SCAN_BITS 1
+typedef uint32_t scan_mask_t;
+#elif defined(__SSE2__)
+#define SCAN_WIDTH 16
+#define SCAN_BITS 1
+typedef uint32_t scan_mask_t;
+#elif defined(__ARM_NEON)
+#define SCAN_WIDTH 16
+#define SCAN_BITS 4
+typedef uint64_t scan_mask_t;
+#endif
+
+/**
+ * 使用率計算に使う64bit整数のベクタ
+ */
+typedef uint64_t lane_u64_t __attribute__((vector_size(USAGE_LANES * sizeof(uint64_t))));
+/**
+ * 使用率計算に使う単精度浮動小数点数のベクタ
+ */
+typedef int64_t lane_s64_t __attribute__((vector_size(USAGE_LANES * sizeof(int64_t))));
+typedef int32_t lane_s32_t __attribute__((vector_size(USAGE_LANES * sizeof(int32_t))));
+typedef float lane_f32_t __attribute__((vector_size(USAGE_LANES * sizeof(float))));
+
+/**
+ * /proc/stat読み出し用構造体
+ *
+ * /proc/statはopenしたまま保持し、サンプリングごとにpreadで先頭から読みなおす。
+ * バッファも使い回すため、定常状態ではメモリ確保を行わない。
+ */
+struct stat_sampler_t {
+  int stat_fd;       /**< /proc/statのファイルディスクリプタ */
+  char *buf;         /**< 読み出しバッファ */
+  size_t buf_size;   /**< 読み出しバッファのサイズ */
+};
+
+/**
+ * 上位選択の比較に使う情報
+ */
+typedef struct rank_context_t {
+  const task_columns_t *tasks; /**< 対象のタスク */
+  int key;                     /**< RANK_KEY_* */
+} rank_context_t;
+
+/**
+ * 上位選択の比較関数
+ */
+typedef int (*comp_task_t)(const void *a, const void *b, void *arg);
+
+#if FEATURE_TASKS
+/**
+ * ワーカースレッド
+ */
+typedef struct pool_worker_t {
+  pool_t *pool;       /**< 所属する集合 */
+  int index;          /**< ワーカー番号 */
+  pthread_t thread;   /**< スレッド */
+} pool_worker_t;
+
+/**
+ * 走査を分担するワーカースレッドの集合
+ *
+ * 0番は呼び出し元スレッドで実行し、1番以降のスレッドは開始と完了の同期で待ち合わせる。
+ */
+struct pool_t {
+  int num;            /**< ワーカー数 */
+  pool_func_t func;   /**< ワーカーで実行する処理 */
+  void *arg;          /**< 処理に渡す引数 */
+  int quit;           /**< ワーカーの終了要求 */
+  pool_worker_t *workers; /**< 1番以降のワーカー */
+  pthread_barrier_t start; /**< 開始の同期 */
+  pthread_barrier_t done;  /**< 完了の同期 */
+};
+#endif
+
+/**
+ * procファイルシステムとして読み出すディレクトリ
+ */
+static const char *proc_root = DEFAULT_PROC_ROOT;
+
+static result_t stat_sampler_read_head(stat_sampler_t *sampler, cputime_t *time);
+#if FEATURE_TASKS
+static inline uint64_t rank_value(const rank_context_t *ctx, int i);
+static inline int comp_task_load(const void *a, const void *b, void *arg);
+static inline int comp_task_rank(const void *a, const void *b, void *arg);
+static inline void task_heap_up(const rank_context_t *ctx, comp_task_t comp, int *heap, int i);
+static inline void task_heap_down(const rank_context_t *ctx, comp_task_t comp, int *heap, int num, int i);
+static int rank_match(const task_columns_t *tasks, const rank_t *rank, int i);
+static inline fd_entry_t *fd_cache_at(fd_cache_t *cache, uint32_t i);
+static uint32_t fd_cache_hash(fd_cache_t *cache, uint64_t key);
+static void *pool_main(void *arg);
+#endif
+
+/**
+ * @brief malloc結果がNULLだった場合にexitする
+ *
+ * @param[in] size 確保サイズ
+ * @return  確保された領域へのポインタ
+ */
+void *xmalloc(size_t size) {
+  void *p = malloc(size);
+  if (p == NULL) {
+    ERR("%s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/**
+ * @brief realloc結果がNULLだった場合にexitする
+ *
+ * @param[in] ptr  再確保する領域
+ * @param[in] size 確保サイズ
+ * @return 確保された領域へのポインタ
+ */
+void *xrealloc(void *ptr, size_t size) {
+  void *p = realloc(ptr, size);
+  if (p == NULL) {
+    ERR("%s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/**
+ * cputime_tのindex番目のフィールドを参照する
+ *
+ * FEATURE_FIELDSに含まれないフィールドは定数0とし、集計から除く。
+ */
+#define FIELD(time, name, index) (FEATURE_FIELDS > (index) ? (time)->name : 0)
+
+/**
+ * @brief カウンタの合計を返す
+ *
+ * @param[in] time cputime_t構造体
+ * @return カウンタの合計値
+ */
+uint64_t get_total(cputime_t *time) {
+  return time->user + time->nice + time->system
+      + time->idle + FIELD(time, iowait, 4) + FIELD(time, irq, 5) + FIELD(time, softirq, 6)
+      + FIELD(time, steal, 7) + FIELD(time, guest, 8) + FIELD(time, guest_nice, 9);
+}
+
+/**
+ * @brief 負荷のカウンタの合計を返す
+ *
+ * @param[in] time cputime_t構造体
+ * @return 負荷のカウンタの合計値
+ */
+uint64_t get_load(cputime_t *time) {
+  return time->user + time->nice + time->system
+      + FIELD(time, irq, 5) + FIELD(time, softirq, 6)
+      + FIELD(time, steal, 7) + FIELD(time, guest, 8) + FIELD(time, guest_nice, 9);
+}
+
+/**
+ * @brief アイドルのカウンタの合計を返す
+ *
+ * @param[in] time cputime_t構造体
+ * @return アイドルのカウンタの合計値
+ */
+uint64_t get_idle(cputime_t *time) {
+  return time->idle + FIELD(time, iowait, 4);
+}
+
+/**
+ * @brief I/O待ちのカウンタの合計を返す
+ *
+ * @param[in] time cputime_t構造体
+ * @return I/O待ちのカウンタの合計値
+ */
+uint64_t get_iowait(cputime_t *time) {
+  return FIELD(time, iowait, 4);
+}
+
+/**
+ * @brief systemのカウンタの合計を返す
+ *
+ * @param[in] time cputime_t構造体
+ * @return systemのカウンタの合計値
+ */
+uint64_t get_system(cputime_t *time) {
+  return time->system;
+}
+
+/**
+ * @brief userのカウンタの合計を返す
+ *
+ * @param[in] time cputime_t構造体
+ * @return userのカウンタの合計値
+ */
+uint64_t get_user(cputime_t *time) {
+  return time->user + time->nice;
+}
+
+/**
+ * @brief 割り込みのカウンタの合計を返す
+ *
+ * @param[in] time cputime_t構造体
+ * @return 割り込みのカウンタの合計値
+ */
+uint64_t get_irq(cputime_t *time) {
+  return FIELD(time, irq, 5) + FIELD(time, softirq, 6);
+}
+
+/**
+ * @brief ゲストのカウンタの合計を返す
+ *
+ * @param[in] time cputime_t構造体
+ * @return ゲストのカウンタの合計値
+ */
+uint64_t get_guest(cputime_t *time) {
+  return FIELD(time, guest, 8) + FIELD(time, guest_nice, 9);
+}
+
+/**
+ * @brief cputime_t間の差分を取る
+ *
+ * @param[in] before 時間的に前の値
+ * @param[in] after 時間的に後の値
+ * @param[out] diff 差分の格納先
+ */
+void get_diff(cputime_t *before, cputime_t *after, cputime_t *diff) {
+  // 負の値の場合は0とする
+#define DIFF(x, index) {diff->x = FIELD(after, x, index) > FIELD(before, x, index) \
+    ? after->x - before->x : 0;}
+  DIFF(user, 0);
+  DIFF(nice, 1);
+  DIFF(system, 2);
+  DIFF(idle, 3);
+  DIFF(iowait, 4);
+  DIFF(irq, 5);
+  DIFF(softirq, 6);
+  DIFF(steal, 7);
+  DIFF(guest, 8);
+  DIFF(guest_nice, 9);
+#undef DIFF
+}
+
+/**
+ * @brief procファイルシステムとして読み出すディレクトリを設定する
+ *
+ * 記録した/procのツリーを読み出す場合に使う。
+ * 以降に作成するstat_sampler_tと、get_proc_root()を参照する走査に影響する。
+ *
+ * @param[in] root ディレクトリ、設定中は呼び出し側で保持すること
+ */
+void set_proc_root(const char *root) {
+  proc_root = root;
+}
+
+/**
+ * @brief procファイルシステムとして読み出すディレクトリを返す
+ *
+ * @return ディレクトリ
+ */
+const char *get_proc_root(void) {
+  return proc_root;
+}
+
+/**
+ * @brief 実際の/procを読み出す設定か
+ *
+ * @return 実際の/procの場合TRUE
+ */
+int is_default_proc_root(void) {
+  return strcmp(proc_root, DEFAULT_PROC_ROOT) == 0;
+}
+
+/**
+ * @brief スナップショットの初期化を行う
+ *
+ * @param[in] num CPUの個数
+ * @return スナップショット
+ */
+snapshot_t *new_snapshot_t(int num) {
+  snapshot_t *snapshot;
+  snapshot = xmalloc(sizeof(snapshot_t));
+  snapshot->num = num;
+  snapshot->times = xmalloc((num + 1) * sizeof(cputime_t));
+  memset(snapshot->times, 0, (num + 1) * sizeof(cputime_t));
+  return snapshot;
+}
+
+/**
+ * @brief スナップショットの開放を行う
+ *
+ * @param[in] snapshot 開放するスナップショット
+ */
+void delete_snapshot_t(snapshot_t *snapshot) {
+  if (snapshot == NULL) {
+    return;
+  }
+  free(snapshot->times);
+  free(snapshot);
+}
+
+/**
+ * @brief スナップショット間の差分を取る
+ *
+ * @param[in]  before 時間的に前の値
+ * @param[in]  after  時間的に後の値
+ * @param[out] delta  差分の格納先、CPUの個数はbeforeと同じであること
+ */
+void snapshot_delta(snapshot_t *before, snapshot_t *after, snapshot_t *delta) {
+  int i;
+  for (i = 0; i <= before->num; i++) {
+    get_diff(&before->times[i], &after->times[i], &delta->times[i]);
+  }
+}
+
+#if FEATURE_CORES
+/**
+ * @brief 列優先の行列を確保する
+ *
+ * @param[in] num CPUの個数
+ * @return 行列
+ */
+cpu_matrix_t *new_cpu_matrix_t(int num) {
+  cpu_matrix_t *matrix = xmalloc(sizeof(cpu_matrix_t));
+  matrix->num = num;
+  matrix->stride = (num + USAGE_LANES - 1) / USAGE_LANES * USAGE_LANES;
+  matrix->counters = xmalloc(sizeof(uint64_t) * CPUTIME_FIELDS * matrix->stride);
+  memset(matrix->counters, 0, sizeof(uint64_t) * CPUTIME_FIELDS * matrix->stride);
+  matrix->online = xmalloc(matrix->stride);
+  memset(matrix->online, 0, matrix->stride);
+  matrix->online_num = 0;
+  return matrix;
+}
+
+/**
+ * @brief 列優先の行列を開放する
+ *
+ * @param[in] matrix 開放する行列
+ */
+void delete_cpu_matrix_t(cpu_matrix_t *matrix) {
+  if (matrix == NULL) {
+    return;
+  }
+  free(matrix->counters);
+  free(matrix->online);
+  free(matrix);
+}
+
+/**
+ * @brief 各コアのCPU時間を列優先の行列へ格納する
+ *
+ * 全てのコアをオンラインとして扱う。
+ *
+ * @param[out] matrix 格納先
+ * @param[in]  times  各コアのCPU時間、matrix->num個
+ */
+void cpu_matrix_store(cpu_matrix_t *matrix, const cputime_t *times) {
+  int stride = matrix->stride;
+  int i, f;
+  for (i = 0; i < matrix->num; i++) {
+    const uint64_t *row = (const uint64_t *) &times[i];
+    for (f = 0; f < CPUTIME_FIELDS; f++) {
+      matrix->counters[f * stride + i] = row[f];
+    }
+    matrix->online[i] = TRUE;
+  }
+  matrix->online_num = matrix->num;
+}
+
+/**
+ * @brief 列優先の行列から各コアのCPU時間の差分を求める
+ *
+ * 差分はget_diff同様、カウンタが減少した場合0とする。
+ * 前後どちらかでオフラインだったコアの差分は0とする。
+ *
+ * @param[in]  before 時間的に前の値
+ * @param[in]  after  時間的に後の値
+ * @param[out] diff   各コアの差分の書き込み先、after->num個
+ */
+void cpu_matrix_diff(const cpu_matrix_t *before, const cpu_matrix_t *after, cputime_t *diff) {
+  int stride = after->stride;
+  int i, f;
+  for (i = 0; i < after->num; i++) {
+    uint64_t *row = (uint64_t *) &diff[i];
+    if (!before->online[i] || !after->online[i]) {
+      memset(row, 0, sizeof(cputime_t));
+      continue;
+    }
+    for (f = 0; f < CPUTIME_FIELDS; f++) {
+      uint64_t b = before->counters[f * stride + i];
+      uint64_t a = after->counters[f * stride + i];
+      row[f] = a > b ? a - b : 0;
+    }
+  }
+}
+
+/**
+ * @brief USAGE_LANESコア分の1フィールドの差分を求める
+ *
+ * カウンタが減少した場合はget_diff同様0とする。
+ * 差分が2^63未満であれば、符号ビットで減少を判定できる。
+ *
+ * @param[in]  before 時間的に前の値の位置
+ * @param[in]  after  時間的に後の値の位置
+ * @param[out] diff   差分の書き込み先
+ */
+static inline void lane_diff(const uint64_t *before, const uint64_t *after, lane_u64_t *diff) {
+  lane_u64_t b;
+  lane_u64_t a;
+  memcpy(&b, before, sizeof(b));
+  memcpy(&a, after, sizeof(a));
+  *diff = a - b;
+  *diff &= ~(lane_u64_t) ((lane_s64_t) *diff >> 63);
+}
+
+/**
+ * @brief USAGE_LANESコア分の使用率を計算する
+ *
+ * USAGE_LANESコアをベクタとして、フィールドごとの差分、全時間、負荷、使用率を求める。
+ * 使用率はfloatで(float) load / total * 100と同じ値となる。
+ * 全時間が2^31未満の場合は32bit整数から変換する。変換結果は64bitからの変換と一致する。
+ *
+ * @param[in]  before 時間的に前の値の先頭コアの位置
+ * @param[in]  after  時間的に後の値の先頭コアの位置
+ * @param[in]  stride 1フィールドあたりの列数
+ * @param[out] usage  結果の書き込み先
+ * @param[in]  index  先頭コアのインデックス
+ */
+static inline void usage_lanes(const uint64_t *before, const uint64_t *after, int stride,
+                               cpu_usage_t *usage, int index) {
+  const int idle = offsetof(cputime_t, idle) / sizeof(uint64_t);
+  const int iowait = offsetof(cputime_t, iowait) / sizeof(uint64_t);
+  const lane_f32_t percent = (lane_f32_t) {0} + 100;
+  lane_u64_t total = {0};
+  lane_u64_t load;
+  lane_u64_t diff;
+  lane_f32_t ratio;
+  uint64_t high = 0;
+  int f;
+  for (f = 0; f < CPUTIME_FIELDS; f++) {
+    lane_diff(&before[f * stride], &after[f * stride], &diff);
+    total += diff;
+  }
+  lane_diff(&before[idle * stride], &after[idle * stride], &diff);
+  load = total - diff;
+  lane_diff(&before[iowait * stride], &after[iowait * stride], &diff);
+  load -= diff;
+  for (f = 0; f < USAGE_LANES; f++) {
+    high |= total[f];
+  }
+  if (high >> 31 == 0) {
+    lane_s32_t total32 = __builtin_convertvector(total, lane_s32_t);
+    // 0除算を避けるため、全時間が0のコアは1とする
+    total32 -= (total32 == 0);
+    ratio = __builtin_convertvector(__builtin_convertvector(load, lane_s32_t), lane_f32_t)
+        / __builtin_convertvector(total32, lane_f32_t) * percent;
+  } else {
+    lane_u64_t divisor = total + ((lane_u64_t) (total == 0) & 1);
+    ratio = __builtin_convertvector(load, lane_f32_t)
+        / __builtin_convertvector(divisor, lane_f32_t) * percent;
+  }
+  memcpy(&usage->total[index], &total, sizeof(total));
+  memcpy(&usage->load[index], &load, sizeof(load));
+  memcpy(&usage->usage[index], &ratio, sizeof(ratio));
+}
+
+/**
+ * @brief 列優先の行列から各コアの使用率を計算する
+ *
+ * オフラインのコアは列が0のため、レーン単位で計算した後に結果を0へ置き換える。
+ * 前後とも全てのコアがオンラインの場合は置き換えを行わない。
+ * 再びオンラインになったコアは、前後の両方がオンラインとなる次の計測から値を持つ。
+ *
+ * @param[in]  before 時間的に前の値
+ * @param[in]  after  時間的に後の値
+ * @param[out] usage  結果の書き込み先
+ */
+void cpu_matrix_usage(const cpu_matrix_t *before, const cpu_matrix_t *after, cpu_usage_t *usage) {
+  int i;
+  for (i = 0; i < after->stride; i += USAGE_LANES) {
+    usage_lanes(&before->counters[i], &after->counters[i], after->stride, usage, i);
+  }
+  if (before->online_num == before->num && after->online_num == after->num) {
+    memset(usage->online, TRUE, after->num);
+    return;
+  }
+  for (i = 0; i < after->num; i++) {
+    usage->online[i] = before->online[i] && after->online[i];
+    if (!usage->online[i]) {
+      usage->total[i] = 0;
+      usage->load[i] = 0;
+      usage->usage[i] = 0;
+    }
+  }
+}
+
+/**
+ * @brief 使用率の計算結果を格納する構造体を確保する
+ *
+ * @param[in] num CPUの個数
+ * @return 使用率の計算結果
+ */
+cpu_usage_t *new_cpu_usage_t(int num) {
+  cpu_usage_t *usage = xmalloc(sizeof(cpu_usage_t));
+  int stride = (num + USAGE_LANES - 1) / USAGE_LANES * USAGE_LANES;
+  usage->num = num;
+  usage->total = xmalloc(sizeof(uint64_t) * stride);
+  usage->load = xmalloc(sizeof(uint64_t) * stride);
+  usage->usage = xmalloc(sizeof(float) * stride);
+  usage->online = xmalloc(stride);
+  memset(usage->online, 0, stride);
+  return usage;
+}
+
+/**
+ * @brief 使用率の計算結果を格納する構造体を開放する
+ *
+ * @param[in] usage 開放する構造体
+ */
+void delete_cpu_usage_t(cpu_usage_t *usage) {
+  if (usage == NULL) {
+    return;
+  }
+  free(usage->total);
+  free(usage->load);
+  free(usage->usage);
+  free(usage->online);
+  free(usage);
+}
+#endif
+
+/**
+ * @brief /proc/stat読み出し用構造体の初期化を行う
+ *
+ * @return /proc/stat読み出し用構造体、失敗した場合NULL
+ */
+stat_sampler_t *new_stat_sampler_t(void) {
+  char path[PATH_MAX];
+  stat_sampler_t *sampler;
+  if (snprintf(path, sizeof(path), "%s/stat", proc_root) >= sizeof(path)) {
+    ERR("%s: %s\n", proc_root, strerror(ENAMETOOLONG));
+    return NULL;
+  }
+  sampler = xmalloc(sizeof(stat_sampler_t));
+  sampler->stat_fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (sampler->stat_fd < 0) {
+    ERR("%s: %s\n", path, strerror(errno));
+    free(sampler);
+    return NULL;
+  }
+  sampler->buf_size = STAT_BUFFER_SIZE;
+  sampler->buf = xmalloc(sampler->buf_size);
+  return sampler;
+}
+
+/**
+ * @brief /proc/stat読み出し用構造体の開放を行う
+ *
+ * @param[in] sampler 開放する構造体
+ */
+void delete_stat_sampler_t(stat_sampler_t *sampler) {
+  if (sampler == NULL) {
+    return;
+  }
+  close(sampler->stat_fd);
+  free(sampler->buf);
+  free(sampler);
+}
+
+/**
+ * @brief /proc/statの内容をバッファへ読み出す
+ *
+ * バッファに収まらなかった場合は拡張して先頭から読みなおす。
+ * 読みだした内容はNUL終端され、次の読み出しまで有効。
+ *
+ * @param[in,out] sampler 読み出しに使う構造体
+ * @return 読みだした内容、失敗した場合NULL
+ */
+const char *stat_sampler_read_file(stat_sampler_t *sampler) {
+  size_t len = 0;
+  ssize_t size;
+  while (TRUE) {
+    size = pread(sampler->stat_fd, sampler->buf + len,
+                 sampler->buf_size - len - 1, len);
+    if (size < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ERR("%s\n", strerror(errno));
+      return NULL;
+    }
+    if (size == 0) {
+      break;
+    }
+    len += size;
+    if (len == sampler->buf_size - 1) {
+      sampler->buf_size *= 2;
+      sampler->buf = xrealloc(sampler->buf, sampler->buf_size);
+      len = 0;
+    }
+  }
+  sampler->buf[len] = 0;
+  return sampler->buf;
+}
+
+/**
+ * @brief statの先頭のCPU全体の行のみを読みだす
+ *
+ * 必要なのは先頭のcpu行だけなので、先頭のみをpreadで読み出す。
+ *
+ * @param[in,out] sampler 読み出しに使う構造体
+ * @param[out]    time    結果の書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t stat_sampler_read_head(stat_sampler_t *sampler, cputime_t *time) {
+  char line[LINE_BUFFER_SIZE];
+  ssize_t size;
+  do {
+    size = pread(sampler->stat_fd, line, sizeof(line) - 1, 0);
+  } while (size < 0 && errno == EINTR);
+  if (size <= 0) {
+    ERR("%s\n", strerror(errno));
+    return FAILURE;
+  }
+  line[size] = 0;
+  memset(time, 0, sizeof(cputime_t));
+  if (strncmp(line, "cpu ", 4) != 0
+      || parse_cputime(line + 3, time) < 4) {
+    ERR("invalid format\n");
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief statの値を読みだす
+ *
+ * CPUの個数が0の場合はCPU全体の値のみをtimes[0]へ読みだす。
+ *
+ * @param[in,out] sampler 読み出しに使う構造体
+ * @param[out]    times   結果の書き込み先、num + 1個の領域
+ * @param[in]     num     CPUの個数
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+result_t stat_sampler_read(stat_sampler_t *sampler, cputime_t *times, int num) {
+  if (num == 0) {
+    return stat_sampler_read_head(sampler, times);
+  }
+  if (stat_sampler_read_file(sampler) == NULL) {
+    return FAILURE;
+  }
+  return parse_cpus(sampler->buf, times, num);
+}
+
+/**
+ * @brief statの値をスナップショットへ読みだす
+ *
+ * @param[in,out] sampler  読み出しに使う構造体
+ * @param[out]    snapshot 結果の書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+result_t snapshot_read(stat_sampler_t *sampler, snapshot_t *snapshot) {
+  return stat_sampler_read(sampler, snapshot->times, snapshot->num);
+}
+
+#if FEATURE_CORES
+/**
+ * @brief /proc/statを読み出し、全体のCPU時間と各コアの列優先の行列を取得する
+ *
+ * @param[in,out] sampler 読み出しに使う構造体
+ * @param[out]    total   全体のCPU時間の書き込み先
+ * @param[out]    cores   各コアのCPU時間の書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+result_t stat_sampler_read_matrix(stat_sampler_t *sampler, cputime_t *total, cpu_matrix_t *cores) {
+  if (stat_sampler_read_file(sampler) == NULL) {
+    return FAILURE;
+  }
+  return parse_cpus_matrix(sampler->buf, total, cores);
+}
+#endif
+
+/**
+ * @brief 各コアの値を格納するテーブルの大きさを返す
+ *
+ * 実際の/procの場合は、オフラインのコアや後からオンラインになるコアも格納できるよう、
+ * _SC_NPROCESSORS_CONFとstatに現れるコア番号の大きい方とする。
+ *
+ * @param[in,out] sampler 読み出しに使う構造体
+ * @return コアの個数、読み出しに失敗した場合-1
+ */
+int stat_sampler_count_cpus(stat_sampler_t *sampler) {
+  const char *stat = stat_sampler_read_file(sampler);
+  int num;
+  if (stat == NULL) {
+    return -1;
+  }
+  num = count_cpus(stat);
+  if (is_default_proc_root()) {
+    long conf = sysconf(_SC_NPROCESSORS_CONF);
+    if (conf > num) {
+      num = conf;
+    }
+  }
+  return num;
+}
+
+/**
+ * @brief 空白に続く10進数を読み取る
+ *
+ * @param[in]  p 読み取り開始位置
+ * @param[out] value 読み取った値
+ * @return 読み取った数値の直後の位置、数値が無かった場合NULL
+ */
+char *scan_uint64(char *p, uint64_t *value) {
+  uint64_t v = 0;
+  while (*p == ' ') {
+    p++;
+  }
+  if (*p < '0' || *p > '9') {
+    return NULL;
+  }
+  do {
+    v = v * 10 + (*p++ - '0');
+  } while (*p >= '0' && *p <= '9');
+  *value = v;
+  return p;
+}
+
+/**
+ * @brief cpu行のカウンタ部分を指定間隔の位置へパースする
+ *
+ * n番目のフィールドをfirst[n * step]へ格納する。
+ * パースするのは先頭からFEATURE_FIELDS個までとする。
+ *
+ * @param[in]  p     "cpu"/"cpuN"の直後の位置
+ * @param[out] first 最初のフィールドの書き込み先
+ * @param[in]  step  フィールドの間隔(要素数)
+ * @return 読み取れたフィールド数
+ */
+static int parse_counters(char *p, uint64_t *first, int step) {
+  int n;
+  for (n = 0; n < FEATURE_FIELDS; n++) {
+    p = scan_uint64(p, &first[n * step]);
+    if (p == NULL) {
+      break;
+    }
+  }
+  return n;
+}
+
+/**
+ * @brief cpu行のカウンタ部分をパースする
+ *
+ * sscanf("%lu %lu ...")と同様に、読み取れたところまでを格納する。
+ *
+ * @param[in]  p    "cpu"/"cpuN"の直後の位置
+ * @param[out] time 結果の書き込み先
+ * @return 読み取れたフィールド数
+ */
+int parse_cputime(char *p, cputime_t *time) {
+  return parse_counters(p, (uint64_t *) time, 1);
+}
+
+/**
+ * @brief "cpuN"のコア番号を読み取る
+ *
+ * @param[in]  p     "cpu"の直後の位置
+ * @param[out] index 読み取ったコア番号
+ * @return コア番号の直後の位置、番号が無かった場合NULL
+ */
+static char *scan_cpu_index(char *p, int *index) {
+  int v = 0;
+  if (*p < '0' || *p > '9') {
+    return NULL;
+  }
+  do {
+    v = v * 10 + (*p++ - '0');
+  } while (*p >= '0' && *p <= '9');
+  *index = v;
+  return p;
+}
+
+/**
+ * @brief statの内容からコアの個数を数える
+ *
+ * CPU全体の行に続く"cpuN"の行のうち、最大のコア番号 + 1を返す。
+ * オフラインのコアは行が無いため、全てのコアがオンラインの場合のみ行数と一致する。
+ *
+ * @param[in] stat statを読みだした内容
+ * @return コアの個数
+ */
+int count_cpus(const char *stat) {
+  int num = 0;
+  int index;
+  char *line = strchr(stat, '\n');
+  while (line != NULL && strncmp(++line, "cpu", 3) == 0) {
+    if (scan_cpu_index(line + 3, &index) != NULL && index >= num) {
+      num = index + 1;
+    }
+    line = strchr(line, '\n');
+  }
+  return num;
+}
+
+/**
+ * @brief statの内容からcpu行をパースする
+ *
+ * CPUの個数が1の場合とFEATURE_CORESが0の場合はCPU全体の行のみを読み取る。
+ * 各コアの値はcpuNの番号の位置へ格納し、行の無いオフラインのコアと
+ * num以上の番号のコアは0とする。
+ *
+ * @param[in]  buf   statを読みだした内容
+ * @param[out] times 結果の書き込み先、num + 1個の領域
+ * @param[in]  num   CPUの個数
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+result_t parse_cpus(char *buf, cputime_t *times, int num) {
+  char *line = buf;
+  cputime_t *work;
+  memset(times, 0, sizeof(cputime_t) * (num + 1));
+  work = &times[num];
+  if (strncmp(line, "cpu ", 4) != 0
+      || parse_cputime(line + 3, work) < 4) {
+    ERR("invalid format\n");
+    return FAILURE;
+  }
+  if (FEATURE_CORES && num > 1) {
+    int index;
+    while ((line = strchr(line, '\n')) != NULL && strncmp(++line, "cpu", 3) == 0) {
+      line = scan_cpu_index(line + 3, &index);
+      if (line == NULL) {
+        ERR("invalid format\n");
+        return FAILURE;
+      }
+      if (index >= num) {
+        continue;
+      }
+      work = &times[index];
+      if (parse_cputime(line, work) < 4) {
+        ERR("invalid format\n");
+        return FAILURE;
+      }
+    }
+  }
+  return SUCCESS;
+}
+
+#if FEATURE_CORES
+/**
+ * @brief /proc/statの内容から全体のCPU時間と各コアの列優先の行列をパースする
+ *
+ * 各コアの値はcpuNの番号の列へ直接書き込み、その列をオンラインとする。
+ * 行の無いオフラインのコアの列は0とし、num以上の番号のコアは読み飛ばす。
+ * このため、計測中にコアがオフライン・オンラインとなっても再確保せずに追従できる。
+ * コアが1つのみの場合は全体の行のみをパースする。
+ *
+ * @param[in]  buf   /proc/statの内容
+ * @param[out] total 全体のCPU時間の書き込み先
+ * @param[out] cores 各コアのCPU時間の書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+result_t parse_cpus_matrix(char *buf, cputime_t *total, cpu_matrix_t *cores) {
+  char *line = buf;
+  memset(total, 0, sizeof(cputime_t));
+  if (strncmp(line, "cpu ", 4) != 0
+      || parse_cputime(line + 3, total) < 4) {
+    ERR("invalid format\n");
+    return FAILURE;
+  }
+  if (cores->num > 1) {
+    int index, f;
+    for (f = 0; f < CPUTIME_FIELDS; f++) {
+      memset(&cores->counters[f * cores->stride], 0, sizeof(uint64_t) * cores->num);
+    }
+    memset(cores->online, 0, cores->num);
+    cores->online_num = 0;
+    while ((line = strchr(line, '\n')) != NULL && strncmp(++line, "cpu", 3) == 0) {
+      line = scan_cpu_index(line + 3, &index);
+      if (line == NULL) {
+        ERR("invalid format\n");
+        return FAILURE;
+      }
+      if (index >= cores->num) {
+        continue;
+      }
+      if (parse_counters(line, &cores->counters[index], cores->stride) < 4) {
+        ERR("invalid format\n");
+        return FAILURE;
+      }
+      if (!cores->online[index]) {
+        cores->online[index] = TRUE;
+        cores->online_num++;
+      }
+    }
+  }
+  return SUCCESS;
+}
+#endif
+
+#if FEATURE_TASKS
+#ifdef SCAN_WIDTH
+/**
+ * @brief SCAN_WIDTHバイト中の空白の位置をマスクとして取得する
+ *
+ * 空白のバイトに対応するSCAN_BITSビットのうち最上位のビットのみを立てる。
+ *
+ * @param[in] p 調べる位置、SCAN_WIDTHバイト読み出せること
+ * @return 空白の位置のマスク
+ */
+static inline scan_mask_t scan_spaces(const char *p) {
+#if defined(__AVX2__)
+  __m256i v = _mm256_loadu_si256((const __m256i *) p);
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+#elif defined(__SSE2__)
+  __m128i v = _mm_loadu_si128((const __m128i *) p);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+#else
+  uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *) p), vdupq_n_u8(' '));
+  uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x8888888888888888ULL;
+#endif
+}
+#endif
+
+/**
+ * @brief 空白区切りのフィールドの開始位置を調べる
+ *
+ * SIMDが使える場合はSCAN_WIDTHバイトずつ空白の位置をマスクとして求め、
+ * 残りの部分とSIMDが使えない場合は1バイトずつ調べる。
+ * procファイルシステムの出力はフィールドを空白1文字で区切るため、
+ * 空白の直後をフィールドの開始位置とする。
+ *
+ * @param[in]  p      最初のフィールドの位置
+ * @param[in]  end    調べる範囲の終端
+ * @param[out] fields 各フィールドの開始位置の書き込み先
+ * @param[in]  max    調べるフィールド数
+ * @return 見つかったフィールド数
+ */
+static int find_fields(const char *p, const char *end, const char **fields, int max) {
+  int n = 0;
+  fields[n++] = p;
+#ifdef SCAN_WIDTH
+  while (n < max && p + SCAN_WIDTH <= end) {
+    scan_mask_t mask = scan_spaces(p);
+    while (mask != 0 && n < max) {
+      fields[n++] = p + __builtin_ctzll(mask) / SCAN_BITS + 1;
+      mask &= mask - 1;
+    }
+    p += SCAN_WIDTH;
+  }
+#endif
+  for (; n < max && p < end; p++) {
+    if (*p == ' ') {
+      fields[n++] = p + 1;
+    }
+  }
+  return n;
+}
+
+/**
+ * @brief 符号付きの10進数を読み取る
+ *
+ * sscanfの"%lu"/"%ld"と同様に先頭の符号を受け付け、負の値は2の補数で返す。
+ *
+ * @param[in]  p     読み取る位置
+ * @param[out] value 結果の書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t scan_field(const char *p, uint64_t *value) {
+  uint64_t v = 0;
+  int negative = FALSE;
+  if (*p == '-' || *p == '+') {
+    negative = *p++ == '-';
+  }
+  if (*p < '0' || *p > '9') {
+    return FAILURE;
+  }
+  do {
+    v = v * 10 + (*p++ - '0');
+  } while (*p >= '0' && *p <= '9');
+  *value = negative ? -v : v;
+  return SUCCESS;
+}
+
+/**
+ * @brief /proc/[pid]/statの内容を指定フィールド数までパースする
+ *
+ * commの後ろのフィールドは区切り位置を先にまとめて調べ、
+ * 必要なフィールドのみを数値に変換する。
+ * 区切り位置を調べる範囲は呼び出し側ごとの定数とし、展開後に不要な走査を行わない。
+ *
+ * @param[in]  line      statを読みだした内容
+ * @param[out] comm      プロセス名の書き込み先、不要な場合NULL
+ * @param[in]  comm_size commのサイズ
+ * @param[out] stat      結果の書き込み先
+ * @param[in]  max       区切り位置を調べるフィールド数
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static inline __attribute__((always_inline))
+result_t parse_task_fields(char *line, char *comm, size_t comm_size, task_stat_t *stat, int max) {
+  const char *fields[TASK_STAT_SCHED_FIELDS];
+  char *end = line + strlen(line);
+  char *tmp;
+  int len;
+  line = strchr(line, '(');
+  if (line == NULL) {
+    return FAILURE;
+  }
+  line++;
+  tmp = memrchr(line, ')', end - line);
+  if (tmp == NULL || tmp + 2 >= end) {
+    return FAILURE;
+  }
+  if (comm != NULL) {
+    len = tmp - line;
+    if (len >= comm_size) {
+      len = comm_size - 1;
+    }
+    memcpy(comm, line, len);
+    comm[len] = 0;
+  }
+  if (find_fields(tmp + 2, end, fields, max) != max
+      || scan_field(fields[11], &stat->utime) != SUCCESS
+      || scan_field(fields[12], &stat->stime) != SUCCESS
+      || scan_field(fields[13], &stat->cutime) != SUCCESS
+      || scan_field(fields[14], &stat->cstime) != SUCCESS
+      || scan_field(fields[15], (uint64_t *) &stat->priority) != SUCCESS
+      || scan_field(fields[16], (uint64_t *) &stat->nice) != SUCCESS
+      || scan_field(fields[19], &stat->starttime) != SUCCESS) {
+    return FAILURE;
+  }
+  stat->state = *fields[0];
+  stat->processor = -1;
+  if (max > TASK_STAT_SCHED_FIELDS - 1) {
+    uint64_t processor;
+    if (scan_field(fields[TASK_STAT_SCHED_FIELDS - 1], &processor) != SUCCESS) {
+      return FAILURE;
+    }
+    stat->processor = processor;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief /proc/[pid]/statの内容をパースする
+ *
+ * state〜starttimeのみを読み出し、processorは-1とする。
+ *
+ * @param[in]  line      statを読みだした内容
+ * @param[out] comm      プロセス名の書き込み先、不要な場合NULL
+ * @param[in]  comm_size commのサイズ
+ * @param[out] stat      結果の書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+result_t parse_task_stat(char *line, char *comm, size_t comm_size, task_stat_t *stat) {
+  return parse_task_fields(line, comm, comm_size, stat, TASK_STAT_FIELDS);
+}
+
+/**
+ * @brief /proc/[pid]/statの内容を最後に実行したCPUまでパースする
+ *
+ * parse_task_statに加え、39番目のフィールド(processor)を読み出す。
+ *
+ * @param[in]  line      statを読みだした内容
+ * @param[out] comm      プロセス名の書き込み先、不要な場合NULL
+ * @param[in]  comm_size commのサイズ
+ * @param[out] stat      結果の書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+result_t parse_task_stat_sched(char *line, char *comm, size_t comm_size, task_stat_t *stat) {
+  return parse_task_fields(line, comm, comm_size, stat, TASK_STAT_SCHED_FIELDS);
+}
+
+/**
+ * @brief /proc/[pid]/schedstatの内容をパースする
+ *
+ * "実行時間 実行待ち時間 タイムスライス数"のうち、実行時間[ns]と実行待ち時間[ns]を読み出す。
+ *
+ * @param[in]  line      schedstatを読みだした内容
+ * @param[out] runtime   実行時間の書き込み先
+ * @param[out] run_delay 実行待ち時間の書き込み先
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+result_t parse_schedstat(char *line, uint64_t *runtime, uint64_t *run_delay) {
+  char *p = scan_uint64(line, runtime);
+  if (p == NULL || scan_uint64(p, run_delay) == NULL) {
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief 上位32bitをキーとしてLSD基数ソートを行う
+ *
+ * RADIX_BITSずつ下位の桁から安定に並べ替える。
+ * 全要素で同じ値となる桁のパスは省略する。
+ *
+ * @param[in,out] data 並べ替える配列
+ * @param[out]    tmp  作業領域、dataと同じ長さ
+ * @param[in]     num  要素数
+ * @return 並べ替えた結果が格納された配列(dataまたはtmp)
+ */
+uint64_t *radix_sort(uint64_t *data, uint64_t *tmp, int num) {
+  int count[RADIX_SIZE];
+  int shift;
+  if (num == 0) {
+    return data;
+  }
+  for (shift = 32; shift < 64; shift += RADIX_BITS) {
+    uint64_t *swap;
+    int pos = 0;
+    int i;
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < num; i++) {
+      count[(data[i] >> shift) & (RADIX_SIZE - 1)]++;
+    }
+    if (count[(data[0] >> shift) & (RADIX_SIZE - 1)] == num) {
+      continue;
+    }
+    for (i = 0; i < RADIX_SIZE; i++) {
+      int c = count[i];
+      count[i] = pos;
+      pos += c;
+    }
+    for (i = 0; i < num; i++) {
+      tmp[count[(data[i] >> shift) & (RADIX_SIZE - 1)]++] = data[i];
+    }
+    swap = data;
+    data = tmp;
+    tmp = swap;
+  }
+  return data;
+}
+
+/**
+ * @brief タスクごとの負荷を計算する
+ *
+ * 前回・今回ともにid昇順に並んでいるため、マージ結合で対応を取る。
+ * 起動時刻が異なる場合はIDが再利用された別のタスクとして扱う。
+ *
+ * @param[in]     before 時間的に前の値
+ * @param[in,out] after  時間的に後の値、loadに結果を格納する
+ */
+void task_delta(const task_columns_t *before, task_columns_t *after) {
+  int i, j;
+  for (i = 0, j = 0; i < after->num; i++) {
+    after->load[i] = after->utime[i] + after->stime[i];
+    for (;j < before->num && before->id[j] < after->id[i]; j++);
+    if (j < before->num && before->id[j] == after->id[i]
+        && before->starttime[j] == after->starttime[i]) {
+      uint64_t prev = before->utime[j] + before->stime[j];
+      after->load[i] = after->load[i] > prev ? after->load[i] - prev : 0;
+    }
+  }
+}
+
+/**
+ * @brief 並べ替えのキーの名前を解釈する
+ *
+ * @param[in] name cpu/total/utime/stime/nice/delay
+ * @return RANK_KEY_*、不明な名前の場合-1
+ */
+int parse_rank_key(const char *name) {
+  static const char *names[] = {"cpu", "total", "utime", "stime", "nice", "delay"};
+  int i;
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(name, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief 上位選択の条件を初期化する
+ *
+ * 負荷降順で全タスクから件数DEFAULT_RANK_NUMを選択する条件とする。
+ *
+ * @param[out] rank 初期化する条件
+ */
+void rank_init(rank_t *rank) {
+  rank->key = RANK_KEY_CPU;
+  rank->num = DEFAULT_RANK_NUM;
+  rank->pid_num = 0;
+  rank->comm = NULL;
+}
+
+/**
+ * @brief カンマ区切りのPIDを絞り込み条件へ追加する
+ *
+ * @param[in,out] rank 条件
+ * @param[in]     list カンマ区切りのPID
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+result_t rank_add_pids(rank_t *rank, const char *list) {
+  const char *p = list;
+  while (*p != 0) {
+    char *end;
+    long pid = strtol(p, &end, 10);
+    if (end == p || pid <= 0 || (*end != ',' && *end != 0)
+        || rank->pid_num >= RANK_PIDS) {
+      return FAILURE;
+    }
+    rank->pids[rank->pid_num++] = pid;
+    p = *end == ',' ? end + 1 : end;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief 並べ替えのキーの値を取得する
+ *
+ * 大きい値ほど上位となるように変換する。
+ *
+ * @param[in] ctx 比較に使う情報
+ * @param[in] i   タスクのインデックス
+ * @return キーの値
+ */
+static inline uint64_t rank_value(const rank_context_t *ctx, int i) {
+  const task_columns_t *tasks = ctx->tasks;
+  switch (ctx->key) {
+    case RANK_KEY_TOTAL:
+      return tasks->utime[i] + tasks->stime[i];
+    case RANK_KEY_UTIME:
+      return tasks->utime[i];
+    case RANK_KEY_STIME:
+      return tasks->stime[i];
+    case RANK_KEY_NICE:
+      return (uint64_t) (INT64_MAX - tasks->nice[i]);
+    case RANK_KEY_DELAY:
+      return tasks->delay[i];
+    default:
+      return tasks->load[i];
+  }
+}
+
+/**
+ * @brief 負荷降順ソート用比較関数
+ *
+ * 負荷が等しい場合はID昇順とする。
+ *
+ * @param[in] a   比較対象のインデックス
+ * @param[in] b   比較対象のインデックス
+ * @param[in] arg 比較に使う情報(rank_context_t)
+ * @return a > b の時負、a == b の時0、a < b の時正
+ */
+static inline int comp_task_load(const void *a, const void *b, void *arg) {
+  const task_columns_t *tasks = ((const rank_context_t *) arg)->tasks;
+  int ia = *(int*)a;
+  int ib = *(int*)b;
+  if (tasks->load[ia] != tasks->load[ib]) {
+    return tasks->load[ia] > tasks->load[ib] ? -1 : 1;
+  }
+  return tasks->id[ia] - tasks->id[ib];
+}
+
+/**
+ * @brief 上位選択用比較関数
+ *
+ * キーの降順とし、キーが等しい場合は負荷降順、ID昇順とする。
+ *
+ * @param[in] a   比較対象のインデックス
+ * @param[in] b   比較対象のインデックス
+ * @param[in] arg 比較に使う情報(rank_context_t)
+ * @return a > b の時負、a == b の時0、a < b の時正
+ */
+static inline int comp_task_rank(const void *a, const void *b, void *arg) {
+  const rank_context_t *ctx = arg;
+  uint64_t va = rank_value(ctx, *(int*)a);
+  uint64_t vb = rank_value(ctx, *(int*)b);
+  if (va != vb) {
+    return va > vb ? -1 : 1;
+  }
+  return comp_task_load(a, b, arg);
+}
+
+/**
+ * @brief 上位のヒープの指定位置から上方向へ整列する
+ *
+ * heapの先頭を最も下位の要素とするヒープとして扱う。
+ *
+ * @param[in]     ctx  比較に使う情報
+ * @param[in]     comp 比較関数
+ * @param[in,out] heap ヒープ
+ * @param[in]     i    整列を開始する位置
+ */
+static inline void task_heap_up(const rank_context_t *ctx, comp_task_t comp, int *heap, int i) {
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    int tmp;
+    if (comp(&heap[parent], &heap[i], (void *) ctx) >= 0) {
+      return;
+    }
+    tmp = heap[i];
+    heap[i] = heap[parent];
+    heap[parent] = tmp;
+    i = parent;
+  }
+}
+
+/**
+ * @brief 上位のヒープの指定位置から下方向へ整列する
+ *
+ * @param[in]     ctx  比較に使う情報
+ * @param[in]     comp 比較関数
+ * @param[in,out] heap ヒープ
+ * @param[in]     num  ヒープの要素数
+ * @param[in]     i    整列を開始する位置
+ */
+static inline void task_heap_down(const rank_context_t *ctx, comp_task_t comp, int *heap, int num, int i) {
+  while (TRUE) {
+    int min = i;
+    int left = i * 2 + 1;
+    int right = left + 1;
+    int tmp;
+    if (left < num && comp(&heap[left], &heap[min], (void *) ctx) > 0) {
+      min = left;
+    }
+    if (right < num && comp(&heap[right], &heap[min], (void *) ctx) > 0) {
+      min = right;
+    }
+    if (min == i) {
+      return;
+    }
+    tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
+
+/**
+ * @brief タスクが絞り込み条件に一致するかを調べる
+ *
+ * PIDはtasks->pid、名前はtasks->commと比較する。
+ *
+ * @param[in] tasks 対象のタスク
+ * @param[in] rank  条件
+ * @param[in] i     タスクのインデックス
+ * @return 一致する場合TRUE
+ */
+static int rank_match(const task_columns_t *tasks, const rank_t *rank, int i) {
+  if (rank->pid_num > 0) {
+    int pid = tasks->pid[i];
+    int j;
+    for (j = 0; j < rank->pid_num && rank->pids[j] != pid; j++);
+    if (j == rank->pid_num) {
+      return FALSE;
+    }
+  }
+  if (rank->comm != NULL
+      && strstr(tasks->comm + tasks->comm_size * i, rank->comm) == NULL) {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/**
+ * @brief ヒープで上位n件を選択する
+ *
+ * 比較関数を定数として呼び出すことで、キーごとに比較をインライン展開する。
+ *
+ * @param[in]  ctx    比較に使う情報
+ * @param[in]  comp   比較関数
+ * @param[in]  rank   条件
+ * @param[in]  filter 絞り込みを行う場合TRUE
+ * @param[in]  n      選択する件数
+ * @param[out] order  結果の書き込み先、n個の領域、順序はヒープのまま
+ * @return 選択した件数
+ */
+static inline __attribute__((always_inline))
+int task_select(const rank_context_t *ctx, comp_task_t comp, const rank_t *rank,
+                int filter, int n, int *order) {
+  const task_columns_t *tasks = ctx->tasks;
+  int num = 0;
+  int i;
+  for (i = 0; i < tasks->num; i++) {
+    if (filter && !rank_match(tasks, rank, i)) {
+      continue;
+    }
+    if (num < n) {
+      order[num] = i;
+      task_heap_up(ctx, comp, order, num);
+      num++;
+    } else if (comp(&i, &order[0], (void *) ctx) < 0) {
+      order[0] = i;
+      task_heap_down(ctx, comp, order, num, 0);
+    }
+  }
+  return num;
+}
+
+/**
+ * @brief 条件に一致するタスクの上位のインデックスをorderに降順で格納する
+ *
+ * 件数が指定されている場合は要素数nのヒープで選択するため、
+ * 選択にかかる時間はタスク数をmとしてO(m log n)となる。
+ * 全件の場合は一致したタスクをすべてソートする。
+ *
+ * @param[in]  tasks 対象のタスク、task_deltaで負荷を計算済みであること
+ * @param[in]  rank  条件
+ * @param[out] order 結果の書き込み先、件数分(全件の場合タスク数分)の領域
+ * @return 選択した件数
+ */
+int task_rank(const task_columns_t *tasks, const rank_t *rank, int *order) {
+  rank_context_t ctx = {tasks, rank->key};
+  comp_task_t comp = rank->key == RANK_KEY_CPU ? comp_task_load : comp_task_rank;
+  int filter = rank->pid_num > 0 || rank->comm != NULL;
+  int n = rank->num;
+  int num = 0;
+  int i;
+  if (n <= 0 || n > tasks->num) {
+    n = tasks->num;
+  }
+  if (n == tasks->num) {
+    for (i = 0; i < tasks->num; i++) {
+      if (!filter || rank_match(tasks, rank, i)) {
+        order[num++] = i;
+      }
+    }
+  } else if (comp == comp_task_load) {
+    num = task_select(&ctx, comp_task_load, rank, filter, n, order);
+  } else {
+    num = task_select(&ctx, comp_task_rank, rank, filter, n, order);
+  }
+  qsort_r(order, num, sizeof(int), comp, &ctx);
+  return num;
+}
+
+/**
+ * @brief 負荷上位n件のインデックスをorderに負荷降順で格納する
+ *
+ * 要素数nのヒープで選択するため、全体をソートする必要はない。
+ *
+ * @param[in]  tasks 対象のタスク、task_deltaで負荷を計算済みであること
+ * @param[in]  n     選択する件数
+ * @param[out] order 結果の書き込み先、n個の領域
+ * @return 選択した件数
+ */
+int task_top(const task_columns_t *tasks, int n, int *order) {
+  rank_t rank;
+  rank_init(&rank);
+  rank.num = n;
+  return task_rank(tasks, &rank, order);
+}
+
+/**
+ * @brief fdキャッシュで保持できるfdの上限を求める
+ *
+ * RLIMIT_NOFILEのソフトリミットをハードリミットまで引き上げたうえで、
+ * FD_RESERVE分を残した数を上限とする。
+ *
+ * @return 保持できるfdの上限
+ */
+int get_fd_limit(void) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+    ERR("%s\n", strerror(errno));
+    return 0;
+  }
+  if (rl.rlim_cur != rl.rlim_max) {
+    rlim_t cur = rl.rlim_cur;
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+      rl.rlim_cur = cur;
+    }
+  }
+  if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > FD_CACHE_MAX + FD_RESERVE) {
+    return FD_CACHE_MAX;
+  }
+  if (rl.rlim_cur <= FD_RESERVE) {
+    return 0;
+  }
+  return rl.rlim_cur - FD_RESERVE;
+}
+
+/**
+ * @brief ディレクトリfdからの相対パスでstatファイルを開く
+ *
+ * @param[in] dir_fd 基準となるディレクトリのファイルディスクリプタ
+ * @param[in] name   ディレクトリ名(PID/TIDなど)
+ * @param[in] file   ファイル名("/stat"、"/schedstat")
+ * @return ファイルディスクリプタ、失敗した場合-1
+ */
+int open_stat_at(int dir_fd, const char *name, const char *file) {
+  char path[NAME_BUFFER_SIZE];
+  size_t len = strlen(name);
+  size_t file_len = strlen(file) + 1;
+  if (len + file_len > sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memcpy(path, name, len);
+  memcpy(path + len, file, file_len);
+  return openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * @brief ファイルの内容をバッファへ読み出す
+ *
+ * 読みだした内容はNUL終端される。
+ *
+ * @param[in]  fd   ファイルディスクリプタ
+ * @param[out] buf  書き込み先
+ * @param[in]  size 書き込み先のサイズ
+ * @return 読みだしたサイズ、失敗した場合-1
+ */
+ssize_t read_fd(int fd, char *buf, size_t size) {
+  size_t len = 0;
+  ssize_t n;
+  while (len < size - 1) {
+    n = read(fd, buf + len, size - len - 1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    len += n;
+  }
+  buf[len] = 0;
+  return len;
+}
+
+/**
+ * @brief 開いたままのfdでファイルを先頭から読みなおす
+ *
+ * 読みだした内容はNUL終端される。
+ * タスクが終了していた(ESRCH/ENOENT)などで読み出せなかった場合は失敗を返す。
+ *
+ * @param[in]  fd   ファイルディスクリプタ
+ * @param[out] buf  書き込み先
+ * @param[in]  size 書き込み先のサイズ
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+result_t reread_fd(int fd, char *buf, size_t size) {
+  ssize_t n;
+  do {
+    n = pread(fd, buf, size - 1, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    return FAILURE;
+  }
+  buf[n] = 0;
+  return SUCCESS;
+}
+
+/**
+ * @brief statファイルを開いて読み出す
+ *
+ * 読み出せた場合、開いたfdは閉じずに返す。
+ *
+ * @param[in]  dir_fd 基準となるディレクトリのファイルディスクリプタ
+ * @param[in]  name   ディレクトリ名(PID/TIDなど)
+ * @param[in]  file   ファイル名("/stat"、"/schedstat")
+ * @param[out] buf    書き込み先
+ * @param[in]  size   書き込み先のサイズ
+ * @param[out] fd     開いたファイルディスクリプタ
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+result_t read_stat_open(int dir_fd, const char *name, const char *file,
+                        char *buf, size_t size, int *fd) {
+  *fd = open_stat_at(dir_fd, name, file);
+  if (*fd < 0) {
+    ERR("%s: %s\n", name, strerror(errno));
+    return FAILURE;
+  }
+  if (read_fd(*fd, buf, size) <= 0) {
+    ERR("%s: %s\n", name, strerror(errno));
+    close(*fd);
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief fdキャッシュの初期化を行う
+ *
+ * @param[in] limit     保持するfdの上限
+ * @param[in] data_size 各エントリに付随させる領域のサイズ
+ * @return fdキャッシュ
+ */
+fd_cache_t *new_fd_cache_t(int limit, size_t data_size) {
+  int i;
+  fd_cache_t *cache = xmalloc(sizeof(fd_cache_t));
+  cache->data_size = data_size;
+  cache->stride = sizeof(fd_entry_t) + (data_size + 7) / 8 * 8;
+  cache->size = INIT_FD_CACHE;
+  cache->num = 0;
+  cache->limit = limit;
+  cache->generation = 0;
+  cache->adaptive = 0;
+  cache->entries = xmalloc(cache->stride * cache->size);
+  for (i = 0; i < cache->size; i++) {
+    fd_cache_at(cache, i)->fd = -1;
+  }
+  return cache;
+}
+
+/**
+ * @brief fdキャッシュの開放を行う
+ *
+ * 保持しているfdはすべてcloseする。
+ *
+ * @param[in] cache 開放するfdキャッシュ
+ */
+void delete_fd_cache_t(fd_cache_t *cache) {
+  int i;
+  if (cache == NULL) {
+    return;
+  }
+  for (i = 0; i < cache->size; i++) {
+    if (fd_cache_at(cache, i)->fd >= 0) {
+      close(fd_cache_at(cache, i)->fd);
+    }
+  }
+  free(cache->entries);
+  free(cache);
+}
+
+/**
+ * @brief テーブル上の位置のエントリを返す
+ *
+ * @param[in] cache fdキャッシュ
+ * @param[in] i     テーブル上の位置
+ * @return エントリ
+ */
+static inline fd_entry_t *fd_cache_at(fd_cache_t *cache, uint32_t i) {
+  return (fd_entry_t *) (cache->entries + cache->stride * i);
+}
+
+/**
+ * @brief キーのハッシュ値からテーブル上の初期位置を求める
+ *
+ * @param[in] cache fdキャッシュ
+ * @param[in] key   キー
+ * @return テーブル上の位置
+ */
+static uint32_t fd_cache_hash(fd_cache_t *cache, uint64_t key) {
+  return (uint32_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (cache->size - 1);
+}
+
+/**
+ * @brief キーに対応するエントリを探す
+ *
+ * @param[in] cache fdキャッシュ
+ * @param[in] key   キー
+ * @return エントリ、見つからない場合NULL
+ */
+fd_entry_t *fd_cache_find(fd_cache_t *cache, uint64_t key) {
+  uint32_t mask = cache->size - 1;
+  uint32_t i = fd_cache_hash(cache, key);
+  while (fd_cache_at(cache, i)->fd >= 0) {
+    if (fd_cache_at(cache, i)->key == key) {
+      return fd_cache_at(cache, i);
+    }
+    i = (i + 1) & mask;
+  }
+  return NULL;
+}
+
+/**
+ * @brief fdをキャッシュに登録する
+ *
+ * 登録したエントリは今回の世代で参照済みとし、付随する領域は0で埋める。
+ * 上限に達している場合は登録せずNULLを返す。
+ * 呼び出し側は登録できなかった場合、fdを自分でcloseすること。
+ *
+ * @param[in,out] cache fdキャッシュ
+ * @param[in]     key   キー
+ * @param[in]     fd    登録するファイルディスクリプタ
+ * @return 登録したエントリ、上限に達していた場合NULL
+ */
+fd_entry_t *fd_cache_insert(fd_cache_t *cache, uint64_t key, int fd) {
+  fd_entry_t *entry;
+  uint32_t mask;
+  uint32_t i;
+  if (cache->num >= cache->limit) {
+    return NULL;
+  }
+  if ((cache->num + 1) * 2 > cache->size) {
+    char *old = cache->entries;
+    int old_size = cache->size;
+    int j;
+    cache->size *= 2;
+    cache->entries = xmalloc(cache->stride * cache->size);
+    for (j = 0; j < cache->size; j++) {
+      fd_cache_at(cache, j)->fd = -1;
+    }
+    mask = cache->size - 1;
+    for (j = 0; j < old_size; j++) {
+      fd_entry_t *src = (fd_entry_t *) (old + cache->stride * j);
+      if (src->fd < 0) {
+        continue;
+      }
+      for (i = fd_cache_hash(cache, src->key);
+           fd_cache_at(cache, i)->fd >= 0; i = (i + 1) & mask);
+      memcpy(fd_cache_at(cache, i), src, cache->stride);
+    }
+    free(old);
+  }
+  mask = cache->size - 1;
+  for (i = fd_cache_hash(cache, key);
+       fd_cache_at(cache, i)->fd >= 0; i = (i + 1) & mask);
+  entry = fd_cache_at(cache, i);
+  memset(entry, 0, cache->stride);
+  entry->key = key;
+  entry->fd = fd;
+  entry->seen = cache->generation;
+  cache->num++;
+  return entry;
+}
+
+/**
+ * @brief エントリをキャッシュから削除する
+ *
+ * 保持していたfdはcloseする。
+ * 後続のエントリを詰めなおすため、削除後はエントリへのポインタは無効となる。
+ *
+ * @param[in,out] cache fdキャッシュ
+ * @param[in]     entry 削除するエントリ
+ */
+void fd_cache_remove(fd_cache_t *cache, fd_entry_t *entry) {
+  uint32_t mask = cache->size - 1;
+  uint32_t i = ((char *) entry - cache->entries) / cache->stride;
+  uint32_t j = i;
+  close(entry->fd);
+  while (TRUE) {
+    uint32_t home;
+    j = (j + 1) & mask;
+    if (fd_cache_at(cache, j)->fd < 0) {
+      break;
+    }
+    home = fd_cache_hash(cache, fd_cache_at(cache, j)->key);
+    // homeが(i, j]の範囲外であれば空いた位置へ詰める
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      memcpy(fd_cache_at(cache, i), fd_cache_at(cache, j), cache->stride);
+      i = j;
+    }
+  }
+  fd_cache_at(cache, i)->fd = -1;
+  cache->num--;
+}
+
+/**
+ * @brief 読みだした起動時刻でキーが再利用されていないかを確認する
+ *
+ * 起動時刻が未確認のエントリには今回の値を記録する。
+ * 再利用されていた場合、呼び出し側はエントリを削除して開きなおすこと。
+ *
+ * @param[in,out] entry     キーに対応するエントリ
+ * @param[in]     starttime 読みだした起動時刻
+ * @return 同一：SUCCESS / 再利用されていた：FAILURE
+ */
+result_t fd_cache_check(fd_entry_t *entry, uint64_t starttime) {
+  if (entry->starttime == 0) {
+    entry->starttime = starttime;
+    return SUCCESS;
+  }
+  return entry->starttime == starttime ? SUCCESS : FAILURE;
+}
+
+/**
+ * @brief 前回読みだした内容を再利用できるかを判定する
+ *
+ * adaptive回連続でCPU時間が変化しなかったタスクはアイドルとみなし、
+ * キーに応じてずらしたadaptive回に1回だけ読みなおす。
+ * それ以外の回は読み出しを省略し、付随する領域に記録した前回の内容を再利用する。
+ *
+ * @param[in] cache fdキャッシュ
+ * @param[in] entry キーに対応するエントリ
+ * @param[in] key   キー
+ * @return 再利用できる場合TRUE、読みなおす必要がある場合FALSE
+ */
+int fd_cache_reuse(fd_cache_t *cache, fd_entry_t *entry, uint64_t key) {
+  return cache->adaptive > 0 && entry->idle >= cache->adaptive
+      && (cache->generation + key) % cache->adaptive != 0;
+}
+
+/**
+ * @brief 読みだした内容を記録し、CPU時間が変化したかを判定する
+ *
+ * 間引かない場合は何もしない。
+ *
+ * @param[in]     cache fdキャッシュ
+ * @param[in,out] entry キーに対応するエントリ
+ * @param[in]     utime 読みだしたユーザ時間
+ * @param[in]     stime 読みだしたシステム時間
+ * @param[in]     data  付随する領域へ記録する内容、data_sizeバイト
+ */
+void fd_cache_record(fd_cache_t *cache, fd_entry_t *entry,
+                     uint64_t utime, uint64_t stime, const void *data) {
+  if (cache->adaptive <= 0) {
+    return;
+  }
+  if (entry->utime == utime && entry->stime == stime) {
+    entry->idle++;
+  } else {
+    entry->idle = 0;
+  }
+  entry->utime = utime;
+  entry->stime = stime;
+  memcpy(fd_entry_data(entry), data, cache->data_size);
+}
+
+/**
+ * @brief 今回のサンプリングで参照されなかったエントリを削除する
+ *
+ * 終了したタスクや、キーが再利用されて開きなおしたタスクのエントリは参照されずに残る。
+ * 削除によって後続のエントリが詰められるため、削除した位置は再度確認する。
+ * サンプリング世代は進めないため、呼び出し側で進めること。
+ *
+ * @param[in,out] cache fdキャッシュ
+ */
+void fd_cache_sweep(fd_cache_t *cache) {
+  int i = 0;
+  while (i < cache->size) {
+    fd_entry_t *entry = fd_cache_at(cache, i);
+    if (entry->fd >= 0 && entry->seen != cache->generation) {
+      fd_cache_remove(cache, entry);
+    } else {
+      i++;
+    }
+  }
+}
+
+/**
+ * @brief エントリに付随する領域を返す
+ *
+ * @param[in] entry エントリ
+ * @return 付随する領域の先頭
+ */
+void *fd_entry_data(fd_entry_t *entry) {
+  return entry + 1;
+}
+
+/**
+ * @brief ディレクトリのPIDを列挙する
+ *
+ * 数字で始まるエントリをPIDとし、配列が不足した場合は倍に拡張する。
+ *
+ * @param[in]     dir       /procのディレクトリストリーム
+ * @param[in,out] pids      PIDの配列
+ * @param[in,out] array_num PIDの配列の長さ
+ * @return 列挙したPID数
+ */
+int list_pids(DIR *dir, int **pids, int *array_num) {
+  struct dirent *dent;
+  int num = 0;
+  rewinddir(dir);
+  while ((dent = readdir(dir)) != NULL) {
+    if(dent->d_name[0] >= '0' && dent->d_name[0] <= '9') {
+      if (num == *array_num) {
+        *array_num *= 2;
+        *pids = xrealloc(*pids, sizeof(int) * *array_num);
+      }
+      (*pids)[num++] = atoi(dent->d_name);
+    }
+  }
+  return num;
+}
+
+/**
+ * @brief ワーカースレッドの集合の初期化を行う
+ *
+ * 呼び出し元スレッドを0番として、残りのnum - 1個のスレッドを起動する。
+ *
+ * @param[in] num  ワーカー数
+ * @param[in] func ワーカーで実行する処理
+ * @param[in] arg  処理に渡す引数
+ * @return ワーカースレッドの集合
+ */
+pool_t *new_pool_t(int num, pool_func_t func, void *arg) {
+  int i;
+  pool_t *pool = xmalloc(sizeof(pool_t));
+  pool->num = num;
+  pool->func = func;
+  pool->arg = arg;
+  pool->quit = FALSE;
+  pool->workers = NULL;
+  if (num <= 1) {
+    return pool;
+  }
+  pool->workers = xmalloc(sizeof(pool_worker_t) * num);
+  pthread_barrier_init(&pool->start, NULL, num);
+  pthread_barrier_init(&pool->done, NULL, num);
+  for (i = 1; i < num; i++) {
+    int err;
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+    err = pthread_create(&pool->workers[i].thread, NULL, pool_main, &pool->workers[i]);
+    if (err != 0) {
+      ERR("%s\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+  }
+  return pool;
+}
+
+/**
+ * @brief ワーカースレッドの集合の開放を行う
+ *
+ * 終了要求を出して全スレッドの終了を待つ。
+ *
+ * @param[in] pool 開放する集合
+ */
+void delete_pool_t(pool_t *pool) {
+  int i;
+  if (pool == NULL) {
+    return;
+  }
+  if (pool->num > 1) {
+    pool->quit = TRUE;
+    pthread_barrier_wait(&pool->start);
+    for (i = 1; i < pool->num; i++) {
+      pthread_join(pool->workers[i].thread, NULL);
+    }
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->done);
+  }
+  free(pool->workers);
+  free(pool);
+}
+
+/**
+ * @brief ワーカースレッドのメインループ
+ *
+ * 開始の同期を待ち、処理が完了したら完了の同期を待つ。
+ *
+ * @param[in] arg 担当するワーカー
+ * @return NULL
+ */
+static void *pool_main(void *arg) {
+  pool_worker_t *worker = arg;
+  pool_t *pool = worker->pool;
+  while (TRUE) {
+    pthread_barrier_wait(&pool->start);
+    if (pool->quit) {
+      break;
+    }
+    pool->func(pool->arg, worker->index);
+    pthread_barrier_wait(&pool->done);
+  }
+  return NULL;
+}
+
+/**
+ * @brief 全ワーカーで処理を1回実行する
+ *
+ * 呼び出し元スレッドも0番として処理を行い、全ワーカーの完了を待って戻る。
+ *
+ * @param[in,out] pool ワーカースレッドの集合
+ */
+void pool_run(pool_t *pool) {
+  if (pool->num > 1) {
+    pthread_barrier_wait(&pool->start);
+  }
+  pool->func(pool->arg, 0);
+  if (pool->num > 1) {
+    pthread_barrier_wait(&pool->done);
+  }
+}
+#endif
+
+/**
+ * @brief 単調増加時計の現在値を返す
+ *
+ * @return 現在時刻[ns]
+ */
+uint64_t get_monotonic(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief 1クロックティックあたりの時間を返す
+ *
+ * @return 1クロックティックの時間[ns]
+ */
+uint64_t get_tick_ns(void) {
+  static uint64_t tick_ns = 0;
+  if (tick_ns == 0) {
+    tick_ns = 1000000000 / sysconf(_SC_CLK_TCK);
+  }
+  return tick_ns;
+}
+
+/**
+ * @brief タイマーを開始する
+ *
+ * @param[out] ticker      初期化するタイマー
+ * @param[in]  interval_ms 間隔[ms]
+ */
+void ticker_start(ticker_t *ticker, int interval_ms) {
+  ticker->interval = (uint64_t) interval_ms * 1000000;
+  ticker->last = get_monotonic();
+  ticker->next = ticker->last + ticker->interval;
+  ticker->elapsed = 0;
+  ticker->skipped = 0;
+}
+
+/**
+ * @brief 次の起床時刻まで待機する
+ *
+ * 処理が間隔を超過して起床時刻を過ぎていた場合は、
+ * 過ぎた回数を飛ばした回数として記録し、その次の起床時刻まで待機する。
+ *
+ * @param[in,out] ticker タイマー
+ */
+void ticker_wait(ticker_t *ticker) {
+  struct timespec ts;
+  uint64_t now = get_monotonic();
+  ticker->skipped = 0;
+  if (now >= ticker->next) {
+    uint64_t late = (now - ticker->next) / ticker->interval + 1;
+    ticker->skipped = late;
+    ticker->next += late * ticker->interval;
+  }
+  ts.tv_sec = ticker->next / 1000000000;
+  ts.tv_nsec = ticker->next % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+  now = get_monotonic();
+  ticker->elapsed = now - ticker->last;
+  ticker->last = now;
+  ticker->next += ticker->interval;
+}
+
+/**
+ * @brief 実測した間隔を表示する
+ *
+ * @param[in] ticker タイマー
+ */
+void show_ticker(const ticker_t *ticker) {
+  printf(" %7.3fs", (double) ticker->elapsed / 1000000000);
+}
+
+/**
+ * @brief timevalをマイクロ秒に変換する
+ *
+ * @param[in] tv 変換する値
+ * @return マイクロ秒
+ */
+uint64_t get_timeval(const struct timeval *tv) {
+  return (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/**
+ * @brief 自身の負荷の計測を開始する
+ *
+ * @param[out] overhead 初期化する計測値
+ */
+void overhead_start(overhead_t *overhead) {
+  memset(overhead, 0, sizeof(overhead_t));
+  getrusage(RUSAGE_SELF, &overhead->usage);
+}
+
+/**
+ * @brief 走査の開始時刻を記録する
+ *
+ * @param[in,out] overhead 計測値
+ */
+void overhead_begin(overhead_t *overhead) {
+  overhead->start = get_monotonic();
+}
+
+/**
+ * @brief 走査の所要時間と前回計測からのCPU時間を記録する
+ *
+ * CPU時間はワーカースレッドを含むプロセス全体の値で、
+ * 結果表示など走査以外の処理も含む。
+ *
+ * @param[in,out] overhead 計測値
+ */
+void overhead_end(overhead_t *overhead) {
+  struct rusage usage;
+  overhead->scan = get_monotonic() - overhead->start;
+  getrusage(RUSAGE_SELF, &usage);
+  overhead->utime = get_timeval(&usage.ru_utime) - get_timeval(&overhead->usage.ru_utime);
+  overhead->stime = get_timeval(&usage.ru_stime) - get_timeval(&overhead->usage.ru_stime);
+  overhead->usage = usage;
+}
+
+/**
+ * @brief 自身の負荷を表示
+ *
+ * @param[in] overhead 計測値
+ * @param[in] opened   今回の走査で開いたファイル数
+ * @param[in] task_num 今回の走査で読みだしたタスク数
+ */
+void show_overhead(const overhead_t *overhead, int opened, int task_num) {
+  printf("self: scan %7.3fms user %7.3fms sys %7.3fms open %5d files %5d tasks\n",
+         (double) overhead->scan / 1000000,
+         (double) overhead->utime / 1000,
+         (double) overhead->stime / 1000,
+         opened, task_num);
+}
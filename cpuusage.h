@@ -0,0 +1,355 @@
+/**
+ * @file cpuusage.h
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief CPU使用率調査コマンドの共通処理
+ *
+ * /proc/statの読み出し、CPU時間の差分、タスクのstatのパース、
+ * タスクの負荷計算と上位選択を提供する。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#ifndef CPUUSAGE_H_
+#define CPUUSAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include "def.h"
+#include "feature.h"
+
+/**
+ * サンプリング間隔の初期値[ms]
+ */
+#define DEFAULT_INTERVAL_MS 5000
+/**
+ * サンプリング間隔の下限[ms]
+ */
+#define MIN_INTERVAL_MS 10
+/**
+ * procファイルシステムのマウント位置の初期値
+ */
+#define DEFAULT_PROC_ROOT "/proc"
+
+/**
+ * statのCPUカウンタ記録用構造体
+ */
+typedef struct cputime_t {
+  uint64_t user;       /**< ユーザーモードで消費した時間 */
+  uint64_t nice;       /**< 低い優先度のユーザーモードで消費した時間 */
+  uint64_t system;     /**< システムモードで消費した時間 */
+  uint64_t idle;       /**< タスク待ちで消費した時間 */
+  uint64_t iowait;     /**< I/O の完了待ちの時間 */
+  uint64_t irq;        /**< 割り込みの処理に使った時間 */
+  uint64_t softirq;    /**< ソフト割り込みの処理に使った時間 */
+  uint64_t steal;      /**< 仮想環境下で他のOSに消費された時間 */
+  uint64_t guest;      /**< ゲストOSの実行に消費された時間 */
+  uint64_t guest_nice; /**< 低い優先度のゲストOSの実行に消費された時間 */
+} cputime_t;
+
+/**
+ * 全CPU時間のスナップショット
+ *
+ * times[0]〜times[num - 1]が各コア、times[num]がCPU全体の値。
+ */
+typedef struct snapshot_t {
+  int num;            /**< CPUの個数 */
+  cputime_t *times;   /**< CPU時間 */
+} snapshot_t;
+
+/**
+ * cputime_tのフィールド数
+ */
+#define CPUTIME_FIELDS (sizeof(cputime_t) / sizeof(uint64_t))
+
+/**
+ * 各コアのCPU時間を格納する列優先の行列
+ *
+ * counters[field * stride + cpu]にcputime_tのfield番目の値を格納する。
+ * strideはSIMDのレーン数の倍数とし、余りの列は0で埋める。
+ * 列は/proc/statのcpuNの番号で対応付け、オフラインのコアの列は0とする。
+ */
+typedef struct cpu_matrix_t {
+  int num;            /**< CPUの個数(コア番号の上限) */
+  int stride;         /**< 1フィールドあたりの列数 */
+  uint64_t *counters; /**< CPU時間 */
+  char *online;       /**< 各コアがオンラインの場合TRUE */
+  int online_num;     /**< オンラインのコアの個数 */
+} cpu_matrix_t;
+
+/**
+ * 各コアの使用率の計算結果
+ *
+ * 各配列はSIMDのレーン数の倍数の長さで確保する。
+ * 前後どちらかでオフラインだったコアは差分を0とし、onlineをFALSEとする。
+ */
+typedef struct cpu_usage_t {
+  int num;              /**< CPUの個数 */
+  uint64_t *total;      /**< 各コアの全時間の差分 */
+  uint64_t *load;       /**< 各コアの負荷の差分 */
+  float *usage;         /**< 各コアの使用率[%] */
+  char *online;         /**< 前後の両方でオンラインだったコアはTRUE */
+} cpu_usage_t;
+
+/**
+ * /proc/stat読み出し用のハンドル
+ */
+typedef struct stat_sampler_t stat_sampler_t;
+
+/**
+ * /proc/[pid]/statから読みだすタスクの値
+ */
+typedef struct task_stat_t {
+  char state;         /**< state */
+  uint64_t utime;     /**< ユーザ時間 */
+  uint64_t stime;     /**< システム時間 */
+  uint64_t cutime;    /**< 子プロセスのユーザ時間 */
+  uint64_t cstime;    /**< 子プロセスのシステム時間 */
+  int64_t priority;   /**< プライオリティ */
+  int64_t nice;       /**< nice値 */
+  uint64_t starttime; /**< 起動時刻 */
+  int processor;      /**< 最後に実行したCPU、parse_task_stat_schedのみ読み出す */
+} task_stat_t;
+
+/**
+ * タスクの負荷計算に使う列の参照
+ *
+ * 各配列は呼び出し側が所有し、idの昇順に並んでいること。
+ */
+typedef struct task_columns_t {
+  int num;             /**< タスク数 */
+  const int *id;       /**< PIDまたはTID */
+  const uint64_t *utime;     /**< ユーザ時間 */
+  const uint64_t *stime;     /**< システム時間 */
+  const uint64_t *starttime; /**< 起動時刻 */
+  uint64_t *load;      /**< 負荷の書き込み先 */
+  const int *pid;      /**< PID、task_rankのPIDでの絞り込みに使う */
+  const int64_t *nice; /**< nice値、task_rankのRANK_KEY_NICEに使う */
+  const char *comm;    /**< 名前の文字列テーブル、task_rankの名前での絞り込みに使う */
+  size_t comm_size;    /**< 名前の文字列テーブルの1要素のサイズ */
+  const uint64_t *delay; /**< 前回からの実行待ち時間、task_rankのRANK_KEY_DELAYに使う */
+} task_columns_t;
+
+/**
+ * 負荷(前回からのCPU時間)で並べる
+ */
+#define RANK_KEY_CPU   0
+/**
+ * 起動からのCPU時間で並べる
+ */
+#define RANK_KEY_TOTAL 1
+/**
+ * 起動からのユーザ時間で並べる
+ */
+#define RANK_KEY_UTIME 2
+/**
+ * 起動からのシステム時間で並べる
+ */
+#define RANK_KEY_STIME 3
+/**
+ * nice値の昇順で並べる
+ */
+#define RANK_KEY_NICE  4
+/**
+ * 前回からの実行待ち時間で並べる
+ */
+#define RANK_KEY_DELAY 5
+/**
+ * 選択する件数の初期値
+ */
+#define DEFAULT_RANK_NUM 10
+/**
+ * 絞り込みに指定できるPIDの個数
+ */
+#define RANK_PIDS 64
+
+/**
+ * タスクの上位選択の条件
+ */
+typedef struct rank_t {
+  int key;              /**< RANK_KEY_* */
+  int num;              /**< 選択する件数、0の場合全件 */
+  int pid_num;          /**< 絞り込むPIDの個数、0の場合絞り込まない */
+  int pids[RANK_PIDS];  /**< 絞り込むPID */
+  const char *comm;     /**< 名前に含む文字列、NULLの場合絞り込まない */
+} rank_t;
+
+#if FEATURE_TASKS
+/**
+ * statファイルのfdキャッシュのエントリ
+ *
+ * テーブル上ではエントリの直後に呼び出し側が指定したサイズの領域が続き、
+ * fd_entry_dataで参照する。
+ */
+typedef struct fd_entry_t {
+  uint64_t key;       /**< キー(PID/TID) */
+  int fd;             /**< ファイルディスクリプタ、未使用の場合-1 */
+  uint32_t seen;      /**< 最後に参照されたサンプリング世代 */
+  uint64_t starttime; /**< 起動時刻、未確認の場合0 */
+  int idle;           /**< CPU時間が変化しなかった連続回数 */
+  uint64_t utime;     /**< 最後に記録したユーザ時間 */
+  uint64_t stime;     /**< 最後に記録したシステム時間 */
+} fd_entry_t;
+
+/**
+ * statファイルのfdキャッシュ
+ *
+ * PID/TIDをキーとするオープンアドレス法のハッシュテーブルで、
+ * サンプリングをまたいでfdを開いたまま保持する。
+ * 登録と削除はテーブルの構造を変えるため、複数スレッドから参照している間は行わないこと。
+ */
+typedef struct fd_cache_t {
+  char *entries;       /**< ハッシュテーブル、strideバイトごとにエントリが並ぶ */
+  size_t stride;       /**< エントリと付随する領域を合わせたサイズ */
+  size_t data_size;    /**< エントリに付随する領域のサイズ */
+  int size;            /**< テーブルサイズ(2のべき乗) */
+  int num;             /**< 格納数 */
+  int limit;           /**< 保持するfdの上限 */
+  uint32_t generation; /**< サンプリング世代、呼び出し側がサンプリングごとに進める */
+  int adaptive;        /**< 間引きを始めるアイドル回数、0の場合は間引かない */
+} fd_cache_t;
+
+/**
+ * 走査を分担するワーカースレッドの集合
+ */
+typedef struct pool_t pool_t;
+
+/**
+ * ワーカーで実行する処理
+ *
+ * indexは0〜ワーカー数-1のワーカー番号で、0番は呼び出し元スレッドで実行する。
+ */
+typedef void (*pool_func_t)(void *arg, int index);
+#endif
+
+/**
+ * 一定間隔で起床するためのタイマー
+ *
+ * 起床時刻は開始時刻から間隔の整数倍の位置に固定し、
+ * 処理時間による遅れを蓄積させない。
+ */
+typedef struct ticker_t {
+  uint64_t interval; /**< 間隔[ns] */
+  uint64_t next;     /**< 次の起床時刻[ns] */
+  uint64_t last;     /**< 前回の起床時刻[ns] */
+  uint64_t elapsed;  /**< 前回の起床からの実測間隔[ns] */
+  int skipped;       /**< 直前の待機で間に合わず飛ばした回数 */
+} ticker_t;
+
+/**
+ * 自身の負荷の計測値
+ */
+typedef struct overhead_t {
+  uint64_t start;       /**< 走査開始時刻[ns] */
+  uint64_t scan;        /**< 走査にかかった時間[ns] */
+  struct rusage usage;  /**< 前回計測時点のリソース使用量 */
+  uint64_t utime;       /**< 前回計測からのユーザ時間[us] */
+  uint64_t stime;       /**< 前回計測からのシステム時間[us] */
+} overhead_t;
+
+void *xmalloc(size_t size);
+void *xrealloc(void *ptr, size_t size);
+
+uint64_t get_total(cputime_t *time);
+uint64_t get_load(cputime_t *time);
+uint64_t get_idle(cputime_t *time);
+uint64_t get_iowait(cputime_t *time);
+uint64_t get_system(cputime_t *time);
+uint64_t get_user(cputime_t *time);
+uint64_t get_irq(cputime_t *time);
+uint64_t get_guest(cputime_t *time);
+void get_diff(cputime_t *before, cputime_t *after, cputime_t *diff);
+
+void set_proc_root(const char *root);
+const char *get_proc_root(void);
+int is_default_proc_root(void);
+
+snapshot_t *new_snapshot_t(int num);
+void delete_snapshot_t(snapshot_t *snapshot);
+void snapshot_delta(snapshot_t *before, snapshot_t *after, snapshot_t *delta);
+
+#if FEATURE_CORES
+cpu_matrix_t *new_cpu_matrix_t(int num);
+void delete_cpu_matrix_t(cpu_matrix_t *matrix);
+void cpu_matrix_store(cpu_matrix_t *matrix, const cputime_t *times);
+void cpu_matrix_diff(const cpu_matrix_t *before, const cpu_matrix_t *after, cputime_t *diff);
+void cpu_matrix_usage(const cpu_matrix_t *before, const cpu_matrix_t *after, cpu_usage_t *usage);
+cpu_usage_t *new_cpu_usage_t(int num);
+void delete_cpu_usage_t(cpu_usage_t *usage);
+#endif
+
+stat_sampler_t *new_stat_sampler_t(void);
+void delete_stat_sampler_t(stat_sampler_t *sampler);
+const char *stat_sampler_read_file(stat_sampler_t *sampler);
+result_t stat_sampler_read(stat_sampler_t *sampler, cputime_t *times, int num);
+result_t snapshot_read(stat_sampler_t *sampler, snapshot_t *snapshot);
+#if FEATURE_CORES
+result_t stat_sampler_read_matrix(stat_sampler_t *sampler, cputime_t *total, cpu_matrix_t *cores);
+#endif
+int stat_sampler_count_cpus(stat_sampler_t *sampler);
+
+char *scan_uint64(char *p, uint64_t *value);
+int parse_cputime(char *p, cputime_t *time);
+int count_cpus(const char *stat);
+result_t parse_cpus(char *buf, cputime_t *times, int num);
+#if FEATURE_CORES
+result_t parse_cpus_matrix(char *buf, cputime_t *total, cpu_matrix_t *cores);
+#endif
+#if FEATURE_TASKS
+result_t parse_task_stat(char *line, char *comm, size_t comm_size, task_stat_t *stat);
+result_t parse_task_stat_sched(char *line, char *comm, size_t comm_size, task_stat_t *stat);
+result_t parse_schedstat(char *line, uint64_t *runtime, uint64_t *run_delay);
+
+uint64_t *radix_sort(uint64_t *data, uint64_t *tmp, int num);
+void task_delta(const task_columns_t *before, task_columns_t *after);
+int task_top(const task_columns_t *tasks, int n, int *order);
+int parse_rank_key(const char *name);
+void rank_init(rank_t *rank);
+result_t rank_add_pids(rank_t *rank, const char *list);
+int task_rank(const task_columns_t *tasks, const rank_t *rank, int *order);
+
+int get_fd_limit(void);
+int open_stat_at(int dir_fd, const char *name, const char *file);
+ssize_t read_fd(int fd, char *buf, size_t size);
+result_t reread_fd(int fd, char *buf, size_t size);
+result_t read_stat_open(int dir_fd, const char *name, const char *file,
+                        char *buf, size_t size, int *fd);
+fd_cache_t *new_fd_cache_t(int limit, size_t data_size);
+void delete_fd_cache_t(fd_cache_t *cache);
+fd_entry_t *fd_cache_find(fd_cache_t *cache, uint64_t key);
+fd_entry_t *fd_cache_insert(fd_cache_t *cache, uint64_t key, int fd);
+void fd_cache_remove(fd_cache_t *cache, fd_entry_t *entry);
+result_t fd_cache_check(fd_entry_t *entry, uint64_t starttime);
+int fd_cache_reuse(fd_cache_t *cache, fd_entry_t *entry, uint64_t key);
+void fd_cache_record(fd_cache_t *cache, fd_entry_t *entry,
+                     uint64_t utime, uint64_t stime, const void *data);
+void fd_cache_sweep(fd_cache_t *cache);
+void *fd_entry_data(fd_entry_t *entry);
+
+int list_pids(DIR *dir, int **pids, int *array_num);
+pool_t *new_pool_t(int num, pool_func_t func, void *arg);
+void delete_pool_t(pool_t *pool);
+void pool_run(pool_t *pool);
+#endif
+
+uint64_t get_monotonic(void);
+uint64_t get_tick_ns(void);
+void ticker_start(ticker_t *ticker, int interval_ms);
+void ticker_wait(ticker_t *ticker);
+void show_ticker(const ticker_t *ticker);
+
+uint64_t get_timeval(const struct timeval *tv);
+void overhead_start(overhead_t *overhead);
+void overhead_begin(overhead_t *overhead);
+void overhead_end(overhead_t *overhead);
+void show_overhead(const overhead_t *overhead, int opened, int task_num);
+
+#endif /* CPUUSAGE_H_ */
@@ -0,0 +1,684 @@
+/**
+ * @file cpuusage_bench.c
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief libcpuusageのベンチマーク
+ *
+ * /procのスナップショットを記録、または合成して繰り返し処理し、
+ * パース・並べ替え・差分・上位選択の各段階のタスクあたりの処理時間を表示する。
+ * スナップショットは/procと同じ構成のディレクトリとして書き出すことができ、
+ * 各コマンドの--proc-rootに指定して同じ条件で繰り返し計測できる。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "cpuusage.h"
+
+/**
+ * スナップショットの記録数の初期値
+ */
+#define DEFAULT_RECORDS 2
+/**
+ * 記録の間隔の初期値[ms]
+ */
+#define DEFAULT_RECORD_INTERVAL_MS 100
+/**
+ * 繰り返し回数の初期値
+ */
+#define DEFAULT_LOOPS 200
+/**
+ * 上位選択の件数
+ */
+#define BENCH_TOP_NUM 10
+/**
+ * 読み出しバッファの初期サイズ
+ */
+#define READ_BUFFER_SIZE 1024
+/**
+ * エントリ配列の初期値
+ */
+#define INIT_ENTRIES 256
+/**
+ * 合成するstatの1行のバッファサイズ
+ */
+#define SYNTH_LINE_SIZE 320
+/**
+ * 合成するCPUの個数
+ */
+#define SYNTH_CPUS 8
+/**
+ * 合成するプロセスあたりのスレッド数
+ */
+#define SYNTH_THREADS 4
+/**
+ * 合成する最初のPID
+ */
+#define SYNTH_FIRST_PID 1000
+
+/**
+ * 記録したタスクのstat
+ */
+typedef struct entry_t {
+  int pid;             /**< PID */
+  int tid;             /**< TID、プロセスのstatの場合はPIDと同じ */
+  char *line;          /**< statの内容 */
+} entry_t;
+
+/**
+ * 記録したタスクのstatの配列
+ */
+typedef struct entry_list_t {
+  entry_t *entries;    /**< エントリ */
+  int num;             /**< エントリ数 */
+  int array_num;       /**< 配列の長さ */
+} entry_list_t;
+
+/**
+ * 記録した1回分のスナップショット
+ */
+typedef struct record_t {
+  char *stat;          /**< /proc/statの内容 */
+  entry_list_t procs;  /**< 各プロセスの/proc/[pid]/statの内容 */
+  entry_list_t tasks;  /**< 各タスクの/proc/[pid]/task/[tid]/statの内容 */
+} record_t;
+
+/**
+ * パースしたタスク情報の列
+ */
+typedef struct table_t {
+  int num;             /**< タスク数 */
+  int *id;             /**< TID */
+  uint64_t *utime;     /**< ユーザ時間 */
+  uint64_t *stime;     /**< システム時間 */
+  uint64_t *starttime; /**< 起動時刻 */
+  uint64_t *load;      /**< 負荷 */
+  int *sorted_id;      /**< TID昇順に並べ替えたTID */
+  uint64_t *sorted_utime;     /**< TID昇順に並べ替えたユーザ時間 */
+  uint64_t *sorted_stime;     /**< TID昇順に並べ替えたシステム時間 */
+  uint64_t *sorted_starttime; /**< TID昇順に並べ替えた起動時刻 */
+  uint64_t *keys;      /**< 並べ替えのキー */
+  uint64_t *tmp;       /**< 並べ替えの作業領域 */
+} table_t;
+
+static char *read_file(const char *path);
+static result_t write_file(const char *path, const char *text);
+static void add_entry(entry_list_t *list, int pid, int tid, char *line);
+static result_t record_proc(record_t *record, stat_sampler_t *sampler);
+static char *synth_task_stat(int tid, int pid, int threads, uint64_t utime);
+static void synth_record(record_t *record, int task_num, int seq);
+static result_t capture_record(record_t *record, const char *dir);
+static void delete_records(record_t *records, int num);
+static table_t *new_table_t(int num);
+static void delete_table_t(table_t *table);
+static int parse_record(record_t *record, snapshot_t *snapshot, table_t *table);
+static void sort_table(table_t *table);
+static void get_columns(table_t *table, task_columns_t *columns);
+
+/**
+ * @brief ファイル全体を読み出す
+ *
+ * @param[in] path 読み出すファイル
+ * @return NUL終端された内容、失敗した場合NULL
+ */
+static char *read_file(const char *path) {
+  size_t buf_size = READ_BUFFER_SIZE;
+  size_t len = 0;
+  char *buf;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  buf = xmalloc(buf_size);
+  while (TRUE) {
+    ssize_t n = read(fd, buf + len, buf_size - len - 1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      free(buf);
+      close(fd);
+      return NULL;
+    }
+    if (n == 0) {
+      break;
+    }
+    len += n;
+    if (len == buf_size - 1) {
+      buf_size *= 2;
+      buf = xrealloc(buf, buf_size);
+    }
+  }
+  close(fd);
+  buf[len] = 0;
+  return buf;
+}
+
+/**
+ * @brief ファイルへ書き出す
+ *
+ * @param[in] path 書き出すファイル
+ * @param[in] text 書き出す内容
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t write_file(const char *path, const char *text) {
+  size_t len = strlen(text);
+  size_t pos = 0;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    ERR("%s: %s\n", path, strerror(errno));
+    return FAILURE;
+  }
+  while (pos < len) {
+    ssize_t n = write(fd, text + pos, len - pos);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ERR("%s: %s\n", path, strerror(errno));
+      close(fd);
+      return FAILURE;
+    }
+    pos += n;
+  }
+  if (close(fd) != 0) {
+    ERR("%s: %s\n", path, strerror(errno));
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief 配列にエントリを追加する
+ *
+ * @param[in,out] list 追加先
+ * @param[in]     pid  PID
+ * @param[in]     tid  TID
+ * @param[in]     line statの内容、listが所有する
+ */
+static void add_entry(entry_list_t *list, int pid, int tid, char *line) {
+  entry_t *entry;
+  if (list->num == list->array_num) {
+    list->array_num = list->array_num ? list->array_num * 2 : INIT_ENTRIES;
+    list->entries = xrealloc(list->entries, list->array_num * sizeof(entry_t));
+  }
+  entry = &list->entries[list->num++];
+  entry->pid = pid;
+  entry->tid = tid;
+  entry->line = line;
+}
+
+/**
+ * @brief procファイルシステムをスナップショットとして記録する
+ *
+ * --proc-rootが指定されている場合はそのディレクトリから記録する。
+ *
+ * @param[out]    record  記録先
+ * @param[in,out] sampler /proc/statの読み出しに使う構造体
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t record_proc(record_t *record, stat_sampler_t *sampler) {
+  const char *root = get_proc_root();
+  const char *stat;
+  struct dirent *dent;
+  DIR *proc_dir;
+  stat = stat_sampler_read_file(sampler);
+  if (stat == NULL) {
+    return FAILURE;
+  }
+  record->stat = strdup(stat);
+  proc_dir = opendir(root);
+  if (proc_dir == NULL) {
+    ERR("%s: %s\n", root, strerror(errno));
+    return FAILURE;
+  }
+  while ((dent = readdir(proc_dir)) != NULL) {
+    char path[PATH_MAX];
+    struct dirent *tent;
+    DIR *task_dir;
+    char *line;
+    int pid;
+    if (dent->d_name[0] < '0' || dent->d_name[0] > '9') {
+      continue;
+    }
+    pid = atoi(dent->d_name);
+    if (snprintf(path, sizeof(path), "%s/%d/stat", root, pid) >= sizeof(path)) {
+      continue;
+    }
+    line = read_file(path);
+    if (line == NULL) {
+      continue;
+    }
+    add_entry(&record->procs, pid, pid, line);
+    snprintf(path, sizeof(path), "%s/%d/task", root, pid);
+    task_dir = opendir(path);
+    if (task_dir == NULL) {
+      continue;
+    }
+    while ((tent = readdir(task_dir)) != NULL) {
+      int tid;
+      if (tent->d_name[0] < '0' || tent->d_name[0] > '9') {
+        continue;
+      }
+      tid = atoi(tent->d_name);
+      if (snprintf(path, sizeof(path), "%s/%d/task/%d/stat", root, pid, tid) >= sizeof(path)) {
+        continue;
+      }
+      line = read_file(path);
+      if (line != NULL) {
+        add_entry(&record->tasks, pid, tid, line);
+      }
+    }
+    closedir(task_dir);
+  }
+  closedir(proc_dir);
+  return SUCCESS;
+}
+
+/**
+ * @brief 合成したタスクのstatを作成する
+ *
+ * フィールドの並びは実際の/proc/[pid]/task/[tid]/statと同じにする。
+ *
+ * @param[in] tid     TID
+ * @param[in] pid     PID
+ * @param[in] threads プロセスのスレッド数
+ * @param[in] utime   ユーザ時間
+ * @return statの内容
+ */
+static char *synth_task_stat(int tid, int pid, int threads, uint64_t utime) {
+  char *line = xmalloc(SYNTH_LINE_SIZE);
+  snprintf(line, SYNTH_LINE_SIZE,
+           "%d (synth-%d) S 1 %d %d 0 -1 4194304 100 0 0 0 %lu %lu 0 0 20 0 %d 0 %d"
+           " 10485760 256 18446744073709551615 1 1 0 0 0 0 0 0 0 0 0 0 17 0 0 0 0 0 0\n",
+           tid, pid, pid, pid, utime, utime / 2, threads, pid);
+  return line;
+}
+
+/**
+ * @brief 合成したスナップショットを作成する
+ *
+ * SYNTH_THREADSスレッドずつのプロセスにtask_num個のタスクを割り当て、
+ * スナップショットの番号に比例してCPU時間を増やす。
+ *
+ * @param[out] record   記録先
+ * @param[in]  task_num タスク数
+ * @param[in]  seq      スナップショットの番号
+ */
+static void synth_record(record_t *record, int task_num, int seq) {
+  size_t size = (SYNTH_CPUS + 4) * 64;
+  int len;
+  int i, j;
+  record->stat = xmalloc(size);
+  len = snprintf(record->stat, size, "cpu  %d 0 %d %d 0 0 0 0 0 0\n",
+                 SYNTH_CPUS * 1000 * (seq + 1), SYNTH_CPUS * 500 * (seq + 1),
+                 SYNTH_CPUS * 100000 * (seq + 1));
+  for (i = 0; i < SYNTH_CPUS; i++) {
+    len += snprintf(record->stat + len, size - len, "cpu%d %d 0 %d %d 0 0 0 0 0 0\n",
+                    i, 1000 * (seq + 1), 500 * (seq + 1), 100000 * (seq + 1));
+  }
+  snprintf(record->stat + len, size - len, "intr 0\nctxt 0\nbtime 1458518400\n");
+  for (i = 0; i < task_num; i += SYNTH_THREADS) {
+    int pid = SYNTH_FIRST_PID + i;
+    int threads = task_num - i < SYNTH_THREADS ? task_num - i : SYNTH_THREADS;
+    uint64_t total = 0;
+    for (j = 0; j < threads; j++) {
+      uint64_t utime = (uint64_t) ((pid + j) % 13) * (seq + 1);
+      add_entry(&record->tasks, pid, pid + j, synth_task_stat(pid + j, pid, threads, utime));
+      total += utime;
+    }
+    add_entry(&record->procs, pid, pid, synth_task_stat(pid, pid, threads, total));
+  }
+}
+
+/**
+ * @brief スナップショットを/procと同じ構成のディレクトリへ書き出す
+ *
+ * dir/stat、dir/[pid]/stat、dir/[pid]/task/[tid]/statを作成する。
+ *
+ * @param[in] record 書き出すスナップショット
+ * @param[in] dir    書き出し先
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t capture_record(record_t *record, const char *dir) {
+  char path[PATH_MAX];
+  int i;
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    ERR("%s: %s\n", dir, strerror(errno));
+    return FAILURE;
+  }
+  snprintf(path, sizeof(path), "%s/stat", dir);
+  if (write_file(path, record->stat) != SUCCESS) {
+    return FAILURE;
+  }
+  for (i = 0; i < record->procs.num; i++) {
+    entry_t *entry = &record->procs.entries[i];
+    snprintf(path, sizeof(path), "%s/%d", dir, entry->pid);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/%d/task", dir, entry->pid);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/%d/stat", dir, entry->pid);
+    if (write_file(path, entry->line) != SUCCESS) {
+      return FAILURE;
+    }
+  }
+  for (i = 0; i < record->tasks.num; i++) {
+    entry_t *entry = &record->tasks.entries[i];
+    snprintf(path, sizeof(path), "%s/%d/task/%d", dir, entry->pid, entry->tid);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/%d/task/%d/stat", dir, entry->pid, entry->tid);
+    if (write_file(path, entry->line) != SUCCESS) {
+      return FAILURE;
+    }
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief スナップショットを開放する
+ *
+ * @param[in] records 開放するスナップショット
+ * @param[in] num     スナップショット数
+ */
+static void delete_records(record_t *records, int num) {
+  int i, j;
+  if (records == NULL) {
+    return;
+  }
+  for (i = 0; i < num; i++) {
+    for (j = 0; j < records[i].procs.num; j++) {
+      free(records[i].procs.entries[j].line);
+    }
+    for (j = 0; j < records[i].tasks.num; j++) {
+      free(records[i].tasks.entries[j].line);
+    }
+    free(records[i].procs.entries);
+    free(records[i].tasks.entries);
+    free(records[i].stat);
+  }
+  free(records);
+}
+
+/**
+ * @brief タスク情報の列を確保する
+ *
+ * @param[in] num 格納するタスク数の上限
+ * @return タスク情報の列
+ */
+static table_t *new_table_t(int num) {
+  table_t *table = xmalloc(sizeof(table_t));
+  if (num == 0) {
+    num = 1;
+  }
+  table->num = 0;
+  table->id = xmalloc(num * sizeof(int));
+  table->utime = xmalloc(num * sizeof(uint64_t));
+  table->stime = xmalloc(num * sizeof(uint64_t));
+  table->starttime = xmalloc(num * sizeof(uint64_t));
+  table->load = xmalloc(num * sizeof(uint64_t));
+  table->sorted_id = xmalloc(num * sizeof(int));
+  table->sorted_utime = xmalloc(num * sizeof(uint64_t));
+  table->sorted_stime = xmalloc(num * sizeof(uint64_t));
+  table->sorted_starttime = xmalloc(num * sizeof(uint64_t));
+  table->keys = xmalloc(num * sizeof(uint64_t));
+  table->tmp = xmalloc(num * sizeof(uint64_t));
+  return table;
+}
+
+/**
+ * @brief タスク情報の列を開放する
+ *
+ * @param[in] table 開放する列
+ */
+static void delete_table_t(table_t *table) {
+  if (table == NULL) {
+    return;
+  }
+  free(table->id);
+  free(table->utime);
+  free(table->stime);
+  free(table->starttime);
+  free(table->load);
+  free(table->sorted_id);
+  free(table->sorted_utime);
+  free(table->sorted_stime);
+  free(table->sorted_starttime);
+  free(table->keys);
+  free(table->tmp);
+  free(table);
+}
+
+/**
+ * @brief スナップショットをパースする
+ *
+ * 記録した内容はパースで書き換えないため、同じ内容を繰り返しパースできる。
+ *
+ * @param[in]  record   パースするスナップショット
+ * @param[out] snapshot CPU時間の書き込み先
+ * @param[out] table    タスク情報の書き込み先
+ * @return パースに失敗したタスク数
+ */
+static int parse_record(record_t *record, snapshot_t *snapshot, table_t *table) {
+  char comm[16];
+  int failed = 0;
+  int i;
+  if (parse_cpus(record->stat, snapshot->times, snapshot->num) != SUCCESS) {
+    failed++;
+  }
+  table->num = 0;
+  for (i = 0; i < record->tasks.num; i++) {
+    task_stat_t task;
+    uint64_t id;
+    char *line = record->tasks.entries[i].line;
+    if (scan_uint64(line, &id) == NULL
+        || parse_task_stat(line, comm, sizeof(comm), &task) != SUCCESS) {
+      failed++;
+      continue;
+    }
+    table->id[table->num] = id;
+    table->utime[table->num] = task.utime;
+    table->stime[table->num] = task.stime;
+    table->starttime[table->num] = task.starttime;
+    table->num++;
+  }
+  return failed;
+}
+
+/**
+ * @brief タスク情報をTID昇順に並べ替える
+ *
+ * @param[in,out] table 並べ替える列
+ */
+static void sort_table(table_t *table) {
+  uint64_t *sorted;
+  int i;
+  for (i = 0; i < table->num; i++) {
+    table->keys[i] = (uint64_t) table->id[i] << 32 | i;
+  }
+  sorted = radix_sort(table->keys, table->tmp, table->num);
+  for (i = 0; i < table->num; i++) {
+    int from = (uint32_t) sorted[i];
+    table->sorted_id[i] = table->id[from];
+    table->sorted_utime[i] = table->utime[from];
+    table->sorted_stime[i] = table->stime[from];
+    table->sorted_starttime[i] = table->starttime[from];
+  }
+}
+
+/**
+ * @brief 負荷計算に使う列の参照を取得する
+ *
+ * @param[in]  table   並べ替え済みの列
+ * @param[out] columns 列の参照の書き込み先
+ */
+static void get_columns(table_t *table, task_columns_t *columns) {
+  columns->num = table->num;
+  columns->id = table->sorted_id;
+  columns->utime = table->sorted_utime;
+  columns->stime = table->sorted_stime;
+  columns->starttime = table->sorted_starttime;
+  columns->load = table->load;
+  columns->pid = NULL;
+  columns->nice = NULL;
+  columns->comm = NULL;
+  columns->comm_size = 0;
+  columns->delay = NULL;
+}
+
+int main(int argc, char **argv) {
+  int result = EXIT_FAILURE;
+  record_t *records = NULL;
+  table_t **tables = NULL;
+  snapshot_t *snapshot = NULL;
+  int record_num = DEFAULT_RECORDS;
+  int interval = DEFAULT_RECORD_INTERVAL_MS;
+  int loops = DEFAULT_LOOPS;
+  int synth = 0;
+  const char *capture = NULL;
+  uint64_t parse_ns = 0;
+  uint64_t sort_ns = 0;
+  uint64_t delta_ns = 0;
+  uint64_t top_ns = 0;
+  uint64_t tasks = 0;
+  int order[BENCH_TOP_NUM];
+  int failed = 0;
+  const struct option options[] = {
+      {"proc-root", required_argument, NULL, 'R'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  int i, j;
+  while ((opt = getopt_long(argc, argv, "n:i:l:g:c:R:", options, NULL)) != -1) {
+    switch (opt) {
+      case 'n':
+        record_num = atoi(optarg);
+        break;
+      case 'i':
+        interval = atoi(optarg);
+        break;
+      case 'l':
+        loops = atoi(optarg);
+        break;
+      case 'g':
+        synth = atoi(optarg);
+        break;
+      case 'c':
+        capture = optarg;
+        break;
+      case 'R':
+        set_proc_root(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n records] [-i msec] [-l loops] [-g tasks] [-c dir] [--proc-root dir]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (record_num < 2 || interval < 0 || loops < 1 || synth < 0) {
+    fprintf(stderr, "-n: 2 or more, -i: 0 or more, -l: 1 or more, -g: 0 or more\n");
+    return EXIT_FAILURE;
+  }
+  if (capture != NULL) {
+    // 書き出すのは1回分のみ
+    record_num = 1;
+  }
+  records = xmalloc(record_num * sizeof(record_t));
+  memset(records, 0, record_num * sizeof(record_t));
+  if (synth > 0) {
+    for (i = 0; i < record_num; i++) {
+      synth_record(&records[i], synth, i);
+    }
+  } else {
+    stat_sampler_t *sampler = new_stat_sampler_t();
+    if (sampler == NULL) {
+      goto error;
+    }
+    for (i = 0; i < record_num; i++) {
+      if (i > 0) {
+        usleep(interval * 1000);
+      }
+      if (record_proc(&records[i], sampler) != SUCCESS) {
+        delete_stat_sampler_t(sampler);
+        goto error;
+      }
+    }
+    delete_stat_sampler_t(sampler);
+  }
+  if (capture != NULL) {
+    if (capture_record(&records[0], capture) != SUCCESS) {
+      goto error;
+    }
+    printf("%s: %d processes, %d tasks\n", capture, records[0].procs.num, records[0].tasks.num);
+    result = EXIT_SUCCESS;
+    goto error;
+  }
+  snapshot = new_snapshot_t(count_cpus(records[0].stat));
+  tables = xmalloc(record_num * sizeof(table_t *));
+  for (i = 0; i < record_num; i++) {
+    tables[i] = new_table_t(records[i].tasks.num);
+  }
+  for (j = 0; j < loops; j++) {
+    uint64_t start;
+    for (i = 0; i < record_num; i++) {
+      start = get_monotonic();
+      failed += parse_record(&records[i], snapshot, tables[i]);
+      parse_ns += get_monotonic() - start;
+      start = get_monotonic();
+      sort_table(tables[i]);
+      sort_ns += get_monotonic() - start;
+      tasks += tables[i]->num;
+      if (i > 0) {
+        task_columns_t before;
+        task_columns_t after;
+        get_columns(tables[i - 1], &before);
+        get_columns(tables[i], &after);
+        start = get_monotonic();
+        task_delta(&before, &after);
+        delta_ns += get_monotonic() - start;
+        start = get_monotonic();
+        task_top(&after, BENCH_TOP_NUM, order);
+        top_ns += get_monotonic() - start;
+      }
+    }
+  }
+  if (tasks == 0) {
+    fprintf(stderr, "no tasks recorded\n");
+    goto error;
+  }
+  printf("%d snapshots, %lu tasks, %d loops%s\n",
+         record_num, tasks / loops, loops, failed ? " (some tasks failed to parse)" : "");
+  printf("parse %8.1f ns/task\n", (double) parse_ns / tasks);
+  printf("sort  %8.1f ns/task\n", (double) sort_ns / tasks);
+  // 差分と上位選択は2つ目以降のスナップショットのみが対象
+  tasks -= (uint64_t) tables[0]->num * loops;
+  if (tasks > 0) {
+    printf("delta %8.1f ns/task\n", (double) delta_ns / tasks);
+    printf("top   %8.1f ns/task\n", (double) top_ns / tasks);
+  }
+  result = EXIT_SUCCESS;
+  error:
+  if (tables != NULL) {
+    for (i = 0; i < record_num; i++) {
+      delete_table_t(tables[i]);
+    }
+    free(tables);
+  }
+  delete_snapshot_t(snapshot);
+  delete_records(records, record_num);
+  return result;
+}
@@ -29,6 +29,8 @@
 #define TRUE  1 /**< 真 */
 #define FALSE 0 /**< 偽 */
 
+#define SWAP(a, b) {void *tmp = a; a = b; b = tmp;} /**< ポインタの入れ替え */
+
 /**
  * @brief 成功失敗を表現する
  */
@@ -0,0 +1,59 @@
+/**
+ * @file feature.h
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief 共通処理のコンパイル時の機能選択
+ *
+ * 各マクロはコンパイル時に-Dで上書きでき、既定値では全ての機能を含む。
+ * 機能を絞る場合は、共通処理をライブラリとせずコマンドと同じ指定でコンパイルする。
+ * 絞った機能の関数は宣言ごと除かれるため、呼び出しはコンパイルエラーとなる。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#ifndef FEATURE_H_
+#define FEATURE_H_
+
+/**
+ * /proc/statのcpu行からパースするフィールド数(4〜10)
+ *
+ * user、nice、system、idleの4つは常にパースし、以降はiowait、irq、softirq、steal、
+ * guest、guest_niceの順に含める。パースしないフィールドは0とし、集計もしない。
+ */
+#ifndef FEATURE_FIELDS
+#define FEATURE_FIELDS 10
+#endif
+
+/**
+ * 各コアのCPU時間を扱うか
+ *
+ * 0の場合は列優先の行列と各コアの使用率の計算を除き、CPU全体の行のみをパースする。
+ */
+#ifndef FEATURE_CORES
+#define FEATURE_CORES 1
+#endif
+
+/**
+ * タスクのstatのパース、負荷計算と上位選択を扱うか
+ */
+#ifndef FEATURE_TASKS
+#define FEATURE_TASKS 1
+#endif
+
+/**
+ * 共有メモリに公開されたスナップショットを読み出すクライアントを含むか
+ */
+#ifndef FEATURE_SHM
+#define FEATURE_SHM 1
+#endif
+
+#if FEATURE_FIELDS < 4 || FEATURE_FIELDS > 10
+#error "FEATURE_FIELDS: 4 to 10"
+#endif
+
+#endif /* FEATURE_H_ */
@@ -0,0 +1,276 @@
+/**
+ * @file format.c
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief 機械可読な出力形式
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "format.h"
+
+/**
+ * バッファの初期容量
+ */
+#define FORMAT_SIZE 4096
+
+static size_t binary_cores_size(uint32_t cpu_num);
+
+/**
+ * @brief 出力形式の名前を解釈する
+ *
+ * @param[in] name text/json/binary
+ * @return FORMAT_*、不明な名前の場合-1
+ */
+int parse_format(const char *name) {
+  if (strcmp(name, "text") == 0) {
+    return FORMAT_TEXT;
+  }
+  if (strcmp(name, "json") == 0) {
+    return FORMAT_JSON;
+  }
+  if (strcmp(name, "binary") == 0) {
+    return FORMAT_BINARY;
+  }
+  return -1;
+}
+
+/**
+ * @brief 出力バッファを作成する
+ *
+ * @return 出力バッファ
+ */
+format_t *new_format_t(void) {
+  format_t *format = xmalloc(sizeof(format_t));
+  format->buf = xmalloc(FORMAT_SIZE);
+  format->len = 0;
+  format->cap = FORMAT_SIZE;
+  return format;
+}
+
+/**
+ * @brief 出力バッファを開放する
+ *
+ * @param[in] format 開放する出力バッファ
+ */
+void delete_format_t(format_t *format) {
+  if (format == NULL) {
+    return;
+  }
+  free(format->buf);
+  free(format);
+}
+
+/**
+ * @brief 出力バッファを空にする
+ *
+ * 確保済みの領域は次の書き込みで再利用する。
+ *
+ * @param[in,out] format 出力バッファ
+ */
+void format_reset(format_t *format) {
+  format->len = 0;
+}
+
+/**
+ * @brief 末尾に指定サイズの領域を確保する
+ *
+ * 返した領域は次にバッファへ書き込むまで有効。
+ *
+ * @param[in,out] format 出力バッファ
+ * @param[in]     size   確保するサイズ
+ * @return 確保した領域の先頭
+ */
+void *format_reserve(format_t *format, size_t size) {
+  char *p;
+  if (format->len + size > format->cap) {
+    while (format->len + size > format->cap) {
+      format->cap *= 2;
+    }
+    format->buf = xrealloc(format->buf, format->cap);
+  }
+  p = format->buf + format->len;
+  format->len += size;
+  return p;
+}
+
+/**
+ * @brief 文字列をそのまま追記する
+ *
+ * @param[in,out] format 出力バッファ
+ * @param[in]     str    追記する文字列
+ */
+void format_str(format_t *format, const char *str) {
+  size_t len = strlen(str);
+  memcpy(format_reserve(format, len), str, len);
+}
+
+/**
+ * @brief 符号なし整数を10進数で追記する
+ *
+ * @param[in,out] format 出力バッファ
+ * @param[in]     value  追記する値
+ */
+void format_uint(format_t *format, uint64_t value) {
+  char tmp[20];
+  int len = 0;
+  do {
+    tmp[sizeof(tmp) - ++len] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  memcpy(format_reserve(format, len), tmp + sizeof(tmp) - len, len);
+}
+
+/**
+ * @brief 符号付き整数を10進数で追記する
+ *
+ * @param[in,out] format 出力バッファ
+ * @param[in]     value  追記する値
+ */
+void format_int(format_t *format, int64_t value) {
+  if (value < 0) {
+    *(char *) format_reserve(format, 1) = '-';
+    format_uint(format, -(uint64_t) value);
+    return;
+  }
+  format_uint(format, value);
+}
+
+/**
+ * @brief 0.1単位の固定小数点数を小数点以下1桁で追記する
+ *
+ * @param[in,out] format 出力バッファ
+ * @param[in]     value  追記する値(123なら"12.3")
+ */
+void format_permille(format_t *format, uint64_t value) {
+  char *p;
+  format_uint(format, value / 10);
+  p = format_reserve(format, 2);
+  p[0] = '.';
+  p[1] = '0' + value % 10;
+}
+
+/**
+ * @brief 文字列をJSONの文字列として追記する
+ *
+ * タスク名は任意のバイト列であるため、制御文字と0x80以上のバイトは
+ * \\u00XX形式でエスケープし、常に正しいJSONとなるようにする。
+ *
+ * @param[in,out] format 出力バッファ
+ * @param[in]     str    追記する文字列
+ * @param[in]     max    最大長、NUL終端されていない場合もここで打ち切る
+ */
+void format_json_str(format_t *format, const char *str, size_t max) {
+  static const char hex[] = "0123456789abcdef";
+  size_t i;
+  char *p = format_reserve(format, max * 6 + 2);
+  *p++ = '"';
+  for (i = 0; i < max && str[i] != 0; i++) {
+    unsigned char c = str[i];
+    if (c == '"' || c == '\\') {
+      *p++ = '\\';
+      *p++ = c;
+    } else if (c < 0x20 || c >= 0x80) {
+      *p++ = '\\';
+      *p++ = 'u';
+      *p++ = '0';
+      *p++ = '0';
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 0xf];
+    } else {
+      *p++ = c;
+    }
+  }
+  *p++ = '"';
+  format->len = p - format->buf;
+}
+
+/**
+ * @brief 現在時刻を取得する
+ *
+ * @return CLOCK_REALTIMEの時刻[ns]
+ */
+uint64_t get_realtime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief 割合を0.1%単位の整数で求める
+ *
+ * 表示と同じく四捨五入し、uint16_tの範囲に収める。
+ *
+ * @param[in] value 値
+ * @param[in] total 合計値、0の場合は0を返す
+ * @return 0.1%単位の割合
+ */
+uint16_t get_permille(uint64_t value, uint64_t total) {
+  uint64_t permille;
+  if (total == 0) {
+    return 0;
+  }
+  permille = (value * 1000 + total / 2) / total;
+  return permille > UINT16_MAX ? UINT16_MAX : permille;
+}
+
+/**
+ * @brief バイナリ形式のレコードの各コアの使用率の位置を求める
+ *
+ * 各コアの使用率の後ろは8バイト境界まで詰められている。
+ *
+ * @param[in] cpu_num CPUの個数
+ * @return ヘッダの末尾から最初のタスクまでのバイト数
+ */
+static size_t binary_cores_size(uint32_t cpu_num) {
+  return (sizeof(uint16_t) * cpu_num + 7) & ~(size_t) 7;
+}
+
+/**
+ * @brief バイナリ形式の1レコードとして解釈できるかを調べる
+ *
+ * @param[in] buf レコード
+ * @param[in] len レコードのサイズ
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+result_t binary_check(const void *buf, size_t len) {
+  const binary_record_t *record = buf;
+  if (len < sizeof(binary_record_t)
+      || record->size != len
+      || record->version != BINARY_VERSION
+      || len != sizeof(binary_record_t) + binary_cores_size(record->cpu_num)
+          + sizeof(binary_task_t) * record->task_num) {
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief バイナリ形式のレコードの各コアの使用率を返す
+ *
+ * @param[in] record binary_checkで確認したレコード
+ * @return cpu_num個の各コアの使用率
+ */
+const uint16_t *binary_cores(const binary_record_t *record) {
+  return (const uint16_t *) (record + 1);
+}
+
+/**
+ * @brief バイナリ形式のレコードのタスクを返す
+ *
+ * @param[in] record binary_checkで確認したレコード
+ * @return task_num個のタスク
+ */
+const binary_task_t *binary_tasks(const binary_record_t *record) {
+  return (const binary_task_t *) ((const char *) (record + 1) + binary_cores_size(record->cpu_num));
+}
@@ -0,0 +1,124 @@
+/**
+ * @file format.h
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief 機械可読な出力形式
+ *
+ * 1回の計測結果を1レコードとして、JSON Lines形式または長さ付きバイナリ形式で書き出す。
+ * 整数・固定小数点は自前で文字列化し、再利用するバッファへ追記するため、
+ * 定常状態ではメモリ確保やprintfを行わない。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#ifndef FORMAT_H_
+#define FORMAT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cpuusage.h"
+
+/**
+ * 人が読むための表示
+ */
+#define FORMAT_TEXT   0
+/**
+ * JSON Lines形式
+ */
+#define FORMAT_JSON   1
+/**
+ * 長さ付きバイナリ形式
+ */
+#define FORMAT_BINARY 2
+
+/**
+ * バイナリ形式のバージョン
+ */
+#define BINARY_VERSION 1
+/**
+ * バイナリ形式でタスクとしてスレッドを記録していることを示すフラグ
+ */
+#define BINARY_FLAG_THREADS 0x1
+/**
+ * バイナリ形式でタスクの負荷をクロックティックではなく[ns]で記録していることを示すフラグ
+ */
+#define BINARY_FLAG_NS 0x2
+/**
+ * バイナリ形式で前後どちらかの計測でオフラインだったコアの使用率
+ */
+#define BINARY_CORE_OFFLINE UINT16_MAX
+/**
+ * バイナリ形式のタスク名の長さ
+ */
+#define BINARY_NAME_LEN 16
+
+/**
+ * バイナリ形式のレコードのヘッダ
+ *
+ * ヘッダに続いてcpu_num個の各コアの使用率(uint16_t、0.1%単位、オフラインはBINARY_CORE_OFFLINE)を
+ * 8バイト境界まで詰めて並べ、
+ * その後にtask_num個のタスク(binary_task_t)が続く。
+ * 値はすべて書き込んだ環境のバイトオーダーで格納する。
+ */
+typedef struct binary_record_t {
+  uint32_t size;      /**< ヘッダを含むレコードのバイト数 */
+  uint16_t version;   /**< BINARY_VERSION */
+  uint16_t flags;     /**< BINARY_FLAG_* */
+  uint32_t cpu_num;   /**< CPUの個数 */
+  uint32_t task_num;  /**< 記録したタスク数 */
+  uint32_t proc_num;  /**< 計測したタスク数 */
+  uint32_t approx;    /**< 読み出しを間引いたタスク数 */
+  uint32_t skipped;   /**< 飛ばした計測の回数 */
+  uint32_t dropped;   /**< 直前に破棄した表示の回数 */
+  uint64_t time;      /**< 記録した時刻[ns](CLOCK_REALTIME) */
+  uint64_t elapsed;   /**< 前回の計測からの間隔[ns] */
+  cputime_t total;    /**< CPU全体のCPU時間の差分 */
+} binary_record_t;
+
+/**
+ * バイナリ形式のタスクの情報
+ */
+typedef struct binary_task_t {
+  int32_t pid;                  /**< PID */
+  int32_t tid;                  /**< TID、プロセスを記録する場合はPIDと同じ */
+  int32_t priority;             /**< プライオリティ */
+  int32_t nice;                 /**< nice値 */
+  uint64_t load;                /**< 負荷、BINARY_FLAG_NSの場合[ns] */
+  uint16_t usage;               /**< 使用率(0.1%単位) */
+  char state;                   /**< state */
+  char reserved[5];             /**< 予約 */
+  char comm[BINARY_NAME_LEN];   /**< タスク名 */
+  char pcomm[BINARY_NAME_LEN];  /**< プロセス名 */
+} binary_task_t;
+
+/**
+ * 再利用する出力バッファ
+ */
+typedef struct format_t {
+  char *buf;  /**< 書き込んだ内容 */
+  size_t len; /**< 書き込んだ長さ */
+  size_t cap; /**< bufの容量 */
+} format_t;
+
+int parse_format(const char *name);
+format_t *new_format_t(void);
+void delete_format_t(format_t *format);
+void format_reset(format_t *format);
+void *format_reserve(format_t *format, size_t size);
+void format_str(format_t *format, const char *str);
+void format_uint(format_t *format, uint64_t value);
+void format_int(format_t *format, int64_t value);
+void format_permille(format_t *format, uint64_t value);
+void format_json_str(format_t *format, const char *str, size_t max);
+uint64_t get_realtime(void);
+uint16_t get_permille(uint64_t value, uint64_t total);
+result_t binary_check(const void *buf, size_t len);
+const uint16_t *binary_cores(const binary_record_t *record);
+const binary_task_t *binary_tasks(const binary_record_t *record);
+
+#endif /* FORMAT_H_ */
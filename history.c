@@ -0,0 +1,328 @@
+/**
+ * @file history.c
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief 計測結果の履歴ファイル
+ *
+ * 書き込み側はファイルの排他ロックにより1プロセスのみとし、レコードの通し番号を最後に書き込むことで、
+ * 読み出し側は書き込み途中や上書きされたレコードを判別する。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "history.h"
+
+/**
+ * 履歴ファイルのハンドル
+ */
+struct history_t {
+  int fd;                   /**< 書き込み用に開いた場合は排他ロックを保持するファイル、読み出し用は-1 */
+  history_header_t *header; /**< マッピングしたヘッダ */
+  char *records;            /**< マッピングしたレコード領域の先頭 */
+  size_t size;              /**< マッピングしたサイズ */
+  size_t cores_offset;      /**< レコード内の各コアのCPU時間の位置 */
+  size_t tasks_offset;      /**< レコード内のタスクの位置 */
+};
+
+static size_t history_record_size(int cpu_num, int task_num);
+static result_t history_map(history_t *history, int fd, size_t size, int prot);
+static result_t history_check(const history_header_t *header, size_t size);
+
+/**
+ * @brief 1レコードのサイズを求める
+ *
+ * @param[in] cpu_num  CPUの個数
+ * @param[in] task_num タスク数
+ * @return 1レコードのサイズ、8バイト境界に揃える
+ */
+static size_t history_record_size(int cpu_num, int task_num) {
+  size_t size = sizeof(history_record_t)
+      + sizeof(cputime_t) * cpu_num
+      + sizeof(history_task_t) * task_num;
+  return (size + 7) & ~(size_t) 7;
+}
+
+/**
+ * @brief 履歴ファイルをマッピングする
+ *
+ * @param[out] history マッピング先
+ * @param[in]  fd      履歴ファイル
+ * @param[in]  size    マッピングするサイズ
+ * @param[in]  prot    PROT_READまたはPROT_READ | PROT_WRITE
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t history_map(history_t *history, int fd, size_t size, int prot) {
+  void *mem = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED) {
+    ERR("%s\n", strerror(errno));
+    return FAILURE;
+  }
+  history->header = mem;
+  history->records = (char *) mem + sizeof(history_header_t);
+  history->size = size;
+  history->cores_offset = sizeof(history_record_t);
+  history->tasks_offset = sizeof(history_record_t)
+      + sizeof(cputime_t) * history->header->cpu_num;
+  return SUCCESS;
+}
+
+/**
+ * @brief ヘッダの内容がファイルと矛盾しないかを調べる
+ *
+ * @param[in] header ヘッダ
+ * @param[in] size   ファイルサイズ
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t history_check(const history_header_t *header, size_t size) {
+  if (size < sizeof(history_header_t)
+      || memcmp(header->magic, HISTORY_MAGIC, sizeof(header->magic)) != 0
+      || header->version != HISTORY_VERSION
+      || header->header_size != sizeof(history_header_t)
+      || header->record_num == 0
+      || header->record_size != history_record_size(header->cpu_num, header->task_num)
+      || size < sizeof(history_header_t) + (size_t) header->record_size * header->record_num) {
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief 書き込み用に履歴ファイルを開く
+ *
+ * ファイルが存在しない、または空の場合は作成する。
+ * 既存のファイルはCPUの個数、レコード数、フラグが一致する場合のみ続きから書き込む。
+ * 他のプロセスが書き込み用に開いている場合は失敗する。
+ *
+ * @param[in] path       履歴ファイル
+ * @param[in] cpu_num    CPUの個数
+ * @param[in] record_num レコード数
+ * @param[in] flags      HISTORY_FLAG_*
+ * @return 履歴ファイルのハンドル、失敗した場合NULL
+ */
+history_t *new_history_t(const char *path, int cpu_num, int record_num, uint32_t flags) {
+  history_t *history = NULL;
+  size_t size = sizeof(history_header_t)
+      + history_record_size(cpu_num, HISTORY_TASKS) * record_num;
+  struct stat st;
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    ERR("%s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    if (errno == EWOULDBLOCK) {
+      ERR("%s: already opened by another writer\n", path);
+    } else {
+      ERR("%s: %s\n", path, strerror(errno));
+    }
+    goto error;
+  }
+  if (fstat(fd, &st) != 0) {
+    ERR("%s: %s\n", path, strerror(errno));
+    goto error;
+  }
+  if (st.st_size == 0 && ftruncate(fd, size) != 0) {
+    ERR("%s: %s\n", path, strerror(errno));
+    goto error;
+  }
+  if (st.st_size != 0 && st.st_size != size) {
+    ERR("%s: size mismatch\n", path);
+    goto error;
+  }
+  history = xmalloc(sizeof(history_t));
+  history->fd = fd;
+  if (history_map(history, fd, size, PROT_READ | PROT_WRITE) != SUCCESS) {
+    goto error;
+  }
+  if (st.st_size == 0) {
+    history_header_t *header = history->header;
+    memcpy(header->magic, HISTORY_MAGIC, sizeof(header->magic));
+    header->version = HISTORY_VERSION;
+    header->header_size = sizeof(history_header_t);
+    header->record_size = history_record_size(cpu_num, HISTORY_TASKS);
+    header->record_num = record_num;
+    header->cpu_num = cpu_num;
+    header->task_num = HISTORY_TASKS;
+    header->flags = flags;
+    header->clock_tick = sysconf(_SC_CLK_TCK);
+    header->count = 0;
+    history->tasks_offset = sizeof(history_record_t) + sizeof(cputime_t) * cpu_num;
+  } else if (history_check(history->header, size) != SUCCESS
+      || history->header->cpu_num != cpu_num
+      || history->header->record_num != record_num
+      || history->header->flags != flags) {
+    ERR("%s: format mismatch\n", path);
+    munmap(history->header, history->size);
+    goto error;
+  }
+  return history;
+  error:
+  free(history);
+  close(fd);
+  return NULL;
+}
+
+/**
+ * @brief 読み出し用に履歴ファイルを開く
+ *
+ * @param[in] path 履歴ファイル
+ * @return 履歴ファイルのハンドル、失敗した場合NULL
+ */
+history_t *load_history_t(const char *path) {
+  history_t *history = NULL;
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    ERR("%s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(history_header_t)) {
+    ERR("%s: invalid format\n", path);
+    goto error;
+  }
+  history = xmalloc(sizeof(history_t));
+  history->fd = -1;
+  if (history_map(history, fd, st.st_size, PROT_READ) != SUCCESS) {
+    goto error;
+  }
+  if (history_check(history->header, st.st_size) != SUCCESS) {
+    ERR("%s: invalid format\n", path);
+    munmap(history->header, history->size);
+    goto error;
+  }
+  close(fd);
+  return history;
+  error:
+  free(history);
+  close(fd);
+  return NULL;
+}
+
+/**
+ * @brief 履歴ファイルを閉じる
+ *
+ * @param[in] history 閉じるハンドル
+ */
+void delete_history_t(history_t *history) {
+  if (history == NULL) {
+    return;
+  }
+  munmap(history->header, history->size);
+  if (history->fd >= 0) {
+    close(history->fd);
+  }
+  free(history);
+}
+
+/**
+ * @brief ヘッダを取得する
+ *
+ * @param[in] history 履歴ファイルのハンドル
+ * @return ヘッダ
+ */
+const history_header_t *history_header(history_t *history) {
+  return history->header;
+}
+
+/**
+ * @brief 次に書き込むレコードを取得する
+ *
+ * 通し番号を0として書き込み中とし、以降の書き込みより先に見えるようにする。
+ * 書き込み後にhistory_commitを呼び出すこと。
+ *
+ * @param[in,out] history 履歴ファイルのハンドル
+ * @return 書き込むレコード
+ */
+history_record_t *history_begin(history_t *history) {
+  history_header_t *header = history->header;
+  history_record_t *record = (history_record_t *)
+      (history->records + (size_t) header->record_size * (header->count % header->record_num));
+  __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  return record;
+}
+
+/**
+ * @brief レコードの書き込みを確定する
+ *
+ * @param[in,out] history 履歴ファイルのハンドル
+ * @param[in,out] record  history_beginで取得したレコード
+ */
+void history_commit(history_t *history, history_record_t *record) {
+  history_header_t *header = history->header;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  record->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  __atomic_store_n(&record->seq, header->count + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&header->count, header->count + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 通し番号を指定してレコードを読み出す
+ *
+ * 各コアのCPU時間とタスクを含むレコード全体をコピーしたあとに通し番号を確認しなおし、
+ * コピー中に書き込み側が上書きを始めた場合は失敗とする。
+ * 通し番号は増える一方のため、失敗したレコードは読みなおしても得られない。
+ *
+ * @param[in]  history 履歴ファイルのハンドル
+ * @param[in]  seq     1から始まる通し番号
+ * @param[out] record  ヘッダのrecord_sizeバイトの書き込み先
+ * @return 成功：SUCCESS / 上書き済みまたは書き込み中：FAILURE
+ */
+result_t history_get(history_t *history, uint64_t seq, history_record_t *record) {
+  const history_header_t *header = history->header;
+  const history_record_t *src;
+  if (seq == 0) {
+    return FAILURE;
+  }
+  src = (const history_record_t *)
+      (history->records + (size_t) header->record_size * ((seq - 1) % header->record_num));
+  if (__atomic_load_n(&src->seq, __ATOMIC_ACQUIRE) != seq) {
+    return FAILURE;
+  }
+  memcpy(record, src, header->record_size);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) != seq) {
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief レコードの各コアのCPU時間の差分を取得する
+ *
+ * @param[in] history 履歴ファイルのハンドル
+ * @param[in] record  レコード
+ * @return cpu_num個の各コアのCPU時間の差分
+ */
+cputime_t *history_cores(history_t *history, const history_record_t *record) {
+  return (cputime_t *) ((char *) record + history->cores_offset);
+}
+
+/**
+ * @brief レコードのタスクを取得する
+ *
+ * @param[in] history 履歴ファイルのハンドル
+ * @param[in] record  レコード
+ * @return task_num個のタスク
+ */
+history_task_t *history_tasks(history_t *history, const history_record_t *record) {
+  return (history_task_t *) ((char *) record + history->tasks_offset);
+}
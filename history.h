@@ -0,0 +1,108 @@
+/**
+ * @file history.h
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief 計測結果の履歴ファイル
+ *
+ * 計測ごとのCPU時間の差分と負荷上位のタスクを、
+ * ヘッダと固定長レコードからなるリングバッファ形式のファイルへmmapで書き込む。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stdint.h>
+#include "cpuusage.h"
+
+/**
+ * 履歴ファイルの先頭の識別子
+ */
+#define HISTORY_MAGIC "CPUHIST\0"
+/**
+ * 履歴ファイルの形式のバージョン
+ */
+#define HISTORY_VERSION 1
+/**
+ * レコード数の初期値(5秒間隔で24時間分)
+ */
+#define DEFAULT_HISTORY_RECORDS 17280
+/**
+ * 1レコードあたりのタスク数
+ */
+#define HISTORY_TASKS 10
+/**
+ * タスク名の長さ
+ */
+#define HISTORY_NAME_LEN 16
+/**
+ * タスクとしてスレッドを記録していることを示すフラグ
+ */
+#define HISTORY_FLAG_THREADS 0x1
+
+/**
+ * 履歴ファイルのヘッダ
+ *
+ * ファイルはヘッダに続いてrecord_num個のrecord_sizeバイトのレコードが並ぶ。
+ * 値はすべて書き込んだ環境のバイトオーダーで格納する。
+ */
+typedef struct history_header_t {
+  char magic[8];        /**< HISTORY_MAGIC */
+  uint32_t version;     /**< HISTORY_VERSION */
+  uint32_t header_size; /**< ヘッダのサイズ */
+  uint32_t record_size; /**< 1レコードのサイズ */
+  uint32_t record_num;  /**< レコード数 */
+  uint32_t cpu_num;     /**< CPUの個数 */
+  uint32_t task_num;    /**< 1レコードあたりのタスク数 */
+  uint32_t flags;       /**< HISTORY_FLAG_* */
+  uint32_t clock_tick;  /**< 1秒あたりのCPU時間の単位数 */
+  uint64_t count;       /**< 書き込んだレコードの総数 */
+} history_header_t;
+
+/**
+ * 記録するタスクの情報
+ */
+typedef struct history_task_t {
+  int32_t pid;                 /**< PID */
+  int32_t tid;                 /**< TID、プロセスを記録する場合はPIDと同じ */
+  uint64_t load;               /**< 負荷 */
+  char comm[HISTORY_NAME_LEN]; /**< タスク名 */
+} history_task_t;
+
+/**
+ * 1回分の計測結果のレコード
+ *
+ * レコードの後ろにcpu_num個の各コアのCPU時間の差分(cputime_t)と、
+ * task_num個のタスク(history_task_t)が続く。
+ */
+typedef struct history_record_t {
+  uint64_t seq;       /**< 1から始まる通し番号、書き込み中は0 */
+  uint64_t time;      /**< 記録した時刻[ns](CLOCK_REALTIME) */
+  uint64_t elapsed;   /**< 前回の計測からの間隔[ns] */
+  uint32_t proc_num;  /**< 計測したタスク数 */
+  uint32_t task_num;  /**< 記録したタスク数 */
+  cputime_t total;    /**< CPU全体のCPU時間の差分 */
+} history_record_t;
+
+/**
+ * 履歴ファイルのハンドル
+ */
+typedef struct history_t history_t;
+
+history_t *new_history_t(const char *path, int cpu_num, int record_num, uint32_t flags);
+history_t *load_history_t(const char *path);
+void delete_history_t(history_t *history);
+const history_header_t *history_header(history_t *history);
+history_record_t *history_begin(history_t *history);
+void history_commit(history_t *history, history_record_t *record);
+result_t history_get(history_t *history, uint64_t seq, history_record_t *record);
+cputime_t *history_cores(history_t *history, const history_record_t *record);
+history_task_t *history_tasks(history_t *history, const history_record_t *record);
+
+#endif /* HISTORY_H_ */
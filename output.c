@@ -0,0 +1,388 @@
+/**
+ * @file output.c
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief 表示の出力スレッド
+ *
+ * フレームの書き込みはサンプリングを行うスレッドのみ、
+ * 書き出しは出力スレッドのみが行う単一生産者・単一消費者のリングバッファとする。
+ * head/tailはそれぞれの書き込み側のみが更新するため、ロックを必要としない。
+ * 全画面表示では、出力スレッドが前回のフレームとの差分に変換してから書き出す。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/ioctl.h>
+#include "output.h"
+#include "cpuusage.h"
+#include "format.h"
+#include "screen.h"
+
+/**
+ * フレームの初期容量
+ */
+#define FRAME_SIZE 4096
+
+/**
+ * 1回分の表示内容
+ */
+typedef struct frame_t {
+  char *buf;   /**< 表示内容 */
+  size_t len;  /**< 表示内容の長さ */
+  size_t cap;  /**< bufの容量 */
+  int dropped; /**< このフレームの直前に破棄したフレーム数 */
+} frame_t;
+
+/**
+ * 出力スレッドのハンドル
+ */
+struct output_t {
+  int fd;              /**< 出力先 */
+  int num;             /**< リングバッファのフレーム数 */
+  frame_t *frames;     /**< num個のフレームと、破棄するフレームの書き込み先 */
+  uint64_t head;       /**< 書き込んだフレームの総数、生産者のみが更新 */
+  uint64_t tail;       /**< 書き出したフレームの総数、消費者のみが更新 */
+  frame_t *current;    /**< 生産者が書き込み中のフレーム */
+  int dropped;         /**< 前回のフレーム以降に破棄したフレーム数 */
+  int annotate;        /**< 破棄したフレーム数を表示するか否か */
+  int closing;         /**< 終了要求 */
+  sem_t ready;         /**< フレームの追加の通知 */
+  pthread_t thread;    /**< 出力スレッド */
+  FILE *stream;        /**< フレームへ書き込むストリーム */
+  FILE *saved_stdout;  /**< 差し替え前のstdout */
+  screen_t *screen;    /**< 全画面表示の描画状態、全画面表示しない場合NULL */
+  format_t *delta;     /**< 全画面表示で書き出す差分 */
+};
+
+static ssize_t output_write(void *cookie, const char *buf, size_t size);
+static void frame_append(frame_t *frame, const char *buf, size_t size);
+static void write_frame(output_t *output, frame_t *frame);
+static frame_t *output_acquire(output_t *output);
+static void write_all(int fd, const char *buf, size_t len);
+static void *output_thread(void *arg);
+
+/**
+ * @brief 出力スレッドを開始する
+ *
+ * @param[in] fd        出力先
+ * @param[in] frame_num リングバッファのフレーム数
+ * @return 出力スレッドのハンドル、失敗した場合NULL
+ */
+output_t *new_output_t(int fd, int frame_num) {
+  int i;
+  cookie_io_functions_t functions = {
+    .write = output_write,
+  };
+  output_t *output = xmalloc(sizeof(output_t));
+  memset(output, 0, sizeof(output_t));
+  output->fd = fd;
+  output->num = frame_num;
+  output->annotate = TRUE;
+  output->frames = xmalloc(sizeof(frame_t) * (frame_num + 1));
+  for (i = 0; i <= frame_num; i++) {
+    output->frames[i].buf = xmalloc(FRAME_SIZE);
+    output->frames[i].len = 0;
+    output->frames[i].cap = FRAME_SIZE;
+    output->frames[i].dropped = 0;
+  }
+  output->stream = fopencookie(output, "w", functions);
+  if (output->stream == NULL) {
+    ERR("%s\n", strerror(errno));
+    goto error;
+  }
+  if (sem_init(&output->ready, 0, 0) != 0) {
+    ERR("%s\n", strerror(errno));
+    fclose(output->stream);
+    goto error;
+  }
+  if (pthread_create(&output->thread, NULL, output_thread, output) != 0) {
+    ERR("pthread_create failed\n");
+    sem_destroy(&output->ready);
+    fclose(output->stream);
+    goto error;
+  }
+  return output;
+  error:
+  for (i = 0; i <= frame_num; i++) {
+    free(output->frames[i].buf);
+  }
+  free(output->frames);
+  free(output);
+  return NULL;
+}
+
+/**
+ * @brief 出力スレッドを終了する
+ *
+ * 書き込み途中のフレームを確定し、未出力のフレームをすべて書き出してから終了する。
+ *
+ * @param[in] output 終了するハンドル
+ */
+void delete_output_t(output_t *output) {
+  int i;
+  if (output == NULL) {
+    return;
+  }
+  output_commit(output);
+  __atomic_store_n(&output->closing, TRUE, __ATOMIC_RELEASE);
+  sem_post(&output->ready);
+  pthread_join(output->thread, NULL);
+  if (output->saved_stdout != NULL) {
+    stdout = output->saved_stdout;
+  }
+  fclose(output->stream);
+  sem_destroy(&output->ready);
+  for (i = 0; i <= output->num; i++) {
+    free(output->frames[i].buf);
+  }
+  free(output->frames);
+  delete_screen_t(output->screen);
+  delete_format_t(output->delta);
+  free(output);
+}
+
+/**
+ * @brief 書き込み中のフレームを確定し、出力スレッドへ渡す
+ *
+ * リングバッファが一杯だった場合、そのフレームは破棄し、
+ * 破棄した数を次に渡すフレームとともに表示する。
+ *
+ * @param[in,out] output 出力スレッドのハンドル
+ */
+void output_commit(output_t *output) {
+  frame_t *frame;
+  fflush(output->stream);
+  frame = output->current;
+  if (frame == NULL) {
+    return;
+  }
+  output->current = NULL;
+  if (frame == &output->frames[output->num]) {
+    output->dropped++;
+    return;
+  }
+  frame->dropped = output->dropped;
+  output->dropped = 0;
+  __atomic_store_n(&output->head, output->head + 1, __ATOMIC_RELEASE);
+  sem_post(&output->ready);
+}
+
+/**
+ * @brief 書き込み中のフレームへstdioを経由せずに追記する
+ *
+ * 先にstdoutへ書き込んだ内容があればその後ろに追記する。
+ *
+ * @param[in,out] output 出力スレッドのハンドル
+ * @param[in]     buf    追記する内容
+ * @param[in]     len    追記するサイズ
+ */
+void output_put(output_t *output, const void *buf, size_t len) {
+  fflush(output->stream);
+  output_write(output, buf, len);
+}
+
+/**
+ * @brief 前回フレームを渡してから破棄したフレーム数を取得する
+ *
+ * 書き込み中のフレームを渡すことができれば、この数がフレームとともに通知される。
+ *
+ * @param[in] output 出力スレッドのハンドル
+ * @return 破棄したフレーム数
+ */
+int output_dropped(output_t *output) {
+  return output->dropped;
+}
+
+/**
+ * @brief 破棄したフレーム数の表示の有無を設定する
+ *
+ * バイナリなど、出力にテキストを混在できない場合は無効にし、
+ * output_droppedで取得した値を出力内容に含める。
+ *
+ * @param[in,out] output   出力スレッドのハンドル
+ * @param[in]     annotate 表示する場合TRUE
+ */
+void output_set_annotate(output_t *output, int annotate) {
+  output->annotate = annotate;
+}
+
+/**
+ * @brief 全画面表示を有効にする
+ *
+ * 以降の各フレームを画面全体の内容として扱い、
+ * 前回のフレームから変化した文字のみをカーソル位置指定とともに1回のwriteで書き出す。
+ * 最初のフレームを渡す前に呼び出すこと。
+ *
+ * @param[in,out] output 出力スレッドのハンドル
+ */
+void output_set_screen(output_t *output) {
+  if (output->screen != NULL) {
+    return;
+  }
+  output->screen = new_screen_t();
+  output->delta = new_format_t();
+}
+
+/**
+ * @brief stdoutをフレームへ書き込むストリームへ差し替える
+ *
+ * glibcではstdoutは代入可能な変数であり、
+ * 差し替えることで各ツールの表示処理はprintfのまま出力スレッドを経由する。
+ * 元のstdoutはdelete_output_tで戻す。
+ *
+ * @param[in,out] output 出力スレッドのハンドル
+ */
+void output_redirect_stdout(output_t *output) {
+  fflush(stdout);
+  output->saved_stdout = stdout;
+  stdout = output->stream;
+}
+
+/**
+ * @brief ストリームへの書き込みを書き込み中のフレームへ追加する
+ *
+ * @param[in] cookie 出力スレッドのハンドル
+ * @param[in] buf    書き込む内容
+ * @param[in] size   書き込むサイズ
+ * @return 書き込んだサイズ
+ */
+static ssize_t output_write(void *cookie, const char *buf, size_t size) {
+  output_t *output = cookie;
+  frame_t *frame = output->current;
+  if (frame == NULL) {
+    frame = output->current = output_acquire(output);
+  }
+  frame_append(frame, buf, size);
+  return size;
+}
+
+/**
+ * @brief フレームの末尾に追記する
+ *
+ * @param[in,out] frame 追記先
+ * @param[in]     buf   追記する内容
+ * @param[in]     size  追記するサイズ
+ */
+static void frame_append(frame_t *frame, const char *buf, size_t size) {
+  if (frame->len + size > frame->cap) {
+    while (frame->len + size > frame->cap) {
+      frame->cap *= 2;
+    }
+    frame->buf = xrealloc(frame->buf, frame->cap);
+  }
+  memcpy(frame->buf + frame->len, buf, size);
+  frame->len += size;
+}
+
+/**
+ * @brief 次に書き込むフレームを取得する
+ *
+ * 空きがない場合は破棄するフレームの書き込み先を返す。
+ *
+ * @param[in] output 出力スレッドのハンドル
+ * @return 書き込むフレーム
+ */
+static frame_t *output_acquire(output_t *output) {
+  uint64_t tail = __atomic_load_n(&output->tail, __ATOMIC_ACQUIRE);
+  frame_t *frame;
+  if (output->head - tail < output->num) {
+    frame = &output->frames[output->head % output->num];
+  } else {
+    frame = &output->frames[output->num];
+  }
+  frame->len = 0;
+  return frame;
+}
+
+/**
+ * @brief 全て書き出すまで書き込む
+ *
+ * @param[in] fd  出力先
+ * @param[in] buf 書き込む内容
+ * @param[in] len 書き込むサイズ
+ */
+static void write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t size = write(fd, buf, len);
+    if (size < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    buf += size;
+    len -= size;
+  }
+}
+
+/**
+ * @brief 1フレームを書き出す
+ *
+ * 破棄したフレーム数は、通常はフレームの前に、全画面表示ではフレームの末尾の行に表示する。
+ * 全画面表示では出力先が端末の場合、その大きさに収まるように切り捨てる。
+ *
+ * @param[in,out] output 出力スレッドのハンドル
+ * @param[in,out] frame  書き出すフレーム、出力スレッドが所有している間のみ変更してよい
+ */
+static void write_frame(output_t *output, frame_t *frame) {
+  char note[64];
+  int len = 0;
+  if (output->annotate && frame->dropped > 0) {
+    len = snprintf(note, sizeof(note), "(dropped %d frames)\n", frame->dropped);
+  }
+  if (output->screen == NULL) {
+    write_all(output->fd, note, len);
+    write_all(output->fd, frame->buf, frame->len);
+  } else {
+    struct winsize ws;
+    int width = 0;
+    int height = 0;
+    if (ioctl(output->fd, TIOCGWINSZ, &ws) == 0) {
+      width = ws.ws_col;
+      height = ws.ws_row;
+    }
+    frame_append(frame, note, len);
+    format_reset(output->delta);
+    screen_render(output->screen, frame->buf, frame->len, width, height, output->delta);
+    write_all(output->fd, output->delta->buf, output->delta->len);
+  }
+}
+
+/**
+ * @brief 出力スレッド
+ *
+ * @param[in] arg 出力スレッドのハンドル
+ * @return NULL
+ */
+static void *output_thread(void *arg) {
+  output_t *output = arg;
+  while (TRUE) {
+    uint64_t head;
+    int closing;
+    while (sem_wait(&output->ready) != 0 && errno == EINTR);
+    closing = __atomic_load_n(&output->closing, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&output->head, __ATOMIC_ACQUIRE);
+    while (output->tail != head) {
+      write_frame(output, &output->frames[output->tail % output->num]);
+      __atomic_store_n(&output->tail, output->tail + 1, __ATOMIC_RELEASE);
+    }
+    if (closing) {
+      break;
+    }
+  }
+  return NULL;
+}
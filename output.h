@@ -0,0 +1,45 @@
+/**
+ * @file output.h
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief 表示の出力スレッド
+ *
+ * サンプリングを行うスレッドは表示内容をフレームとしてメモリ上に書き込み、
+ * 出力スレッドが単一生産者・単一消費者のリングバッファから取り出して書き出す。
+ * 出力先の書き込みが遅れてもサンプリングは待たされず、
+ * リングバッファが一杯の場合はそのフレームを破棄して次の表示で破棄数を示す。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+/**
+ * リングバッファのフレーム数の初期値
+ */
+#define DEFAULT_OUTPUT_FRAMES 8
+
+/**
+ * 出力スレッドのハンドル
+ */
+typedef struct output_t output_t;
+
+output_t *new_output_t(int fd, int frame_num);
+void delete_output_t(output_t *output);
+void output_commit(output_t *output);
+void output_put(output_t *output, const void *buf, size_t len);
+int output_dropped(output_t *output);
+void output_set_annotate(output_t *output, int annotate);
+void output_set_screen(output_t *output);
+void output_redirect_stdout(output_t *output);
+
+#endif /* OUTPUT_H_ */
@@ -0,0 +1,273 @@
+/**
+ * @file screen.c
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief 差分のみを書き換える全画面表示
+ *
+ * 行内の位置はバイト単位で扱うため、ASCII以外を含む行は行全体を書きなおす。
+ * 端末の幅を超える部分は折り返しで位置がずれないよう切り捨てる。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "screen.h"
+
+/**
+ * 行数の初期容量
+ */
+#define INIT_SCREEN_LINES 64
+/**
+ * 変化した範囲の間の変化していない文字がこの数未満であれば、まとめて書き出す
+ *
+ * カーソル位置指定のエスケープシーケンスはおよそこの長さとなる。
+ */
+#define SCREEN_GAP 8
+
+/**
+ * 1画面分の内容
+ */
+typedef struct page_t {
+  char *buf;      /**< 切り捨て後の内容 */
+  size_t cap;     /**< bufの容量 */
+  size_t *start;  /**< 各行の先頭のbuf内の位置 */
+  int *len;       /**< 各行の長さ、改行を含まない */
+  int num;        /**< 行数 */
+  int size;       /**< start/lenの容量 */
+} page_t;
+
+/**
+ * 全画面表示の描画状態
+ */
+struct screen_t {
+  page_t pages[2]; /**< 前回と今回の内容 */
+  int current;     /**< 前回描画した内容のインデックス */
+  int drawn;       /**< 画面を消去してから描画したか */
+  int width;       /**< 前回描画した端末の幅 */
+  int height;      /**< 前回描画した端末の高さ */
+};
+
+static void page_load(page_t *page, const char *buf, size_t len, int width, int height);
+static int is_ascii(const char *line, int len);
+static void put_cursor(format_t *out, int row, int col);
+static void put_line(format_t *out, int row, const char *prev, int prev_len,
+                     const char *next, int next_len);
+
+/**
+ * @brief 全画面表示の描画状態を作成する
+ *
+ * 最初の描画では画面を消去してから全体を書き出す。
+ *
+ * @return 描画状態
+ */
+screen_t *new_screen_t(void) {
+  screen_t *screen = xmalloc(sizeof(screen_t));
+  memset(screen, 0, sizeof(screen_t));
+  return screen;
+}
+
+/**
+ * @brief 全画面表示の描画状態を開放する
+ *
+ * @param[in] screen 開放する描画状態
+ */
+void delete_screen_t(screen_t *screen) {
+  int i;
+  if (screen == NULL) {
+    return;
+  }
+  for (i = 0; i < 2; i++) {
+    free(screen->pages[i].buf);
+    free(screen->pages[i].start);
+    free(screen->pages[i].len);
+  }
+  free(screen);
+}
+
+/**
+ * @brief フレームを行に分割して格納する
+ *
+ * 各行は幅まで、行数は高さまでで切り捨てる。
+ *
+ * @param[out] page   格納先
+ * @param[in]  buf    フレームの内容
+ * @param[in]  len    フレームの長さ
+ * @param[in]  width  端末の幅、0の場合切り捨てない
+ * @param[in]  height 端末の高さ、0の場合切り捨てない
+ */
+static void page_load(page_t *page, const char *buf, size_t len, int width, int height) {
+  const char *end = buf + len;
+  size_t pos = 0;
+  if (page->cap < len) {
+    page->cap = len;
+    page->buf = xrealloc(page->buf, page->cap);
+  }
+  page->num = 0;
+  while (buf < end && (height == 0 || page->num < height)) {
+    const char *eol = memchr(buf, '\n', end - buf);
+    int line_len = (eol != NULL ? eol : end) - buf;
+    if (page->num == page->size) {
+      page->size = page->size == 0 ? INIT_SCREEN_LINES : page->size * 2;
+      page->start = xrealloc(page->start, sizeof(size_t) * page->size);
+      page->len = xrealloc(page->len, sizeof(int) * page->size);
+    }
+    page->start[page->num] = pos;
+    page->len[page->num] = width > 0 && line_len > width ? width : line_len;
+    memcpy(page->buf + pos, buf, page->len[page->num]);
+    pos += page->len[page->num];
+    page->num++;
+    if (eol == NULL) {
+      break;
+    }
+    buf = eol + 1;
+  }
+}
+
+/**
+ * @brief 行がASCIIのみで構成されているかを調べる
+ *
+ * @param[in] line 行の先頭
+ * @param[in] len  行の長さ
+ * @return ASCIIのみの場合TRUE
+ */
+static int is_ascii(const char *line, int len) {
+  int i;
+  for (i = 0; i < len; i++) {
+    if ((unsigned char) line[i] >= 0x80) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/**
+ * @brief カーソル位置指定のエスケープシーケンスを書き込む
+ *
+ * @param[out] out 書き込み先
+ * @param[in]  row 行、0から数える
+ * @param[in]  col 列、0から数える
+ */
+static void put_cursor(format_t *out, int row, int col) {
+  format_str(out, "\033[");
+  format_uint(out, row + 1);
+  format_str(out, ";");
+  format_uint(out, col + 1);
+  format_str(out, "H");
+}
+
+/**
+ * @brief 1行分の変化した文字を書き込む
+ *
+ * 変化した範囲ごとにカーソルを移動して書き出し、間隔がSCREEN_GAP未満の範囲はまとめる。
+ * 前回より短くなった場合は行末まで消去する。
+ *
+ * @param[out] out      書き込み先
+ * @param[in]  row      行、0から数える
+ * @param[in]  prev     前回の内容
+ * @param[in]  prev_len 前回の長さ
+ * @param[in]  next     今回の内容
+ * @param[in]  next_len 今回の長さ
+ */
+static void put_line(format_t *out, int row, const char *prev, int prev_len,
+                     const char *next, int next_len) {
+  int common = prev_len < next_len ? prev_len : next_len;
+  int cursor = -1;
+  int i = 0;
+  if (prev_len == next_len && memcmp(prev, next, next_len) == 0) {
+    return;
+  }
+  if (!is_ascii(prev, prev_len) || !is_ascii(next, next_len)) {
+    put_cursor(out, row, 0);
+    memcpy(format_reserve(out, next_len), next, next_len);
+    format_str(out, "\033[K");
+    return;
+  }
+  while (i < next_len) {
+    int begin;
+    int end;
+    int same = 0;
+    while (i < common && prev[i] == next[i]) {
+      i++;
+    }
+    if (i == next_len) {
+      break;
+    }
+    begin = i;
+    end = i;
+    while (i < next_len && same < SCREEN_GAP) {
+      if (i < common && prev[i] == next[i]) {
+        same++;
+      } else {
+        same = 0;
+        end = i + 1;
+      }
+      i++;
+    }
+    if (cursor != begin) {
+      put_cursor(out, row, begin);
+    }
+    memcpy(format_reserve(out, end - begin), next + begin, end - begin);
+    cursor = end;
+    i = end;
+  }
+  if (next_len < prev_len) {
+    if (cursor != next_len) {
+      put_cursor(out, row, next_len);
+    }
+    format_str(out, "\033[K");
+  }
+}
+
+/**
+ * @brief フレームを前回の描画との差分として書き込む
+ *
+ * 端末の大きさが変わった場合は、画面を消去して全体を書きなおす。
+ * 書き込み後はカーソルを最終行の次の行頭へ移動する。
+ * 変化が無い場合は何も書き込まない。
+ *
+ * @param[in,out] screen 描画状態
+ * @param[in]     buf    フレームの内容
+ * @param[in]     len    フレームの長さ
+ * @param[in]     width  端末の幅、0の場合切り捨てない
+ * @param[in]     height 端末の高さ、0の場合切り捨てない
+ * @param[out]    out    書き込み先、末尾に追記する
+ */
+void screen_render(screen_t *screen, const char *buf, size_t len, int width, int height,
+                   format_t *out) {
+  page_t *prev = &screen->pages[screen->current];
+  page_t *next = &screen->pages[screen->current ^ 1];
+  size_t base = out->len;
+  int i;
+  page_load(next, buf, len, width, height);
+  if (!screen->drawn || screen->width != width || screen->height != height) {
+    format_str(out, "\033[H\033[2J");
+    prev->num = 0;
+    screen->drawn = TRUE;
+    screen->width = width;
+    screen->height = height;
+  }
+  for (i = 0; i < next->num; i++) {
+    if (i < prev->num) {
+      put_line(out, i, prev->buf + prev->start[i], prev->len[i],
+               next->buf + next->start[i], next->len[i]);
+    } else {
+      put_line(out, i, NULL, 0, next->buf + next->start[i], next->len[i]);
+    }
+  }
+  if (next->num < prev->num) {
+    put_cursor(out, next->num, 0);
+    format_str(out, "\033[J");
+  }
+  if (out->len != base) {
+    put_cursor(out, next->num, 0);
+  }
+  screen->current ^= 1;
+}
@@ -0,0 +1,35 @@
+/**
+ * @file screen.h
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief 差分のみを書き換える全画面表示
+ *
+ * 1フレームを画面全体の内容として扱い、前回描画したフレームと行ごとに比較して、
+ * 変化した文字のみをカーソル位置指定のエスケープシーケンスとともに書き出す。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#ifndef SCREEN_H_
+#define SCREEN_H_
+
+#include <stddef.h>
+#include "cpuusage.h"
+#include "format.h"
+
+/**
+ * 全画面表示の描画状態
+ */
+typedef struct screen_t screen_t;
+
+screen_t *new_screen_t(void);
+void delete_screen_t(screen_t *screen);
+void screen_render(screen_t *screen, const char *buf, size_t len, int width, int height,
+                   format_t *out);
+
+#endif /* SCREEN_H_ */
@@ -0,0 +1,364 @@
+/**
+ * @file shm.c
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief 共有メモリによる計測結果の公開
+ *
+ * 書き込み側は共有メモリへのflockで1プロセスのみに限定する。
+ * 領域が足りない場合、書き込み側は共有メモリを拡張してからマッピングしなおし、
+ * 読み出し側はスナップショットのサイズがマッピングを超えていた場合にマッピングしなおす。
+ * 共有メモリは縮小しないため、拡張前のマッピングも引き続き有効となる。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "shm.h"
+
+/**
+ * スナップショット領域の初期サイズ
+ */
+#define SHM_INIT_CAPACITY (64 * 1024)
+
+/**
+ * 共有メモリのハンドル
+ */
+struct shm_t {
+  int fd;               /**< 共有メモリのファイルディスクリプタ */
+  int prot;             /**< マッピングの保護属性 */
+  shm_header_t *header; /**< マッピングしたヘッダ */
+  char *data;           /**< マッピングしたスナップショット領域の先頭 */
+  size_t size;          /**< マッピングしたサイズ */
+};
+
+/**
+ * SIGINT/SIGTERMを受けたか
+ */
+static volatile sig_atomic_t shm_stopped;
+
+static void shm_path(const char *name, char *path, size_t size);
+static result_t shm_map(shm_t *shm, size_t size);
+static result_t shm_check(const shm_header_t *header);
+
+/**
+ * @brief 共有メモリの名前をshm_openに渡すパスへ変換する
+ *
+ * 先頭に'/'が無い場合は付加する。
+ *
+ * @param[in]  name 共有メモリの名前
+ * @param[out] path 書き込み先
+ * @param[in]  size pathのサイズ
+ */
+static void shm_path(const char *name, char *path, size_t size) {
+  snprintf(path, size, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+/**
+ * @brief 共有メモリをマッピングする
+ *
+ * 既にマッピングしている場合は開放してからマッピングしなおす。
+ *
+ * @param[in,out] shm  対象のハンドル
+ * @param[in]     size マッピングするサイズ
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t shm_map(shm_t *shm, size_t size) {
+  void *mem = mmap(NULL, size, shm->prot, MAP_SHARED, shm->fd, 0);
+  if (mem == MAP_FAILED) {
+    ERR("%s\n", strerror(errno));
+    return FAILURE;
+  }
+  if (shm->header != NULL) {
+    munmap(shm->header, shm->size);
+  }
+  shm->header = mem;
+  shm->data = (char *) mem + sizeof(shm_header_t);
+  shm->size = size;
+  return SUCCESS;
+}
+
+/**
+ * @brief ヘッダの内容が共有メモリの形式と一致するかを調べる
+ *
+ * @param[in] header ヘッダ
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t shm_check(const shm_header_t *header) {
+  if (memcmp(header->magic, SHM_MAGIC, sizeof(header->magic)) != 0
+      || header->version != SHM_VERSION
+      || header->header_size != sizeof(shm_header_t)) {
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief 書き込み用に共有メモリを開く
+ *
+ * 共有メモリが存在しない場合は作成する。
+ * 以前の書き込み側が残した共有メモリは通し番号を引き継いで再利用するため、
+ * 読み出し側は書き込み側を起動しなおしても開きなおす必要はない。
+ * 他のプロセスが書き込み用に開いている場合は失敗する。
+ *
+ * @param[in] name 共有メモリの名前
+ * @return 共有メモリのハンドル、失敗した場合NULL
+ */
+shm_t *new_shm_t(const char *name) {
+  shm_t *shm = NULL;
+  char path[NAME_MAX];
+  struct stat st;
+  int fd;
+  shm_path(name, path, sizeof(path));
+  fd = shm_open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    ERR("%s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    if (errno == EWOULDBLOCK) {
+      ERR("%s: already opened by another writer\n", path);
+    } else {
+      ERR("%s: %s\n", path, strerror(errno));
+    }
+    goto error;
+  }
+  if (fstat(fd, &st) != 0) {
+    ERR("%s: %s\n", path, strerror(errno));
+    goto error;
+  }
+  if (st.st_size < sizeof(shm_header_t) + SHM_INIT_CAPACITY) {
+    if (ftruncate(fd, sizeof(shm_header_t) + SHM_INIT_CAPACITY) != 0) {
+      ERR("%s: %s\n", path, strerror(errno));
+      goto error;
+    }
+    st.st_size = sizeof(shm_header_t) + SHM_INIT_CAPACITY;
+  }
+  shm = xmalloc(sizeof(shm_t));
+  shm->fd = fd;
+  shm->prot = PROT_READ | PROT_WRITE;
+  shm->header = NULL;
+  if (shm_map(shm, st.st_size) != SUCCESS) {
+    goto error;
+  }
+  if (shm_check(shm->header) != SUCCESS) {
+    shm_header_t *header = shm->header;
+    memcpy(header->magic, SHM_MAGIC, sizeof(header->magic));
+    header->version = SHM_VERSION;
+    header->header_size = sizeof(shm_header_t);
+    header->seq = 0;
+    header->size = 0;
+  } else if (shm->header->seq & 1) {
+    // 書き込み途中で終了した書き込み側の内容は破棄する
+    shm->header->size = 0;
+    __atomic_store_n(&shm->header->seq, shm->header->seq + 1, __ATOMIC_RELEASE);
+  }
+  shm->header->capacity = shm->size - sizeof(shm_header_t);
+  return shm;
+  error:
+  free(shm);
+  close(fd);
+  return NULL;
+}
+
+/**
+ * @brief 読み出し用に共有メモリを開く
+ *
+ * @param[in] name 共有メモリの名前
+ * @return 共有メモリのハンドル、失敗した場合NULL
+ */
+shm_t *load_shm_t(const char *name) {
+  shm_t *shm = NULL;
+  char path[NAME_MAX];
+  struct stat st;
+  int fd;
+  shm_path(name, path, sizeof(path));
+  fd = shm_open(path, O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0) {
+    ERR("%s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(shm_header_t)) {
+    ERR("%s: invalid format\n", path);
+    goto error;
+  }
+  shm = xmalloc(sizeof(shm_t));
+  shm->fd = fd;
+  shm->prot = PROT_READ;
+  shm->header = NULL;
+  if (shm_map(shm, st.st_size) != SUCCESS) {
+    goto error;
+  }
+  if (shm_check(shm->header) != SUCCESS) {
+    ERR("%s: invalid format\n", path);
+    munmap(shm->header, shm->size);
+    goto error;
+  }
+  return shm;
+  error:
+  free(shm);
+  close(fd);
+  return NULL;
+}
+
+/**
+ * @brief 共有メモリのハンドルを開放する
+ *
+ * 共有メモリ自体は削除しない。
+ *
+ * @param[in] shm 開放するハンドル
+ */
+void delete_shm_t(shm_t *shm) {
+  if (shm == NULL) {
+    return;
+  }
+  munmap(shm->header, shm->size);
+  close(shm->fd);
+  free(shm);
+}
+
+/**
+ * @brief スナップショットを書き込む
+ *
+ * 通し番号を奇数にしてから内容を書き込み、偶数に戻すことで書き込みの完了を示す。
+ * 領域が足りない場合は倍々に拡張する。
+ *
+ * @param[in,out] shm 書き込み用に開いたハンドル
+ * @param[in]     buf スナップショット
+ * @param[in]     len スナップショットのサイズ
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+result_t shm_publish(shm_t *shm, const void *buf, size_t len) {
+  shm_header_t *header;
+  uint64_t seq;
+  if (sizeof(shm_header_t) + len > shm->size) {
+    size_t capacity = shm->size - sizeof(shm_header_t);
+    while (capacity < len) {
+      capacity *= 2;
+    }
+    if (ftruncate(shm->fd, sizeof(shm_header_t) + capacity) != 0) {
+      ERR("%s\n", strerror(errno));
+      return FAILURE;
+    }
+    if (shm_map(shm, sizeof(shm_header_t) + capacity) != SUCCESS) {
+      return FAILURE;
+    }
+  }
+  header = shm->header;
+  seq = header->seq;
+  __atomic_store_n(&header->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(shm->data, buf, len);
+  __atomic_store_n(&header->size, len, __ATOMIC_RELAXED);
+  header->capacity = shm->size - sizeof(shm_header_t);
+  __atomic_store_n(&header->seq, seq + 2, __ATOMIC_RELEASE);
+  return SUCCESS;
+}
+
+/**
+ * @brief 新しいスナップショットがあれば読み出す
+ *
+ * 書き込み中(通し番号が奇数)の場合は待たずに新しいスナップショットが無いものとして戻り、
+ * 待機は呼び出し側に任せる。書き込み側が書き込み途中で停止していても読み出し側は回り続けない。
+ * コピー中に書き込みが始まった場合は読みなおす。
+ * スナップショットがマッピングの範囲を超えている場合は、拡張後のサイズでマッピングしなおす。
+ *
+ * @param[in,out] shm    読み出し用に開いたハンドル
+ * @param[out]    format 読みだしたスナップショットの書き込み先
+ * @param[in,out] seq    前回読みだした通し番号、読みだした場合は更新する
+ * @return 読みだした場合TRUE、新しいスナップショットが無いか書き込み中の場合FALSE
+ */
+int shm_read(shm_t *shm, format_t *format, uint64_t *seq) {
+  while (TRUE) {
+    uint64_t begin = __atomic_load_n(&shm->header->seq, __ATOMIC_ACQUIRE);
+    uint64_t size;
+    if ((begin & 1) || begin == *seq) {
+      return FALSE;
+    }
+    size = __atomic_load_n(&shm->header->size, __ATOMIC_RELAXED);
+    if (sizeof(shm_header_t) + size > shm->size) {
+      struct stat st;
+      if (fstat(shm->fd, &st) != 0 || st.st_size < sizeof(shm_header_t) + size
+          || shm_map(shm, st.st_size) != SUCCESS) {
+        // 拡張の途中の場合は書き込み完了後に読みなおす
+        return FALSE;
+      }
+      continue;
+    }
+    format_reset(format);
+    memcpy(format_reserve(format, size), shm->data, size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shm->header->seq, __ATOMIC_RELAXED) == begin) {
+      *seq = begin;
+      return TRUE;
+    }
+  }
+}
+
+/**
+ * @brief SIGINT/SIGTERMを受けたことを記録する
+ *
+ * @param[in] sig シグナル番号
+ */
+static void shm_on_signal(int sig) {
+  shm_stopped = TRUE;
+}
+
+/**
+ * @brief SIGINT/SIGTERMでshm_waitを終了させる
+ *
+ * シグナルを受けるとshm_waitがNULLを返すようになり、
+ * 読み出し側は後始末をしてから終了できる。
+ */
+void shm_catch_signals(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = shm_on_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+}
+
+/**
+ * @brief 新しいスナップショットが書き込まれるまで待って読み出す
+ *
+ * SHM_POLL_MSごとに通し番号を確認する。
+ * 長さ付きバイナリ形式のレコードとして解釈できないスナップショットは読み飛ばす。
+ * shm_catch_signalsで捕捉したシグナルを受けた場合は待たずに戻る。
+ *
+ * @param[in,out] shm    読み出し用に開いたハンドル
+ * @param[out]    format 読みだしたスナップショットの書き込み先
+ * @param[in,out] seq    前回読みだした通し番号
+ * @return formatの内容をレコードとして参照するポインタ、シグナルを受けた場合NULL
+ */
+const binary_record_t *shm_wait(shm_t *shm, format_t *format, uint64_t *seq) {
+  const struct timespec poll = {0, SHM_POLL_MS * 1000000L};
+  while (!shm_stopped) {
+    if (!shm_read(shm, format, seq)) {
+      nanosleep(&poll, NULL);
+      continue;
+    }
+    if (binary_check(format->buf, format->len) == SUCCESS) {
+      return (const binary_record_t *) format->buf;
+    }
+    ERR("invalid snapshot\n");
+  }
+  return NULL;
+}
@@ -0,0 +1,71 @@
+/**
+ * @file shm.h
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief 共有メモリによる計測結果の公開
+ *
+ * 1つの書き込み側が計測ごとのスナップショットをPOSIX共有メモリへ書き込み、
+ * 複数の読み出し側がロックを取らずに一貫したスナップショットを読み出す。
+ * 書き込み中であることは通し番号(seqlock)で表し、
+ * 読み出し側は前後で通し番号が変化していないことで書き込みと重ならなかったことを確認する。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#ifndef SHM_H_
+#define SHM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cpuusage.h"
+#include "format.h"
+
+/**
+ * 共有メモリの先頭の識別子
+ */
+#define SHM_MAGIC "CPUSHM\0\0"
+/**
+ * 共有メモリの形式のバージョン
+ */
+#define SHM_VERSION 1
+/**
+ * 新しいスナップショットを待つ際の確認間隔[ms]
+ */
+#define SHM_POLL_MS 10
+
+/**
+ * 共有メモリのヘッダ
+ *
+ * ヘッダに続いてcapacityバイトのスナップショット領域が続き、
+ * 先頭からsizeバイトが最新のスナップショットとなる。
+ * seqは書き込み中は奇数、書き込み完了後は偶数となる。
+ * 値はすべて書き込んだ環境のバイトオーダーで格納する。
+ */
+typedef struct shm_header_t {
+  char magic[8];        /**< SHM_MAGIC */
+  uint32_t version;     /**< SHM_VERSION */
+  uint32_t header_size; /**< ヘッダのサイズ */
+  uint64_t seq;         /**< 通し番号 */
+  uint64_t size;        /**< スナップショットのサイズ */
+  uint64_t capacity;    /**< スナップショット領域のサイズ */
+} shm_header_t;
+
+/**
+ * 共有メモリのハンドル
+ */
+typedef struct shm_t shm_t;
+
+shm_t *new_shm_t(const char *name);
+shm_t *load_shm_t(const char *name);
+void delete_shm_t(shm_t *shm);
+result_t shm_publish(shm_t *shm, const void *buf, size_t len);
+int shm_read(shm_t *shm, format_t *format, uint64_t *seq);
+void shm_catch_signals(void);
+const binary_record_t *shm_wait(shm_t *shm, format_t *format, uint64_t *seq);
+
+#endif /* SHM_H_ */
@@ -0,0 +1,340 @@
+/**
+ * @file topology.c
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief CPUトポロジーごとの集計
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include "topology.h"
+
+/**
+ * sysfsの値を読み出すバッファサイズ
+ */
+#define SYS_BUFFER_SIZE 4096
+
+static result_t read_sys_file(const char *path, char *buf, size_t size);
+static void parse_cpulist(const char *list, char *mask, int num);
+static int add_domain(topology_level_t *level, int id);
+static int comp_int(const void *a, const void *b);
+static void read_nodes(topology_t *topology, const char *sys_root, char *mask, char *buf);
+static void read_packages(topology_t *topology, const char *sys_root, char *buf);
+static void read_llcs(topology_t *topology, const char *sys_root, char *mask, char *buf);
+
+/**
+ * @brief sysfsのファイルを読み出す
+ *
+ * 読みだした内容はNUL終端し、末尾の改行を取り除く。
+ *
+ * @param[in]  path 読み出すファイル
+ * @param[out] buf  書き込み先
+ * @param[in]  size bufのサイズ
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t read_sys_file(const char *path, char *buf, size_t size) {
+  ssize_t len;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return FAILURE;
+  }
+  do {
+    len = read(fd, buf, size - 1);
+  } while (len < 0 && errno == EINTR);
+  close(fd);
+  if (len < 0) {
+    return FAILURE;
+  }
+  while (len > 0 && buf[len - 1] == '\n') {
+    len--;
+  }
+  buf[len] = 0;
+  return SUCCESS;
+}
+
+/**
+ * @brief "0-3,8,10-11"形式のCPUリストを解釈する
+ *
+ * num以上の番号は無視する。
+ *
+ * @param[in]  list CPUリスト
+ * @param[out] mask 含まれるコアをTRUEとする、num個の領域
+ * @param[in]  num  CPUの個数
+ */
+static void parse_cpulist(const char *list, char *mask, int num) {
+  const char *p = list;
+  memset(mask, 0, num);
+  while (*p >= '0' && *p <= '9') {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    long i;
+    if (*end == '-') {
+      last = strtol(end + 1, &end, 10);
+    }
+    for (i = first; i <= last && i < num; i++) {
+      mask[i] = TRUE;
+    }
+    if (*end != ',') {
+      break;
+    }
+    p = end + 1;
+  }
+}
+
+/**
+ * @brief 番号に対応する分類のインデックスを返す
+ *
+ * 未登録の番号の場合は末尾に追加する。
+ *
+ * @param[in,out] level 対象の単位
+ * @param[in]     id    分類の番号
+ * @return 分類のインデックス
+ */
+static int add_domain(topology_level_t *level, int id) {
+  int i;
+  for (i = 0; i < level->num; i++) {
+    if (level->id[i] == id) {
+      return i;
+    }
+  }
+  level->id[level->num] = id;
+  return level->num++;
+}
+
+/**
+ * @brief intの昇順の比較関数
+ *
+ * @param[in] a 比較対象
+ * @param[in] b 比較対象
+ * @return 比較結果
+ */
+static int comp_int(const void *a, const void *b) {
+  return *(const int *) a - *(const int *) b;
+}
+
+/**
+ * @brief NUMAノードごとのCPUリストを読み出す
+ *
+ * node*ディレクトリの番号順に分類を登録し、cpulistに含まれるコアを割り当てる。
+ *
+ * @param[in,out] topology 対象のトポロジー
+ * @param[in]     sys_root sysfsのマウント位置
+ * @param[out]    mask     作業領域、num個
+ * @param[out]    buf      作業領域、SYS_BUFFER_SIZE
+ */
+static void read_nodes(topology_t *topology, const char *sys_root, char *mask, char *buf) {
+  topology_level_t *level = &topology->levels[TOPOLOGY_NODE];
+  char path[PATH_MAX];
+  struct dirent *dent;
+  int *ids = NULL;
+  int id_num = 0;
+  int id_size = 0;
+  int i, j;
+  DIR *dir;
+  snprintf(path, sizeof(path), "%s/devices/system/node", sys_root);
+  dir = opendir(path);
+  if (dir == NULL) {
+    return;
+  }
+  while ((dent = readdir(dir)) != NULL) {
+    if (strncmp(dent->d_name, "node", 4) != 0
+        || dent->d_name[4] < '0' || dent->d_name[4] > '9') {
+      continue;
+    }
+    if (id_num == id_size) {
+      id_size = id_size == 0 ? 8 : id_size * 2;
+      ids = xrealloc(ids, sizeof(int) * id_size);
+    }
+    ids[id_num++] = atoi(dent->d_name + 4);
+  }
+  closedir(dir);
+  qsort(ids, id_num, sizeof(int), comp_int);
+  for (i = 0; i < id_num; i++) {
+    int index = -1;
+    snprintf(path, sizeof(path), "%s/devices/system/node/node%d/cpulist", sys_root, ids[i]);
+    if (read_sys_file(path, buf, SYS_BUFFER_SIZE) != SUCCESS) {
+      continue;
+    }
+    parse_cpulist(buf, mask, topology->num);
+    for (j = 0; j < topology->num; j++) {
+      if (!mask[j] || level->index[j] >= 0) {
+        continue;
+      }
+      if (index < 0) {
+        index = add_domain(level, ids[i]);
+      }
+      level->index[j] = index;
+    }
+  }
+  free(ids);
+}
+
+/**
+ * @brief 各コアのパッケージ番号を読み出す
+ *
+ * @param[in,out] topology 対象のトポロジー
+ * @param[in]     sys_root sysfsのマウント位置
+ * @param[out]    buf      作業領域、SYS_BUFFER_SIZE
+ */
+static void read_packages(topology_t *topology, const char *sys_root, char *buf) {
+  topology_level_t *level = &topology->levels[TOPOLOGY_PACKAGE];
+  char path[PATH_MAX];
+  int i;
+  for (i = 0; i < topology->num; i++) {
+    snprintf(path, sizeof(path), "%s/devices/system/cpu/cpu%d/topology/physical_package_id",
+             sys_root, i);
+    if (read_sys_file(path, buf, SYS_BUFFER_SIZE) != SUCCESS || buf[0] == 0) {
+      continue;
+    }
+    level->index[i] = add_domain(level, atoi(buf));
+  }
+}
+
+/**
+ * @brief 各コアのL3キャッシュを共有する範囲を読み出す
+ *
+ * 分類が未定のコアについてcache/index*のうちlevelが3のものを探し、
+ * shared_cpu_listに含まれるコアを同じ分類とする。
+ * 分類の番号は見つかった順の通し番号とする。
+ *
+ * @param[in,out] topology 対象のトポロジー
+ * @param[in]     sys_root sysfsのマウント位置
+ * @param[out]    mask     作業領域、num個
+ * @param[out]    buf      作業領域、SYS_BUFFER_SIZE
+ */
+static void read_llcs(topology_t *topology, const char *sys_root, char *mask, char *buf) {
+  topology_level_t *level = &topology->levels[TOPOLOGY_LLC];
+  char path[PATH_MAX];
+  int i, j, k;
+  for (i = 0; i < topology->num; i++) {
+    int index;
+    if (level->index[i] >= 0) {
+      continue;
+    }
+    for (k = 0; ; k++) {
+      snprintf(path, sizeof(path), "%s/devices/system/cpu/cpu%d/cache/index%d/level",
+               sys_root, i, k);
+      if (read_sys_file(path, buf, SYS_BUFFER_SIZE) != SUCCESS) {
+        break;
+      }
+      if (strcmp(buf, "3") == 0) {
+        break;
+      }
+    }
+    snprintf(path, sizeof(path), "%s/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+             sys_root, i, k);
+    if (read_sys_file(path, buf, SYS_BUFFER_SIZE) != SUCCESS) {
+      continue;
+    }
+    parse_cpulist(buf, mask, topology->num);
+    mask[i] = TRUE;
+    index = add_domain(level, level->num);
+    for (j = i; j < topology->num; j++) {
+      if (mask[j] && level->index[j] < 0) {
+        level->index[j] = index;
+      }
+    }
+  }
+}
+
+/**
+ * @brief sysfsからCPUトポロジーを読み出す
+ *
+ * 読み出せなかったコアはその単位での分類を-1とし、集計から除く。
+ *
+ * @param[in] sys_root sysfsのマウント位置
+ * @param[in] num      CPUの個数
+ * @return CPUトポロジー
+ */
+topology_t *new_topology_t(const char *sys_root, int num) {
+  static const char *names[TOPOLOGY_LEVELS] = {"node", "pkg", "llc"};
+  topology_t *topology = xmalloc(sizeof(topology_t));
+  char *mask = xmalloc(num);
+  char *buf = xmalloc(SYS_BUFFER_SIZE);
+  int i, j;
+  topology->num = num;
+  for (i = 0; i < TOPOLOGY_LEVELS; i++) {
+    topology_level_t *level = &topology->levels[i];
+    level->name = names[i];
+    level->num = 0;
+    level->id = xmalloc(sizeof(int) * num);
+    level->index = xmalloc(sizeof(int) * num);
+    level->total = xmalloc(sizeof(uint64_t) * num);
+    level->load = xmalloc(sizeof(uint64_t) * num);
+    level->usage = xmalloc(sizeof(float) * num);
+    for (j = 0; j < num; j++) {
+      level->index[j] = -1;
+    }
+  }
+  read_nodes(topology, sys_root, mask, buf);
+  read_packages(topology, sys_root, buf);
+  read_llcs(topology, sys_root, mask, buf);
+  free(mask);
+  free(buf);
+  return topology;
+}
+
+/**
+ * @brief CPUトポロジーを開放する
+ *
+ * @param[in] topology 開放するCPUトポロジー
+ */
+void delete_topology_t(topology_t *topology) {
+  int i;
+  if (topology == NULL) {
+    return;
+  }
+  for (i = 0; i < TOPOLOGY_LEVELS; i++) {
+    topology_level_t *level = &topology->levels[i];
+    free(level->id);
+    free(level->index);
+    free(level->total);
+    free(level->load);
+    free(level->usage);
+  }
+  free(topology);
+}
+
+/**
+ * @brief 各コアの使用率の計算結果を単位ごとに集計する
+ *
+ * 分類ごとに全時間と負荷の差分を合計して使用率を求める。
+ * 前後どちらかでオフラインだったコアは含めない。
+ *
+ * @param[in,out] topology 集計先のCPUトポロジー
+ * @param[in]     usage    cpu_matrix_usageの計算結果
+ */
+void topology_usage(topology_t *topology, const cpu_usage_t *usage) {
+  int i, j;
+  for (i = 0; i < TOPOLOGY_LEVELS; i++) {
+    topology_level_t *level = &topology->levels[i];
+    memset(level->total, 0, sizeof(uint64_t) * level->num);
+    memset(level->load, 0, sizeof(uint64_t) * level->num);
+    for (j = 0; j < topology->num && j < usage->num; j++) {
+      int index = level->index[j];
+      if (index < 0 || !usage->online[j]) {
+        continue;
+      }
+      level->total[index] += usage->total[j];
+      level->load[index] += usage->load[j];
+    }
+    for (j = 0; j < level->num; j++) {
+      level->usage[j] = level->total[j] == 0 ? 0 : (float) level->load[j] / level->total[j] * 100;
+    }
+  }
+}
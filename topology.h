@@ -0,0 +1,71 @@
+/**
+ * @file topology.h
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief CPUトポロジーごとの集計
+ *
+ * 起動時に一度だけsysfsからNUMAノード、パッケージ、L3キャッシュの共有範囲を読み出し、
+ * 各コアの使用率の計算結果をそれぞれの単位で集計する。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#ifndef TOPOLOGY_H_
+#define TOPOLOGY_H_
+
+#include <stdint.h>
+#include "cpuusage.h"
+
+/**
+ * sysfsのマウント位置の初期値
+ */
+#define DEFAULT_SYS_ROOT "/sys"
+
+/**
+ * NUMAノード
+ */
+#define TOPOLOGY_NODE    0
+/**
+ * パッケージ(ソケット)
+ */
+#define TOPOLOGY_PACKAGE 1
+/**
+ * L3キャッシュを共有する範囲
+ */
+#define TOPOLOGY_LLC     2
+/**
+ * 集計の単位の個数
+ */
+#define TOPOLOGY_LEVELS  3
+
+/**
+ * 1つの単位でのコアの分類
+ */
+typedef struct topology_level_t {
+  const char *name; /**< 表示名 */
+  int num;          /**< 分類の個数 */
+  int *id;          /**< 各分類の番号、num個 */
+  int *index;       /**< 各コアが属する分類のインデックス、不明な場合-1 */
+  uint64_t *total;  /**< 各分類の全時間の差分の集計先 */
+  uint64_t *load;   /**< 各分類の負荷の差分の集計先 */
+  float *usage;     /**< 各分類の使用率[%]の集計先 */
+} topology_level_t;
+
+/**
+ * CPUトポロジー
+ */
+typedef struct topology_t {
+  int num;                                  /**< CPUの個数 */
+  topology_level_t levels[TOPOLOGY_LEVELS]; /**< 各単位での分類 */
+} topology_t;
+
+topology_t *new_topology_t(const char *sys_root, int num);
+void delete_topology_t(topology_t *topology);
+void topology_usage(topology_t *topology, const cpu_usage_t *usage);
+
+#endif /* TOPOLOGY_H_ */
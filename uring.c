@@ -0,0 +1,239 @@
+/**
+ * @file uring.c
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief io_uringによるまとめ読み
+ *
+ * SQのtailとCQのheadはこのスレッドのみが更新し、
+ * カーネルが更新するSQのheadとCQのtailはacquireで読み出す。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+/**
+ * io_uringのハンドル
+ */
+struct uring_t {
+  int fd;                    /**< io_uringのファイルディスクリプタ */
+  void *sq_ptr;              /**< mmapしたSQリング */
+  size_t sq_size;            /**< SQリングのサイズ */
+  void *cq_ptr;              /**< mmapしたCQリング、SQと共有の場合sq_ptr */
+  size_t cq_size;            /**< CQリングのサイズ */
+  struct io_uring_sqe *sqes; /**< mmapしたSQEの配列 */
+  size_t sqes_size;          /**< SQEの配列のサイズ */
+  unsigned *sq_head;         /**< SQのhead、カーネルが更新する */
+  unsigned *sq_tail;         /**< SQのtail */
+  unsigned sq_mask;          /**< SQのインデックスのマスク */
+  unsigned sq_entries;       /**< SQのエントリ数 */
+  unsigned *sq_array;        /**< SQのインデックス配列 */
+  unsigned *cq_head;         /**< CQのhead */
+  unsigned *cq_tail;         /**< CQのtail、カーネルが更新する */
+  unsigned cq_mask;          /**< CQのインデックスのマスク */
+  struct io_uring_cqe *cqes; /**< CQEの配列 */
+  unsigned queued;           /**< SQへ積んで未投入の数 */
+  unsigned inflight;         /**< 投入して完了を回収していない数 */
+};
+
+/**
+ * @brief io_uringを初期化する
+ *
+ * カーネルが対応していない場合や、seccompなどで禁止されている場合は失敗する。
+ * CQはSQの2倍のエントリ数で作られるため、SQ一杯の投入を溢れずに受けられる。
+ *
+ * @param[in] entries SQのエントリ数
+ * @return io_uringのハンドル、失敗した場合NULL
+ */
+uring_t *new_uring_t(unsigned entries) {
+  struct io_uring_params params;
+  uring_t *uring;
+  char *sq;
+  char *cq;
+  int fd;
+  memset(&params, 0, sizeof(params));
+  fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    ERR("io_uring_setup: %s\n", strerror(errno));
+    return NULL;
+  }
+  uring = xmalloc(sizeof(uring_t));
+  memset(uring, 0, sizeof(uring_t));
+  uring->fd = fd;
+  uring->sq_ptr = MAP_FAILED;
+  uring->cq_ptr = MAP_FAILED;
+  uring->sqes = MAP_FAILED;
+  uring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  uring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (uring->cq_size > uring->sq_size) {
+      uring->sq_size = uring->cq_size;
+    }
+    uring->cq_size = uring->sq_size;
+  }
+  uring->sq_ptr = mmap(NULL, uring->sq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (uring->sq_ptr == MAP_FAILED) {
+    ERR("mmap: %s\n", strerror(errno));
+    goto error;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    uring->cq_ptr = uring->sq_ptr;
+  } else {
+    uring->cq_ptr = mmap(NULL, uring->cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (uring->cq_ptr == MAP_FAILED) {
+      ERR("mmap: %s\n", strerror(errno));
+      goto error;
+    }
+  }
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (uring->sqes == MAP_FAILED) {
+    ERR("mmap: %s\n", strerror(errno));
+    goto error;
+  }
+  sq = uring->sq_ptr;
+  cq = uring->cq_ptr;
+  uring->sq_head = (unsigned *) (sq + params.sq_off.head);
+  uring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  uring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+  uring->sq_entries = params.sq_entries;
+  uring->sq_array = (unsigned *) (sq + params.sq_off.array);
+  uring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  uring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  uring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  return uring;
+  error:
+  delete_uring_t(uring);
+  return NULL;
+}
+
+/**
+ * @brief io_uringを開放する
+ *
+ * @param[in] uring 開放するハンドル
+ */
+void delete_uring_t(uring_t *uring) {
+  if (uring == NULL) {
+    return;
+  }
+  if (uring->sqes != MAP_FAILED) {
+    munmap(uring->sqes, uring->sqes_size);
+  }
+  if (uring->cq_ptr != MAP_FAILED && uring->cq_ptr != uring->sq_ptr) {
+    munmap(uring->cq_ptr, uring->cq_size);
+  }
+  if (uring->sq_ptr != MAP_FAILED) {
+    munmap(uring->sq_ptr, uring->sq_size);
+  }
+  close(uring->fd);
+  free(uring);
+}
+
+/**
+ * @brief 先頭からの読み出しをSQへ積む
+ *
+ * 投入はuring_submit_waitでまとめて行う。
+ * 完了はuser_dataとともにuring_reapで回収する。
+ *
+ * @param[in,out] uring     io_uringのハンドル
+ * @param[in]     fd        読み出すファイルディスクリプタ
+ * @param[out]    buf       書き込み先
+ * @param[in]     len       書き込み先のサイズ
+ * @param[in]     user_data 完了時に返す値
+ * @return 成功：SUCCESS / 失敗：FAILURE、SQに空きがない場合
+ */
+result_t uring_prep_read(uring_t *uring, int fd, void *buf, unsigned len, uint64_t user_data) {
+  unsigned tail = *uring->sq_tail;
+  unsigned head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned index;
+  struct io_uring_sqe *sqe;
+  if (tail - head >= uring->sq_entries) {
+    return FAILURE;
+  }
+  index = tail & uring->sq_mask;
+  sqe = &uring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->off = 0;
+  sqe->addr = (uint64_t) (uintptr_t) buf;
+  sqe->len = len;
+  sqe->user_data = user_data;
+  uring->sq_array[index] = index;
+  __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  uring->queued++;
+  return SUCCESS;
+}
+
+/**
+ * @brief SQへ積んだ要求を投入し、全ての完了を待つ
+ *
+ * 投入と完了待ちは1回のio_uring_enterで行う。
+ * CQには回収済みでない完了も含まれるため、未回収の全要求がCQに揃うまで待つ。
+ * 途中で割り込まれた場合は残りの投入と完了待ちを続ける。
+ *
+ * @param[in,out] uring io_uringのハンドル
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+result_t uring_submit_wait(uring_t *uring) {
+  while (uring->queued > 0 || uring->inflight > 0) {
+    unsigned ready = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE) - *uring->cq_head;
+    int n;
+    if (uring->queued == 0 && ready >= uring->inflight) {
+      break;
+    }
+    n = syscall(__NR_io_uring_enter, uring->fd, uring->queued,
+                uring->queued + uring->inflight, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ERR("io_uring_enter: %s\n", strerror(errno));
+      return FAILURE;
+    }
+    uring->queued -= n;
+    uring->inflight += n;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief 完了した要求を1つ回収する
+ *
+ * @param[in,out] uring     io_uringのハンドル
+ * @param[out]    user_data 要求時に指定した値
+ * @param[out]    res       読みだしたサイズ、失敗した場合は-errno
+ * @return 回収した場合TRUE、完了した要求が無い場合FALSE
+ */
+int uring_reap(uring_t *uring, uint64_t *user_data, int *res) {
+  unsigned head = *uring->cq_head;
+  struct io_uring_cqe *cqe;
+  if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return FALSE;
+  }
+  cqe = &uring->cqes[head & uring->cq_mask];
+  *user_data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+  uring->inflight--;
+  return TRUE;
+}
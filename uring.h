@@ -0,0 +1,36 @@
+/**
+ * @file uring.h
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief io_uringによるまとめ読み
+ *
+ * 多数のファイルの読み出しをSQへ積み、1回のio_uring_enterで投入して完了を待つ。
+ * liburingには依存せず、システムコールとmmapしたリングを直接扱う。
+ * 1つのリングは1つのスレッドのみが使用する前提とし、ロックは行わない。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <stdint.h>
+#include "cpuusage.h"
+
+/**
+ * io_uringのハンドル
+ */
+typedef struct uring_t uring_t;
+
+uring_t *new_uring_t(unsigned entries);
+void delete_uring_t(uring_t *uring);
+result_t uring_prep_read(uring_t *uring, int fd, void *buf, unsigned len, uint64_t user_data);
+result_t uring_submit_wait(uring_t *uring);
+int uring_reap(uring_t *uring, uint64_t *user_data, int *res);
+
+#endif /* URING_H_ */
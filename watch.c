@@ -0,0 +1,766 @@
+/**
+ * @file watch.c
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief proc connectorとtaskstatsによるイベント方式のタスク追跡
+ *
+ * /procの走査は起動時とイベント取りこぼし時のみ行う。
+ * taskstatsへの問い合わせは送信をまとめ、応答はrecvmmsgでまとめて受信する。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <linux/taskstats.h>
+#include "watch.h"
+
+/**
+ * /proc配下の相対パス名バッファのサイズ
+ */
+#define NAME_BUFFER_SIZE 64
+/**
+ * ラインバッファのサイズ
+ */
+#define LINE_BUFFER_SIZE 1024
+/**
+ * getdents64用バッファのサイズ
+ */
+#define DENTS_BUFFER_SIZE 4096
+/**
+ * 追跡するタスクテーブルサイズの初期値
+ */
+#define INIT_WATCH_TASKS 1024
+/**
+ * taskstatsへの問い合わせを一度に送信する数
+ */
+#define WATCH_BATCH 64
+/**
+ * この回数連続でCPU時間が変化しなかったタスクはアイドルとみなし、
+ * 以降はこの回数に1回だけ問い合わせる
+ */
+#define WATCH_IDLE_TICKS 4
+/**
+ * taskstatsの応答待ちのタイムアウト[秒]
+ */
+#define WATCH_TIMEOUT_SEC 1
+/**
+ * netlinkの受信メッセージ1つあたりのバッファサイズ
+ */
+#define NETLINK_MSG_SIZE 2048
+/**
+ * taskstatsへの要求メッセージ1つあたりのサイズ
+ */
+#define NETLINK_REQUEST_SIZE NLMSG_SPACE(GENL_HDRLEN + NLA_HDRLEN + sizeof(uint32_t))
+/**
+ * generic netlinkメッセージのペイロード先頭
+ */
+#define GENLMSG_DATA(nlh) ((char *) NLMSG_DATA(nlh) + GENL_HDRLEN)
+/**
+ * netlink属性の値の先頭
+ */
+#define NLA_DATA(nla) ((char *) (nla) + NLA_HDRLEN)
+/**
+ * netlink属性が残りの長さに収まっているか
+ */
+#define NLA_OK(nla, len) ((len) >= (int) sizeof(struct nlattr) \
+    && (nla)->nla_len >= sizeof(struct nlattr) && (nla)->nla_len <= (len))
+/**
+ * 次のnetlink属性
+ */
+#define NLA_NEXT(nla, len) ((len) -= NLA_ALIGN((nla)->nla_len), \
+    (struct nlattr *) ((char *) (nla) + NLA_ALIGN((nla)->nla_len)))
+
+static size_t put_genl_request(char *buf, uint16_t type, uint32_t seq, uint8_t cmd,
+                               uint16_t attr, const void *data, size_t len);
+static result_t watch_subscribe(int fd);
+static uint16_t watch_resolve_family(int fd, char *buf, size_t size);
+static uint32_t watch_hash(watch_t *watch, int tid);
+static watch_task_t *watch_find(watch_t *watch, int tid);
+static void watch_add(watch_t *watch, int tid, int pid);
+static void watch_remove(watch_t *watch, watch_task_t *task);
+static void watch_sweep(watch_t *watch);
+static void watch_scan_threads(watch_t *watch, int pid);
+static void watch_scan(watch_t *watch, DIR *proc_dir);
+static void watch_event(watch_t *watch, struct proc_event *ev);
+static void watch_drain(watch_t *watch);
+static void watch_read_stat(watch_t *watch, watch_task_t *task);
+static void watch_reply(watch_t *watch, struct nlmsghdr *nlh);
+static void watch_query_batch(watch_t *watch, int *tids, int num);
+static void watch_query(watch_t *watch);
+
+/**
+ * @brief netlinkメッセージとしてgeneric netlinkの要求を書き込む
+ *
+ * @param[out] buf  書き込み先
+ * @param[in]  type メッセージタイプ(ファミリーID)
+ * @param[in]  seq  シーケンス番号
+ * @param[in]  cmd  コマンド
+ * @param[in]  attr 属性タイプ
+ * @param[in]  data 属性の値
+ * @param[in]  len  属性の値のサイズ
+ * @return 書き込んだサイズ
+ */
+static size_t put_genl_request(char *buf, uint16_t type, uint32_t seq, uint8_t cmd,
+                               uint16_t attr, const void *data, size_t len) {
+  struct nlmsghdr *nlh = (struct nlmsghdr *) buf;
+  struct genlmsghdr *genl = NLMSG_DATA(nlh);
+  struct nlattr *nla = (struct nlattr *) GENLMSG_DATA(nlh);
+  nlh->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + NLA_HDRLEN + NLA_ALIGN(len));
+  nlh->nlmsg_type = type;
+  nlh->nlmsg_flags = NLM_F_REQUEST;
+  nlh->nlmsg_seq = seq;
+  nlh->nlmsg_pid = 0;
+  genl->cmd = cmd;
+  genl->version = TASKSTATS_GENL_VERSION;
+  genl->reserved = 0;
+  nla->nla_type = attr;
+  nla->nla_len = NLA_HDRLEN + len;
+  memset(NLA_DATA(nla), 0, NLA_ALIGN(len));
+  memcpy(NLA_DATA(nla), data, len);
+  return NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+/**
+ * @brief proc connectorのイベント通知を購読する
+ *
+ * @param[in] fd proc connectorのソケット
+ * @return 成功：SUCCESS / 失敗：FAILURE
+ */
+static result_t watch_subscribe(int fd) {
+  char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))]
+      __attribute__((aligned(NLMSG_ALIGNTO)));
+  struct nlmsghdr *nlh = (struct nlmsghdr *) buf;
+  struct cn_msg *msg = NLMSG_DATA(nlh);
+  enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+  memset(buf, 0, sizeof(buf));
+  nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(op));
+  nlh->nlmsg_type = NLMSG_DONE;
+  msg->id.idx = CN_IDX_PROC;
+  msg->id.val = CN_VAL_PROC;
+  msg->len = sizeof(op);
+  memcpy(msg->data, &op, sizeof(op));
+  if (send(fd, buf, nlh->nlmsg_len, 0) < 0) {
+    ERR("%s\n", strerror(errno));
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief taskstatsのファミリーIDを問い合わせる
+ *
+ * @param[in] fd   generic netlinkのソケット
+ * @param[in] buf  作業用バッファ
+ * @param[in] size 作業用バッファのサイズ
+ * @return ファミリーID、失敗した場合0
+ */
+static uint16_t watch_resolve_family(int fd, char *buf, size_t size) {
+  struct nlmsghdr *nlh = (struct nlmsghdr *) buf;
+  struct nlattr *nla;
+  ssize_t len;
+  len = put_genl_request(buf, GENL_ID_CTRL, 0, CTRL_CMD_GETFAMILY,
+                         CTRL_ATTR_FAMILY_NAME, TASKSTATS_GENL_NAME,
+                         sizeof(TASKSTATS_GENL_NAME));
+  if (send(fd, buf, len, 0) < 0) {
+    ERR("%s\n", strerror(errno));
+    return 0;
+  }
+  len = recv(fd, buf, size, 0);
+  if (len < 0 || !NLMSG_OK(nlh, len) || nlh->nlmsg_type == NLMSG_ERROR) {
+    ERR("taskstats is not available\n");
+    return 0;
+  }
+  len = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+  for (nla = (struct nlattr *) GENLMSG_DATA(nlh); NLA_OK(nla, len); nla = NLA_NEXT(nla, len)) {
+    if (nla->nla_type == CTRL_ATTR_FAMILY_ID) {
+      return *(uint16_t *) NLA_DATA(nla);
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief イベント方式のタスク追跡構造体の初期化を行う
+ *
+ * proc connectorの購読とtaskstatsのファミリーIDの解決を行う。
+ * いずれも権限(CAP_NET_ADMIN)やカーネルの設定によっては利用できない。
+ *
+ * @param[in] proc_fd /procのファイルディスクリプタ
+ * @param[in] mode    WATCH_PROCESS / WATCH_THREAD
+ * @return タスク追跡構造体、利用できない場合NULL
+ */
+watch_t *new_watch_t(int proc_fd, int mode) {
+  struct sockaddr_nl addr;
+  struct timeval timeout = {WATCH_TIMEOUT_SEC, 0};
+  watch_t *watch = xmalloc(sizeof(watch_t));
+  memset(watch, 0, sizeof(watch_t));
+  watch->mode = mode;
+  watch->genl_fd = -1;
+  watch->proc_fd = proc_fd;
+  watch->req = xmalloc(WATCH_BATCH * NETLINK_REQUEST_SIZE);
+  watch->buf = xmalloc(WATCH_BATCH * NETLINK_MSG_SIZE);
+  watch->cn_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+  if (watch->cn_fd < 0) {
+    ERR("%s\n", strerror(errno));
+    goto error;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = CN_IDX_PROC;
+  if (bind(watch->cn_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    ERR("%s\n", strerror(errno));
+    goto error;
+  }
+  if (watch_subscribe(watch->cn_fd) != SUCCESS) {
+    goto error;
+  }
+  watch->genl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+  if (watch->genl_fd < 0) {
+    ERR("%s\n", strerror(errno));
+    goto error;
+  }
+  addr.nl_groups = 0;
+  if (bind(watch->genl_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    ERR("%s\n", strerror(errno));
+    goto error;
+  }
+  setsockopt(watch->genl_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  watch->family = watch_resolve_family(watch->genl_fd, watch->buf, NETLINK_MSG_SIZE);
+  if (watch->family == 0) {
+    goto error;
+  }
+  watch->clk_tck = sysconf(_SC_CLK_TCK);
+  watch->size = INIT_WATCH_TASKS;
+  watch->tasks = xmalloc(sizeof(watch_task_t) * watch->size);
+  memset(watch->tasks, 0, sizeof(watch_task_t) * watch->size);
+  watch->resync = TRUE;
+  return watch;
+  error:
+  delete_watch_t(watch);
+  return NULL;
+}
+
+/**
+ * @brief イベント方式のタスク追跡構造体の開放を行う
+ *
+ * @param[in] watch 開放する構造体
+ */
+void delete_watch_t(watch_t *watch) {
+  if (watch == NULL) {
+    return;
+  }
+  if (watch->cn_fd >= 0) {
+    close(watch->cn_fd);
+  }
+  if (watch->genl_fd >= 0) {
+    close(watch->genl_fd);
+  }
+  free(watch->tasks);
+  free(watch->req);
+  free(watch->buf);
+  free(watch);
+}
+
+/**
+ * @brief TIDのハッシュ値からテーブル上の初期位置を求める
+ *
+ * @param[in] watch タスク追跡構造体
+ * @param[in] tid   TID
+ * @return テーブル上の位置
+ */
+static uint32_t watch_hash(watch_t *watch, int tid) {
+  return ((uint32_t) tid * 2654435761U) & (watch->size - 1);
+}
+
+/**
+ * @brief TIDに対応するタスクを探す
+ *
+ * @param[in] watch タスク追跡構造体
+ * @param[in] tid   TID
+ * @return タスク、見つからない場合NULL
+ */
+static watch_task_t *watch_find(watch_t *watch, int tid) {
+  uint32_t mask = watch->size - 1;
+  uint32_t i;
+  for (i = watch_hash(watch, tid); watch->tasks[i].tid != 0; i = (i + 1) & mask) {
+    if (watch->tasks[i].tid == tid) {
+      return &watch->tasks[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief タスクを追跡対象に加える
+ *
+ * 既に追跡している場合は次回の問い合わせ対象とするだけとする。
+ *
+ * @param[in,out] watch タスク追跡構造体
+ * @param[in]     tid   TID
+ * @param[in]     pid   PID
+ */
+static void watch_add(watch_t *watch, int tid, int pid) {
+  uint32_t mask;
+  uint32_t i;
+  watch_task_t *task = watch_find(watch, tid);
+  if (task != NULL) {
+    task->refresh = TRUE;
+    return;
+  }
+  if ((watch->num + 1) * 2 > watch->size) {
+    watch_task_t *old = watch->tasks;
+    int old_size = watch->size;
+    int j;
+    watch->size *= 2;
+    watch->tasks = xmalloc(sizeof(watch_task_t) * watch->size);
+    memset(watch->tasks, 0, sizeof(watch_task_t) * watch->size);
+    mask = watch->size - 1;
+    for (j = 0; j < old_size; j++) {
+      if (old[j].tid == 0) {
+        continue;
+      }
+      for (i = watch_hash(watch, old[j].tid); watch->tasks[i].tid != 0; i = (i + 1) & mask);
+      watch->tasks[i] = old[j];
+    }
+    free(old);
+  }
+  mask = watch->size - 1;
+  for (i = watch_hash(watch, tid); watch->tasks[i].tid != 0; i = (i + 1) & mask);
+  task = &watch->tasks[i];
+  memset(task, 0, sizeof(watch_task_t));
+  task->tid = tid;
+  task->pid = pid;
+  task->refresh = TRUE;
+  watch->num++;
+}
+
+/**
+ * @brief タスクを追跡対象から外す
+ *
+ * 後続のエントリを詰めなおすため、削除後はタスクへのポインタは無効となる。
+ *
+ * @param[in,out] watch タスク追跡構造体
+ * @param[in]     task  削除するタスク
+ */
+static void watch_remove(watch_t *watch, watch_task_t *task) {
+  watch_task_t *tasks = watch->tasks;
+  uint32_t mask = watch->size - 1;
+  uint32_t i = task - tasks;
+  uint32_t j = i;
+  while (TRUE) {
+    uint32_t home;
+    j = (j + 1) & mask;
+    if (tasks[j].tid == 0) {
+      break;
+    }
+    home = watch_hash(watch, tasks[j].tid);
+    // homeが(i, j]の範囲外であれば空いた位置へ詰める
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      tasks[i] = tasks[j];
+      i = j;
+    }
+  }
+  tasks[i].tid = 0;
+  watch->num--;
+}
+
+/**
+ * @brief 終了が確認されたタスクをまとめて追跡対象から外す
+ *
+ * @param[in,out] watch タスク追跡構造体
+ */
+static void watch_sweep(watch_t *watch) {
+  int i = 0;
+  while (i < watch->size) {
+    watch_task_t *task = &watch->tasks[i];
+    if (task->tid != 0 && task->gone) {
+      watch_remove(watch, task);
+    } else {
+      i++;
+    }
+  }
+}
+
+/**
+ * @brief 指定PIDプロセス配下のスレッドを追跡対象に加える
+ *
+ * /proc/[pid]/taskをgetdents64で直接スタック上のバッファへ読み出す。
+ *
+ * @param[in,out] watch タスク追跡構造体
+ * @param[in]     pid   PID
+ */
+static void watch_scan_threads(watch_t *watch, int pid) {
+  char path[NAME_BUFFER_SIZE];
+  char dents[DENTS_BUFFER_SIZE];
+  ssize_t size;
+  int task_fd;
+  snprintf(path, sizeof(path), "%d/task", pid);
+  task_fd = openat(watch->proc_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (task_fd < 0) {
+    return;
+  }
+  watch->opened++;
+  while ((size = getdents64(task_fd, dents, sizeof(dents))) > 0) {
+    ssize_t pos;
+    struct dirent64 *dent;
+    for (pos = 0; pos < size; pos += dent->d_reclen) {
+      dent = (struct dirent64 *) (dents + pos);
+      if(dent->d_name[0] >= '0' && dent->d_name[0] <= '9') {
+        watch_add(watch, atoi(dent->d_name), pid);
+      }
+    }
+  }
+  close(task_fd);
+}
+
+/**
+ * @brief /procを走査して追跡対象を作り直す
+ *
+ * 起動直後と、イベントの取りこぼしが発生した場合にのみ行う。
+ *
+ * @param[in,out] watch    タスク追跡構造体
+ * @param[in]     proc_dir /procのディレクトリストリーム
+ */
+static void watch_scan(watch_t *watch, DIR *proc_dir) {
+  struct dirent *dent;
+  memset(watch->tasks, 0, sizeof(watch_task_t) * watch->size);
+  watch->num = 0;
+  rewinddir(proc_dir);
+  while ((dent = readdir(proc_dir)) != NULL) {
+    if(dent->d_name[0] >= '0' && dent->d_name[0] <= '9') {
+      int pid = atoi(dent->d_name);
+      if (watch->mode == WATCH_THREAD) {
+        watch_scan_threads(watch, pid);
+      } else {
+        watch_add(watch, pid, pid);
+      }
+    }
+  }
+  watch->resync = FALSE;
+}
+
+/**
+ * @brief proc connectorのイベントを反映する
+ *
+ * プロセス単位の場合、スレッドのイベントはプロセスの代表スレッドのもののみ扱う。
+ *
+ * @param[in,out] watch タスク追跡構造体
+ * @param[in]     ev    イベント
+ */
+static void watch_event(watch_t *watch, struct proc_event *ev) {
+  int thread = watch->mode == WATCH_THREAD;
+  watch_task_t *task;
+  int tid;
+  int pid;
+  switch (ev->what) {
+    case PROC_EVENT_FORK:
+      tid = ev->event_data.fork.child_pid;
+      pid = ev->event_data.fork.child_tgid;
+      if (thread || tid == pid) {
+        watch_add(watch, tid, pid);
+      }
+      break;
+    case PROC_EVENT_EXEC:
+      pid = ev->event_data.exec.process_tgid;
+      watch_add(watch, thread ? ev->event_data.exec.process_pid : pid, pid);
+      break;
+    case PROC_EVENT_COMM:
+      tid = ev->event_data.comm.process_pid;
+      pid = ev->event_data.comm.process_tgid;
+      if (thread || tid == pid) {
+        task = watch_find(watch, tid);
+        if (task != NULL) {
+          task->refresh = TRUE;
+        }
+      }
+      break;
+    case PROC_EVENT_EXIT:
+      tid = ev->event_data.exit.process_pid;
+      pid = ev->event_data.exit.process_tgid;
+      task = thread || tid == pid ? watch_find(watch, tid) : NULL;
+      if (task == NULL) {
+        break;
+      }
+      if (thread) {
+        watch_remove(watch, task);
+      } else {
+        // 他のスレッドが残っている可能性があるため、問い合わせで終了を確認する
+        task->refresh = TRUE;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * @brief 溜まっているproc connectorのイベントをすべて反映する
+ *
+ * 受信バッファが溢れてイベントを取りこぼした場合は再走査を要求する。
+ *
+ * @param[in,out] watch タスク追跡構造体
+ */
+static void watch_drain(watch_t *watch) {
+  char buf[NETLINK_MSG_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+  ssize_t len;
+  while (TRUE) {
+    struct nlmsghdr *nlh = (struct nlmsghdr *) buf;
+    len = recv(watch->cn_fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == ENOBUFS) {
+        watch->resync = TRUE;
+        continue;
+      }
+      break;
+    }
+    for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+      struct cn_msg *msg = NLMSG_DATA(nlh);
+      if (nlh->nlmsg_type != NLMSG_DONE || msg->id.idx != CN_IDX_PROC) {
+        continue;
+      }
+      watch_event(watch, (struct proc_event *) msg->data);
+    }
+  }
+}
+
+/**
+ * @brief /procのstatからtaskstatsで得られない情報を読みだす
+ *
+ * 新たに追跡を始めた場合と、exec/comm変更のイベントがあった場合にのみ行う。
+ *
+ * @param[in]     watch タスク追跡構造体
+ * @param[in,out] task  書き込み先
+ */
+static void watch_read_stat(watch_t *watch, watch_task_t *task) {
+  char name[NAME_BUFFER_SIZE];
+  char line[LINE_BUFFER_SIZE];
+  task_stat_t stat;
+  int fd;
+  if (watch->mode == WATCH_THREAD) {
+    snprintf(name, sizeof(name), "%d/task/%d", task->pid, task->tid);
+  } else {
+    snprintf(name, sizeof(name), "%d", task->pid);
+  }
+  fd = open_stat_at(watch->proc_fd, name, "/stat");
+  if (fd < 0) {
+    return;
+  }
+  watch->opened++;
+  if (read_fd(fd, line, sizeof(line)) > 0
+      && parse_task_stat(line, task->comm, sizeof(task->comm), &stat) == SUCCESS) {
+    task->state = stat.state;
+    task->priority = stat.priority;
+    task->nice = stat.nice;
+  }
+  close(fd);
+}
+
+/**
+ * @brief taskstatsの応答を反映する
+ *
+ * TGID単位の値は終了したスレッドの分が含まれず減少することがあるため、
+ * 減少した分を補正値として加算し単調増加となるようにする。
+ *
+ * @param[in,out] watch タスク追跡構造体
+ * @param[in]     nlh   応答メッセージ
+ */
+static void watch_reply(watch_t *watch, struct nlmsghdr *nlh) {
+  int thread = watch->mode == WATCH_THREAD;
+  int aggr_type = thread ? TASKSTATS_TYPE_AGGR_PID : TASKSTATS_TYPE_AGGR_TGID;
+  int id_type = thread ? TASKSTATS_TYPE_PID : TASKSTATS_TYPE_TGID;
+  struct nlattr *nla;
+  int len = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+  for (nla = (struct nlattr *) GENLMSG_DATA(nlh); NLA_OK(nla, len); nla = NLA_NEXT(nla, len)) {
+    struct nlattr *inner;
+    struct taskstats stats;
+    watch_task_t *task = NULL;
+    int inner_len;
+    uint64_t utime;
+    uint64_t stime;
+    if (nla->nla_type != aggr_type) {
+      continue;
+    }
+    memset(&stats, 0, sizeof(stats));
+    inner_len = nla->nla_len - NLA_HDRLEN;
+    for (inner = (struct nlattr *) NLA_DATA(nla); NLA_OK(inner, inner_len);
+         inner = NLA_NEXT(inner, inner_len)) {
+      if (inner->nla_type == id_type) {
+        task = watch_find(watch, *(uint32_t *) NLA_DATA(inner));
+      } else if (inner->nla_type == TASKSTATS_TYPE_STATS) {
+        size_t size = inner->nla_len - NLA_HDRLEN;
+        memcpy(&stats, NLA_DATA(inner), size < sizeof(stats) ? size : sizeof(stats));
+      }
+    }
+    if (task == NULL) {
+      continue;
+    }
+    utime = stats.ac_utime * watch->clk_tck / 1000000 + task->utime_base;
+    stime = stats.ac_stime * watch->clk_tck / 1000000 + task->stime_base;
+    if (utime < task->utime) {
+      task->utime_base += task->utime - utime;
+      utime = task->utime;
+    }
+    if (stime < task->stime) {
+      task->stime_base += task->stime - stime;
+      stime = task->stime;
+    }
+    if (task->refresh) {
+      watch_read_stat(watch, task);
+      task->refresh = FALSE;
+      task->idle = 0;
+    } else if (utime == task->utime && stime == task->stime) {
+      task->idle++;
+    } else {
+      task->idle = 0;
+    }
+    task->utime = utime;
+    task->stime = stime;
+  }
+}
+
+/**
+ * @brief taskstatsへの問い合わせをまとめて行う
+ *
+ * 複数の要求を1回のsendで送信し、応答はrecvmmsgでまとめて受信する。
+ * タスクが存在しない場合はエラー応答となるため、終了したものとして扱う。
+ *
+ * @param[in,out] watch タスク追跡構造体
+ * @param[in]     tids  問い合わせるTID
+ * @param[in]     num   問い合わせる数
+ */
+static void watch_query_batch(watch_t *watch, int *tids, int num) {
+  uint16_t attr = watch->mode == WATCH_THREAD ? TASKSTATS_CMD_ATTR_PID : TASKSTATS_CMD_ATTR_TGID;
+  char *req = watch->req;
+  struct mmsghdr msgs[WATCH_BATCH];
+  struct iovec iovs[WATCH_BATCH];
+  uint32_t base = watch->seq;
+  size_t len = 0;
+  int received = 0;
+  int i;
+  for (i = 0; i < num; i++) {
+    uint32_t id = tids[i];
+    len += put_genl_request(req + len, watch->family, base + i, TASKSTATS_CMD_GET,
+                            attr, &id, sizeof(id));
+  }
+  watch->seq += num;
+  if (send(watch->genl_fd, req, len, 0) < 0) {
+    ERR("%s\n", strerror(errno));
+    return;
+  }
+  while (received < num) {
+    int n;
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < num - received; i++) {
+      iovs[i].iov_base = watch->buf + i * NETLINK_MSG_SIZE;
+      iovs[i].iov_len = NETLINK_MSG_SIZE;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg(watch->genl_fd, msgs, num - received, MSG_WAITFORONE, NULL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ERR("%s\n", strerror(errno));
+      break;
+    }
+    for (i = 0; i < n; i++) {
+      struct nlmsghdr *nlh = (struct nlmsghdr *) iovs[i].iov_base;
+      int msg_len = msgs[i].msg_len;
+      for (; NLMSG_OK(nlh, msg_len); nlh = NLMSG_NEXT(nlh, msg_len)) {
+        uint32_t index = nlh->nlmsg_seq - base;
+        if (index >= num) {
+          continue;
+        }
+        received++;
+        if (nlh->nlmsg_type == NLMSG_ERROR) {
+          struct nlmsgerr *err = NLMSG_DATA(nlh);
+          watch_task_t *task = watch_find(watch, tids[index]);
+          if (err->error != 0 && task != NULL) {
+            task->gone = TRUE;
+          }
+        } else if (nlh->nlmsg_type == watch->family) {
+          watch_reply(watch, nlh);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief 問い合わせが必要なタスクについてtaskstatsを取得する
+ *
+ * 新しいタスクと最近CPU時間が変化したタスクは毎回、
+ * しばらく変化していないタスクはWATCH_IDLE_TICKS回に1回だけ問い合わせる。
+ *
+ * @param[in,out] watch タスク追跡構造体
+ */
+static void watch_query(watch_t *watch) {
+  int tids[WATCH_BATCH];
+  int num = 0;
+  int slot = watch->tick % WATCH_IDLE_TICKS;
+  int i;
+  for (i = 0; i < watch->size; i++) {
+    watch_task_t *task = &watch->tasks[i];
+    if (task->tid == 0) {
+      continue;
+    }
+    if (task->refresh || task->idle < WATCH_IDLE_TICKS
+        || task->tid % WATCH_IDLE_TICKS == slot) {
+      tids[num++] = task->tid;
+      if (num == WATCH_BATCH) {
+        watch_query_batch(watch, tids, num);
+        num = 0;
+      }
+    }
+  }
+  if (num > 0) {
+    watch_query_batch(watch, tids, num);
+  }
+  watch_sweep(watch);
+  watch->tick++;
+}
+
+/**
+ * @brief 追跡対象とCPU時間を最新の状態にする
+ *
+ * /procの走査は起動時とイベント取りこぼし時のみ行い、
+ * それ以外はproc connectorのイベントで追跡対象を更新する。
+ * 更新後はtasksのうちtidが0でなく、refreshでないものが今回の結果となる。
+ *
+ * @param[in,out] watch    タスク追跡構造体
+ * @param[in]     proc_dir /procのディレクトリストリーム
+ */
+void watch_update(watch_t *watch, DIR *proc_dir) {
+  watch->opened = 0;
+  if (watch->resync) {
+    watch_scan(watch, proc_dir);
+  }
+  watch_drain(watch);
+  if (watch->resync) {
+    watch_scan(watch, proc_dir);
+  }
+  watch_query(watch);
+}
@@ -0,0 +1,86 @@
+/**
+ * @file watch.h
+ *
+ * Copyright (c) 2016 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief proc connectorとtaskstatsによるイベント方式のタスク追跡
+ *
+ * タスクの生成・終了はproc connectorのイベントで追跡し、
+ * CPU時間はtaskstatsで必要なタスクについてのみ問い合わせる。
+ * プロセス単位(TGID)とスレッド単位(TID)のいずれかで追跡する。
+ *
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2016/3/21
+ */
+
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <stdint.h>
+#include <dirent.h>
+#include "cpuusage.h"
+
+/**
+ * プロセス単位で追跡する
+ */
+#define WATCH_PROCESS 0
+/**
+ * スレッド単位で追跡する
+ */
+#define WATCH_THREAD  1
+/**
+ * 追跡するタスクの名前の長さ
+ */
+#define WATCH_COMM_LEN 16
+
+/**
+ * イベント方式で追跡するタスク情報
+ */
+typedef struct watch_task_t {
+  int tid;                 /**< TID、プロセス単位の場合PID、0は未使用 */
+  int pid;                 /**< PID */
+  char comm[WATCH_COMM_LEN]; /**< 名前 */
+  char state;              /**< state */
+  int64_t priority;        /**< プライオリティ */
+  int64_t nice;            /**< nice値 */
+  uint64_t utime;          /**< ユーザ時間 */
+  uint64_t stime;          /**< システム時間 */
+  uint64_t utime_base;     /**< 終了したスレッド分のユーザ時間の補正値 */
+  uint64_t stime_base;     /**< 終了したスレッド分のシステム時間の補正値 */
+  int idle;                /**< CPU時間が変化しなかった連続回数 */
+  int refresh;             /**< 次回必ず問い合わせ、statも読みなおすか */
+  int gone;                /**< 終了が確認されたか */
+} watch_task_t;
+
+/**
+ * proc connectorとtaskstatsによるタスク追跡構造体
+ *
+ * tasksはTIDをキーとするハッシュテーブルで、
+ * 呼び出し側はsize個の要素のうちtidが0でなく、refreshでないものを結果として読み出す。
+ */
+typedef struct watch_t {
+  int mode;                /**< WATCH_PROCESS / WATCH_THREAD */
+  int cn_fd;               /**< proc connectorのソケット */
+  int genl_fd;             /**< taskstatsのソケット */
+  int proc_fd;             /**< /procのファイルディスクリプタ */
+  uint16_t family;         /**< taskstatsのファミリーID */
+  uint32_t seq;            /**< シーケンス番号 */
+  uint32_t tick;           /**< 問い合わせ回数 */
+  int resync;              /**< /procの再走査が必要か */
+  int opened;              /**< 今回のサンプリングで開いたファイル数 */
+  int64_t clk_tck;         /**< 1秒あたりのクロックティック数 */
+  watch_task_t *tasks;     /**< タスクのハッシュテーブル */
+  int size;                /**< テーブルサイズ(2のべき乗) */
+  int num;                 /**< 格納数 */
+  char *req;               /**< 送信バッファ */
+  char *buf;               /**< 受信バッファ */
+} watch_t;
+
+watch_t *new_watch_t(int proc_fd, int mode);
+void delete_watch_t(watch_t *watch);
+void watch_update(watch_t *watch, DIR *proc_dir);
+
+#endif /* WATCH_H_ */